@@ -0,0 +1,517 @@
+/*
+ * Microbenchmarks of the HDO engine and the code around it.  Each case runs in
+ * a child process of its own so that the peak RSS and CPU time it reports are
+ * its own.  Results are printed as one JSON object per line, e.g.
+ *
+ *   {"stage": "hdo", "corpus": "darshan", "block_size": 131072,
+ *    "file_size": 65536, "files": 1024, "bytes": 67108864, "seconds": 0.52,
+ *    "cpu_seconds": 0.51, "mb_per_s": 128.2, "files_per_s": 1969.2,
+ *    "peak_rss_kb": 4120}
+ *
+ * Stages:
+ *   hdo        hoover_create_hdo() over every file, for each block and file size
+ *   tube       hoover_create_hdo(), build_hoover_header(), and the file tube's
+ *              hoover_send_message() over every file, for each file size
+ *   serialize  serialize_header() of each header, for each header count
+ *   manifest   build_manifest() over all headers, for each header count
+ *
+ * Corpora are generated: "darshan" mimics the counters and timestamps of a
+ * Darshan log, and "random" is incompressible.  With -d, the files in a
+ * directory (e.g., captured Darshan logs) are used as they are, and the file
+ * size sweep does not apply.
+ *
+ * Usage: bench-hoover [-c corpora] [-d dir] [-b block_sizes] [-s file_sizes]
+ *                     [-n header_counts] [-m min_bytes] [stage [stage ...]]
+ *
+ * Lists are comma-separated, and sizes may end in k, m, or g.
+ */
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700 /* for mkdtemp and nftw */
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "hooverio.h"
+#include "hooverfile.h"
+
+#define BENCH_MAX_LIST 32
+
+/* no case reads more files than this, however small they are */
+#ifndef BENCH_MAX_FILES
+    #define BENCH_MAX_FILES 4096
+#endif
+
+/* one benchmark case; zero fields do not apply to its stage */
+struct bench_case {
+    const char *stage;
+    const char *corpus;
+    size_t block_size;
+    size_t file_size;
+    long count;
+};
+
+/* what a case measured; the child fills it in */
+struct bench_result {
+    long files;
+    uint64_t bytes;
+    double seconds;
+    double cpu_seconds;
+    long peak_rss_kb;
+};
+
+static char scratch_dir[PATH_MAX];
+static const char *captured_dir = NULL;
+
+/*******************************************************************************
+ * Helpers
+ ******************************************************************************/
+
+static double now( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_time( void ) {
+    struct rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+         + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/* parse 64k, 1m, etc. */
+static size_t parse_size( const char *s ) {
+    char *end;
+    size_t size = strtoul( s, &end, 10 );
+    if ( *end == 'k' || *end == 'K' ) size <<= 10;
+    else if ( *end == 'm' || *end == 'M' ) size <<= 20;
+    else if ( *end == 'g' || *end == 'G' ) size <<= 30;
+    return size;
+}
+
+/* split a comma-separated list in place; returns the number of items */
+static int split_list( char *list, char **items ) {
+    int n = 0;
+    char *item;
+    for ( item = strtok(list, ","); item && n < BENCH_MAX_LIST; item = strtok(NULL, ",") )
+        items[n++] = item;
+    return n;
+}
+
+static uint64_t xorshift( uint64_t *state ) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/*
+ * Fill buf with len bytes of the named corpus.  "darshan" is a text header
+ * followed by records of mostly small 64-bit counters and float timestamps,
+ * which compresses about as well as a real log; "random" does not compress.
+ */
+static void fill_corpus( unsigned char *buf, size_t len, const char *corpus, uint64_t seed ) {
+    uint64_t state = seed * 2654435761u + 1;
+    size_t pos = 0;
+
+    if ( strcmp(corpus, "random") == 0 ) {
+        for ( ; pos < len; pos++ )
+            buf[pos] = xorshift(&state) >> 24;
+        return;
+    }
+
+    pos = snprintf( (char *)buf, len, "# darshan log version: 3.41\n# exe: /global/u1/a/app.x -i input.%lu\n"
+                    "# mount entry:\t/global/cscratch1\tlustre\n", (unsigned long)seed );
+    while ( pos < len ) {
+        uint64_t r = xorshift( &state );
+        int64_t value;
+        if ( (pos / 8) % 16 < 10 )
+            value = (r % 4 == 0) ? (int64_t)(r >> 40) % 4096 : 0;   /* counters */
+        else {
+            double t = (double)(r >> 11) / (1ULL << 53) * 3600.0;  /* timestamps */
+            memcpy( &value, &t, sizeof(value) );
+        }
+        if ( len - pos < sizeof(value) ) {
+            memcpy( buf + pos, &value, len - pos );
+            break;
+        }
+        memcpy( buf + pos, &value, sizeof(value) );
+        pos += sizeof(value);
+    }
+}
+
+static int remove_entry( const char *path, const struct stat *st, int flag, struct FTW *ftw ) {
+    return remove( path );
+}
+
+/*
+ * Write count files of size bytes of a corpus into dir, named 0, 1, 2, ...
+ * Returns 0 on success.
+ */
+static int make_corpus( const char *dir, const char *corpus, size_t size, long count ) {
+    unsigned char *buf = malloc( size ? size : 1 );
+    char path[PATH_MAX];
+    long i;
+    FILE *fp;
+
+    if ( !buf || mkdir(dir, 0700) != 0 ) {
+        free( buf );
+        return -1;
+    }
+    for ( i = 0; i < count; i++ ) {
+        fill_corpus( buf, size, corpus, i );
+        snprintf( path, sizeof(path), "%s/%ld", dir, i );
+        if ( !(fp = fopen(path, "w")) || fwrite(buf, 1, size, fp) != size || fclose(fp) != 0 ) {
+            fprintf( stderr, "could not write %s\n", path );
+            free( buf );
+            return -1;
+        }
+    }
+    free( buf );
+    return 0;
+}
+
+/*
+ * List the files a case reads: the captured directory if there is one, or
+ * else a freshly generated corpus.  Returns the number of files, or -1.
+ */
+static long list_inputs( const struct bench_case *bc, long count, char ***paths ) {
+    char dir[PATH_MAX];
+    long n = 0, i;
+
+    if ( captured_dir ) {
+        DIR *d = opendir( captured_dir );
+        struct dirent *de;
+        struct stat st;
+        if ( !d ) {
+            fprintf( stderr, "could not open %s\n", captured_dir );
+            return -1;
+        }
+        *paths = malloc( BENCH_MAX_FILES * sizeof(**paths) );
+        while ( *paths && n < BENCH_MAX_FILES && (de = readdir(d)) ) {
+            snprintf( dir, sizeof(dir), "%s/%s", captured_dir, de->d_name );
+            if ( de->d_name[0] != '.' && stat(dir, &st) == 0 && S_ISREG(st.st_mode) )
+                (*paths)[n++] = strdup( dir );
+        }
+        closedir( d );
+        return n;
+    }
+
+    snprintf( dir, sizeof(dir), "%s/in", scratch_dir );
+    if ( make_corpus(dir, bc->corpus, bc->file_size, count) != 0 )
+        return -1;
+    if ( !(*paths = malloc(count * sizeof(**paths))) )
+        return -1;
+    for ( i = 0; i < count; i++ ) {
+        char path[PATH_MAX];
+        snprintf( path, sizeof(path), "%s/%ld", dir, i );
+        (*paths)[i] = strdup( path );
+    }
+    return count;
+}
+
+/* a synthetic header like the producer would build for file i */
+static void fake_header( struct hoover_header *header, long i ) {
+    memset( header, 0, sizeof(*header) );
+    snprintf( header->filename, sizeof(header->filename),
+              "/global/cscratch1/darshan/2024/5/17/user_app_id%ld-%ld.darshan.gz", i * 7919, i );
+    strcpy( header->node_id, "nid01234" );
+    strcpy( header->task_id, "123456-0" );
+    strcpy( header->compression, "gz" );
+    strcpy( header->type, "darshan" );
+    strcpy( header->hash_algo, "sha1" );
+    snprintf( (char *)header->sha_hash, sizeof(header->sha_hash), "%040lx", (unsigned long)i * 2654435761u );
+    snprintf( header->hash_orig, sizeof(header->hash_orig), "%040lx", (unsigned long)i );
+    header->size = 4096 + i;
+}
+
+/*******************************************************************************
+ * Stages
+ ******************************************************************************/
+
+static int bench_hdo( const struct bench_case *bc, long count, struct bench_result *res ) {
+    char **paths;
+    long n, i;
+    double start;
+
+    if ( (n = list_inputs(bc, count, &paths)) < 0 )
+        return -1;
+
+    start = now();
+    for ( i = 0; i < n; i++ ) {
+        struct hoover_data_obj *hdo;
+        FILE *fp = fopen( paths[i], "r" );
+        if ( !fp || !(hdo = hoover_create_hdo(fp, bc->block_size)) ) {
+            fprintf( stderr, "could not create HDO from %s\n", paths[i] );
+            return -1;
+        }
+        res->bytes += hdo->size_orig;
+        free_hdo( hdo );
+        fclose( fp );
+    }
+    res->seconds = now() - start;
+    res->files = n;
+    return 0;
+}
+
+static int bench_tube( const struct bench_case *bc, long count, struct bench_result *res ) {
+    struct hoover_tube_config *config;
+    struct hoover_tube *tube;
+    char out_dir[PATH_MAX];
+    char **paths;
+    long n, i;
+    double start;
+
+    if ( (n = list_inputs(bc, count, &paths)) < 0 )
+        return -1;
+
+    /* the file tube writes into the working directory and logs every file */
+    snprintf( out_dir, sizeof(out_dir), "%s/out", scratch_dir );
+    if ( mkdir(out_dir, 0700) != 0 || chdir(out_dir) != 0 )
+        return -1;
+    freopen( "/dev/null", "w", stderr );
+    config = read_tube_config();
+    if ( !(tube = create_hoover_tube(config)) )
+        return -1;
+
+    start = now();
+    for ( i = 0; i < n; i++ ) {
+        struct hoover_data_obj *hdo;
+        struct hoover_header *header;
+        FILE *fp = fopen( paths[i], "r" );
+        if ( !fp || !(hdo = hoover_create_hdo(fp, bc->block_size))
+        ||   !(header = build_hoover_header(paths[i], hdo, "darshan"))
+        ||   hoover_send_message(tube, hdo, header) != 0 )
+            return -1;
+        res->bytes += hdo->size_orig;
+        free_hoover_header( header );
+        free_hdo( hdo );
+        fclose( fp );
+    }
+    if ( hoover_flush_tube(tube) != 0 )
+        return -1;
+    res->seconds = now() - start;
+    res->files = n;
+
+    free_hoover_tube( tube );
+    free_tube_config( config );
+    return 0;
+}
+
+static int bench_serialize( const struct bench_case *bc, struct bench_result *res ) {
+    struct hoover_header header;
+    double start;
+    long i;
+
+    start = now();
+    for ( i = 0; i < bc->count; i++ ) {
+        char *serialized;
+        fake_header( &header, i );
+        if ( !(serialized = serialize_header(&header)) )
+            return -1;
+        res->bytes += strlen( serialized );
+        free( serialized );
+    }
+    res->seconds = now() - start;
+    res->files = bc->count;
+    return 0;
+}
+
+static int bench_manifest( const struct bench_case *bc, struct bench_result *res ) {
+    struct hoover_header_arena *headers = create_hoover_header_arena();
+    struct hoover_header header;
+    char *manifest;
+    double start;
+    long i;
+
+    for ( i = 0; headers && i < bc->count; i++ ) {
+        fake_header( &header, i );
+        if ( hoover_header_arena_add(headers, &header) != 0 )
+            return -1;
+    }
+    if ( !headers )
+        return -1;
+
+    start = now();
+    if ( !(manifest = build_manifest(headers)) )
+        return -1;
+    res->seconds = now() - start;
+    res->bytes = strlen( manifest );
+    res->files = bc->count;
+
+    free( manifest );
+    free_hoover_header_arena( headers );
+    return 0;
+}
+
+/*******************************************************************************
+ * Driver
+ ******************************************************************************/
+
+/*
+ * Run one case in a child process and print its result.  The child measures
+ * the stage itself, and reports its CPU time and peak RSS from its rusage.
+ */
+static int run_case( const struct bench_case *bc, uint64_t min_bytes ) {
+    struct bench_result res;
+    int pipefd[2], status, got;
+    pid_t pid;
+    long count = 1;
+
+    if ( bc->file_size > 0 ) {
+        count = min_bytes / bc->file_size;
+        if ( count < 1 ) count = 1;
+        if ( count > BENCH_MAX_FILES ) count = BENCH_MAX_FILES;
+    }
+
+    if ( pipe(pipefd) != 0 )
+        return -1;
+    fflush( stdout );
+    if ( (pid = fork()) < 0 )
+        return -1;
+
+    if ( pid == 0 ) {
+        struct rusage usage;
+        double cpu;
+        int ret;
+
+        close( pipefd[0] );
+        memset( &res, 0, sizeof(res) );
+        cpu = cpu_time();
+        if ( strcmp(bc->stage, "hdo") == 0 )
+            ret = bench_hdo( bc, count, &res );
+        else if ( strcmp(bc->stage, "tube") == 0 )
+            ret = bench_tube( bc, count, &res );
+        else if ( strcmp(bc->stage, "serialize") == 0 )
+            ret = bench_serialize( bc, &res );
+        else
+            ret = bench_manifest( bc, &res );
+        res.cpu_seconds = cpu_time() - cpu;
+        getrusage( RUSAGE_SELF, &usage );
+        res.peak_rss_kb = usage.ru_maxrss;
+        if ( ret == 0 && write(pipefd[1], &res, sizeof(res)) != sizeof(res) )
+            ret = -1;
+        _exit( ret == 0 ? 0 : 1 );
+    }
+
+    close( pipefd[1] );
+    memset( &res, 0, sizeof(res) );
+    got = read( pipefd[0], &res, sizeof(res) ) == sizeof(res);
+    close( pipefd[0] );
+    if ( waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || !got ) {
+        fprintf( stderr, "%s benchmark failed (corpus %s, block size %zu, file size %zu, count %ld)\n",
+                 bc->stage, bc->corpus, bc->block_size, bc->file_size, bc->count );
+        return -1;
+    }
+
+    printf( "{\"stage\": \"%s\", \"corpus\": \"%s\", \"block_size\": %zu, \"file_size\": %zu, "
+            "\"files\": %ld, \"bytes\": %llu, \"seconds\": %.6f, \"cpu_seconds\": %.6f, "
+            "\"mb_per_s\": %.2f, \"files_per_s\": %.1f, \"peak_rss_kb\": %ld}\n",
+            bc->stage, bc->corpus, bc->block_size, bc->file_size,
+            res.files, (unsigned long long)res.bytes, res.seconds, res.cpu_seconds,
+            res.seconds > 0 ? res.bytes / res.seconds / 1e6 : 0.0,
+            res.seconds > 0 ? res.files / res.seconds : 0.0,
+            res.peak_rss_kb );
+    fflush( stdout );
+
+    /* the next case starts with an empty scratch directory */
+    nftw( scratch_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS );
+    mkdir( scratch_dir, 0700 );
+    return 0;
+}
+
+int main( int argc, char **argv ) {
+    char corpora_arg[] = "darshan",
+         block_arg[] = "32k,128k,1m",
+         size_arg[] = "4k,64k,1m,16m",
+         count_arg[] = "1000,10000,100000";
+    char *corpora_list = corpora_arg, *block_list = block_arg,
+         *size_list = size_arg, *count_list = count_arg;
+    char *corpora[BENCH_MAX_LIST], *blocks[BENCH_MAX_LIST], *sizes[BENCH_MAX_LIST], *counts[BENCH_MAX_LIST];
+    const char *all_stages[] = { "hdo", "tube", "serialize", "manifest" };
+    const char *tmpdir;
+    uint64_t min_bytes = 64 << 20;
+    int num_corpora, num_blocks, num_sizes, num_counts;
+    int c, s, i, j, k, failed = 0;
+
+    while ( (c = getopt(argc, argv, "c:d:b:s:n:m:h")) != -1 ) {
+        switch (c) {
+        case 'c': corpora_list = optarg; break;
+        case 'd': captured_dir = optarg; break;
+        case 'b': block_list = optarg; break;
+        case 's': size_list = optarg; break;
+        case 'n': count_list = optarg; break;
+        case 'm': min_bytes = parse_size(optarg); break;
+        default:
+            fprintf( stderr, "Syntax: %s [-c corpora] [-d dir] [-b block_sizes] [-s file_sizes] [-n header_counts] [-m min_bytes] [stage [stage ...]]\n", argv[0] );
+            return 1;
+        }
+    }
+    num_corpora = split_list( corpora_list, corpora );
+    num_blocks = split_list( block_list, blocks );
+    num_sizes = split_list( size_list, sizes );
+    num_counts = split_list( count_list, counts );
+    if ( captured_dir ) {
+        /* the files are what they are, so there is one corpus and no sizes */
+        corpora[0] = "captured";
+        num_corpora = 1;
+        sizes[0] = "0";
+        num_sizes = 1;
+    }
+
+    tmpdir = getenv( "TMPDIR" );
+    snprintf( scratch_dir, sizeof(scratch_dir), "%s/bench-hoover.XXXXXX", tmpdir ? tmpdir : "/tmp" );
+    if ( !mkdtemp(scratch_dir) ) {
+        fprintf( stderr, "could not create a scratch directory in %s\n", tmpdir ? tmpdir : "/tmp" );
+        return 1;
+    }
+
+    for ( s = 0; s < (int)(sizeof(all_stages) / sizeof(*all_stages)); s++ ) {
+        struct bench_case bc;
+        int wanted = optind >= argc;
+
+        for ( i = optind; i < argc; i++ )
+            wanted |= strcmp(argv[i], all_stages[s]) == 0;
+        if ( !wanted )
+            continue;
+
+        memset( &bc, 0, sizeof(bc) );
+        bc.stage = all_stages[s];
+        if ( strcmp(bc.stage, "serialize") == 0 || strcmp(bc.stage, "manifest") == 0 ) {
+            bc.corpus = "synthetic";
+            for ( i = 0; i < num_counts; i++ ) {
+                bc.count = atol( counts[i] );
+                failed += run_case( &bc, min_bytes ) != 0;
+            }
+            continue;
+        }
+
+        for ( i = 0; i < num_corpora; i++ ) {
+            bc.corpus = corpora[i];
+            for ( j = 0; j < num_sizes; j++ ) {
+                bc.file_size = parse_size( sizes[j] );
+                /* only the HDO engine itself is swept across block sizes */
+                for ( k = 0; k < (strcmp(bc.stage, "hdo") == 0 ? num_blocks : 1); k++ ) {
+                    bc.block_size = strcmp(bc.stage, "hdo") == 0 ? parse_size(blocks[k]) : HOOVER_BLK_SIZE;
+                    failed += run_case( &bc, min_bytes ) != 0;
+                }
+            }
+        }
+    }
+
+    nftw( scratch_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS );
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Time hoover_create_manifest_hdo() over growing numbers of headers to show
+ * that it scales linearly.  Prints one row per manifest size with the memory
+ * the headers take, the size of the manifest, the time taken, and the time per
+ * header, which should stay roughly flat.  The peak memory of the whole run is
+ * printed last.
+ *
+ * Usage: bench-manifest [max_headers]
+ */
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600 /* for clock_gettime in time.h */
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hooverio.h"
+
+static double now( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* a field of /proc/self/status, such as VmRSS, in KiB, or -1 if it is missing */
+static long status_kib( const char *field ) {
+    char line[256];
+    size_t len = strlen(field);
+    long kib = -1;
+    FILE *fp;
+
+    if ( !(fp = fopen("/proc/self/status", "r")) )
+        return -1;
+    while ( fgets(line, sizeof(line), fp) ) {
+        if ( strncmp(line, field, len) == 0 && line[len] == ':' ) {
+            kib = atol( line + len + 1 );
+            break;
+        }
+    }
+    fclose( fp );
+    return kib;
+}
+
+int main(int argc, char **argv) {
+    struct hoover_header scratch;
+    struct hoover_header_arena *headers;
+    struct hoover_data_obj *hdo;
+    long max_headers = 1000000, num_headers, i = 0, base_kib, headers_kib;
+    double start, elapsed;
+
+    if ( argc > 1 && (max_headers = atol(argv[1])) < 1 ) {
+        fprintf( stderr, "Syntax: %s [max_headers]\n", argv[0] );
+        return 1;
+    }
+
+    /* the headers are kept the way the producer keeps them */
+    base_kib = status_kib( "VmRSS" );
+    if ( !(headers = create_hoover_header_arena()) ) {
+        fprintf( stderr, "could not allocate header arena\n" );
+        return 1;
+    }
+    memset( &scratch, 0, sizeof(scratch) );
+    strcpy( scratch.node_id, "nid00001" );
+    strcpy( scratch.task_id, "123456-0" );
+    strcpy( scratch.compression, "gz" );
+    strcpy( scratch.type, "darshan" );
+    strcpy( scratch.hash_algo, "sha1" );
+
+    printf( "%10s %12s %14s %14s %12s %14s\n",
+            "headers", "header KiB", "bytes", "compressed", "seconds", "ns/header" );
+    for ( num_headers = 1000; ; num_headers *= 10 ) {
+        if ( num_headers > max_headers )
+            num_headers = max_headers;
+
+        for ( ; i < num_headers; i++ ) {
+            /* every eighth name needs escaping */
+            snprintf( scratch.filename, sizeof(scratch.filename),
+                      (i % 8) ? "/scratch/darshan/2024/1/1/user_app_id%ld.darshan.gz"
+                              : "/scratch/darshan/\"quoted\"\\%ld\t.darshan.gz", i );
+            snprintf( (char *)scratch.sha_hash, sizeof(scratch.sha_hash), "%040lx", (unsigned long)i * 2654435761u );
+            snprintf( scratch.hash_orig, sizeof(scratch.hash_orig), "%040lx", (unsigned long)i );
+            scratch.size = 4096 + i;
+            if ( hoover_header_arena_add(headers, &scratch) != 0 ) {
+                fprintf( stderr, "could not keep %ld headers\n", num_headers );
+                return 1;
+            }
+        }
+        headers_kib = status_kib( "VmRSS" ) - base_kib;
+
+        start = now();
+        hdo = hoover_create_manifest_hdo( headers );
+        elapsed = now() - start;
+        if ( !hdo ) {
+            fprintf( stderr, "hoover_create_manifest_hdo failed at %ld headers\n", num_headers );
+            return 1;
+        }
+
+        printf( "%10ld %12ld %14zu %14zu %12.4f %14.1f\n", num_headers, headers_kib,
+                hdo->size_orig, hdo->size, elapsed, elapsed * 1e9 / num_headers );
+        free_hdo( hdo );
+
+        if ( num_headers == max_headers )
+            break;
+    }
+    printf( "peak RSS (VmHWM) %ld KiB\n", status_kib("VmHWM") );
+
+    free_hoover_header_arena( headers );
+    return 0;
+}
@@ -0,0 +1,50 @@
+#!/bin/bash
+#
+#  Compare compression codecs on a set of real input files (e.g., Darshan logs)
+#  by running each one through test-hdo.  Prints one row per codec with the
+#  compression throughput and ratio over all of the input files.
+#
+#  Usage: ./compare-codecs.sh [-p compress_threads] <file> [file [...]]
+#
+#  Codecs are taken from $CODECS; zstd and lz4 must be compiled in with
+#  make HOOVER_CODECS="zstd lz4"
+#
+
+CODECS=${CODECS:-"none lz4 lz4:9 zstd:-3 zstd:1 zstd:3 zstd:9 zstd:19 gzip:1 gzip:6 gzip:9"}
+
+opts=""
+if [ "$1" == "-p" ]; then
+    opts="-p $2"
+    shift 2
+fi
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 [-p compress_threads] <file> [file [...]]" >&2
+    exit 1
+fi
+
+printf "%-10s %14s %14s %8s %10s %10s\n" codec bytes_in bytes_out ratio seconds MB/s
+for codec in $CODECS
+do
+    bytes_in=0
+    bytes_out=0
+    start=$(date +%s%N)
+    for file in "$@"
+    do
+        out=$(./test-hdo $opts -c $codec "$file" 2>/dev/null) || { bytes_in=-1; break; }
+        bytes_in=$((bytes_in + $(awk '/^Loaded:/ { print $2 }' <<< "$out")))
+        bytes_out=$((bytes_out + $(awk '/^Saving:/ { print $2 }' <<< "$out")))
+    done
+    end=$(date +%s%N)
+
+    if [ $bytes_in -lt 0 ]; then
+        printf "%-10s %14s\n" $codec "unavailable"
+        continue
+    fi
+
+    awk -v codec=$codec -v bin=$bytes_in -v bout=$bytes_out -v ns=$((end - start)) 'BEGIN {
+        secs = ns / 1e9
+        printf("%-10s %14d %14d %8.3f %10.3f %10.1f\n", codec, bin, bout,
+            (bout > 0 ? bin / bout : 0), secs, (secs > 0 ? bin / secs / 1e6 : 0))
+    }'
+done
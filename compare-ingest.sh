@@ -0,0 +1,60 @@
+#!/bin/bash
+#
+#  Compare batched (io_uring) and one-by-one ingestion of many small files by
+#  running producer-file over the same set of files both ways.  Prints one row
+#  per mode with the files per second and, if strace is installed, the number
+#  of system calls made.
+#
+#  Usage: ./compare-ingest.sh [-t num_threads] [num_files [max_file_size]]
+#
+#  Input files are cut from hooverio.c into a scratch directory, which is
+#  removed afterwards.  Output HDOs are written to a second scratch directory.
+#
+
+opts=""
+if [ "$1" == "-t" ]; then
+    opts="-t $2"
+    shift 2
+fi
+
+NUM_FILES=${1:-10000}
+MAX_SIZE=${2:-8192}
+PRODUCER=${PRODUCER:-$(pwd)/producer-file}
+
+if [ ! -x "$PRODUCER" ]; then
+    echo "$PRODUCER not found; build it with make producer-file" >&2
+    exit 1
+fi
+
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT
+mkdir "$scratch/in" "$scratch/out"
+
+for i in $(seq 1 $NUM_FILES)
+do
+    head -c $((RANDOM % MAX_SIZE + 1)) hooverio.c > "$scratch/in/file$i.darshan"
+done
+
+printf "%-10s %10s %10s %12s %12s\n" mode files seconds files/s syscalls
+for mode in batched single
+do
+    modeopt=""
+    [ $mode == "single" ] && modeopt="-U"
+    rm -f "$scratch"/out/*
+
+    start=$(date +%s%N)
+    ( cd "$scratch/out" && "$PRODUCER" $opts $modeopt --dir "$scratch/in" >/dev/null 2>&1 )
+    end=$(date +%s%N)
+
+    syscalls="-"
+    if command -v strace >/dev/null 2>&1; then
+        rm -f "$scratch"/out/*
+        syscalls=$( cd "$scratch/out" && strace -f -c -o /dev/stderr "$PRODUCER" $opts $modeopt --dir "$scratch/in" 2>&1 >/dev/null \
+                    | awk '$NF == "total" { print $4 }' )
+    fi
+
+    awk -v mode=$mode -v files=$NUM_FILES -v ns=$((end - start)) -v sc="$syscalls" 'BEGIN {
+        secs = ns / 1e9
+        printf("%-10s %10d %10.3f %12.1f %12s\n", mode, files, secs, (secs > 0 ? files / secs : 0), sc)
+    }'
+done
@@ -11,7 +11,6 @@ import json
 import pika
 import hoover
 import argparse
-import StringIO
 
 _DEFAULT_VERBOSITY = 'INFO'
 
@@ -71,7 +70,7 @@ def begin_consume( host, exchange, output_dir, port=pika.connection.ConnectionPa
             fp.write(body)
 
         ### Calculate checksum and compare to manifest
-        checksum = hoover.checksum( StringIO.StringIO(body) )
+        checksum = hoover.checksum_data( body, properties.headers.get('hash_algo', 'sha1') )
         if checksum == properties.headers['sha_hash']:
             print("Wrote output to %s (cksum: %s)" % (output_file, checksum)) 
         else:
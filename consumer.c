@@ -0,0 +1,958 @@
+/*
+ * Multi-threaded consumer that receives HDOs from a tube, verifies them, and
+ * writes them out.  The native counterpart to consumer.py.
+ */
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "hooverio.h"
+#ifdef HOOVER_TUBE_FILE
+#include "hooverfile.h"
+#elif defined(HOOVER_TUBE_MEM)
+#include "hoovermem.h"
+#else
+#include "hooverrmq.h"
+#endif
+#include "hooverqueue.h"
+#include "hooverbundle.h"
+
+#ifndef HOOVER_MAX_THREADS
+    #define HOOVER_MAX_THREADS 256
+#endif
+
+/* number of messages that may wait for a worker per worker thread */
+#ifndef HOOVER_QUEUE_DEPTH_PER_THREAD
+    #define HOOVER_QUEUE_DEPTH_PER_THREAD 2
+#endif
+
+/* milliseconds to wait for a message before settling the ones that are done */
+#ifndef HOOVER_RECEIVE_POLL_MS
+    #define HOOVER_RECEIVE_POLL_MS 100
+#endif
+
+/* seconds to wait before trying again once the tube has gone away */
+#ifndef HOOVER_RECEIVE_RETRY_INTERVAL
+    #define HOOVER_RECEIVE_RETRY_INTERVAL 5
+#endif
+
+/* with -e, milliseconds without a message before the consumer exits */
+#ifndef HOOVER_IDLE_EXIT_MS
+    #define HOOVER_IDLE_EXIT_MS 1000
+#endif
+
+/* chunks are staged here, under output_dir, unless chunk_dir says otherwise */
+#define HOOVER_CHUNK_DIR ".chunks"
+
+/* messages that fail verification are kept here, under output_dir, as
+ * consumer.py does */
+#define HOOVER_QUARANTINE_DIR ".quarantine"
+
+/* what to tell the tube about a message once a worker is done with it */
+enum consumer_verdict {
+    CONSUMER_ACK = 0,          /* written out, or nothing more to do */
+    CONSUMER_REQUEUE,          /* not written this time; deliver it again */
+    CONSUMER_DROP              /* can never be written, or quarantined */
+};
+
+struct consumer_options {
+    char output_dir[PATH_MAX];
+    char chunk_dir[PATH_MAX];
+    char quarantine_dir[PATH_MAX];
+    int decompress;            /* write decoded data rather than the payload */
+};
+
+/*
+ * consumer_job carries one message from the receiving thread to a worker and
+ *   back.  Only the receiving thread may settle messages with the tube.
+ */
+struct consumer_job {
+    struct hoover_message *msg;
+    enum consumer_verdict verdict;
+};
+
+struct consumer_work {
+    struct consumer_options *opts;
+    struct hoover_queue *todo; /* received, waiting for a worker */
+    struct hoover_queue *done; /* processed, waiting to be settled */
+};
+
+/*
+ * output_file is a file being written from an HDO payload.  The payload is
+ *   hashed, decoded if need be, and written in a single pass, to a .partial
+ *   file that only takes its real name once the payload has been verified.
+ */
+struct output_file {
+    struct hoover_header *header;
+    struct hoover_hdo_decoder *decoder;
+    FILE *fp;
+    int decode;                /* write the decoded data, not the payload */
+    int failed;                /* a write to fp failed */
+    int corrupt;               /* the payload failed verification */
+    char path[PATH_MAX];
+    char partial[PATH_MAX];
+};
+
+/*
+ * Helpers
+ */
+static const char *base_name( const char *path ) {
+    const char *p = strrchr( path, '/' );
+    return p ? p + 1 : path;
+}
+
+/* mkdir -p */
+static int make_dirs( const char *path ) {
+    char buf[PATH_MAX];
+    char *p;
+
+    if ( snprintf(buf, PATH_MAX, "%s", path) >= PATH_MAX )
+        return -1;
+    for ( p = buf + 1; *p; p++ ) {
+        if ( *p != '/' )
+            continue;
+        *p = '\0';
+        if ( mkdir(buf, 0755) != 0 && errno != EEXIST )
+            return -1;
+        *p = '/';
+    }
+    if ( mkdir(buf, 0755) != 0 && errno != EEXIST )
+        return -1;
+    return 0;
+}
+
+/* map a whole file into memory; empty files map to an empty buffer */
+static void *map_file( const char *path, size_t *len ) {
+    static char empty[1];
+    struct stat st;
+    void *data;
+    int fd;
+
+    if ( (fd = open(path, O_RDONLY)) < 0 )
+        return NULL;
+    if ( fstat(fd, &st) != 0 ) {
+        close( fd );
+        return NULL;
+    }
+    *len = st.st_size;
+    if ( *len == 0 )
+        data = empty;
+    else if ( (data = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED )
+        data = NULL;
+    close( fd );
+    return data;
+}
+
+static void unmap_file( void *data, size_t len ) {
+    if ( len > 0 )
+        munmap( data, len );
+    return;
+}
+
+/* write a file such that other processes see either all of it or none of it */
+static int write_file_atomically( const char *path, const void *data, size_t len ) {
+    char tmp[PATH_MAX];
+    FILE *fp;
+    int ret = 0;
+
+    snprintf( tmp, PATH_MAX, "%s.tmp", path );
+    if ( !(fp = fopen(tmp, "w")) )
+        return -1;
+    if ( fwrite(data, 1, len, fp) != len )
+        ret = -1;
+    if ( fclose(fp) != 0 )
+        ret = -1;
+    if ( ret == 0 && rename(tmp, path) != 0 )
+        ret = -1;
+    if ( ret != 0 )
+        unlink( tmp );
+    return ret;
+}
+
+/* write "key": "value" with value escaped for JSON */
+static void write_json_string( FILE *fp, const char *key, const char *value ) {
+    const unsigned char *p;
+
+    fprintf( fp, "\"%s\": \"", key );
+    for ( p = (const unsigned char *)value; *p; p++ ) {
+        if ( *p == '"' || *p == '\\' )
+            fprintf( fp, "\\%c", *p );
+        else if ( *p < 0x20 )
+            fprintf( fp, "\\u%04x", *p );
+        else
+            fputc( *p, fp );
+    }
+    fputc( '"', fp );
+    return;
+}
+
+/*
+ * Write an HDO's headers, and those of one of its chunks if chunk is not
+ * NULL, as a JSON object in the form consumer.py reads them
+ */
+static int write_headers( const char *path, struct hoover_header *header, struct hoover_chunk_info *chunk ) {
+    char tmp[PATH_MAX];
+    FILE *fp;
+    int ret = 0;
+
+    snprintf( tmp, PATH_MAX, "%s.tmp", path );
+    if ( !(fp = fopen(tmp, "w")) )
+        return -1;
+
+    fprintf( fp, "{" );
+    if ( header->filename[0] ) {
+        write_json_string( fp, "filename", header->filename );
+        fprintf( fp, ", " );
+    }
+    write_json_string( fp, "node_id", header->node_id );
+    fprintf( fp, ", " );
+    write_json_string( fp, "task_id", header->task_id );
+    fprintf( fp, ", " );
+    write_json_string( fp, "compression", header->compression );
+    fprintf( fp, ", " );
+    write_json_string( fp, "sha_hash", (char *)header->sha_hash );
+    fprintf( fp, ", \"size\": %lu, ", (unsigned long)header->size );
+    write_json_string( fp, "type", header->type );
+    fprintf( fp, ", " );
+    write_json_string( fp, "hash_orig", header->hash_orig );
+    fprintf( fp, ", " );
+    write_json_string( fp, "hash_algo", header->hash_algo );
+    if ( chunk ) {
+        fprintf( fp, ", " );
+        write_json_string( fp, "transfer_id", chunk->transfer_id );
+        fprintf( fp, ", \"chunk_index\": %ld, \"chunk_count\": %ld, ",
+            (long)chunk->index, (long)chunk->count );
+        write_json_string( fp, "chunk_sha_hash", chunk->sha_hash );
+    }
+    fprintf( fp, "}" );
+
+    if ( fclose(fp) != 0 || rename(tmp, path) != 0 ) {
+        unlink( tmp );
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Quarantine
+ */
+
+/*
+ * Pick a name in the quarantine directory for a payload that failed
+ * verification and save its headers next to it, the same way consumer.py
+ * does.  Returns nonzero if the headers cannot be saved.
+ */
+static int quarantine_path( struct consumer_options *opts, struct hoover_header *header,
+                            struct hoover_chunk_info *chunk, char *path ) {
+    static unsigned long count = 0;
+    char headers[PATH_MAX];
+    const char *name = header->filename[0] ? header->filename
+                     : (chunk && chunk->transfer_id[0]) ? chunk->transfer_id : "unnamed";
+
+    snprintf( path, PATH_MAX, "%s/%s.%ld.%d.%lu", opts->quarantine_dir, base_name(name),
+        (long)time(NULL), (int)getpid(), __atomic_add_fetch(&count, 1, __ATOMIC_RELAXED) );
+    snprintf( headers, PATH_MAX, "%s.headers.json", path );
+    if ( make_dirs(opts->quarantine_dir) != 0 || write_headers(headers, header, chunk) != 0 ) {
+        fprintf( stderr, "could not quarantine %s\n", name );
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Keep a message that failed verification so that it can be looked at later,
+ * and tell the tube not to deliver it again.  If it cannot be kept, it is
+ * requeued instead so that it is not lost.
+ */
+static enum consumer_verdict quarantine( struct consumer_options *opts, struct hoover_header *header,
+                                         struct hoover_chunk_info *chunk, const void *data, size_t len ) {
+    char path[PATH_MAX];
+
+    if ( quarantine_path(opts, header, chunk, path) != 0 )
+        return CONSUMER_REQUEUE;
+    if ( write_file_atomically(path, data, len) != 0 ) {
+        fprintf( stderr, "could not quarantine %s as %s\n", header->filename, path );
+        return CONSUMER_REQUEUE;
+    }
+    fprintf( stderr, "quarantined %s as %s\n", header->filename, path );
+    return CONSUMER_DROP;
+}
+
+/*
+ * Move a file that failed verification into quarantine without copying it,
+ * or remove it if it cannot be moved
+ */
+static void quarantine_file( struct consumer_options *opts, struct hoover_header *header,
+                             const char *file ) {
+    char path[PATH_MAX];
+
+    if ( quarantine_path(opts, header, NULL, path) != 0 || rename(file, path) != 0 ) {
+        fprintf( stderr, "could not quarantine %s\n", file );
+        unlink( file );
+        return;
+    }
+    fprintf( stderr, "quarantined %s as %s\n", file, path );
+    return;
+}
+
+/*
+ * Output files
+ */
+
+/* directory under output_dir for each type of HDO; same as consumer.py */
+static const char *type_dir( const char *type ) {
+    if ( strcmp(type, "darshan") == 0 )
+        return "darshanlogs";
+    else if ( strcmp(type, "manifest") == 0 )
+        return "manifests";
+    return "misc";
+}
+
+/*
+ * Work out where the file described by a header should be written.  An HDO
+ * without a file name is a manifest, and is named after its checksum so that
+ * a manifest that is sent twice is only written once.  Returns nonzero if the
+ * file cannot be written.
+ */
+static int output_path( struct consumer_options *opts, struct hoover_header *header,
+                        char *parent, char *path ) {
+    const char *dir = type_dir( header->type );
+    char name[PATH_MAX];
+    struct stat st;
+
+    if ( header->filename[0] )
+        snprintf( name, PATH_MAX, "%s", base_name(header->filename) );
+    else
+        snprintf( name, PATH_MAX, "manifest_%s.json",
+            header->sha_hash[0] ? (char *)header->sha_hash : header->hash_orig );
+    if ( name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ) {
+        fprintf( stderr, "cannot write a file called '%s'\n", header->filename );
+        return -1;
+    }
+
+    if ( dir[0] == '/' )
+        snprintf( parent, PATH_MAX, "%s", dir );
+    else if ( dir[0] )
+        snprintf( parent, PATH_MAX, "%s/%s", opts->output_dir, dir );
+    else
+        snprintf( parent, PATH_MAX, "%s", opts->output_dir );
+    if ( snprintf(path, PATH_MAX, "%s/%s", parent, name) >= PATH_MAX ) {
+        fprintf( stderr, "output path for %s is too long\n", name );
+        return -1;
+    }
+
+    if ( stat(path, &st) == 0 && S_ISDIR(st.st_mode) ) {
+        fprintf( stderr, "target output %s exists but is a dir\n", path );
+        return -1;
+    }
+    return 0;
+}
+
+static int write_to_output( const void *data, size_t len, void *arg ) {
+    struct output_file *out = arg;
+    if ( fwrite(data, 1, len, out->fp) != len )
+        out->failed = 1;
+    return out->failed;
+}
+
+/*
+ * Start writing the HDO described by header.  With decompression on, a file
+ * whose name ends in its codec's suffix is decoded to the name without it;
+ * files in a codec this build cannot decode are written as they are.  Returns
+ * CONSUMER_ACK if the file is open, or what to do with the message if not.
+ */
+static enum consumer_verdict open_output( struct consumer_options *opts, struct hoover_header *header,
+                                          struct output_file *out ) {
+    size_t len, suffix_len = strlen( header->compression );
+    char parent[PATH_MAX];
+
+    memset( out, 0, sizeof(*out) );
+    out->header = header;
+    if ( output_path(opts, header, parent, out->path) != 0 )
+        return CONSUMER_DROP;
+    if ( make_dirs(parent) != 0 ) {
+        fprintf( stderr, "could not create output dir %s\n", parent );
+        return CONSUMER_REQUEUE;
+    }
+
+    len = strlen( out->path );
+    if ( opts->decompress && suffix_len > 0 && len > suffix_len + 1
+    &&   out->path[len - suffix_len - 1] == '.'
+    &&   strcmp(out->path + len - suffix_len, header->compression) == 0
+    &&   (out->decoder = hoover_open_hdo_decoder(header->compression, header->hash_algo, 1)) ) {
+        out->decode = 1;
+        out->path[len - suffix_len - 1] = '\0';
+    }
+
+    /* without a payload hash, the payload is checked by decoding it against
+     * hash_orig */
+    if ( !out->decoder
+    &&   !(out->decoder = hoover_open_hdo_decoder(header->compression, header->hash_algo,
+                                                  !header->sha_hash[0] && header->hash_orig[0])) )
+        return CONSUMER_REQUEUE;
+
+    snprintf( out->partial, PATH_MAX, "%s.partial", out->path );
+    if ( !(out->fp = fopen(out->partial, "w")) ) {
+        fprintf( stderr, "could not open %s for writing\n", out->partial );
+        hoover_close_hdo_decoder( out->decoder, NULL, NULL );
+        return CONSUMER_REQUEUE;
+    }
+    return CONSUMER_ACK;
+}
+
+/*
+ * Hash, decode, and write the next piece of an output file's payload, one
+ * block at a time so that each block is still in cache for every step.
+ */
+static void write_output( struct output_file *out, const void *data, size_t len ) {
+    const char *p = data;
+
+    while ( len > 0 && !out->failed ) {
+        size_t n = len < HOOVER_BLK_SIZE ? len : HOOVER_BLK_SIZE;
+        if ( hoover_decode_hdo_data(out->decoder, p, n, out->decode ? write_to_output : NULL, out) != 0 )
+            break; /* the decoder remembers; close_output() reports it */
+        if ( !out->decode )
+            write_to_output( p, n, out );
+        p += n;
+        len -= n;
+    }
+    return;
+}
+
+/*
+ * Finish an output file and give it its real name if the payload checks out.
+ * The payload is checked against sha_hash if the producer computed it, and
+ * otherwise against hash_orig.  A local HDO with neither is taken as it is.
+ * If a payload that is not local fails, out->corrupt is set and the .partial
+ * file is left for the caller to quarantine.
+ */
+static enum consumer_verdict close_output( struct output_file *out, int local ) {
+    struct hoover_header *header = out->header;
+    char hash[HASH_DIGEST_LENGTH_HEX], hash_orig[HASH_DIGEST_LENGTH_HEX];
+    const char *expected;
+    int corrupt, verified;
+
+    corrupt = hoover_close_hdo_decoder( out->decoder, hash, hash_orig );
+    if ( fclose(out->fp) != 0 )
+        out->failed = 1;
+
+    if ( header->sha_hash[0] ) {
+        expected = (char *)header->sha_hash;
+        verified = strcmp(hash, expected) == 0
+                && (!hash_orig[0] || !header->hash_orig[0] || strcmp(hash_orig, header->hash_orig) == 0);
+    }
+    else if ( header->hash_orig[0] ) {
+        expected = header->hash_orig;
+        verified = strcmp(hash_orig, expected) == 0;
+    }
+    else {
+        expected = "nothing";
+        verified = local;
+    }
+
+    if ( out->failed ) {
+        fprintf( stderr, "could not write %s\n", out->partial );
+        unlink( out->partial );
+        return CONSUMER_REQUEUE;
+    }
+    else if ( corrupt || !verified ) {
+        fprintf( stderr, "checksum mismatch for %s (cksum: %s, was expecting %s)\n",
+            out->path, corrupt ? "corrupt" : (header->sha_hash[0] ? hash : hash_orig), expected );
+        /* delivering the same bytes again will not help; a local file is
+         * set aside by its tube, anything else is quarantined */
+        if ( local )
+            unlink( out->partial );
+        else
+            out->corrupt = 1;
+        return CONSUMER_DROP;
+    }
+    else if ( rename(out->partial, out->path) != 0 ) {
+        fprintf( stderr, "could not rename %s to %s\n", out->partial, out->path );
+        unlink( out->partial );
+        return CONSUMER_REQUEUE;
+    }
+
+    printf( "wrote %s (cksum: %s)\n", out->path, out->decode ? hash_orig : hash );
+    return CONSUMER_ACK;
+}
+
+/*
+ * Write one HDO payload that is entirely in memory, or quarantine it if it
+ * fails verification
+ */
+static enum consumer_verdict write_payload( struct consumer_options *opts, struct hoover_header *header,
+                                            const void *data, size_t len, int local ) {
+    struct output_file out;
+    enum consumer_verdict verdict;
+
+    if ( (verdict = open_output(opts, header, &out)) != CONSUMER_ACK )
+        return verdict;
+    write_output( &out, data, len );
+    if ( (verdict = close_output(&out, local)) == CONSUMER_DROP && out.corrupt ) {
+        /* the .partial file may hold decoded data, so keep the payload */
+        unlink( out.partial );
+        verdict = quarantine( opts, header, NULL, data, len );
+    }
+    return verdict;
+}
+
+/*
+ * Bundles
+ */
+
+/*
+ * Write out every member of a bundle as if it had arrived on its own.  Each
+ * member is checked against its own checksum, and quarantined if it fails.
+ * The bundle is only done with once every member was written or quarantined.
+ * A bundle that cannot be taken apart is quarantined as a whole.
+ */
+static enum consumer_verdict unpack_bundle( struct consumer_options *opts, struct hoover_header *header,
+                                            const void *data, size_t len ) {
+    enum consumer_verdict verdict = CONSUMER_ACK;
+    struct hoover_header member;
+    const void *payload;
+    size_t offset = 0, payload_len;
+    int ret, count = 0;
+
+    while ( (ret = hoover_bundle_next(data, len, &offset, &member, &payload, &payload_len)) > 0 ) {
+        count++;
+        if ( write_payload(opts, &member, payload, payload_len, 0) == CONSUMER_REQUEUE )
+            verdict = CONSUMER_REQUEUE;
+    }
+    if ( ret < 0 ) {
+        fprintf( stderr, "bundle %s is malformed after %d files\n", header->filename, count );
+        return quarantine( opts, header, NULL, data, len );
+    }
+
+    printf( "unpacked %d files from bundle %s\n", count, header->filename );
+    return verdict;
+}
+
+/*
+ * Verify a bundle as a whole before unpacking it
+ */
+static enum consumer_verdict handle_bundle( struct consumer_options *opts, struct hoover_message *msg ) {
+    struct hoover_header *header = &(msg->header);
+    const char *expected = header->sha_hash[0] ? (char *)header->sha_hash : header->hash_orig;
+    char hash[HASH_DIGEST_LENGTH_HEX];
+
+    if ( expected[0] ) {
+        if ( hoover_hash_data(header->hash_algo[0] ? header->hash_algo : "sha1", msg->body, msg->size, hash) != 0 ) {
+            fprintf( stderr, "cannot verify bundle %s with %s\n", header->filename, header->hash_algo );
+            return CONSUMER_REQUEUE;
+        }
+        if ( strcmp(hash, expected) != 0 ) {
+            fprintf( stderr, "checksum mismatch for bundle %s (cksum: %s, was expecting %s)\n",
+                header->filename, hash, expected );
+            return quarantine( opts, header, NULL, msg->body, msg->size );
+        }
+    }
+    return unpack_bundle( opts, header, msg->body, msg->size );
+}
+
+/*
+ * Chunks
+ */
+
+/*
+ * Save the headers of a split HDO next to its chunks, as consumer.py does, so
+ * that whichever consumer receives the last chunk can write out the whole HDO.
+ */
+static int write_chunk_headers( const char *stage_dir, struct hoover_message *msg ) {
+    char path[PATH_MAX];
+
+    snprintf( path, PATH_MAX, "%s/headers.json", stage_dir );
+    return write_headers( path, &(msg->header), &(msg->chunk) );
+}
+
+/* remove a staging directory and everything in it */
+static void remove_stage( const char *stage_dir ) {
+    char path[PATH_MAX];
+    struct dirent *entry;
+    DIR *dir;
+
+    if ( (dir = opendir(stage_dir)) ) {
+        while ( (entry = readdir(dir)) != NULL ) {
+            if ( strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 )
+                continue;
+            snprintf( path, PATH_MAX, "%s/%s", stage_dir, entry->d_name );
+            if ( unlink(path) != 0 )
+                rmdir( path );
+        }
+        closedir( dir );
+    }
+    rmdir( stage_dir );
+    return;
+}
+
+/*
+ * Concatenate the staged chunks of an HDO into its output file once every
+ * chunk has arrived, verifying the whole HDO on the way.  Chunks of one HDO
+ * may be received by different consumers, including consumer.py, so mkdir of
+ * 'assembling' decides which of them writes it out.
+ */
+static void assemble_chunks( struct consumer_options *opts, const char *stage_dir ) {
+    struct hoover_header header;
+    struct output_file out;
+    char path[PATH_MAX];
+    char *headers, *p;
+    void *data;
+    size_t len;
+    long i, count = 0;
+
+    snprintf( path, PATH_MAX, "%s/headers.json", stage_dir );
+    if ( !(headers = map_file(path, &len)) )
+        return;
+    deserialize_header( headers, len, &header );
+    for ( p = headers; len > strlen("\"chunk_count\"") && p < headers + len - strlen("\"chunk_count\""); p++ ) {
+        if ( strncmp(p, "\"chunk_count\"", strlen("\"chunk_count\"")) == 0 ) {
+            p += strlen("\"chunk_count\"");
+            while ( p < headers + len && (*p == ' ' || *p == ':') )
+                p++;
+            count = strtol( p, NULL, 10 );
+            break;
+        }
+    }
+    unmap_file( headers, len );
+    if ( count <= 0 )
+        return;
+
+    for ( i = 0; i < count; i++ ) {
+        snprintf( path, PATH_MAX, "%s/%ld", stage_dir, i );
+        if ( access(path, F_OK) != 0 )
+            return;
+    }
+
+    snprintf( path, PATH_MAX, "%s/assembling", stage_dir );
+    if ( mkdir(path, 0755) != 0 )
+        return;
+
+    if ( open_output(opts, &header, &out) != CONSUMER_ACK ) {
+        rmdir( path );
+        return;
+    }
+    for ( i = 0; i < count && !out.failed; i++ ) {
+        snprintf( path, PATH_MAX, "%s/%ld", stage_dir, i );
+        if ( !(data = map_file(path, &len)) ) {
+            fprintf( stderr, "could not read chunk %s\n", path );
+            out.failed = 1;
+            break;
+        }
+        write_output( &out, data, len );
+        unmap_file( data, len );
+    }
+
+    if ( close_output(&out, 0) == CONSUMER_ACK ) {
+        printf( "assembled %ld chunks into %s\n", count, out.path );
+        /* a bundle is only a container; keep it unless it was unpacked or
+         * quarantined */
+        if ( strcmp(header.type, "bundle") == 0 && (data = map_file(out.path, &len)) ) {
+            if ( unpack_bundle(opts, &header, data, len) != CONSUMER_REQUEUE )
+                unlink( out.path );
+            unmap_file( data, len );
+        }
+    }
+    else if ( out.corrupt ) {
+        quarantine_file( opts, &header, out.partial );
+    }
+    remove_stage( stage_dir );
+    return;
+}
+
+/*
+ * Stage one chunk of a split HDO, then try to reassemble the HDO
+ */
+static enum consumer_verdict handle_chunk( struct consumer_options *opts, struct hoover_message *msg ) {
+    struct hoover_header *header = &(msg->header);
+    char hash[HASH_DIGEST_LENGTH_HEX], stage_dir[PATH_MAX], path[PATH_MAX];
+
+    if ( hoover_hash_data(header->hash_algo[0] ? header->hash_algo : "sha1", msg->body, msg->size, hash) != 0 ) {
+        fprintf( stderr, "cannot verify chunk %ld of %s with %s\n",
+            (long)msg->chunk.index, msg->chunk.transfer_id, header->hash_algo );
+        return CONSUMER_REQUEUE;
+    }
+    if ( strcmp(hash, msg->chunk.sha_hash) != 0 ) {
+        fprintf( stderr, "checksum mismatch for chunk %ld of %s (cksum: %s, was expecting %s)\n",
+            (long)msg->chunk.index, msg->chunk.transfer_id, hash, msg->chunk.sha_hash );
+        return quarantine( opts, header, &(msg->chunk), msg->body, msg->size );
+    }
+
+    snprintf( stage_dir, PATH_MAX, "%s/%s", opts->chunk_dir, base_name(msg->chunk.transfer_id) );
+    snprintf( path, PATH_MAX, "%s/%ld", stage_dir, (long)msg->chunk.index );
+    if ( make_dirs(stage_dir) != 0
+    ||   write_file_atomically(path, msg->body, msg->size) != 0
+    ||   (msg->chunk.count > 0 && write_chunk_headers(stage_dir, msg) != 0) ) {
+        fprintf( stderr, "could not stage chunk %ld of %s\n", (long)msg->chunk.index, msg->chunk.transfer_id );
+        return CONSUMER_REQUEUE;
+    }
+
+    /* the chunk is safely staged no matter how assembly goes */
+    assemble_chunks( opts, stage_dir );
+    return CONSUMER_ACK;
+}
+
+/*
+ * Worker threads
+ */
+static enum consumer_verdict process_message( struct consumer_options *opts, struct hoover_message *msg ) {
+    struct hoover_header *header = &(msg->header);
+
+    /* chunks carry a checksum of their own */
+    if ( msg->has_chunk )
+        return handle_chunk( opts, msg );
+
+    if ( !header->sha_hash[0] && !header->hash_orig[0] && !msg->local ) {
+        fprintf( stderr, "no checksum provided for %s; discarding it\n", header->filename );
+        return CONSUMER_DROP;
+    }
+    if ( strcmp(header->type, "bundle") == 0 )
+        return handle_bundle( opts, msg );
+    return write_payload( opts, header, msg->body, msg->size, msg->local );
+}
+
+void *consumer_worker( void *arg ) {
+    struct consumer_work *work = arg;
+    struct consumer_job *job;
+
+    while ( (job = hoover_queue_pop(work->todo)) != NULL ) {
+        job->verdict = process_message( work->opts, job->msg );
+        hoover_queue_push( work->done, job );
+    }
+    return NULL;
+}
+
+/*
+ * Main thread
+ */
+
+/* counts of messages by how they were settled */
+struct consumer_stats {
+    unsigned long acked;
+    unsigned long requeued;
+    unsigned long dropped;
+};
+
+static void settle_job( struct hoover_tube *tube, struct consumer_job *job, struct consumer_stats *stats ) {
+    switch ( job->verdict ) {
+    case CONSUMER_ACK:
+        hoover_ack_message( tube, job->msg );
+        stats->acked++;
+        break;
+    case CONSUMER_REQUEUE:
+        hoover_reject_message( tube, job->msg, 1 );
+        stats->requeued++;
+        break;
+    case CONSUMER_DROP:
+        hoover_reject_message( tube, job->msg, 0 );
+        stats->dropped++;
+        break;
+    }
+    free( job );
+    return;
+}
+
+/* default to one worker per online core */
+int default_num_threads( void ) {
+    long ncpus = sysconf( _SC_NPROCESSORS_ONLN );
+    if ( ncpus < 1 )
+        return 1;
+    else if ( ncpus > HOOVER_MAX_THREADS )
+        return HOOVER_MAX_THREADS;
+    return (int)ncpus;
+}
+
+int main( int argc, char **argv ) {
+    struct hoover_tube_config *config;
+    struct hoover_tube *tube;
+    struct hoover_message *msg;
+    struct consumer_options opts;
+    struct consumer_work work;
+    struct consumer_job *job;
+    struct consumer_stats stats;
+    struct timespec no_wait = { 0, 0 };
+    sigset_t signals;
+    pthread_t *workers;
+    int num_threads = default_num_threads();
+    int prefetch = 0, decompress = -1, exit_when_idle = 0;
+    char *output_dir = NULL, *chunk_dir = NULL;
+    size_t depth, max_outstanding, outstanding = 0;
+    int c, ret, timed_out, idle_ms = 0, status = 0;
+
+    while ( (c = getopt(argc, argv, "t:q:o:C:xe")) != -1 ) {
+        switch (c) {
+        case 't':
+            num_threads = atoi(optarg);
+            if ( num_threads < 1 || num_threads > HOOVER_MAX_THREADS ) {
+                fprintf( stderr, "number of threads must be between 1 and %d\n", HOOVER_MAX_THREADS );
+                return 1;
+            }
+            break;
+        case 'q':
+            /* unacknowledged messages per connection; overrides the tube config */
+            prefetch = atoi(optarg);
+            break;
+        case 'o':
+            output_dir = optarg;
+            break;
+        case 'C':
+            chunk_dir = optarg;
+            break;
+        case 'x':
+            /* decode files after verifying them */
+            decompress = 1;
+            break;
+        case 'e':
+            /* exit once the tube has nothing more to deliver */
+            exit_when_idle = 1;
+            break;
+        default:
+            fprintf( stderr, "Syntax: %s [-t num_threads] [-q prefetch] [-o output_dir] [-C chunk_dir] [-x] [-e]\n", argv[0] );
+            return 1;
+        }
+    }
+
+    /* Load the tube configuration  */
+    if ( !(config = read_tube_config()) ) {
+        fprintf( stderr, "NULL config\n" );
+        return 1;
+    }
+    else {
+        save_tube_config( config, stdout );
+    }
+    if ( prefetch > 0 )
+        config->prefetch = prefetch;
+    if ( config->hash && hoover_set_hash(config->hash) != 0 )
+        return 1;
+
+    memset( &opts, 0, sizeof(opts) );
+    if ( !output_dir )
+        output_dir = config->output_dir ? config->output_dir : ".";
+    snprintf( opts.output_dir, PATH_MAX, "%s", output_dir );
+    if ( !chunk_dir )
+        chunk_dir = config->chunk_dir;
+    if ( chunk_dir )
+        snprintf( opts.chunk_dir, PATH_MAX, "%s", chunk_dir );
+    else
+        snprintf( opts.chunk_dir, PATH_MAX, "%s/%s", opts.output_dir, HOOVER_CHUNK_DIR );
+    snprintf( opts.quarantine_dir, PATH_MAX, "%s/%s", opts.output_dir, HOOVER_QUARANTINE_DIR );
+    opts.decompress = decompress < 0 ? config->decompress : decompress;
+
+#ifdef HOOVER_TUBE_FILE
+    /* files written into the tube's directory would be delivered all over
+     * again; subdirectories of it are fine since the tube never looks there */
+    {
+        char tube_dir[PATH_MAX], out_dir[PATH_MAX];
+        if ( realpath(config->dir, tube_dir) && realpath(opts.output_dir, out_dir)
+        &&   strcmp(tube_dir, out_dir) == 0 ) {
+            fprintf( stderr, "output_dir %s is the tube directory; pick another with -o\n", opts.output_dir );
+            return 1;
+        }
+    }
+#endif
+
+    if ( (tube = create_hoover_tube(config)) == NULL ) {
+        fprintf( stderr, "could not establish tube\n" );
+        return 1;
+    }
+
+    /* Workers may hold a few messages each beyond the one they are working
+     * on.  Every message that is out can always be put on the done queue, so
+     * the workers never wait for the receiving thread. */
+    depth = (size_t)num_threads * HOOVER_QUEUE_DEPTH_PER_THREAD;
+    max_outstanding = depth + num_threads;
+    memset( &work, 0, sizeof(work) );
+    work.opts = &opts;
+    if ( !(work.todo = create_hoover_queue(depth))
+    ||   !(work.done = create_hoover_queue(max_outstanding))
+    ||   !(workers = malloc(num_threads * sizeof(*workers))) ) {
+        fprintf( stderr, "couldn't allocate work queues\n" );
+        return 1;
+    }
+
+    /* Only the main thread hears about SIGINT and friends */
+    sigemptyset( &signals );
+    sigaddset( &signals, SIGINT );
+    sigaddset( &signals, SIGTERM );
+    sigaddset( &signals, SIGHUP );
+    pthread_sigmask( SIG_BLOCK, &signals, NULL );
+
+    for ( int i = 0; i < num_threads; i++ ) {
+        if ( pthread_create(&workers[i], NULL, consumer_worker, &work) != 0 ) {
+            fprintf( stderr, "couldn't create worker thread %d\n", i );
+            return 1;
+        }
+    }
+
+    memset( &stats, 0, sizeof(stats) );
+    while ( sigtimedwait(&signals, NULL, &no_wait) < 0 ) {
+        /* settle whatever the workers have finished */
+        while ( (job = hoover_queue_pop_timed(work.done, 0, &timed_out)) != NULL ) {
+            settle_job( tube, job, &stats );
+            outstanding--;
+        }
+        if ( outstanding >= max_outstanding ) {
+            settle_job( tube, hoover_queue_pop(work.done), &stats );
+            outstanding--;
+            continue;
+        }
+
+        ret = hoover_receive_message( tube, &msg, HOOVER_RECEIVE_POLL_MS );
+        if ( ret < 0 ) {
+            if ( exit_when_idle ) {
+                status = 1;
+                break;
+            }
+            fprintf( stderr, "could not receive; trying again in %d seconds\n", HOOVER_RECEIVE_RETRY_INTERVAL );
+            sleep( HOOVER_RECEIVE_RETRY_INTERVAL );
+            continue;
+        }
+        else if ( ret == 0 ) {
+            if ( exit_when_idle && outstanding == 0 && (idle_ms += HOOVER_RECEIVE_POLL_MS) >= HOOVER_IDLE_EXIT_MS )
+                break;
+            continue;
+        }
+
+        idle_ms = 0;
+        if ( !(job = calloc(1, sizeof(*job))) ) {
+            fprintf( stderr, "couldn't allocate job\n" );
+            hoover_reject_message( tube, msg, 1 );
+            continue;
+        }
+        job->msg = msg;
+        hoover_queue_push( work.todo, job );
+        outstanding++;
+    }
+
+    /* finish and settle everything that was received */
+    hoover_queue_close( work.todo );
+    for ( int i = 0; i < num_threads; i++ )
+        pthread_join( workers[i], NULL );
+    free( workers );
+    while ( outstanding > 0 && (job = hoover_queue_pop_timed(work.done, 0, &timed_out)) != NULL ) {
+        settle_job( tube, job, &stats );
+        outstanding--;
+    }
+    free_hoover_queue( work.todo );
+    free_hoover_queue( work.done );
+
+    printf( "consumed %lu messages; %lu requeued, %lu discarded\n", stats.acked, stats.requeued, stats.dropped );
+
+    free_hoover_tube( tube );
+    free_tube_config( config );
+
+    return status;
+}
@@ -10,6 +10,7 @@ import sys
 import random
 import json
 import time
+import shutil
 import logging
 import pika
 import urllib # for urllib.quote
@@ -21,6 +22,8 @@ _DEFAULT_CONFIG_FILE = '/etc/opt/nersc/slurmd_log_rotate_mq.conf'
 _DEFAULT_CONFIG_FILE = 'amqpcreds.conf'
 _AMQP_URI_TEMPLATE = "amqp%(ssl)s://%(username)s:%(password)s@%(server)s:%(port)s/%(vhost)s"
 _MAX_RECONNECT_DELAY = 10.0 * 60.0
+_CHUNK_DIR = '.chunks'
+_QUARANTINE_DIR = '.quarantine'
 _HOOVER_TYPE_OUTDIR_MAP = {
     "darshan":  "darshanlogs",
     "manifest": "manifests",
@@ -78,6 +81,18 @@ class HooverConsumer(object):
         self.type_outdir_map = _HOOVER_TYPE_OUTDIR_MAP
         if 'type_outdir_map' in config:
             self.type_outdir_map = config['type_outdir_map']
+        self.chunk_dir = os.path.join(self.output_dir, _CHUNK_DIR)
+        if 'chunk_dir' in config:
+            self.chunk_dir = config['chunk_dir']
+        self.quarantine_dir = os.path.join(self.output_dir, _QUARANTINE_DIR)
+        if 'quarantine_dir' in config:
+            self.quarantine_dir = config['quarantine_dir']
+        self.decompress = False
+        if 'decompress' in config and config['decompress']:
+            self.decompress = True
+        self.manifest_json = False
+        if 'manifest_json' in config and config['manifest_json']:
+            self.manifest_json = True
 
         ### private attributes to describe rabbitmq state
         self._connection = None
@@ -294,31 +309,221 @@ class HooverConsumer(object):
         LOGGER.info('Received message # %s from %s',
                     basic_deliver.delivery_tag, properties.app_id )
 
-        ### Figure out what to call this file
-        if properties.headers is None or 'sha_hash' not in properties.headers:
+        if properties.headers is None or ('sha_hash' not in properties.headers
+                                          and 'hash_orig' not in properties.headers):
             ### Messages without checksums at all are useless to us; discard
             LOGGER.error("No checksum provided in message header:\n%s" %
                 json.dumps(properties.headers))
             return
-        elif 'filename' not in properties.headers:
+        elif 'transfer_id' in properties.headers:
+            ### HDOs bigger than max_transmit_size arrive in pieces
+            self.on_chunk(basic_deliver, properties.headers, body)
+            return
+        elif properties.headers.get('type') == 'bundle':
+            ### Small HDOs arrive many to a message
+            self.on_bundle(basic_deliver, properties.headers, body)
+            return
+
+        ### Check the body while it is still in memory, so that nothing that
+        ### is corrupt is ever written out and nothing is read back
+        (checksum, expected) = self.verify(properties.headers, body)
+        if checksum != expected:
+            LOGGER.error("Checksum mismatch for %s (cksum: %s, was expecting %s)" %
+                (properties.headers.get('filename'), checksum, expected))
+            self.reject(basic_deliver, properties.headers, body, checksum)
+            return
+
+        (parent_dir, output_file) = self.output_path(properties.headers)
+        if output_file is None:
+            return
+
+        ### Start interacting with the system and keep an eye out for exceptions
+        try:
+            if not os.path.isdir(parent_dir):
+                LOGGER.info("Creating output dir %s" % parent_dir)
+                os.makedirs(parent_dir)
+
+            ### Write the message body into the intended file
+            _write_atomically(output_file, body)
+        except:
+            LOGGER.error('Unexpected error: %s' % str(sys.exc_info()))
+            self._channel.basic_nack(basic_deliver.delivery_tag)
+            return
+
+        LOGGER.info("Wrote output to %s (cksum: %s)" % (output_file, checksum))
+        LOGGER.info('Acknowledging message %s', basic_deliver.delivery_tag)
+        self._channel.basic_ack(basic_deliver.delivery_tag)
+        if properties.headers.get('type') == 'manifest':
+            self.on_manifest(output_file, properties.headers, body)
+        if self.decompress:
+            self.decompress_output(output_file, properties.headers)
+
+    def verify(self, headers, data):
+        """Calculate the checksum of an HDO's payload the same way its
+        producer did.  The payload is checked against sha_hash when the
+        producer hashed it; otherwise the payload is decompressed and checked
+        against hash_orig.
+
+        :param dict headers: Hoover headers of the message
+        :param str data: the HDO's payload
+        :returns: tuple of (calculated checksum, expected checksum); the
+            calculated checksum is None if it could not be calculated
+
+        """
+        algo = headers.get('hash_algo', 'sha1')
+        try:
+            if headers.get('sha_hash'):
+                return (hoover.checksum_data(data, algo), headers['sha_hash'])
+            return (hoover.checksum_decompressed_data(data, headers.get('compression', ''), algo),
+                    headers.get('hash_orig'))
+        except:
+            LOGGER.error('Could not calculate %s checksum: %s' % (algo, str(sys.exc_info())))
+            return (None, headers.get('sha_hash') or headers.get('hash_orig'))
+
+    def quarantine_path(self, headers):
+        """Pick a name in quarantine_dir for a payload that failed
+        verification and save its headers next to it.  Raises an exception
+        if the headers cannot be saved.
+
+        :param dict headers: Hoover headers of the payload
+        :returns: path the payload should be saved to
+
+        """
+        name = os.path.basename(headers.get('filename') or
+                                headers.get('transfer_id') or 'unnamed')
+        path = os.path.join(self.quarantine_dir, '%s.%d.%d.%d' %
+            (name, int(time.time()), os.getpid(), random.randint(0, 2**31)))
+        if not os.path.isdir(self.quarantine_dir):
+            os.makedirs(self.quarantine_dir)
+        _write_atomically(path + '.headers.json', json.dumps(headers))
+        return path
+
+    def quarantine(self, headers, data):
+        """Keep a payload that failed verification, along with its headers,
+        in quarantine_dir so that it can be looked at later.
+
+        :param dict headers: Hoover headers of the payload
+        :param str data: the payload
+        :returns: path the payload was saved to, or None if it could not be
+
+        """
+        try:
+            path = self.quarantine_path(headers)
+            _write_atomically(path, data)
+        except:
+            LOGGER.error('Could not quarantine %s: %s' % (headers.get('filename'), str(sys.exc_info())))
+            return None
+        LOGGER.warning("Quarantined %s as %s" % (headers.get('filename'), path))
+        return path
+
+    def reject(self, basic_deliver, headers, body, checksum):
+        """Quarantine a message that failed verification and tell the broker
+        not to deliver it again.  If it cannot be quarantined, or could not
+        be checked here at all, it is requeued instead so that it is not lost.
+
+        :param pika.Spec.Basic.Deliver: basic_deliver method
+        :param dict headers: Hoover headers of the message
+        :param str|unicode body: The message body
+        :param str checksum: checksum calculated for the body, or None
+
+        """
+        requeue = checksum is None or self.quarantine(headers, body) is None
+        self._channel.basic_nack(basic_deliver.delivery_tag, requeue=requeue)
+
+    def on_bundle(self, basic_deliver, headers, body):
+        """Verify a bundle of small HDOs as a whole, then unpack it.  The
+        bundle is only acknowledged if every member it carries was verified
+        and written.
+
+        :param pika.Spec.Basic.Deliver: basic_deliver method
+        :param dict headers: Hoover headers of the message
+        :param str|unicode body: The bundle's payload
+
+        """
+        (checksum, expected) = self.verify(headers, body)
+        if checksum != expected:
+            LOGGER.error("Checksum mismatch for bundle %s (cksum: %s, was expecting %s)" %
+                (headers.get('filename'), checksum, expected))
+            self.reject(basic_deliver, headers, body, checksum)
+            return
+
+        if self.unpack_bundle(StringIO.StringIO(body)):
+            LOGGER.info('Acknowledging bundle %s (message %s)',
+                        headers.get('filename'), basic_deliver.delivery_tag)
+            self._channel.basic_ack(basic_deliver.delivery_tag)
+        else:
+            self._channel.basic_nack(basic_deliver.delivery_tag)
+
+    def unpack_bundle(self, f):
+        """Write out every member of a bundle as if it had arrived in a message
+        of its own.  Each member is checked against its own checksum before
+        it is written, and quarantined if it does not match.
+
+        :param f: file-like object holding the bundle's payload
+        :returns: True if every member was verified and written
+
+        """
+        success = True
+        count = 0
+        try:
+            for (headers, payload) in hoover.read_bundle(f):
+                count += 1
+                (checksum, expected) = self.verify(headers, payload)
+                if checksum != expected:
+                    LOGGER.error("Checksum mismatch for bundled %s (cksum: %s, was expecting %s)" %
+                        (headers.get('filename'), checksum, expected))
+                    if checksum is None or self.quarantine(headers, payload) is None:
+                        success = False
+                    continue
+
+                (parent_dir, output_file) = self.output_path(headers)
+                if output_file is None:
+                    success = False
+                    continue
+                if not os.path.isdir(parent_dir):
+                    LOGGER.info("Creating output dir %s" % parent_dir)
+                    os.makedirs(parent_dir)
+                _write_atomically(output_file, payload)
+                LOGGER.info("Wrote bundled output to %s (cksum: %s)" % (output_file, checksum))
+                if self.decompress:
+                    self.decompress_output(output_file, headers)
+        except:
+            LOGGER.error('Could not unpack bundle: %s' % str(sys.exc_info()))
+            return False
+
+        LOGGER.info("Unpacked %d files from bundle" % count)
+        return success
+
+    def output_path(self, headers):
+        """Figure out where the file described by a set of Hoover headers
+        should be written.
+
+        :param dict headers: Hoover headers of the message
+        :returns: tuple of (parent directory, output file name); the output
+            file name is None if the file cannot be written
+
+        """
+        ### Figure out what to call this file
+        if 'filename' not in headers:
             ### No filename with checksum indicates a manifest being sent.
             ### Key manifests their expected contents so that if a manifest
             ### has to be re-sent, it is not duplicated on the consumer side
-            output_file = os.path.basename('manifest_%s.json' % properties.headers['sha_hash'])
+            output_file = os.path.basename('manifest_%s.json' %
+                (headers.get('sha_hash') or headers['hash_orig']))
         else:
             ### Actual files have intended file names embedded
-            output_file = os.path.basename(properties.headers['filename'])
+            output_file = os.path.basename(headers['filename'])
 
         ### Figure out where to put this file.  If the global config is an
         ### absolute path, we use that and disregard output_dir entirely;
         ### otherwise, we take output_dir as a base then tack on the globally
         ### configured dir
-        if 'type' not in properties.headers:
+        if 'type' not in headers:
             parent_dir = ""
-        elif properties.headers['type'] not in self.type_outdir_map:
+        elif headers['type'] not in self.type_outdir_map:
             parent_dir = self.type_outdir_map['_default']
         else:
-            parent_dir = self.type_outdir_map[properties.headers['type']]
+            parent_dir = self.type_outdir_map[headers['type']]
 
         if not parent_dir.startswith(os.sep):
             parent_dir = os.path.join(self.output_dir, parent_dir)
@@ -327,34 +532,214 @@ class HooverConsumer(object):
 
         if os.path.isdir(output_file):
             LOGGER.error("Target output %s exists but is a dir" % output_file)
-            return
+            return (parent_dir, None)
         elif os.path.exists(output_file):
             LOGGER.warning("Target output %s exists; overwriting" % output_file)
 
-        ### Start interacting with the system and keep an eye out for exceptions
-        try: 
-            if not os.path.isdir(parent_dir):
-                LOGGER.info("Creating output dir %s" % parent_dir)
-                os.makedirs(parent_dir)
+        return (parent_dir, output_file)
 
-            ### Write the message body into the intended file
-            open( output_file, 'w+' ).write(body)
+    def on_chunk(self, basic_deliver, headers, body):
+        """Stage one chunk of an HDO that was split across several messages,
+        then try to reassemble the HDO.  Chunks of one HDO may be delivered to
+        different consumers, so chunk_dir must be shared by every consumer
+        that writes to the same output_dir.
+
+        :param pika.Spec.Basic.Deliver: basic_deliver method
+        :param dict headers: Hoover headers of the message
+        :param str|unicode body: The chunk's payload
+
+        """
+        try:
+            checksum = hoover.checksum_data( body, headers.get('hash_algo', 'sha1') )
+        except ValueError:
+            LOGGER.error('Could not calculate checksum: %s' % str(sys.exc_info()))
+            checksum = None
+        if checksum != headers['chunk_sha_hash']:
+            LOGGER.error("Checksum mismatch for chunk %s of %s (cksum: %s, was expecting %s)" %
+                (headers['chunk_index'], headers['transfer_id'], checksum, headers['chunk_sha_hash']))
+            self.reject(basic_deliver, headers, body, checksum)
+            return
+
+        stage_dir = os.path.join(self.chunk_dir, os.path.basename(headers['transfer_id']))
+        try:
+            if not os.path.isdir(stage_dir):
+                try:
+                    os.makedirs(stage_dir)
+                except OSError:
+                    ### another consumer may have just created it
+                    if not os.path.isdir(stage_dir):
+                        raise
+            _write_atomically(os.path.join(stage_dir, '%d' % headers['chunk_index']), body)
+
+            ### chunk_count is only nonzero once the size of the whole HDO is
+            ### known, and those are the headers we need to write it out
+            if int(headers.get('chunk_count', 0)) > 0:
+                _write_atomically(os.path.join(stage_dir, 'headers.json'), json.dumps(headers))
         except:
             LOGGER.error('Unexpected error: %s' % str(sys.exc_info()))
             self._channel.basic_nack(basic_deliver.delivery_tag)
+            return
 
-        ### Calculate checksum and compare to manifest
-        checksum = hoover.checksum( StringIO.StringIO(body) )
-        if checksum == properties.headers['sha_hash']:
-            LOGGER.info("Wrote output to %s (cksum: %s)" % (output_file, checksum))
-            LOGGER.info('Acknowledging message %s', basic_deliver.delivery_tag)
-            self._channel.basic_ack(basic_deliver.delivery_tag)
+        LOGGER.info('Acknowledging chunk %s of %s (message %s)',
+                    headers['chunk_index'], headers['transfer_id'], basic_deliver.delivery_tag)
+        self._channel.basic_ack(basic_deliver.delivery_tag)
+
+        self.assemble_chunks(stage_dir)
+
+    def assemble_chunks(self, stage_dir):
+        """Concatenate the staged chunks of an HDO into its output file once
+        every chunk has arrived, then verify the checksum of the whole HDO.
+
+        :param str stage_dir: directory containing the HDO's chunks
+        :returns: name of the output file, or None if the HDO is incomplete,
+            is being assembled by another consumer, or failed verification
+
+        """
+        headers_file = os.path.join(stage_dir, 'headers.json')
+        if not os.path.exists(headers_file):
+            return None
+        with open(headers_file, 'r') as fp:
+            headers = json.load(fp)
+
+        chunks = [os.path.join(stage_dir, '%d' % i) for i in range(int(headers['chunk_count']))]
+        if not all(os.path.exists(chunk) for chunk in chunks):
+            return None
+
+        ### mkdir is atomic, so only one consumer gets to assemble the HDO
+        try:
+            os.mkdir(os.path.join(stage_dir, 'assembling'))
+        except OSError:
+            return None
+
+        (parent_dir, output_file) = self.output_path(headers)
+        if output_file is None:
+            shutil.rmtree(stage_dir, ignore_errors=True)
+            return None
+
+        try:
+            if not os.path.isdir(parent_dir):
+                LOGGER.info("Creating output dir %s" % parent_dir)
+                os.makedirs(parent_dir)
+            ### without a payload hash, the original data is hashed on the way
+            ### through so that the assembled file never has to be read back
+            compression = None
+            if not headers['sha_hash']:
+                compression = headers.get('compression', '')
+            with open(output_file + '.partial', 'wb') as fp:
+                (checksum, checksum_orig) = hoover.concatenate(chunks, fp,
+                    algo=headers.get('hash_algo', 'sha1'), compression=compression)
+            expected = headers['sha_hash']
+            if not expected:
+                (checksum, expected) = (checksum_orig, headers.get('hash_orig'))
+        except:
+            LOGGER.error('Unexpected error: %s' % str(sys.exc_info()))
+            os.rmdir(os.path.join(stage_dir, 'assembling'))
+            return None
+
+        if checksum == expected:
+            os.rename(output_file + '.partial', output_file)
+            LOGGER.info("Assembled %d chunks into %s (cksum: %s)" % (len(chunks), output_file, checksum))
+            if headers.get('type') == 'bundle':
+                ### a bundle is only a container; keep it if it cannot be unpacked
+                with open(output_file, 'rb') as fp:
+                    unpacked = self.unpack_bundle(fp)
+                if unpacked:
+                    os.unlink(output_file)
+                    output_file = None
+            elif self.decompress:
+                output_file = self.decompress_output(output_file, headers)
         else:
-            LOGGER.error("Checksum mismatch for %s (cksum: %s, was expecting %s)" % 
-                (output_file, checksum, properties.headers['sha_hash']))
-            ### We assume that sha mismatch occurred on the network (unlikely)
-            ### or at this client (e.g., out of space).
-            self._channel.basic_nack(basic_deliver.delivery_tag)
+            LOGGER.error("Checksum mismatch for %s (cksum: %s, was expecting %s)" %
+                (output_file, checksum, expected))
+            self.quarantine_file(headers, output_file + '.partial')
+            output_file = None
+
+        shutil.rmtree(stage_dir, ignore_errors=True)
+        return output_file
+
+    def quarantine_file(self, headers, filename):
+        """Move a file that failed verification into quarantine_dir without
+        copying it, or remove it if it cannot be moved.
+
+        :param dict headers: Hoover headers of the file
+        :param str filename: path to the file
+
+        """
+        try:
+            path = self.quarantine_path(headers)
+            os.rename(filename, path)
+        except:
+            LOGGER.error('Could not quarantine %s: %s' % (filename, str(sys.exc_info())))
+            os.unlink(filename)
+            return
+        LOGGER.warning("Quarantined %s as %s" % (filename, path))
+
+    def on_manifest(self, output_file, headers, body):
+        """Check a manifest that was just written out and, if manifest_json
+        is set, write a binary one out again as JSON next to it.  Only the
+        header of a binary manifest is read unless it is converted.
+
+        :param str output_file: path to the manifest as received
+        :param dict headers: Hoover headers of the message
+        :param str body: the manifest as received, possibly compressed
+
+        """
+        compression = headers.get('compression', '')
+        try:
+            dec = hoover.decompressor(compression)
+            data = dec.decompress(body) + dec.flush()
+            if not data.startswith(hoover.MANIFEST_MAGIC):
+                return
+            manifest = hoover.BinaryManifest(data)
+            LOGGER.info("Binary manifest %s lists %d files" % (output_file, len(manifest)))
+            if not self.manifest_json:
+                return
+
+            json_file = output_file
+            if compression and json_file.endswith('.' + compression):
+                json_file = json_file[:-len(compression) - 1]
+            if json_file.endswith('.hvm'):
+                json_file = json_file[:-len('.hvm')]
+            json_file += '.json'
+            _write_atomically(json_file, hoover.manifest_to_json(data))
+        except:
+            LOGGER.error('Could not read manifest %s: %s' % (output_file, str(sys.exc_info())))
+            return
+        LOGGER.info("Converted manifest to %s" % json_file)
+
+    def decompress_output(self, output_file, headers):
+        """Replace a verified output file with its decompressed contents.  The
+        producer appends the codec's suffix to the file name, so the
+        decompressed file is written to the name without it.  If the codec
+        cannot be decoded here, the compressed file is left in place.
+
+        :param str output_file: path to the compressed output file
+        :param dict headers: Hoover headers of the message
+        :returns: name of the file that now holds the data
+
+        """
+        compression = headers.get('compression', '')
+        suffix = '.' + compression
+        if compression == '' or not output_file.endswith(suffix):
+            return output_file
+
+        decompressed_file = output_file[:-len(suffix)]
+        try:
+            with open(decompressed_file + '.partial', 'wb') as fp:
+                checksum = hoover.decompress_file(output_file, fp, compression,
+                                                  algo=headers.get('hash_algo', 'sha1'))
+            if headers.get('hash_orig') and checksum != headers['hash_orig']:
+                raise ValueError("checksum %s does not match hash_orig %s" % (checksum, headers['hash_orig']))
+            os.rename(decompressed_file + '.partial', decompressed_file)
+            os.unlink(output_file)
+        except:
+            LOGGER.error('Could not decompress %s: %s' % (output_file, str(sys.exc_info())))
+            if os.path.exists(decompressed_file + '.partial'):
+                os.unlink(decompressed_file + '.partial')
+            return output_file
+
+        LOGGER.info("Decompressed %s into %s (cksum: %s)" % (output_file, decompressed_file, checksum))
+        return decompressed_file
 
     def stop_consuming(self):
         """Tell RabbitMQ that you would like to stop consuming by sending the
@@ -418,6 +803,18 @@ class HooverConsumer(object):
         self._connection.close()
 
 
+def _write_atomically(filename, data):
+    """
+    Write data to a file such that other processes either see the whole file
+    or nothing at all
+
+    :param str filename: path to the file to create or replace
+    :param str data: contents of the file
+    """
+    with open(filename + '.tmp', 'wb') as fp:
+        fp.write(data)
+    os.rename(filename + '.tmp', filename)
+
 def _read_config(filename):
     """
     Read a Hoover configuration file and return a dict of parameters
@@ -439,6 +836,8 @@ def _read_config(filename):
                     value = True
                 else:
                     value = False
+            elif key == 'decompress' or key == 'manifest_json':
+                value = int(value) != 0
             elif key == 'type_outdir_map':
                 value = json.reads(value)
             config[key] = value
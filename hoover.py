@@ -1,8 +1,101 @@
 #!/usr/bin/env python
 
 import hashlib
+import zlib
+import json
+import re
+import struct
+import binascii
+import codecs
+import collections
 
-def sha1sum( f, blocksize=2**30 ):
+try:
+    import zstandard
+except ImportError:
+    zstandard = None
+
+try:
+    import lz4.frame
+except ImportError:
+    lz4 = None
+
+try:
+    import xxhash
+except ImportError:
+    xxhash = None
+
+try:
+    import blake3
+except ImportError:
+    blake3 = None
+
+### every bundle payload starts with this; see hooverbundle.h
+BUNDLE_MAGIC = 'HVB1'
+
+### every binary manifest starts with this; see hoovermanifest.h
+MANIFEST_MAGIC = 'HVM1'
+
+### fields of a manifest entry, in the order the JSON manifest lists them
+MANIFEST_FIELDS = ( 'filename', 'node_id', 'task_id', 'compression',
+                    'sha1sum', 'hash_orig', 'hash_algo', 'size', 'type' )
+
+### UTF-8 of the lone surrogates U+DC80 to U+DCFF, which Hoover's JSON uses to
+### escape bytes that are not valid UTF-8 (see strbuf_json_string in hooverio.c)
+_ESCAPED_BYTE = re.compile('\xed([\xb2\xb3])([\x80-\xbf])')
+
+def json_bytes( value ):
+    """Turn a string decoded from Hoover's JSON back into the bytes that were
+    serialized.  Each \\udcXY escape stands for the raw byte 0xXY; everything
+    else is UTF-8.  Values that are not strings are returned as they are."""
+    if isinstance(value, unicode):
+        return _ESCAPED_BYTE.sub(
+            lambda m: chr(0x80 | ((ord(m.group(1)) - 0xb2) << 6) | (ord(m.group(2)) & 0x3f)),
+            value.encode('utf-8'))
+    return value
+
+def _escape_bytes( err ):
+    """Codec error handler that escapes each invalid byte 0xXY as U+DCXY"""
+    return (u''.join(unichr(0xdc00 | ord(b)) for b in err.object[err.start:err.end]), err.end)
+
+codecs.register_error('hoover_escape', _escape_bytes)
+
+def json_string( value ):
+    """Serialize a value the way hooverio.c does, escaping bytes that are
+    not valid UTF-8 so that json_bytes() gets them back"""
+    if isinstance(value, str):
+        value = value.decode('utf-8', 'hoover_escape')
+    return json.dumps(value)
+
+def _json_object_bytes( pairs ):
+    """object_pairs_hook that keeps every string as its original bytes"""
+    return collections.OrderedDict((json_bytes(key), json_bytes(value)) for (key, value) in pairs)
+
+class _Identity(object):
+    """Decompressor for HDOs that were stored without compression"""
+    def decompress(self, data):
+        return data
+    def flush(self):
+        return ''
+
+class _ZstdDecompressor(object):
+    """Adapt zstandard's decompressobj to the zlib decompressobj interface"""
+    def __init__(self):
+        self._obj = zstandard.ZstdDecompressor().decompressobj()
+    def decompress(self, data):
+        return self._obj.decompress(data)
+    def flush(self):
+        return ''
+
+class _Lz4Decompressor(object):
+    """Adapt lz4's LZ4FrameDecompressor to the zlib decompressobj interface"""
+    def __init__(self):
+        self._obj = lz4.frame.LZ4FrameDecompressor()
+    def decompress(self, data):
+        return self._obj.decompress(data)
+    def flush(self):
+        return ''
+
+def sha1sum( f, blocksize=2**20 ):
     """Calculate the SHA1 sum of a file-like object"""
     hasher = hashlib.new('sha1')
     buf = f.read(blocksize)
@@ -11,9 +104,257 @@ def sha1sum( f, blocksize=2**30 ):
         buf = f.read(blocksize)
     return hasher.hexdigest()
 
-def checksum( f ):
-    """Wrapper function for SHA1 sum"""
-    return sha1sum( f )
+def hasher( algo='sha1' ):
+    """Return a new hashlib-style object for a Hoover hash_algo.  Raises
+    ValueError if the hash is unknown or its Python module is missing."""
+    if algo in ('sha1', 'sha256'):
+        return hashlib.new(algo)
+    elif algo == 'xxh3' and xxhash is not None:
+        return xxhash.xxh3_128()
+    elif algo == 'blake3' and blake3 is not None:
+        return blake3.blake3()
+    raise ValueError("unsupported hash '%s'" % algo)
+
+def checksum( f, algo='sha1', blocksize=2**20 ):
+    """Calculate the checksum of a file-like object with the given Hoover
+    hash_algo"""
+    if algo == 'sha1':
+        return sha1sum( f, blocksize )
+    h = hasher(algo)
+    buf = f.read(blocksize)
+    while len(buf) > 0:
+        h.update(buf)
+        buf = f.read(blocksize)
+    return h.hexdigest()
+
+def checksum_decompressed( f, compression, algo='sha1', blocksize=2**20 ):
+    """Calculate the checksum of the original data held compressed in the
+    file-like object f"""
+    h = hasher(algo)
+    dec = decompressor(compression)
+    buf = f.read(blocksize)
+    while len(buf) > 0:
+        h.update(dec.decompress(buf))
+        buf = f.read(blocksize)
+    h.update(dec.flush())
+    return h.hexdigest()
+
+def checksum_data( data, algo='sha1' ):
+    """Calculate the checksum of a string that is already in memory"""
+    h = hasher(algo)
+    h.update(data)
+    return h.hexdigest()
+
+def checksum_decompressed_data( data, compression, algo='sha1', blocksize=2**20 ):
+    """Calculate the checksum of the original data held compressed in the
+    string data.  The string is decompressed a block at a time without being
+    copied."""
+    h = hasher(algo)
+    dec = decompressor(compression)
+    for offset in range(0, len(data), blocksize):
+        h.update(dec.decompress(buffer(data, offset, blocksize)))
+    h.update(dec.flush())
+    return h.hexdigest()
+
+def concatenate( filenames, out, blocksize=2**20, algo='sha1', compression=None ):
+    """Concatenate files into the file-like object out and return a tuple of
+    the checksum of everything that was written and, if compression is given,
+    the checksum of the data it decompresses to (otherwise None)"""
+    h = hasher(algo)
+    if compression is not None:
+        h_orig = hasher(algo)
+        dec = decompressor(compression)
+    for filename in filenames:
+        with open(filename, 'rb') as f:
+            buf = f.read(blocksize)
+            while len(buf) > 0:
+                h.update(buf)
+                if compression is not None:
+                    h_orig.update(dec.decompress(buf))
+                out.write(buf)
+                buf = f.read(blocksize)
+    if compression is None:
+        return (h.hexdigest(), None)
+    h_orig.update(dec.flush())
+    return (h.hexdigest(), h_orig.hexdigest())
+
+def decompressor( compression ):
+    """Return an object with decompress() and flush() methods that undoes the
+    given HDO compression (the compression field of a Hoover header).  Raises
+    ValueError if the codec is unknown or its Python module is missing."""
+    if compression is None or compression == '':
+        return _Identity()
+    elif compression == 'gz':
+        return zlib.decompressobj(16 + zlib.MAX_WBITS)
+    elif compression == 'zst' and zstandard is not None:
+        return _ZstdDecompressor()
+    elif compression == 'lz4' and lz4 is not None:
+        return _Lz4Decompressor()
+    raise ValueError("unsupported compression '%s'" % compression)
+
+def decompress_file( filename, out, compression, blocksize=2**20, algo='sha1' ):
+    """Decompress the file filename into the file-like object out and return
+    the checksum of the decompressed data"""
+    h = hasher(algo)
+    dec = decompressor(compression)
+    with open(filename, 'rb') as f:
+        buf = f.read(blocksize)
+        while len(buf) > 0:
+            data = dec.decompress(buf)
+            h.update(data)
+            out.write(data)
+            buf = f.read(blocksize)
+    data = dec.flush()
+    h.update(data)
+    out.write(data)
+    return h.hexdigest()
+
+def read_bundle( f ):
+    """Iterate over the members of a bundle in the file-like object f and yield
+    a (headers, payload) tuple for each one.  Member headers are serialized
+    like manifest entries, so their sha1sum is renamed to sha_hash to match
+    the headers of a message.  Raises ValueError if f is not a valid bundle."""
+    if f.read(len(BUNDLE_MAGIC)) != BUNDLE_MAGIC:
+        raise ValueError("not a Hoover bundle")
+    while True:
+        buf = f.read(4)
+        if len(buf) == 0:
+            return
+        elif len(buf) != 4:
+            raise ValueError("truncated bundle member header length")
+        (header_len,) = struct.unpack('>I', buf)
+        header = f.read(header_len)
+        buf = f.read(8)
+        if len(header) != header_len or len(buf) != 8:
+            raise ValueError("truncated bundle member header")
+        (payload_len,) = struct.unpack('>Q', buf)
+        payload = f.read(payload_len)
+        if len(payload) != payload_len:
+            raise ValueError("truncated bundle member payload")
+        headers = json.loads(header, object_pairs_hook=_json_object_bytes)
+        if 'sha1sum' in headers:
+            headers['sha_hash'] = headers.pop('sha1sum')
+        yield (headers, payload)
+
+class BinaryManifest(object):
+    """Read-only view of a binary manifest (see hoovermanifest.h).  Entries
+    are only decoded when they are asked for, so a file can be looked up by
+    hash or by name without parsing the rest.  Entries are ordered dicts with
+    the same keys as in the JSON manifest."""
+    _HEADER = struct.Struct('>4s7I')
+    _RECORD = struct.Struct('>6IQBBH')
+    _DIGEST_LEN = 32
+    _ORIG_KEY = 0x80000000
+
+    def __init__(self, data):
+        if len(data) < self._HEADER.size:
+            raise ValueError("truncated manifest header")
+        (magic, self._count, self._record_size, self._records, self._hash_index,
+         self._name_index, self._strings, strings_size) = self._HEADER.unpack_from(data, 0)
+        if magic != MANIFEST_MAGIC:
+            raise ValueError("not a Hoover binary manifest")
+        if self._record_size < self._RECORD.size + 2 * self._DIGEST_LEN \
+        or self._records + self._count * self._record_size > len(data) \
+        or self._hash_index > self._name_index \
+        or (self._name_index - self._hash_index) % 4 != 0 \
+        or self._name_index + 4 * self._count > len(data) \
+        or self._strings + strings_size > len(data):
+            raise ValueError("truncated or corrupt manifest")
+        self._data = data
+        self._hash_count = (self._name_index - self._hash_index) // 4
+
+    def __len__(self):
+        return self._count
+
+    def __getitem__(self, i):
+        if i < 0:
+            i += self._count
+        if i < 0 or i >= self._count:
+            raise IndexError("manifest entry out of range")
+        return self._entry(i)
+
+    def __iter__(self):
+        for i in xrange(self._count):
+            yield self._entry(i)
+
+    def _string(self, offset):
+        start = self._strings + offset
+        return self._data[start:self._data.index('\0', start)]
+
+    def _key(self, index, i, by_hash):
+        """Sort key of the i-th entry of one of the indices, and its record"""
+        (record,) = struct.unpack_from('>I', self._data, index + 4 * i)
+        if by_hash:
+            orig = record & self._ORIG_KEY
+            record &= ~self._ORIG_KEY
+            base = self._records + record * self._record_size
+            digest = base + 36 + (self._DIGEST_LEN if orig else 0)
+            length = ord(self._data[base + (33 if orig else 32)])
+            return (self._data[digest:digest + length], record)
+        base = self._records + record * self._record_size
+        (offset,) = struct.unpack_from('>I', self._data, base)
+        return (self._string(offset), record)
+
+    def _entry(self, record):
+        base = self._records + record * self._record_size
+        fields = self._RECORD.unpack_from(self._data, base)
+        digests = base + self._RECORD.size
+        sha_hash = self._data[digests:digests + fields[7]]
+        hash_orig = self._data[digests + self._DIGEST_LEN:digests + self._DIGEST_LEN + fields[8]]
+        entry = collections.OrderedDict()
+        entry['filename'] = self._string(fields[0])
+        entry['node_id'] = self._string(fields[1])
+        entry['task_id'] = self._string(fields[2])
+        entry['compression'] = self._string(fields[3])
+        entry['sha1sum'] = binascii.hexlify(sha_hash)
+        entry['hash_orig'] = binascii.hexlify(hash_orig)
+        entry['hash_algo'] = self._string(fields[5])
+        entry['size'] = fields[6]
+        entry['type'] = self._string(fields[4])
+        return entry
+
+    def _find(self, index, count, key, by_hash):
+        lo, hi = 0, count
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self._key(index, mid, by_hash)[0] < key:
+                lo = mid + 1
+            else:
+                hi = mid
+        if lo < count:
+            (found, record) = self._key(index, lo, by_hash)
+            if found == key:
+                return self._entry(record)
+        return None
+
+    def find_by_hash(self, sha_hash):
+        """Entry whose sha1sum (the hash of the payload) or hash_orig (the
+        hash of the original file) is the hex digest sha_hash, or None"""
+        try:
+            key = binascii.unhexlify(sha_hash)
+        except TypeError:
+            return None
+        if not key:
+            return None
+        return self._find(self._hash_index, self._hash_count, key, True)
+
+    def find_by_name(self, filename):
+        """Entry for the transmitted file name filename, or None"""
+        return self._find(self._name_index, self._count, filename, False)
+
+def read_manifest( data ):
+    """Parse a manifest in either format into a list of entries"""
+    if data.startswith(MANIFEST_MAGIC):
+        return list(BinaryManifest(data))
+    return json.loads(data, object_pairs_hook=_json_object_bytes)
+
+def manifest_to_json( data ):
+    """Convert a manifest in either format to the JSON one that
+    build_manifest() writes"""
+    return '[' + ','.join(
+        '{ ' + ', '.join('"%s": %s' % (key, json_string(entry[key]))
+                         for key in MANIFEST_FIELDS if key in entry) + ' }'
+        for entry in read_manifest(data)) + ']'
 
 def checksum_file( filename ):
     with open(filename, 'rb') as f:
@@ -0,0 +1,238 @@
+/*******************************************************************************
+ *  hooverbundle.c
+ *
+ *  Container that carries many small HDOs in a single Hoover message
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hooverbundle.h"
+
+/*******************************************************************************
+ * Private functions
+ ******************************************************************************/
+
+/**
+ *  Make room for len more bytes at the end of the bundle's payload
+ */
+static int reserve( struct hoover_bundle *bundle, size_t len ) {
+    unsigned char *new_data;
+    size_t new_capacity;
+
+    if ( bundle->size + len <= bundle->capacity )
+        return 0;
+
+    new_capacity = bundle->capacity ? bundle->capacity : 64 * 1024;
+    while ( new_capacity < bundle->size + len )
+        new_capacity *= 2;
+    if ( !(new_data = realloc(bundle->data, new_capacity)) )
+        return -1;
+    bundle->data = new_data;
+    bundle->capacity = new_capacity;
+    return 0;
+}
+
+/**
+ *  Append an unsigned integer of width bytes in big-endian order
+ */
+static void append_be( struct hoover_bundle *bundle, uint64_t value, int width ) {
+    int i;
+    for ( i = width - 1; i >= 0; i-- )
+        bundle->data[bundle->size++] = (unsigned char)(value >> (8 * i));
+    return;
+}
+
+/**
+ *  Read an unsigned integer of width bytes in big-endian order
+ */
+static uint64_t read_be( const unsigned char *p, int width ) {
+    uint64_t value = 0;
+    int i;
+    for ( i = 0; i < width; i++ )
+        value = (value << 8) | p[i];
+    return value;
+}
+
+/*******************************************************************************
+ * Global functions
+ ******************************************************************************/
+
+/**
+ *  Create an empty bundle that asks to be flushed once its payload reaches
+ *  max_size bytes or it holds max_count members
+ */
+struct hoover_bundle *create_hoover_bundle( size_t max_size, int max_count ) {
+    struct hoover_bundle *bundle;
+
+    if ( max_size == 0 )
+        return NULL;
+
+    if ( !(bundle = calloc(1, sizeof(*bundle))) )
+        return NULL;
+
+    bundle->max_size = max_size;
+    bundle->max_count = max_count > 0 ? max_count : HOOVER_BUNDLE_COUNT;
+
+    return bundle;
+}
+
+/**
+ *  Destroy a bundle along with any members that were never turned into an HDO
+ */
+void free_hoover_bundle( struct hoover_bundle *bundle ) {
+    if ( bundle == NULL ) {
+        fprintf( stderr, "free_hoover_bundle: received NULL pointer\n" );
+        return;
+    }
+    free(bundle->data);
+    free(bundle);
+    return;
+}
+
+/**
+ *  Should this HDO travel in a bundle at all?  Only small HDOs that are
+ *  already in memory are worth bundling.
+ */
+int hoover_bundle_accepts( struct hoover_bundle *bundle, struct hoover_data_obj *hdo ) {
+    return bundle != NULL
+        && hdo->stream == NULL
+        && hdo->size <= HOOVER_BUNDLE_MEMBER_MAX
+        && hdo->size <= bundle->max_size;
+}
+
+/**
+ *  Can this HDO be added without pushing the bundle past its limits?  An
+ *  empty bundle takes anything that it accepts.
+ */
+int hoover_bundle_fits( struct hoover_bundle *bundle, struct hoover_data_obj *hdo ) {
+    return bundle->count == 0
+        || ( bundle->count < bundle->max_count
+          && bundle->size + hdo->size <= bundle->max_size );
+}
+
+/**
+ *  Has the bundle reached either of its limits?
+ */
+int hoover_bundle_full( struct hoover_bundle *bundle ) {
+    return bundle->count >= bundle->max_count
+        || bundle->size >= bundle->max_size;
+}
+
+/**
+ *  Append an HDO and its header to the bundle.  The HDO's data is copied, so
+ *  the caller still owns hdo and header.
+ */
+int hoover_bundle_add( struct hoover_bundle *bundle, struct hoover_data_obj *hdo, struct hoover_header *header ) {
+    char *serialized;
+    size_t header_len;
+
+    if ( hdo->stream ) {
+        fprintf( stderr, "hoover_bundle_add: cannot bundle a streaming HDO\n" );
+        return -1;
+    }
+    if ( !(serialized = serialize_header(header)) )
+        return -1;
+    header_len = strlen(serialized);
+
+    if ( reserve(bundle, (bundle->count == 0 ? HOOVER_BUNDLE_MAGIC_LEN : 0)
+                         + 4 + header_len + 8 + hdo->size) != 0 ) {
+        fprintf( stderr, "hoover_bundle_add: could not grow bundle\n" );
+        free(serialized);
+        return -1;
+    }
+
+    if ( bundle->count == 0 ) {
+        memcpy( bundle->data, HOOVER_BUNDLE_MAGIC, HOOVER_BUNDLE_MAGIC_LEN );
+        bundle->size = HOOVER_BUNDLE_MAGIC_LEN;
+        strncpy( bundle->hash_algo, header->hash_algo, HASH_ALGO_FIELD_LEN );
+    }
+
+    append_be( bundle, header_len, 4 );
+    memcpy( bundle->data + bundle->size, serialized, header_len );
+    bundle->size += header_len;
+    append_be( bundle, hdo->size, 8 );
+    memcpy( bundle->data + bundle->size, hdo->data, hdo->size );
+    bundle->size += hdo->size;
+    bundle->count++;
+
+    free(serialized);
+    return 0;
+}
+
+/**
+ *  Turn the bundle's payload into an uncompressed HDO that can be sent like
+ *  any other, then empty the bundle.  The members are already compressed, so
+ *  the payload is only hashed.  Returns NULL if the bundle is empty.
+ */
+struct hoover_data_obj *hoover_bundle_to_hdo( struct hoover_bundle *bundle ) {
+    struct hoover_data_obj *hdo;
+
+    if ( bundle->count == 0 )
+        return NULL;
+
+    if ( !(hdo = calloc(1, sizeof(*hdo))) )
+        return NULL;
+
+    if ( hoover_hash_data(bundle->hash_algo, bundle->data, bundle->size, hdo->hash_orig) != 0 ) {
+        fprintf( stderr, "hoover_bundle_to_hdo: cannot hash bundle with %s\n", bundle->hash_algo );
+        free(hdo);
+        return NULL;
+    }
+    strncpy( hdo->hash, hdo->hash_orig, HASH_DIGEST_LENGTH_HEX );
+    strncpy( hdo->hash_algo, bundle->hash_algo, HASH_ALGO_FIELD_LEN );
+    hdo->data = realloc( bundle->data, bundle->size ); /* hand over the payload */
+    if ( !hdo->data )
+        hdo->data = bundle->data;
+    hdo->size = bundle->size;
+    hdo->size_orig = bundle->size;
+
+    bundle->data = NULL;
+    bundle->size = 0;
+    bundle->capacity = 0;
+    bundle->count = 0;
+
+    return hdo;
+}
+
+/**
+ *  Step through the members of a received bundle payload.  *offset must be 0
+ *  on the first call and is advanced past each member.  Returns 1 and points
+ *  header, data, and size at the next member, 0 once every member has been
+ *  read, or -1 if the payload is not a well-formed bundle.  data points into
+ *  payload, which must outlive it.
+ */
+int hoover_bundle_next( const void *payload, size_t len, size_t *offset,
+                        struct hoover_header *header, const void **data, size_t *size ) {
+    const unsigned char *p = payload;
+    uint64_t header_len, payload_len;
+
+    if ( *offset == 0 ) {
+        if ( len < HOOVER_BUNDLE_MAGIC_LEN || memcmp(p, HOOVER_BUNDLE_MAGIC, HOOVER_BUNDLE_MAGIC_LEN) != 0 )
+            return -1;
+        *offset = HOOVER_BUNDLE_MAGIC_LEN;
+    }
+    if ( *offset == len )
+        return 0;
+
+    if ( len - *offset < 4 )
+        return -1;
+    header_len = read_be( p + *offset, 4 );
+    *offset += 4;
+    if ( len - *offset < header_len
+    ||   deserialize_header((const char *)p + *offset, header_len, header) != 0 )
+        return -1;
+    *offset += header_len;
+
+    if ( len - *offset < 8 )
+        return -1;
+    payload_len = read_be( p + *offset, 8 );
+    *offset += 8;
+    if ( len - *offset < payload_len )
+        return -1;
+    *data = p + *offset;
+    *size = payload_len;
+    *offset += payload_len;
+
+    return 1;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hooverio.h"
+
+/* compressed HDOs no bigger than this are bundled when bundling is enabled */
+#ifndef HOOVER_BUNDLE_MEMBER_MAX
+    #define HOOVER_BUNDLE_MEMBER_MAX (64 * 1024)
+#endif
+
+/* most HDOs in one bundle unless the config says otherwise */
+#ifndef HOOVER_BUNDLE_COUNT
+    #define HOOVER_BUNDLE_COUNT 1024
+#endif
+
+/* every bundle payload starts with these four bytes */
+#define HOOVER_BUNDLE_MAGIC "HVB1"
+#define HOOVER_BUNDLE_MAGIC_LEN 4
+
+/*
+ * hoover_bundle packs many small HDOs into the payload of one message so that
+ *   each of them does not pay for a publish of its own.  The payload is the
+ *   magic followed by one record per member:
+ *
+ *     uint32_t header_len    (big-endian)
+ *     char header[]          (serialize_header() of the member's header)
+ *     uint64_t payload_len   (big-endian)
+ *     char payload[]         (the member HDO's data, still compressed)
+ *
+ *   Members keep their own hashes, so the consumer verifies each one as if it
+ *   had arrived in a message of its own.
+ */
+struct hoover_bundle {
+    unsigned char *data;       /* payload built so far */
+    size_t size;               /* bytes used in data */
+    size_t capacity;           /* bytes allocated for data */
+    int count;                 /* members in the bundle */
+    size_t max_size;           /* flush once the payload reaches this size */
+    int max_count;             /* flush once the bundle has this many members */
+    char hash_algo[HASH_ALGO_FIELD_LEN]; /* hash used by the members */
+};
+
+struct hoover_bundle *create_hoover_bundle( size_t max_size, int max_count );
+void free_hoover_bundle( struct hoover_bundle *bundle );
+
+int hoover_bundle_accepts( struct hoover_bundle *bundle, struct hoover_data_obj *hdo );
+int hoover_bundle_fits( struct hoover_bundle *bundle, struct hoover_data_obj *hdo );
+int hoover_bundle_add( struct hoover_bundle *bundle, struct hoover_data_obj *hdo, struct hoover_header *header );
+int hoover_bundle_full( struct hoover_bundle *bundle );
+struct hoover_data_obj *hoover_bundle_to_hdo( struct hoover_bundle *bundle );
+int hoover_bundle_next( const void *payload, size_t len, size_t *offset,
+                        struct hoover_header *header, const void **data, size_t *size );
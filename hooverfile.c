@@ -16,22 +16,61 @@
 #include <ctype.h>
 #include <time.h>
 #include <libgen.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "hooverio.h"
 #include "hooverfile.h"
+#include "hooverstats.h"
+#include "hooverbundle.h"
+
+/* files being written by hoover_send_message(), held by a consumer, or given
+ * up on by a consumer; hoover_receive_message() skips all of them */
+#define HOOVER_PARTIAL_SUFFIX ".partial"
+#define HOOVER_RECEIVING_SUFFIX ".receiving"
+#define HOOVER_REJECTED_SUFFIX ".rejected"
+
+/* milliseconds between scans of an empty directory */
+#ifndef HOOVER_FILE_POLL_INTERVAL
+#define HOOVER_FILE_POLL_INTERVAL 200
+#endif
 
 /*******************************************************************************
  * Private functions
  ******************************************************************************/
 
 /**
- * Write a memory buffer to a file block by block
+ * Write a memory buffer to a file block by block; HOOVER_BLOCK_AUTO picks a
+ * block size to suit the file.  Streaming HDOs are written chunk by chunk as
+ * they are compressed, and block_size is ignored.
  */
 size_t hoover_write_hdo( FILE *fp, struct hoover_data_obj *hdo, size_t block_size ) {
     void *p_out = hdo->data;
     size_t bytes_written,
            tot_bytes_written = 0,
            bytes_left = hdo->size;
+
+    if ( hdo->stream ) {
+        const void *chunk;
+        size_t len;
+        int ret;
+        while ( (ret = hoover_read_hdo_chunk(hdo, &chunk, &len)) > 0 ) {
+            bytes_written = fwrite( chunk, 1, len, fp );
+            tot_bytes_written += bytes_written;
+            if ( bytes_written != len )
+                break;
+        }
+        if ( ret < 0 )
+            fprintf( stderr, "hoover_write_hdo: failed to read HDO stream\n" );
+        return tot_bytes_written;
+    }
+
+    if ( bytes_left == 0 )
+        return 0;
+    if ( block_size == HOOVER_BLOCK_AUTO )
+        block_size = hoover_pick_block_size( fileno(fp), hdo->size );
     do {
         if ( bytes_left > block_size )
             bytes_written = fwrite( p_out, 1, block_size, fp );
@@ -55,6 +94,8 @@ struct hoover_tube_config *read_tube_config(void) {
     struct hoover_tube_config *config;
     config = calloc(1, sizeof(struct hoover_tube_config));
     getcwd(config->dir, PATH_MAX);
+    config->hash_compressed = 1;
+    config->adaptive_compression = HOOVER_ADAPTIVE;
     return config;
 }
 
@@ -76,6 +117,14 @@ void free_tube_config(struct hoover_tube_config *config) {
         fprintf( stderr, "free_tube_config: received NULL pointer\n" );
         return;
     }
+    free(config->compression);
+    free(config->hash);
+    free(config->index_file);
+    free(config->spool_dir);
+    free(config->stats_file);
+    free(config->block_size_cache);
+    free(config->output_dir);
+    free(config->chunk_dir);
     free(config);
     return;
 }
@@ -103,30 +152,259 @@ void free_hoover_tube( struct hoover_tube *tube ) {
 }
 
 /**
- * Convert Hoover structures into a file
+ * Convert Hoover structures into a file.  Returns 0 once the file is written.
  */
-void hoover_send_message( struct hoover_tube *tube,
-                          struct hoover_data_obj *hdo,
-                          struct hoover_header *header ) {
+static int send_message( struct hoover_tube *tube,
+                         struct hoover_data_obj *hdo,
+                         struct hoover_header *header ) {
     char buf[PATH_MAX] = "";
+    char partial[PATH_MAX];
     char *bn;
     FILE *fp;
+    size_t written;
+    int ret = 0;
 
     strncat(buf, tube->dir, PATH_MAX);
     strncat(buf, "/", PATH_MAX);
     strncat(buf, header->filename, PATH_MAX);
     bn = basename(buf);
 
-    fp = fopen( bn, "w" );
+    /* consumers only see the file once it is complete */
+    snprintf( partial, PATH_MAX, "%s" HOOVER_PARTIAL_SUFFIX, bn );
+    fp = fopen( partial, "w" );
     if ( !fp ) {
         fprintf(stderr, "hoover_send_message: could not open %s for writing\n", bn);
-        return;
+        tube->failed++;
+        return -1;
     }
     else {
         fprintf(stderr, "hoover_send_message: writing %s\n", bn);
     }
         
-    hoover_write_hdo( fp, hdo, 512*1024 );
-    fclose(fp);
+    written = hoover_write_hdo( fp, hdo, HOOVER_BLOCK_AUTO );
+    if ( fclose(fp) != 0 || (!hdo->stream && written != hdo->size) ) {
+        fprintf(stderr, "hoover_send_message: failed to write %s\n", bn);
+        tube->failed++;
+        ret = -1;
+        unlink( partial );
+    }
+    else if ( rename(partial, bn) != 0 ) {
+        fprintf(stderr, "hoover_send_message: failed to rename %s to %s\n", partial, bn);
+        tube->failed++;
+        ret = -1;
+        unlink( partial );
+    }
+
+    if ( hdo->stream )
+        update_hoover_header( header, hdo );
+    return ret;
+}
+
+/**
+ * Send a message and charge the time it took to the send stage.  hdo->size is
+ * final by the time a streaming HDO has been sent.
+ */
+int hoover_send_message( struct hoover_tube *tube,
+                         struct hoover_data_obj *hdo,
+                         struct hoover_header *header ) {
+    uint64_t t0 = hoover_stats_start();
+    int ret = send_message( tube, hdo, header );
+    hoover_stats_stop( HOOVER_STAGE_SEND, t0 );
+    hoover_stats_count( HOOVER_COUNT_MESSAGES, 1 );
+    hoover_stats_count( HOOVER_COUNT_MESSAGE_BYTES, hdo->size );
+    return ret;
+}
+
+/**
+ * Files are complete as soon as hoover_send_message() returns, so there is
+ * nothing to wait for.  Returns the number of files that could not be written
+ * since the last flush.
+ */
+int hoover_flush_tube( struct hoover_tube *tube ) {
+    int failed = tube->failed;
+    tube->failed = 0;
+    hoover_stats_count( HOOVER_COUNT_FAILED, failed );
+    return failed;
+}
+
+/**
+ * Does name end with suffix?
+ */
+static int has_suffix( const char *name, const char *suffix ) {
+    size_t name_len = strlen(name), suffix_len = strlen(suffix);
+    return name_len >= suffix_len && strcmp(name + name_len - suffix_len, suffix) == 0;
+}
+
+/**
+ * Files carry no headers, so work out what can be from a file's name and
+ * contents.  It has no checksum; the consumer's hash is used for the ones it
+ * computes.
+ */
+static void guess_file_header( struct hoover_message *msg, const char *name ) {
+    struct hoover_header *header = &(msg->header);
+    const char *hash = hoover_get_hash();
+
+    strncpy( header->filename, name, sizeof(header->filename) - 1 );
+    strncpy( header->hash_algo, hash ? hash : HOOVER_HASH, sizeof(header->hash_algo) - 1 );
+    header->size = msg->size;
+
+    if ( has_suffix(name, ".gz") )
+        strcpy( header->compression, "gz" );
+    else if ( has_suffix(name, ".zst") )
+        strcpy( header->compression, "zst" );
+    else if ( has_suffix(name, ".lz4") )
+        strcpy( header->compression, "lz4" );
+
+    if ( msg->size >= HOOVER_BUNDLE_MAGIC_LEN
+    &&   memcmp(msg->body, HOOVER_BUNDLE_MAGIC, HOOVER_BUNDLE_MAGIC_LEN) == 0 )
+        strcpy( header->type, "bundle" );
+    else if ( strncmp(name, "manifest", strlen("manifest")) == 0 )
+        strcpy( header->type, "manifest" );
+    else if ( strstr(name, ".darshan") )
+        strcpy( header->type, "darshan" );
     return;
 }
+
+/**
+ * Claim one file in the tube's directory by renaming it out of the way of
+ * other consumers, then load it.  Returns 1 if a file was claimed, 0 if there
+ * was none, or -1 if the directory cannot be read.
+ */
+static int claim_file( struct hoover_tube *tube, struct hoover_message *msg ) {
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    int fd, ret = 0;
+
+    if ( !(dir = opendir(tube->dir)) ) {
+        fprintf( stderr, "hoover_receive_message: cannot open %s\n", tube->dir );
+        return -1;
+    }
+
+    while ( ret == 0 && (entry = readdir(dir)) != NULL ) {
+        const char *name = entry->d_name;
+        if ( name[0] == '.'
+        ||   has_suffix(name, HOOVER_PARTIAL_SUFFIX)
+        ||   has_suffix(name, HOOVER_RECEIVING_SUFFIX)
+        ||   has_suffix(name, HOOVER_REJECTED_SUFFIX) )
+            continue;
+
+        snprintf( msg->orig_path, PATH_MAX, "%s/%s", tube->dir, name );
+        if ( lstat(msg->orig_path, &st) != 0 || !S_ISREG(st.st_mode) )
+            continue;
+        snprintf( msg->path, PATH_MAX, "%s" HOOVER_RECEIVING_SUFFIX, msg->orig_path );
+        if ( rename(msg->orig_path, msg->path) != 0 )
+            continue; /* another consumer got to it first */
+
+        if ( (fd = open(msg->path, O_RDONLY)) < 0 || fstat(fd, &st) != 0 ) {
+            fprintf( stderr, "hoover_receive_message: cannot open %s\n", msg->path );
+            if ( fd >= 0 )
+                close( fd );
+            rename( msg->path, msg->orig_path );
+            continue;
+        }
+
+        msg->size = st.st_size;
+        if ( msg->size == 0 ) {
+            msg->body = NULL;
+        }
+        else if ( (msg->body = mmap(NULL, msg->size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED ) {
+            msg->mapped = 1;
+        }
+        else {
+            fprintf( stderr, "hoover_receive_message: cannot map %s\n", msg->path );
+            msg->body = NULL;
+            close( fd );
+            rename( msg->path, msg->orig_path );
+            continue;
+        }
+        close( fd );
+
+        guess_file_header( msg, name );
+        ret = 1;
+    }
+
+    closedir( dir );
+    return ret;
+}
+
+/**
+ * Wait up to timeout_ms milliseconds for a file to appear in the tube's
+ * directory and take it.  Files whose names end in .partial, .receiving, or
+ * .rejected, and hidden files, are left alone.  Returns 1 and sets *msg if a
+ * file was taken, 0 on timeout, or -1 if the directory cannot be read.
+ *
+ * The file stays in the directory under a new name until the message is
+ * settled with hoover_ack_message() or hoover_reject_message().
+ */
+int hoover_receive_message( struct hoover_tube *tube, struct hoover_message **msg, int timeout_ms ) {
+    struct hoover_message *m;
+    struct timespec interval;
+    int ret;
+
+    if ( !(m = calloc(1, sizeof(*m))) ) {
+        fprintf( stderr, "hoover_receive_message: could not allocate message\n" );
+        return -1;
+    }
+    m->local = 1;
+
+    while ( (ret = claim_file(tube, m)) == 0 && timeout_ms > 0 ) {
+        int wait_ms = timeout_ms < HOOVER_FILE_POLL_INTERVAL ? timeout_ms : HOOVER_FILE_POLL_INTERVAL;
+        interval.tv_sec = wait_ms / 1000;
+        interval.tv_nsec = (long)(wait_ms % 1000) * 1000000;
+        nanosleep( &interval, NULL );
+        timeout_ms -= wait_ms;
+    }
+
+    if ( ret == 1 )
+        *msg = m;
+    else
+        free( m );
+    return ret;
+}
+
+/**
+ * Release a message's body and free it.
+ */
+static void free_message( struct hoover_message *msg ) {
+    if ( msg->mapped )
+        munmap( msg->body, msg->size );
+    free( msg );
+    return;
+}
+
+/**
+ * The file has been dealt with, so remove it from the tube, and free the
+ * message.
+ */
+int hoover_ack_message( struct hoover_tube *tube, struct hoover_message *msg ) {
+    int ret = 0;
+    if ( unlink(msg->path) != 0 ) {
+        fprintf( stderr, "hoover_ack_message: could not remove %s\n", msg->path );
+        ret = -1;
+    }
+    free_message( msg );
+    return ret;
+}
+
+/**
+ * Give a file back.  If requeue is set, it gets its old name back and will be
+ * received again; otherwise it is renamed to <name>.rejected so that it can be
+ * looked at later.  Frees the message.
+ */
+int hoover_reject_message( struct hoover_tube *tube, struct hoover_message *msg, int requeue ) {
+    char rejected[PATH_MAX];
+    const char *dest = msg->orig_path;
+    int ret = 0;
+
+    if ( !requeue ) {
+        snprintf( rejected, PATH_MAX, "%s" HOOVER_REJECTED_SUFFIX, msg->orig_path );
+        dest = rejected;
+    }
+    if ( rename(msg->path, dest) != 0 ) {
+        fprintf( stderr, "hoover_reject_message: could not rename %s to %s\n", msg->path, dest );
+        ret = -1;
+    }
+    free_message( msg );
+    return ret;
+}
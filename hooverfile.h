@@ -1,9 +1,42 @@
 struct hoover_tube_config {
     char dir[PATH_MAX];
+    char *compression;        /* codec spec for hoover_set_codec(), or NULL */
+    char *hash;               /* hash for hoover_set_hash(), or NULL */
+    int hash_compressed;      /* also hash the compressed payload */
+    int adaptive_compression; /* store data that would not shrink */
+    size_t block_size;        /* bytes read at a time; 0 = pick for each file */
+    char *block_size_cache;   /* calibrate block sizes and keep them here, or NULL */
+    size_t bundle_size;       /* bundle small HDOs into messages this big; 0 = off */
+    int bundle_count;         /* most HDOs per bundle; 0 = default */
+    char *index_file;         /* remembers delivered files across runs, or NULL */
+    char *spool_dir;          /* journal messages here before sending, or NULL */
+    int binary_manifest;      /* send the manifest in the binary format, not JSON */
+    char *stats_file;         /* producers write their statistics here, or NULL */
+    int stats_interval;       /* seconds between statistics updates; 0 = only at exit */
+    int prefetch;             /* unused; files are claimed one at a time */
+    char *output_dir;         /* where consumers write received files, or NULL */
+    char *chunk_dir;          /* where consumers stage chunks of split HDOs, or NULL */
+    int decompress;           /* consumers decode files after verifying them */
 };
 
 struct hoover_tube {
     char dir[PATH_MAX];
+    int failed;               /* files not written since the last flush */
+};
+
+/* hoover_message is one file taken out of the tube's directory by
+   hoover_receive_message().  The file is renamed to <name>.receiving while it
+   is held so that no other consumer picks it up. */
+struct hoover_message {
+    struct hoover_header header;
+    int has_chunk;            /* always 0; files are never split */
+    struct hoover_chunk_info chunk;
+    void *body;               /* contents of the file */
+    size_t size;
+    int local;                /* never crossed a network, so may lack a checksum */
+    int mapped;               /* body is mmapped rather than malloced */
+    char path[PATH_MAX];      /* where the file sits while it is held */
+    char orig_path[PATH_MAX]; /* where it goes back to if requeued */
 };
 
 struct hoover_tube *create_hoover_tube(struct hoover_tube_config *config);
@@ -13,6 +46,15 @@ struct hoover_tube_config *read_tube_config(void);
 void save_tube_config(struct hoover_tube_config *config, FILE *out);
 void free_tube_config(struct hoover_tube_config *config);
 
-void hoover_send_message(struct hoover_tube *tube,
-                         struct hoover_data_obj *hdo,
-                         struct hoover_header *header);
+int hoover_send_message(struct hoover_tube *tube,
+                        struct hoover_data_obj *hdo,
+                        struct hoover_header *header);
+int hoover_flush_tube(struct hoover_tube *tube);
+
+int hoover_receive_message(struct hoover_tube *tube,
+                           struct hoover_message **msg,
+                           int timeout_ms);
+int hoover_ack_message(struct hoover_tube *tube, struct hoover_message *msg);
+int hoover_reject_message(struct hoover_tube *tube,
+                          struct hoover_message *msg,
+                          int requeue);
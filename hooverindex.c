@@ -0,0 +1,396 @@
+/*******************************************************************************
+ *  hooverindex.c
+ *
+ *  On-node index of files that have already been delivered, so that running
+ *  the producer over the same files again does not send them again
+ ******************************************************************************/
+#if !defined(_XOPEN_SOURCE) || _XOPEN_SOURCE < 700
+    #define _XOPEN_SOURCE 700
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+
+#include "hooverindex.h"
+
+#define HOOVER_INDEX_MAGIC "HVI1"
+#define HOOVER_INDEX_HEADER_LEN 8  /* magic + uint32_t record size */
+
+#ifdef __APPLE__
+    #define st_mtim st_mtimespec
+#endif
+
+/*******************************************************************************
+ * Private functions
+ ******************************************************************************/
+
+/**
+ *  32-bit FNV-1a hash of a record, not counting the checksum field itself
+ */
+static uint32_t record_checksum( const struct hoover_index_record *record ) {
+    const unsigned char *p = (const unsigned char *)record;
+    size_t i, len = offsetof(struct hoover_index_record, checksum);
+    uint32_t h = 2166136261U;
+    for ( i = 0; i < len; i++ ) {
+        h ^= p[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/**
+ *  Find the slot that holds (or would hold) the record for path_hash
+ */
+static size_t find_slot( struct hoover_index *index, uint64_t path_hash ) {
+    size_t mask = index->num_slots - 1,
+           i = (size_t)path_hash & mask;
+    while ( index->slots[i] != 0
+    &&      index->records[index->slots[i] - 1].path_hash != path_hash )
+        i = (i + 1) & mask;
+    return i;
+}
+
+/**
+ *  Double the number of slots and rehash every record
+ */
+static int grow_slots( struct hoover_index *index ) {
+    size_t i, num_slots = index->num_slots ? 2 * index->num_slots : 1024;
+    uint32_t *old_slots = index->slots;
+
+    if ( !(index->slots = calloc(num_slots, sizeof(*(index->slots)))) ) {
+        index->slots = old_slots;
+        return -1;
+    }
+    index->num_slots = num_slots;
+    for ( i = 0; i < index->num_records; i++ )
+        index->slots[find_slot(index, index->records[i].path_hash)] = i + 1;
+
+    free(old_slots);
+    return 0;
+}
+
+/**
+ *  Insert a record into the in-memory table, replacing any older record for
+ *  the same path
+ */
+static int insert_record( struct hoover_index *index, const struct hoover_index_record *record ) {
+    size_t slot;
+
+    if ( 2 * (index->num_records + 1) > index->num_slots && grow_slots(index) != 0 )
+        return -1;
+
+    slot = find_slot(index, record->path_hash);
+    if ( index->slots[slot] != 0 ) {
+        index->records[index->slots[slot] - 1] = *record;
+        return 0;
+    }
+
+    if ( index->num_records == index->max_records ) {
+        size_t max_records = index->max_records ? 2 * index->max_records : 1024;
+        struct hoover_index_record *records = realloc(index->records, max_records * sizeof(*records));
+        if ( !records )
+            return -1;
+        index->records = records;
+        index->max_records = max_records;
+    }
+    index->records[index->num_records++] = *record;
+    index->slots[slot] = index->num_records;
+    return 0;
+}
+
+/**
+ *  Write an empty index file header
+ */
+static int reset_index_file( int fd ) {
+    char header[HOOVER_INDEX_HEADER_LEN];
+    uint32_t record_size = sizeof(struct hoover_index_record);
+
+    memcpy( header, HOOVER_INDEX_MAGIC, 4 );
+    memcpy( header + 4, &record_size, 4 );
+    if ( ftruncate(fd, 0) != 0 || hoover_pwrite_all(fd, header, sizeof(header), 0) != 0 )
+        return -1;
+    return fsync(fd);
+}
+
+/**
+ *  Read every valid record in the index file into memory.  Anything after the
+ *  first invalid record is cut off.
+ */
+static int load_index( struct hoover_index *index ) {
+    char header[HOOVER_INDEX_HEADER_LEN];
+    uint32_t record_size;
+    struct hoover_index_record *buf;
+    off_t offset = HOOVER_INDEX_HEADER_LEN;
+    ssize_t n;
+    size_t i;
+
+    n = pread(index->fd, header, sizeof(header), 0);
+    memcpy( &record_size, header + 4, 4 );
+    if ( n != sizeof(header)
+    ||   memcmp(header, HOOVER_INDEX_MAGIC, 4) != 0
+    ||   record_size != sizeof(struct hoover_index_record) ) {
+        if ( n > 0 )
+            fprintf( stderr, "load_index: %s is not a usable index; starting over\n", index->path );
+        return reset_index_file(index->fd);
+    }
+
+    if ( !(buf = malloc(HOOVER_INDEX_BATCH * sizeof(*buf))) )
+        return -1;
+
+    while ( (n = pread(index->fd, buf, HOOVER_INDEX_BATCH * sizeof(*buf), offset)) > 0 ) {
+        for ( i = 0; i < (size_t)n / sizeof(*buf); i++ ) {
+            if ( buf[i].checksum != record_checksum(&buf[i]) )
+                break;
+            if ( insert_record(index, &buf[i]) != 0 ) {
+                free(buf);
+                return -1;
+            }
+        }
+        offset += i * sizeof(*buf);
+        index->file_records += i;
+        if ( i * sizeof(*buf) != (size_t)n )
+            break;
+    }
+    free(buf);
+    if ( n < 0 )
+        return -1;
+
+    /* a crash in the middle of an append leaves a partial record behind */
+    if ( n > 0 ) {
+        fprintf( stderr, "load_index: discarding damaged records at the end of %s\n", index->path );
+        if ( ftruncate(index->fd, offset) != 0 || fsync(index->fd) != 0 )
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ *  Rewrite the index file with only the latest record for each path.  The new
+ *  file is renamed over the old one, so a crash leaves one or the other.
+ */
+static int compact_index( struct hoover_index *index ) {
+    size_t tmp_len = strlen(index->path) + 5;
+    char *tmp_path, *dir_path;
+    int fd, dir_fd;
+
+    if ( !(tmp_path = malloc(tmp_len)) )
+        return -1;
+    snprintf( tmp_path, tmp_len, "%s.tmp", index->path );
+
+    if ( (fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0 ) {
+        free(tmp_path);
+        return -1;
+    }
+    if ( hoover_lock_file(fd) != 0
+    ||   reset_index_file(fd) != 0
+    ||   hoover_pwrite_all(fd, index->records, index->num_records * sizeof(*(index->records)), HOOVER_INDEX_HEADER_LEN) != 0
+    ||   fsync(fd) != 0
+    ||   rename(tmp_path, index->path) != 0 ) {
+        fprintf( stderr, "compact_index: could not rewrite %s\n", index->path );
+        close(fd);
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+
+    /* make the rename itself durable */
+    if ( (dir_path = strdup(index->path)) ) {
+        if ( (dir_fd = open(dirname(dir_path), O_RDONLY)) >= 0 ) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+        free(dir_path);
+    }
+
+    /* other producers waiting on the old file notice that it was replaced */
+    close(index->fd);
+    index->fd = fd;
+    index->file_records = index->num_records;
+    free(tmp_path);
+    return 0;
+}
+
+/*******************************************************************************
+ * Global functions
+ ******************************************************************************/
+
+/**
+ *  Open (creating if necessary) and load the index stored at path.  The index
+ *  stays locked against other producers until it is closed.
+ */
+struct hoover_index *open_hoover_index( const char *path ) {
+    struct hoover_index *index;
+    struct stat st_fd, st_path;
+
+    if ( !(index = calloc(1, sizeof(*index))) )
+        return NULL;
+    index->fd = -1;
+    if ( !(index->path = strdup(path)) ) {
+        free(index);
+        return NULL;
+    }
+
+    /* the file may be replaced by compaction while we wait for the lock */
+    while ( 1 ) {
+        if ( (index->fd = open(path, O_RDWR | O_CREAT, 0600)) < 0 ) {
+            fprintf( stderr, "open_hoover_index: could not open %s\n", path );
+            close_hoover_index(index);
+            return NULL;
+        }
+        if ( hoover_lock_file(index->fd) != 0 ) {
+            fprintf( stderr, "open_hoover_index: could not lock %s\n", path );
+            close_hoover_index(index);
+            return NULL;
+        }
+        if ( fstat(index->fd, &st_fd) == 0 && stat(path, &st_path) == 0
+        &&   st_fd.st_ino == st_path.st_ino && st_fd.st_dev == st_path.st_dev )
+            break;
+        close(index->fd);
+    }
+
+    if ( load_index(index) != 0 ) {
+        fprintf( stderr, "open_hoover_index: could not load %s\n", path );
+        close_hoover_index(index);
+        return NULL;
+    }
+    if ( index->num_slots == 0 && grow_slots(index) != 0 ) {
+        close_hoover_index(index);
+        return NULL;
+    }
+
+    return index;
+}
+
+/**
+ *  Write out anything that was added, then release the index
+ */
+void close_hoover_index( struct hoover_index *index ) {
+    if ( index == NULL ) {
+        fprintf( stderr, "close_hoover_index: received NULL pointer\n" );
+        return;
+    }
+    if ( index->fd >= 0 ) {
+        if ( index->num_pending > 0 )
+            hoover_index_sync(index);
+        close(index->fd); /* also drops the lock */
+    }
+    free(index->pending);
+    free(index->slots);
+    free(index->records);
+    free(index->path);
+    free(index);
+    return;
+}
+
+/**
+ *  Has the file at path already been delivered as it is now?  If so, return 1
+ *  and copy its record into record (if not NULL).  A file only counts if its
+ *  inode, size, and mtime are unchanged and it was hashed with hash_algo.
+ */
+int hoover_index_lookup( struct hoover_index *index, const char *path, const struct stat *st,
+                         const char *hash_algo, struct hoover_index_record *record ) {
+    struct hoover_index_record *found;
+    uint64_t path_hash = hoover_hash_path(path);
+    size_t slot;
+
+    if ( index == NULL || index->num_slots == 0 )
+        return 0;
+
+    slot = find_slot(index, path_hash);
+    if ( index->slots[slot] == 0 )
+        return 0;
+    found = &(index->records[index->slots[slot] - 1]);
+
+    if ( found->inode != (uint64_t)st->st_ino
+    ||   found->size_orig != (uint64_t)st->st_size
+    ||   found->mtime_sec != (int64_t)st->st_mtim.tv_sec
+    ||   found->mtime_nsec != (int64_t)st->st_mtim.tv_nsec
+    ||   strncmp(found->hash_algo, hash_algo, HASH_ALGO_FIELD_LEN) != 0 )
+        return 0;
+
+    if ( record )
+        *record = *found;
+    return 1;
+}
+
+/**
+ *  Describe a file that has been sent, as it was when it was opened, so that
+ *  it can be added to the index once its delivery is confirmed.  Returns -1
+ *  if the header does not have a hash_orig yet.
+ */
+int hoover_index_make_record( const char *path, const struct stat *st, struct hoover_header *header,
+                              struct hoover_index_record *record ) {
+    size_t i, hex_len = strlen(header->hash_orig);
+    unsigned int byte;
+
+    if ( hex_len == 0 || hex_len % 2 != 0 || hex_len / 2 > HASH_DIGEST_MAX_LENGTH )
+        return -1;
+
+    memset( record, 0, sizeof(*record) );
+    record->path_hash = hoover_hash_path(path);
+    record->inode = st->st_ino;
+    record->size_orig = st->st_size;
+    record->mtime_sec = st->st_mtim.tv_sec;
+    record->mtime_nsec = st->st_mtim.tv_nsec;
+    record->size = header->size;
+    strncpy( record->hash_algo, header->hash_algo, HASH_ALGO_FIELD_LEN - 1 );
+    strncpy( record->compression, header->compression, COMPRESS_FIELD_LEN - 1 );
+    for ( i = 0; i < hex_len / 2; i++ ) {
+        if ( sscanf(header->hash_orig + 2 * i, "%2x", &byte) != 1 )
+            return -1;
+        record->digest[i] = byte;
+    }
+    record->digest_len = hex_len / 2;
+    record->checksum = record_checksum(record);
+    return 0;
+}
+
+/**
+ *  Remember a file whose delivery has been confirmed.  Nothing is written
+ *  until hoover_index_sync().
+ */
+int hoover_index_add( struct hoover_index *index, const struct hoover_index_record *record ) {
+    if ( index->num_pending % HOOVER_INDEX_BATCH == 0 ) {
+        struct hoover_index_record *pending;
+        pending = realloc(index->pending, (index->num_pending + HOOVER_INDEX_BATCH) * sizeof(*pending));
+        if ( !pending )
+            return -1;
+        index->pending = pending;
+    }
+    index->pending[index->num_pending++] = *record;
+    return 0;
+}
+
+/**
+ *  Append everything that was added to the index file and make it durable.
+ *  Returns 0 once the records are safely on disk.
+ */
+int hoover_index_sync( struct hoover_index *index ) {
+    size_t i;
+    off_t offset = HOOVER_INDEX_HEADER_LEN + (off_t)index->file_records * sizeof(struct hoover_index_record);
+
+    if ( index->num_pending == 0 )
+        return 0;
+
+    if ( hoover_pwrite_all(index->fd, index->pending, index->num_pending * sizeof(*(index->pending)), offset) != 0
+    ||   fsync(index->fd) != 0 ) {
+        fprintf( stderr, "hoover_index_sync: could not write %s\n", index->path );
+        return -1;
+    }
+    index->file_records += index->num_pending;
+
+    for ( i = 0; i < index->num_pending; i++ )
+        insert_record( index, &(index->pending[i]) );
+    index->num_pending = 0;
+
+    /* rewrite the file once most of it is superseded records */
+    if ( index->file_records > 2 * index->num_records + HOOVER_INDEX_BATCH )
+        compact_index(index);
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "hooverio.h"
+
+/* index records are appended in batches of this many */
+#ifndef HOOVER_INDEX_BATCH
+    #define HOOVER_INDEX_BATCH 4096
+#endif
+
+/*
+ * hoover_index_record remembers one file that was delivered.  The file is
+ *   identified by its path (as a 64-bit hash) and its stat data; if any of
+ *   those change, the file has to be sent again.  The rest of the record is
+ *   what the manifest needs to list the file without reading it.
+ *
+ *   Records are fixed-size and stored in native byte order, since the index
+ *   never leaves the node that wrote it.
+ */
+struct hoover_index_record {
+    uint64_t path_hash;                    /* FNV-1a hash of the file's path */
+    uint64_t inode;
+    uint64_t size_orig;                    /* st_size when it was sent */
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;                         /* size of the compressed payload */
+    char hash_algo[HASH_ALGO_FIELD_LEN];
+    char compression[COMPRESS_FIELD_LEN];
+    unsigned char digest[HASH_DIGEST_MAX_LENGTH]; /* hash_orig in binary */
+    uint32_t digest_len;
+    uint32_t checksum;                     /* FNV-1a of everything above */
+};
+
+/*
+ * hoover_index maps files to the hash_orig that was delivered for them.  It
+ *   is an append-only file of records, loaded into an open-addressing hash
+ *   table keyed by path.  A torn or corrupt record at the end of the file
+ *   (e.g., from a crash during an append) is cut off when the index is
+ *   opened, so the index only ever forgets files and never vouches for one
+ *   that was not delivered.  Once more than half of the file is superseded
+ *   records, it is rewritten and renamed over the original.
+ *
+ *   Lookups do not modify the index, so several threads may look up files at
+ *   once as long as nothing is being added.
+ */
+struct hoover_index {
+    char *path;                            /* index file */
+    int fd;                                /* open for appending; also holds the lock */
+    struct hoover_index_record *records;   /* one per distinct path */
+    size_t num_records;
+    size_t max_records;
+    uint32_t *slots;                       /* record number + 1, or 0 if empty */
+    size_t num_slots;                      /* always a power of two */
+    size_t file_records;                   /* records in the file, live or not */
+    struct hoover_index_record *pending;   /* added but not yet written */
+    size_t num_pending;
+};
+
+struct hoover_index *open_hoover_index( const char *path );
+void close_hoover_index( struct hoover_index *index );
+
+int hoover_index_lookup( struct hoover_index *index, const char *path, const struct stat *st,
+                         const char *hash_algo, struct hoover_index_record *record );
+int hoover_index_make_record( const char *path, const struct stat *st, struct hoover_header *header,
+                              struct hoover_index_record *record );
+int hoover_index_add( struct hoover_index *index, const struct hoover_index_record *record );
+int hoover_index_sync( struct hoover_index *index );
@@ -0,0 +1,435 @@
+/*******************************************************************************
+ *  hooveringest.c
+ *
+ *  Batched ingestion of many small input files through io_uring.  Opening,
+ *  stat'ing, reading, and closing a whole batch of files costs a couple of
+ *  system calls instead of several per file.
+ ******************************************************************************/
+#if !defined(_XOPEN_SOURCE) || _XOPEN_SOURCE < 700
+    #define _XOPEN_SOURCE 700
+#endif
+#ifndef _DEFAULT_SOURCE
+    #define _DEFAULT_SOURCE /* syscall() */
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "hooveringest.h"
+
+#if defined(__linux__) && !defined(HOOVER_NO_URING)
+    #if defined(__has_include)
+        #if __has_include(<linux/io_uring.h>)
+            #define HOOVER_HAVE_URING
+        #endif
+    #endif
+#endif
+
+#ifdef HOOVER_HAVE_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+
+/* a batch takes two submissions per file: open and statx, then read and close */
+#define HOOVER_INGEST_RING_SIZE (2 * HOOVER_INGEST_BATCH)
+
+struct hoover_ingest {
+    int ring_fd;
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;                         /* same as sq_ring with IORING_FEAT_SINGLE_MMAP */
+    size_t cq_ring_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;                    /* queued but not yet submitted */
+    struct statx stx[HOOVER_INGEST_BATCH];
+};
+
+/*******************************************************************************
+ * Private functions
+ ******************************************************************************/
+
+/**
+ *  Does the kernel support every operation that a batch needs?
+ */
+static int probe_ops( int ring_fd ) {
+    const int needed[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE };
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    size_t i;
+    int ok = 1;
+
+    if ( !probe )
+        return 0;
+    if ( syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0 ) {
+        free(probe);
+        return 0;
+    }
+    for ( i = 0; i < sizeof(needed) / sizeof(*needed); i++ ) {
+        if ( needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED) )
+            ok = 0;
+    }
+    free(probe);
+    return ok;
+}
+
+/**
+ *  Get a cleared submission queue entry.  The ring is sized for a full batch,
+ *  so there is always room.
+ */
+static struct io_uring_sqe *get_sqe( struct hoover_ingest *ingest, uint64_t user_data ) {
+    unsigned tail = *(ingest->sq_tail) + ingest->to_submit,
+             index = tail & *(ingest->sq_mask);
+    struct io_uring_sqe *sqe = &(ingest->sqes[index]);
+
+    memset( sqe, 0, sizeof(*sqe) );
+    sqe->user_data = user_data;
+    ingest->sq_array[index] = index;
+    ingest->to_submit++;
+    return sqe;
+}
+
+/**
+ *  Submit everything queued and wait for as many completions, handing each to
+ *  complete().  Returns 0, or -1 if the ring itself failed.
+ */
+static int submit_and_wait( struct hoover_ingest *ingest, struct hoover_ingest_file *files,
+                            void (*complete)(struct hoover_ingest *, struct hoover_ingest_file *, uint64_t, int) ) {
+    unsigned pending = ingest->to_submit,
+             submit = ingest->to_submit;
+
+    /* publish the new entries before the kernel can see the new tail */
+    __atomic_store_n( ingest->sq_tail, *(ingest->sq_tail) + submit, __ATOMIC_RELEASE );
+    ingest->to_submit = 0;
+
+    while ( pending > 0 ) {
+        unsigned head, tail;
+        int ret = syscall( __NR_io_uring_enter, ingest->ring_fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0 );
+        if ( ret < 0 && errno != EINTR )
+            return -1;
+        if ( ret > 0 )
+            submit -= (unsigned)ret < submit ? (unsigned)ret : submit;
+
+        head = *(ingest->cq_head);
+        tail = __atomic_load_n( ingest->cq_tail, __ATOMIC_ACQUIRE );
+        for ( ; head != tail && pending > 0; head++, pending-- ) {
+            struct io_uring_cqe *cqe = &(ingest->cqes[head & *(ingest->cq_mask)]);
+            complete( ingest, files, cqe->user_data, cqe->res );
+        }
+        __atomic_store_n( ingest->cq_head, head, __ATOMIC_RELEASE );
+    }
+    return 0;
+}
+
+/**
+ *  Fill in a struct stat from what statx returned
+ */
+static void statx_to_stat( const struct statx *stx, struct stat *st ) {
+    memset( st, 0, sizeof(*st) );
+    st->st_dev = makedev( stx->stx_dev_major, stx->stx_dev_minor );
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_size = stx->stx_size;
+    st->st_blksize = stx->stx_blksize;
+    st->st_blocks = stx->stx_blocks;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+    return;
+}
+
+/*
+ * Each file gets two completions per phase, told apart by the low bit of
+ * user_data: open (0) and statx (1), then read (0) and close (1).  A statx
+ * that failed is flagged with st_nlink = 0, which no open file can have.
+ */
+static void complete_open( struct hoover_ingest *ingest, struct hoover_ingest_file *files, uint64_t user_data, int res ) {
+    struct hoover_ingest_file *file = &files[user_data / 2];
+    if ( user_data % 2 == 0 ) {
+        file->fd = res >= 0 ? res : -1;
+        file->error = res >= 0 ? 0 : -res;
+    }
+    else if ( res >= 0 ) {
+        statx_to_stat( &(ingest->stx[user_data / 2]), &(file->st) );
+        if ( file->st.st_nlink == 0 )
+            file->st.st_nlink = 1;
+    }
+    return;
+}
+
+static void complete_read( struct hoover_ingest *ingest, struct hoover_ingest_file *files, uint64_t user_data, int res ) {
+    struct hoover_ingest_file *file = &files[user_data / 2];
+    (void)ingest;
+    if ( user_data % 2 == 0 ) {
+        if ( res < 0 ) {
+            free( file->data );
+            file->data = NULL;
+            file->error = -res;
+        }
+        else {
+            /* a short read is finished by finish_read() */
+            file->len = res;
+        }
+    }
+    else if ( res == 0 ) {
+        file->fd = -1;
+    }
+    return;
+}
+
+/**
+ *  Read the rest of a file whose read came up short.  Reads are retried until
+ *  the size it was stat'ed at; only reaching the end of the file before that
+ *  means it shrank, and the data is cut to what was there.
+ */
+static void finish_read( struct hoover_ingest_file *file ) {
+    size_t want = file->st.st_size;
+    while ( file->len < want ) {
+        ssize_t res = pread( file->fd, (char *)file->data + file->len, want - file->len, file->len );
+        if ( res < 0 && errno == EINTR )
+            continue;
+        if ( res < 0 ) {
+            free( file->data );
+            file->data = NULL;
+            file->len = 0;
+            file->error = errno;
+            return;
+        }
+        if ( res == 0 )
+            return;
+        file->len += res;
+    }
+    return;
+}
+
+/**
+ *  Close every fd and free every buffer of a batch that the ring gave up on,
+ *  so the caller can process the files one by one from scratch
+ */
+static void abandon_batch( struct hoover_ingest_file *files, int num_files ) {
+    int i;
+    for ( i = 0; i < num_files; i++ ) {
+        if ( files[i].fd >= 0 )
+            close( files[i].fd );
+        free( files[i].data );
+        files[i].fd = -1;
+        files[i].data = NULL;
+        files[i].len = 0;
+    }
+    return;
+}
+
+/*******************************************************************************
+ * Global functions
+ ******************************************************************************/
+
+/**
+ *  Set up a ring for batched ingestion.  Returns NULL if io_uring or any of
+ *  the operations it needs are not available, in which case files should be
+ *  opened and read one by one as usual.  A ring must only be used by one
+ *  thread at a time.
+ */
+struct hoover_ingest *create_hoover_ingest( void ) {
+    struct hoover_ingest *ingest;
+    struct io_uring_params params;
+
+    if ( !(ingest = calloc(1, sizeof(*ingest))) )
+        return NULL;
+
+    memset( &params, 0, sizeof(params) );
+    ingest->ring_fd = syscall( __NR_io_uring_setup, HOOVER_INGEST_RING_SIZE, &params );
+    if ( ingest->ring_fd < 0 ) {
+        free(ingest);
+        return NULL;
+    }
+    if ( !probe_ops(ingest->ring_fd) || params.sq_entries < HOOVER_INGEST_RING_SIZE ) {
+        close(ingest->ring_fd);
+        free(ingest);
+        return NULL;
+    }
+
+    ingest->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ingest->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ( params.features & IORING_FEAT_SINGLE_MMAP ) {
+        if ( ingest->cq_ring_len > ingest->sq_ring_len )
+            ingest->sq_ring_len = ingest->cq_ring_len;
+        ingest->cq_ring_len = 0;
+    }
+    ingest->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ingest->sq_ring = mmap( NULL, ingest->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ingest->ring_fd, IORING_OFF_SQ_RING );
+    if ( ingest->sq_ring == MAP_FAILED ) {
+        ingest->sq_ring = NULL;
+        free_hoover_ingest(ingest);
+        return NULL;
+    }
+    ingest->cq_ring = ingest->sq_ring;
+    if ( ingest->cq_ring_len ) {
+        ingest->cq_ring = mmap( NULL, ingest->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                ingest->ring_fd, IORING_OFF_CQ_RING );
+        if ( ingest->cq_ring == MAP_FAILED ) {
+            ingest->cq_ring = NULL;
+            free_hoover_ingest(ingest);
+            return NULL;
+        }
+    }
+    ingest->sqes = mmap( NULL, ingest->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ingest->ring_fd, IORING_OFF_SQES );
+    if ( ingest->sqes == MAP_FAILED ) {
+        ingest->sqes = NULL;
+        free_hoover_ingest(ingest);
+        return NULL;
+    }
+
+    ingest->sq_head = (unsigned *)((char *)ingest->sq_ring + params.sq_off.head);
+    ingest->sq_tail = (unsigned *)((char *)ingest->sq_ring + params.sq_off.tail);
+    ingest->sq_mask = (unsigned *)((char *)ingest->sq_ring + params.sq_off.ring_mask);
+    ingest->sq_array = (unsigned *)((char *)ingest->sq_ring + params.sq_off.array);
+    ingest->cq_head = (unsigned *)((char *)ingest->cq_ring + params.cq_off.head);
+    ingest->cq_tail = (unsigned *)((char *)ingest->cq_ring + params.cq_off.tail);
+    ingest->cq_mask = (unsigned *)((char *)ingest->cq_ring + params.cq_off.ring_mask);
+    ingest->cqes = (struct io_uring_cqe *)((char *)ingest->cq_ring + params.cq_off.cqes);
+
+    return ingest;
+}
+
+/**
+ *  Tear down a ring
+ */
+void free_hoover_ingest( struct hoover_ingest *ingest ) {
+    if ( ingest == NULL ) {
+        fprintf( stderr, "free_hoover_ingest: received NULL pointer\n" );
+        return;
+    }
+    if ( ingest->sqes )
+        munmap( ingest->sqes, ingest->sqes_len );
+    if ( ingest->cq_ring && ingest->cq_ring != ingest->sq_ring )
+        munmap( ingest->cq_ring, ingest->cq_ring_len );
+    if ( ingest->sq_ring )
+        munmap( ingest->sq_ring, ingest->sq_ring_len );
+    close( ingest->ring_fd );
+    free( ingest );
+    return;
+}
+
+/**
+ *  Open and stat up to HOOVER_INGEST_BATCH files, then read in and close each
+ *  regular file of at most max_read bytes.  The caller owns the resulting
+ *  fds and data.  Returns -1 if the ring failed, leaving the batch to be
+ *  processed one file at a time.
+ */
+int hoover_ingest_files( struct hoover_ingest *ingest, struct hoover_ingest_file *files,
+                         int num_files, size_t max_read ) {
+    struct io_uring_sqe *sqe;
+    int i;
+
+    if ( num_files > HOOVER_INGEST_BATCH )
+        return -1;
+
+    for ( i = 0; i < num_files; i++ ) {
+        files[i].fd = -1;
+        files[i].data = NULL;
+        files[i].len = 0;
+        files[i].error = 0;
+        memset( &(files[i].st), 0, sizeof(files[i].st) );
+
+        sqe = get_sqe( ingest, 2 * i );
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)files[i].filename;
+        sqe->open_flags = O_RDONLY;
+
+        sqe = get_sqe( ingest, 2 * i + 1 );
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)files[i].filename;
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (uintptr_t)&(ingest->stx[i]);
+    }
+    if ( submit_and_wait(ingest, files, complete_open) != 0 ) {
+        abandon_batch( files, num_files );
+        return -1;
+    }
+
+    /* read small files in full and close them right behind the read */
+    for ( i = 0; i < num_files; i++ ) {
+        if ( files[i].fd < 0 )
+            continue;
+        if ( files[i].st.st_nlink == 0 && fstat(files[i].fd, &(files[i].st)) != 0 ) {
+            files[i].error = errno;
+            close( files[i].fd );
+            files[i].fd = -1;
+            continue;
+        }
+        if ( !S_ISREG(files[i].st.st_mode) || (size_t)files[i].st.st_size > max_read )
+            continue;
+        if ( !(files[i].data = malloc(files[i].st.st_size ? files[i].st.st_size : 1)) )
+            continue;
+        files[i].len = files[i].st.st_size;
+
+        sqe = get_sqe( ingest, 2 * i );
+        sqe->opcode = IORING_OP_READ;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->fd = files[i].fd;
+        sqe->addr = (uintptr_t)files[i].data;
+        sqe->len = files[i].st.st_size;
+        sqe->off = 0;
+
+        sqe = get_sqe( ingest, 2 * i + 1 );
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = files[i].fd;
+    }
+    if ( submit_and_wait(ingest, files, complete_read) != 0 ) {
+        abandon_batch( files, num_files );
+        return -1;
+    }
+
+    /* a short or failed read cancels the close linked to it */
+    for ( i = 0; i < num_files; i++ ) {
+        if ( files[i].fd >= 0 && files[i].data && files[i].len < (size_t)files[i].st.st_size )
+            finish_read( &files[i] );
+        if ( files[i].fd >= 0 && (files[i].data || files[i].error) ) {
+            close( files[i].fd );
+            files[i].fd = -1;
+        }
+    }
+    return 0;
+}
+
+#else
+
+/*
+ * Without io_uring, every file is opened and read one by one by the caller
+ */
+struct hoover_ingest *create_hoover_ingest( void ) {
+    return NULL;
+}
+
+void free_hoover_ingest( struct hoover_ingest *ingest ) {
+    (void)ingest;
+    return;
+}
+
+int hoover_ingest_files( struct hoover_ingest *ingest, struct hoover_ingest_file *files,
+                         int num_files, size_t max_read ) {
+    (void)ingest; (void)files; (void)num_files; (void)max_read;
+    return -1;
+}
+
+#endif
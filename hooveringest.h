@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* most files opened, stat'ed, and read together */
+#ifndef HOOVER_INGEST_BATCH
+    #define HOOVER_INGEST_BATCH 64
+#endif
+
+struct hoover_ingest; /* private to hooveringest.c */
+
+/*
+ * hoover_ingest_file is one file of a batch handed to hoover_ingest_files().
+ *   Small regular files are read into memory in full and closed; anything
+ *   else is left open for the caller to process as before.
+ */
+struct hoover_ingest_file {
+    const char *filename;
+    int fd;                   /* open file if it was not read in, or -1 */
+    struct stat st;           /* valid if the file was opened */
+    void *data;               /* whole file if it was read in, or NULL */
+    size_t len;
+    int error;                /* errno if the file could not be opened or read */
+};
+
+struct hoover_ingest *create_hoover_ingest( void );
+void free_hoover_ingest( struct hoover_ingest *ingest );
+int hoover_ingest_files( struct hoover_ingest *ingest, struct hoover_ingest_file *files,
+                         int num_files, size_t max_read );
@@ -14,17 +14,222 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __APPLE__
+#include <sys/param.h>
+#include <sys/mount.h>
+#else
+#include <sys/vfs.h>
+#endif
+#include <time.h>
 #include <assert.h> /* for debugging */
+#include <pthread.h>
 #include <zlib.h>
+#include <openssl/evp.h>
+#ifdef HOOVER_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HOOVER_HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef HOOVER_HAVE_XXHASH
+#include <xxhash.h>
+#endif
+#ifdef HOOVER_HAVE_BLAKE3
+#include <blake3.h>
+#endif
 
 #include "hooverio.h"
+#include "hooverstats.h"
 
 /*******************************************************************************
  *  local prototypes and structs
  ******************************************************************************/
-struct block_state_structs *init_block_states( void );
+struct stream_slot;
+struct hoover_codec;
+struct hoover_hash;
+
+struct block_state_structs *init_block_states( const struct hoover_codec *codec, int level, int num_threads,
+                                               const struct hoover_hash *hash, int hash_compressed );
+static void free_block_states( struct block_state_structs *bss );
 int *finalize_block_states( struct block_state_structs *bss );
+static int worth_compressing( const unsigned char *data, size_t len );
+static int append_output( unsigned char **buf, size_t *len, size_t *size, const void *data, size_t data_len );
+static void *deflate_parallel_block( void *arg );
+static int read_chunk_serial( struct hoover_hdo_stream *stream, struct stream_slot **chunk );
+static int read_chunk_parallel( struct hoover_hdo_stream *stream, struct stream_slot **chunk );
+static void free_hdo_stream( struct hoover_hdo_stream *stream );
+static void release_relay( struct hoover_hdo_relay *relay, int reader );
+static int read_chunk_relay( struct hoover_data_obj *hdo, const void **chunk, size_t *len );
+static ssize_t read_input( struct hoover_hdo_stream *stream, unsigned char *buf, size_t len, const unsigned char **data );
+static struct hoover_data_obj *drain_hdo( struct hoover_data_obj *hdo, off_t size_hint );
+static void init_defaults( void );
+static void init_ids( void );
+static const struct hoover_hash *find_hash( const char *name );
+static const struct hoover_codec *find_codec( const char *name, size_t name_len );
+static size_t pick_block_size( int fd, size_t size, int single_stream );
+static int start_compress_pool( int num_threads );
+static void *compress_pool_worker( void *arg );
+
+/* number of threads hoover_create_hdo may use to compress a single file */
+static int hoover_compress_threads = 1;
+
+/* workers that compress the blocks of parallel streams.  They are started the
+ * first time a parallel stream is set up and live until the process exits;
+ * every stream's blocks share one queue, see read_chunk_parallel() */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;          /* signaled when slots are queued */
+    pthread_cond_t done;          /* broadcast when a queued slot completes */
+    struct stream_slot *head;     /* oldest queued slot */
+    struct stream_slot *tail;     /* newest queued slot */
+    int num_workers;
+} hoover_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                  PTHREAD_COND_INITIALIZER, NULL, NULL, 0 };
+
+/* codec and level applied to new HDOs; see hoover_set_codec() */
+static const struct hoover_codec *hoover_codec = NULL;
+static int hoover_codec_level;
+
+/* store data that would not shrink instead of compressing it; see
+ * hoover_set_adaptive() */
+static int hoover_adaptive = HOOVER_ADAPTIVE;
+
+/* block size used for HOOVER_BLOCK_AUTO instead of picking one; see
+ * hoover_set_block_size() */
+static size_t hoover_block_size = HOOVER_BLOCK_AUTO;
+
+/* integrity hash applied to new HDOs; see hoover_set_hash() */
+static const struct hoover_hash *hoover_hash = NULL;
+static int hoover_hash_compressed = 1;
+
+static pthread_once_t hoover_defaults_once = PTHREAD_ONCE_INIT;
+
+/* node_id and task_id do not change while the process runs, so they are only
+ * looked up once; see build_hoover_header() */
+static char hoover_node_id[HOST_NAME_MAX];
+static char hoover_task_id[TASK_ID_LEN];
+static pthread_once_t hoover_ids_once = PTHREAD_ONCE_INIT;
+
+/* strings of a hoover_header_arena are packed into blocks of this size */
+#define HOOVER_ARENA_BLOCK_SIZE (1024 * 1024)
+
+struct hoover_arena_block {
+    struct hoover_arena_block *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+/* bytes of a block that are looked at to judge whether it would shrink, and
+ * the number of places a whole input is judged at before it is opened */
+#ifndef HOOVER_ENTROPY_SAMPLE
+    #define HOOVER_ENTROPY_SAMPLE 4096
+#endif
+#ifndef HOOVER_ADAPTIVE_SAMPLES
+    #define HOOVER_ADAPTIVE_SAMPLES 8
+#endif
+
+/* inputs of at least HOOVER_LARGE_INPUT bytes that are compressed as a single
+ * stream are read in blocks of at least HOOVER_LARGE_BLK_SIZE */
+#ifndef HOOVER_LARGE_INPUT
+    #define HOOVER_LARGE_INPUT (64 * 1024 * 1024)
+#endif
+#ifndef HOOVER_LARGE_BLK_SIZE
+    #define HOOVER_LARGE_BLK_SIZE (1024 * 1024)
+#endif
+
+/* block sizes measured by hoover_calibrate_block_sizes(), one per kind of
+ * filesystem and codec.  The table is filled in before any HDO is opened and
+ * only read afterwards, so it takes no lock. */
+#define HOOVER_MAX_FS_BLOCK_SIZES 32
+
+struct fs_block_size {
+    unsigned long fs_type;       /* f_type from statfs() */
+    char codec[16];              /* codec name */
+    size_t block_size;
+};
+
+static struct fs_block_size hoover_fs_block_sizes[HOOVER_MAX_FS_BLOCK_SIZES];
+static int hoover_num_fs_block_sizes = 0;
+
+/* calibration looks at the first HOOVER_CALIBRATE_FILES inputs to find the
+ * filesystems in use, measures each one on its largest input provided that is
+ * at least HOOVER_CALIBRATE_MIN_SIZE, and reads no more than
+ * HOOVER_CALIBRATE_BYTES of it per block size tried */
+#ifndef HOOVER_CALIBRATE_FILES
+    #define HOOVER_CALIBRATE_FILES 256
+#endif
+#ifndef HOOVER_CALIBRATE_MIN_SIZE
+    #define HOOVER_CALIBRATE_MIN_SIZE (1024 * 1024)
+#endif
+#ifndef HOOVER_CALIBRATE_BYTES
+    #define HOOVER_CALIBRATE_BYTES (16 * 1024 * 1024)
+#endif
+
+/* deflate window size; also the amount of history each parallel block uses as
+ * its preset dictionary */
+#define HOOVER_DEFLATE_DICT_SIZE 32768
+
+/*
+ * codec_stream is a zlib-like view of a single compression stream.  Codecs
+ *   consume input from next_in and write output to next_out, advancing both
+ *   pointers and decrementing avail_in and avail_out to match.
+ */
+struct codec_stream {
+    const unsigned char *next_in;
+    size_t avail_in;
+    unsigned char *next_out;
+    size_t avail_out;
+    void *state;                 /* private to the codec */
+};
+
+/*
+ * hoover_codec describes one compression algorithm.  compress() returns 0 if
+ *   it needs more input or more output space, 1 once finish is set and all
+ *   output has been produced, and -1 on error.  decode() undoes it, returning
+ *   1 instead of 0 whenever the input seen so far ends on a complete stream.
+ *   init, end, decode_init, and decode_end may be NULL for codecs that keep
+ *   no state.
+ *
+ *   set_level() changes the level of a stream between two blocks of input,
+ *   and may write to next_out while doing so; level 0 must store data as is.
+ *   It returns 0 on success and nonzero if the level could not be changed
+ *   this time.  It is NULL for codecs whose level is fixed once they start.
+ */
+struct hoover_codec {
+    const char *name;            /* name accepted by hoover_set_codec() */
+    const char *suffix;          /* value of the compression field; "" if none */
+    int default_level;
+    int min_level;
+    int max_level;
+    int block_parallel;          /* supports pigz-style parallel blocks */
+    int (*init)( struct codec_stream *strm, int level, int num_threads );
+    int (*compress)( struct codec_stream *strm, int finish );
+    void (*end)( struct codec_stream *strm );
+    int (*decode_init)( struct codec_stream *strm );
+    int (*decode)( struct codec_stream *strm );
+    void (*decode_end)( struct codec_stream *strm );
+    int (*set_level)( struct codec_stream *strm, int level );
+};
+
+/*
+ * hoover_hash describes one integrity hash.  create() returns a new context,
+ *   final() writes digest_len bytes and destroys the context, and destroy()
+ *   throws a context away without finishing it.
+ */
+struct hoover_hash {
+    const char *name;            /* value of the hash_algo field */
+    size_t digest_len;
+    void *(*create)( void );
+    void (*update)( void *ctx, const void *data, size_t len );
+    void (*final)( void *ctx, unsigned char *digest );
+    void (*destroy)( void *ctx );
+};
 
 /*
  * block_state_structs is just a container for the state structs that belong
@@ -32,188 +237,2258 @@ int *finalize_block_states( struct block_state_structs *bss );
  *   that may be used by hooverio
  */
 struct block_state_structs {
-    SHA_CTX sha_stream;
-    SHA_CTX sha_stream_compressed;
-    z_stream z_stream; 
+    const struct hoover_hash *hash;
+    void *hash_stream;
+    void *hash_stream_compressed; /* NULL if the output is not hashed */
+    const struct hoover_codec *codec;
+    struct codec_stream codec_stream;
     char compression[COMPRESS_FIELD_LEN];
-    unsigned char sha_hash[SHA_DIGEST_LENGTH];
-    unsigned char sha_hash_compressed[SHA_DIGEST_LENGTH];
-    char sha_hash_hex[SHA_DIGEST_LENGTH_HEX];
-    char sha_hash_compressed_hex[SHA_DIGEST_LENGTH_HEX];
+    char hash_hex[HASH_DIGEST_LENGTH_HEX];
+    char hash_compressed_hex[HASH_DIGEST_LENGTH_HEX];
+};
+
+/*
+ * hoover_hdo_decoder checks, and optionally decompresses, an HDO payload as it
+ *   arrives piece by piece.  The payload is always hashed as is; if decoding,
+ *   the decompressed data is hashed too and handed to the caller.
+ */
+struct hoover_hdo_decoder {
+    const struct hoover_hash *hash;
+    void *hash_stream;           /* hash of the payload */
+    void *hash_stream_orig;      /* hash of the decoded data, or NULL */
+    const struct hoover_codec *codec; /* NULL if not decoding */
+    struct codec_stream codec_stream;
+    int complete;                /* input so far ends on a complete stream */
+    int failed;
+    unsigned char *out;
+    size_t out_size;
+};
+
+/*
+ * stream_slot is one buffer in a stream's ring of output chunks.  When
+ *   compressing in parallel (pigz-style), each slot also carries the state for
+ *   one block: the block is deflated as an independent raw deflate stream that
+ *   ends on a byte boundary, so the outputs of all blocks can be concatenated
+ *   into a single gzip member.  The data immediately preceding 'in' is used as
+ *   the preset dictionary so that compression ratio is close to that of a
+ *   single deflate stream.
+ */
+struct stream_slot {
+    z_stream z_stream;    /* parallel only */
+    const unsigned char *in; /* parallel only; points into the stream's input */
+    size_t in_len;        /* parallel only; bytes of input data */
+    size_t dict_len;      /* parallel only; bytes before 'in' usable as a dictionary */
+    uLong crc;            /* parallel only; crc32 of the input data */
+    int level;            /* parallel only; level to compress the block at */
+    int cur_level;        /* parallel only; level z_stream is set to */
+    int adaptive;         /* parallel only; store the block if it would not shrink */
+    int status;           /* nonzero if compression failed */
+    int queued;           /* parallel only; nonzero until a pool worker is done */
+    struct stream_slot *next_job; /* parallel only; next slot in the pool's queue */
+    unsigned char *out;   /* compressed output */
+    size_t out_size;      /* allocated size of *out */
+    size_t out_len;       /* bytes of compressed output */
+};
+
+/*
+ * hoover_hdo_stream is the state behind an HDO whose payload is produced
+ *   incrementally by hoover_read_hdo_chunk().  Input is consumed one block (or
+ *   one block per thread) at a time and compressed into a small, fixed ring of
+ *   output slots, so memory use does not depend on the size of the input.
+ *
+ * Input comes from a FILE*, or from a file descriptor.  Regular files opened
+ *   by descriptor are mmap()ed and hashed and compressed straight out of the
+ *   page cache; pipes and other special files are read() into in_buf.
+ */
+struct hoover_hdo_stream {
+    FILE *fp;                    /* stdio input, or NULL */
+    int fd;                      /* descriptor input, or -1 */
+    ssize_t (*reader)( void *arg, void *buf, size_t len ); /* callback input, or NULL */
+    void *reader_arg;
+    const unsigned char *map;    /* whole input file if it is mapped, or NULL */
+    size_t map_len;
+    int map_borrowed;            /* map is the caller's buffer, not a mapping */
+    size_t map_pos;              /* bytes of the mapping consumed so far */
+    size_t block_size;
+    int num_threads;             /* >1 only for pigz-style parallel gzip */
+    int level;
+    int cur_level;               /* level the codec is at right now (serial) */
+    int adaptive;                /* store blocks that would not shrink */
+    struct block_state_structs *bss;
+    unsigned char *in_buf;       /* input buffer (unused if mapped); in parallel
+                                    mode, the first HOOVER_DEFLATE_DICT_SIZE
+                                    bytes hold history */
+    size_t dict_valid;           /* bytes of valid history before the batch */
+    struct stream_slot *slots;   /* ring of output chunks */
+    int num_slots;
+    int next_slot;               /* next slot to hand out (parallel) */
+    int filled_slots;            /* slots filled by the last batch (parallel) */
+    uLong crc;                   /* crc32 of all input so far (parallel) */
+    struct stream_slot frame;    /* gzip header/trailer (parallel) */
+    int header_sent;
+    int eof;                     /* input has been exhausted */
+    int done;                    /* all output has been handed out */
+    int fail;
+    size_t tot_bytes_read;
+    size_t tot_bytes_written;
+    struct hoover_hdo_relay *relay; /* chunks come from another thread, or NULL */
+};
+
+/*
+ * hoover_hdo_relay carries the chunks of one HDO, read by one thread, to a
+ *   second HDO that another thread reads.  At most depth chunks wait in
+ *   between.  Both ends hold a reference, and whichever lets go last frees it.
+ */
+struct relay_chunk {
+    void *data;
+    size_t len;
+};
+
+struct hoover_hdo_relay {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;      /* a chunk was added or taken, or an end let go */
+    struct hoover_data_obj *src; /* HDO the chunks are read from */
+    struct relay_chunk *chunks;  /* ring of waiting chunks */
+    int depth;
+    int head;
+    int count;
+    int finished;                /* 1 once src has ended, -1 if it failed */
+    int cancelled;               /* the reading end was freed */
+    int refs;
+    void *current;               /* chunk the reading end holds */
+    struct hoover_data_obj result; /* sizes and hashes of src once finished */
 };
 
 
 /*******************************************************************************
  * internal functions
  ******************************************************************************/
-struct block_state_structs *init_block_states( void ) {
+struct block_state_structs *init_block_states( const struct hoover_codec *codec, int level, int num_threads,
+                                               const struct hoover_hash *hash, int hash_compressed ) {
     struct block_state_structs *bss;
 
-    bss = malloc(sizeof(*bss));
-    if ( !bss ) return NULL;
+    bss = calloc(1, sizeof(*bss));
+    if ( !bss ) return NULL;
+    bss->hash = hash;
+    bss->codec = codec;
+
+    /* init hash calculators */
+    if ( !(bss->hash_stream = hash->create())
+    ||   (hash_compressed && !(bss->hash_stream_compressed = hash->create())) ) {
+        free_block_states(bss);
+        return NULL;
+    }
+    strncpy(bss->compression, codec->suffix, COMPRESS_FIELD_LEN);
+
+    /* parallel compression keeps one raw deflate stream per stream_slot */
+    if ( codec->block_parallel && num_threads > 1 )
+        return bss;
+
+    /* init compression codec */
+    if ( codec->init && codec->init(&(bss->codec_stream), level, num_threads) != 0 ) {
+        free_block_states(bss);
+        return NULL;
+    }
+
+    return bss;
+}
+
+int *finalize_block_states( struct block_state_structs *bss ) {
+    unsigned char digest[HASH_DIGEST_MAX_LENGTH];
+
+    /* codecs' end functions ignore streams that were never initialized */
+    if ( bss->codec->end )
+        bss->codec->end( &(bss->codec_stream) );
+
+    bss->hash->final( bss->hash_stream, digest );
+    bss->hash_stream = NULL;
+    hoover_digest_to_hex( digest, bss->hash->digest_len, bss->hash_hex );
+
+    if ( bss->hash_stream_compressed ) {
+        bss->hash->final( bss->hash_stream_compressed, digest );
+        bss->hash_stream_compressed = NULL;
+        hoover_digest_to_hex( digest, bss->hash->digest_len, bss->hash_compressed_hex );
+    }
+
+    return 0;
+}
+
+/*
+ * Release block state structures without finalizing them
+ */
+static void free_block_states( struct block_state_structs *bss ) {
+    if ( bss->codec->end )
+        bss->codec->end( &(bss->codec_stream) );
+    if ( bss->hash_stream )
+        bss->hash->destroy( bss->hash_stream );
+    if ( bss->hash_stream_compressed )
+        bss->hash->destroy( bss->hash_stream_compressed );
+    free( bss );
+    return;
+}
+
+/*
+ * Convert a binary digest into a NULL-terminated hex string
+ */
+void hoover_digest_to_hex( const unsigned char *digest, size_t digest_len, char *hash_hex ) {
+    static const char digits[] = "0123456789abcdef";
+    size_t i;
+    for ( i = 0; i < digest_len; i++ ) {
+        hash_hex[2*i] = digits[digest[i] >> 4];
+        hash_hex[2*i + 1] = digits[digest[i] & 0xf];
+    }
+    hash_hex[2*digest_len] = '\0';
+    return;
+}
+
+/*
+ * Convert a hex digest back to binary.  Returns the number of bytes, or -1 if
+ * hash_hex is not a digest.
+ */
+int hoover_digest_from_hex( const char *hash_hex, unsigned char *digest ) {
+    size_t len = strlen(hash_hex), i;
+
+    if ( len % 2 != 0 || len > 2 * HASH_DIGEST_MAX_LENGTH )
+        return -1;
+    for ( i = 0; i < len; i++ ) {
+        char c = hash_hex[i];
+        int nibble;
+        if ( c >= '0' && c <= '9' ) nibble = c - '0';
+        else if ( c >= 'a' && c <= 'f' ) nibble = c - 'a' + 10;
+        else if ( c >= 'A' && c <= 'F' ) nibble = c - 'A' + 10;
+        else return -1;
+        if ( i % 2 == 0 )
+            digest[i / 2] = nibble << 4;
+        else
+            digest[i / 2] |= nibble;
+    }
+    return len / 2;
+}
+
+/*
+ * log2(x) in 1/256ths of a bit, good to within 0.05 bits.  The table holds
+ * log2 at the midpoint of each sixteenth between 1 and 2.
+ */
+static uint32_t log2_q8( uint32_t x ) {
+    static const uint8_t mantissa[16] = {
+        11, 33, 54, 73, 92, 109, 126, 142, 157, 172, 186, 200, 213, 226, 238, 250 };
+    int msb = 31 - __builtin_clz(x);
+    return 256 * msb + mantissa[((uint64_t)x << 4 >> msb) & 15];
+}
+
+/*
+ * Would data shrink enough to be worth compressing?  The entropy of its bytes
+ * is measured over up to HOOVER_ENTROPY_SAMPLE of them, taken in short runs
+ * spread across the data, and compared against HOOVER_ADAPTIVE_MIN_GAIN.
+ * This only sees the distribution of bytes, not repeats, so it errs towards
+ * compressing: text and binaries pass, while random or already compressed
+ * data does not.
+ */
+static int worth_compressing( const unsigned char *data, size_t len ) {
+    const size_t run = 64;
+    uint32_t counts[256] = { 0 };
+    uint32_t n = 0, bits_q8, i;
+    uint64_t sum = 0;
+    size_t pos, step;
+
+    /* too little data to judge, and too little to waste much time on */
+    if ( len < 2 * run )
+        return 1;
+
+    step = len / (HOOVER_ENTROPY_SAMPLE / run);
+    if ( step < run )
+        step = run;
+    for ( pos = 0; pos + run <= len && n < HOOVER_ENTROPY_SAMPLE; pos += step ) {
+        for ( i = 0; i < run; i++ )
+            counts[data[pos + i]]++;
+        n += run;
+    }
+
+    /* n * entropy = sum over bytes of c * log2(n / c) */
+    for ( i = 0; i < 256; i++ )
+        if ( counts[i] )
+            sum += (uint64_t)counts[i] * (log2_q8(n) - log2_q8(counts[i]));
+    bits_q8 = (uint32_t)(sum / n);
+
+    return bits_q8 * 100 < 8 * 256 * (100 - HOOVER_ADAPTIVE_MIN_GAIN);
+}
+
+/*
+ * Append data to a growable buffer, doubling its size as necessary
+ */
+static int append_output( unsigned char **buf, size_t *len, size_t *size, const void *data, size_t data_len ) {
+    if ( *len + data_len > *size ) {
+        size_t new_size = *size ? *size : data_len;
+        unsigned char *new_buf;
+        while ( new_size < *len + data_len )
+            new_size *= 2;
+        if ( !(new_buf = realloc(*buf, new_size)) )
+            return 1;
+        *buf = new_buf;
+        *size = new_size;
+    }
+    memcpy( *buf + *len, data, data_len );
+    *len += data_len;
+    return 0;
+}
+
+/*
+ * Compress one block of a parallel compression (run by a pool worker).  The
+ * z_stream must already be initialized for raw deflate.
+ */
+static void *deflate_parallel_block( void *arg ) {
+    struct stream_slot *blk = arg;
+    z_stream *strm = &(blk->z_stream);
+
+    int level = blk->level;
+
+    blk->status = 0;
+    blk->out_len = 0;
+    blk->crc = crc32( crc32(0L, Z_NULL, 0), blk->in, blk->in_len );
+
+    if ( deflateReset(strm) != Z_OK ) {
+        blk->status = 1;
+        return NULL;
+    }
+
+    /* a block that would not shrink goes out as stored deflate blocks.  A
+     * freshly reset stream has nothing to flush, so the change takes effect
+     * right away; if zlib refuses, the block is just compressed as usual */
+    if ( blk->adaptive && !worth_compressing(blk->in, blk->in_len) ) {
+        level = 0;
+        hoover_stats_count( HOOVER_COUNT_STORED_BLOCKS, 1 );
+    }
+    if ( level != blk->cur_level && deflateParams(strm, level, Z_DEFAULT_STRATEGY) == Z_OK )
+        blk->cur_level = level;
+
+    /* stored blocks make no use of history */
+    if ( blk->dict_len > 0 && blk->cur_level != 0
+    &&   deflateSetDictionary(strm, blk->in - blk->dict_len, blk->dict_len) != Z_OK ) {
+        blk->status = 1;
+        return NULL;
+    }
+
+    strm->next_in = (Bytef *)blk->in;
+    strm->avail_in = blk->in_len;
+    do {
+        /* Z_SYNC_FLUSH does not promise to stay within deflateBound, so grow
+         * the output buffer whenever deflate fills it */
+        if ( blk->out_len == blk->out_size ) {
+            size_t new_size = blk->out_size ? 2 * blk->out_size : deflateBound(strm, blk->in_len) + 16;
+            unsigned char *new_out = realloc( blk->out, new_size );
+            if ( !new_out ) {
+                blk->status = 1;
+                return NULL;
+            }
+            blk->out = new_out;
+            blk->out_size = new_size;
+        }
+        strm->next_out = blk->out + blk->out_len;
+        strm->avail_out = blk->out_size - blk->out_len;
+
+        /* a sync flush ends the block on a byte boundary without marking it
+         * as the last block of the deflate stream */
+        if ( deflate(strm, Z_SYNC_FLUSH) != Z_OK ) {
+            blk->status = 1;
+            return NULL;
+        }
+        blk->out_len = blk->out_size - strm->avail_out;
+    } while ( strm->avail_out == 0 );
+
+    return NULL;
+}
+
+/*
+ * Produce the next chunk of a serially compressed stream.  Input is read one
+ * block at a time and deflated until the single output slot is full or the
+ * input runs out.
+ */
+static int read_chunk_serial( struct hoover_hdo_stream *stream, struct stream_slot **chunk ) {
+    struct stream_slot *slot = &(stream->slots[0]);
+    struct codec_stream *strm = &(stream->bss->codec_stream);
+    uint64_t t0;
+    int ret, level;
+
+    slot->out_len = 0;
+    while ( slot->out_len < slot->out_size && !stream->done ) {
+        level = stream->cur_level;
+        if ( strm->avail_in == 0 && !stream->eof ) {
+            const unsigned char *in;
+            ssize_t bytes_read = read_input( stream, stream->in_buf, stream->block_size, &in );
+            if ( bytes_read < 0 )
+                return -1;
+
+            /* decide how to treat this block before the codec sees it */
+            if ( stream->adaptive ) {
+                level = worth_compressing( in, bytes_read ) ? stream->level : 0;
+                if ( level == 0 )
+                    hoover_stats_count( HOOVER_COUNT_STORED_BLOCKS, 1 );
+            }
+
+            /* update the hash of the pre-compressed data */
+            t0 = hoover_stats_start();
+            stream->bss->hash->update( stream->bss->hash_stream, in, bytes_read );
+            hoover_stats_stop( HOOVER_STAGE_HASH, t0 );
+            stream->tot_bytes_read += bytes_read;
+
+            strm->next_in = in;
+            strm->avail_in = bytes_read;
+        }
+
+        strm->next_out = slot->out + slot->out_len;
+        strm->avail_out = slot->out_size - slot->out_len;
+
+        /* switching levels flushes what the codec holds, which may not fit in
+         * the slot; then this block stays at the old level */
+        if ( level != stream->cur_level && stream->bss->codec->set_level( strm, level ) == 0 )
+            stream->cur_level = level;
+
+        /* the codec updates avail_in and next_in as it consumes input data.
+           it may also update avail_out and next_out if it flushed any data,
+           but this is not necessarily the case since most codecs internally
+           buffer data */
+        t0 = hoover_stats_start();
+        ret = stream->bss->codec->compress( strm, stream->eof );
+        hoover_stats_stop( HOOVER_STAGE_COMPRESS, t0 );
+        if ( ret == 1 )
+            stream->done = 1;
+        else if ( ret != 0 )
+            return -1;
+
+        slot->out_len = slot->out_size - strm->avail_out;
+    }
+
+    *chunk = slot;
+    return 0;
+}
+
+/*
+ * Start compression workers until the pool has num_threads of them.  Workers
+ * inherit the signal mask of the thread that starts them.
+ *
+ * Returns the number of workers in the pool, which may be zero if none could
+ * be started.
+ */
+static int start_compress_pool( int num_threads ) {
+    pthread_t thread;
+    int num_workers;
+
+    pthread_mutex_lock( &hoover_pool.lock );
+    while ( hoover_pool.num_workers < num_threads ) {
+        if ( pthread_create(&thread, NULL, compress_pool_worker, NULL) != 0 )
+            break;
+        pthread_detach( thread );
+        hoover_pool.num_workers++;
+    }
+    num_workers = hoover_pool.num_workers;
+    pthread_mutex_unlock( &hoover_pool.lock );
+
+    return num_workers;
+}
+
+/*
+ * Compress queued slots until the process exits (thread entry point).
+ */
+static void *compress_pool_worker( void *arg ) {
+    struct stream_slot *blk;
+
+    (void)arg;
+    pthread_mutex_lock( &hoover_pool.lock );
+    while ( 1 ) {
+        while ( !(blk = hoover_pool.head) )
+            pthread_cond_wait( &hoover_pool.work, &hoover_pool.lock );
+        if ( !(hoover_pool.head = blk->next_job) )
+            hoover_pool.tail = NULL;
+        pthread_mutex_unlock( &hoover_pool.lock );
+
+        deflate_parallel_block( blk );
+
+        pthread_mutex_lock( &hoover_pool.lock );
+        blk->queued = 0;
+        pthread_cond_broadcast( &hoover_pool.done );
+    }
+    return NULL;
+}
+
+/*
+ * Produce the next chunk of a parallel (pigz-style) compressed stream.  Input
+ * is read in batches of one block per thread, and each batch's blocks are
+ * deflated concurrently; every slot in the ring then becomes one chunk.  The
+ * output is a single gzip member: a fixed gzip header, the concatenated raw
+ * deflate blocks, an empty final deflate block, and the combined crc32/size
+ * trailer.  Hashing of the original data overlaps with compression.
+ */
+static int read_chunk_parallel( struct hoover_hdo_stream *stream, struct stream_slot **chunk ) {
+    /* same header zlib writes for deflateInit2(..., 15 + 16, ...) on unix */
+    static const unsigned char gzip_header[] = { 0x1f, 0x8b, 0x08, 0, 0, 0, 0, 0, 0, 0x03 };
+    /* a final, empty fixed-Huffman block terminates the deflate stream */
+    static const unsigned char deflate_last_block[] = { 0x03, 0x00 };
+    const unsigned char *batch = NULL;
+    size_t batch_len = 0;
+    uint64_t t0, t_compress;
+    int i, pooled, num_blocks = 0;
+
+    if ( !stream->header_sent ) {
+        memcpy( stream->frame.out, gzip_header, sizeof(gzip_header) );
+        stream->frame.out_len = sizeof(gzip_header);
+        stream->header_sent = 1;
+        *chunk = &(stream->frame);
+        return 0;
+    }
+
+    /* hand out the rest of the last batch before reading another */
+    if ( stream->next_slot < stream->filled_slots ) {
+        *chunk = &(stream->slots[stream->next_slot++]);
+        return 0;
+    }
+
+    if ( stream->eof ) {
+        unsigned char *p = stream->frame.out;
+        memcpy( p, deflate_last_block, sizeof(deflate_last_block) );
+        p += sizeof(deflate_last_block);
+        for ( i = 0; i < 4; i++ ) {
+            p[i] = (stream->crc >> (8 * i)) & 0xff;
+            p[4 + i] = (stream->tot_bytes_read >> (8 * i)) & 0xff;
+        }
+        stream->frame.out_len = sizeof(deflate_last_block) + 8;
+        stream->done = 1;
+        *chunk = &(stream->frame);
+        return 0;
+    }
+
+    /* fill up to one block per thread.  Blocks of a batch are contiguous
+     * whether they are mapped or copied into in_buf */
+    while ( num_blocks < stream->num_slots ) {
+        struct stream_slot *blk = &(stream->slots[num_blocks]);
+        const unsigned char *in;
+        ssize_t bytes_read = read_input( stream,
+            stream->in_buf ? stream->in_buf + HOOVER_DEFLATE_DICT_SIZE + batch_len : NULL,
+            stream->block_size, &in );
+        if ( bytes_read < 0 )
+            return -1;
+        if ( bytes_read == 0 )
+            break;
+        if ( num_blocks == 0 )
+            batch = in;
+        blk->in = in;
+        blk->in_len = bytes_read;
+        blk->dict_len = stream->dict_valid + batch_len;
+        if ( blk->dict_len > HOOVER_DEFLATE_DICT_SIZE )
+            blk->dict_len = HOOVER_DEFLATE_DICT_SIZE;
+        num_blocks++;
+        batch_len += bytes_read;
+        if ( stream->eof )
+            break;
+    }
+
+    t_compress = hoover_stats_start();
+    pthread_mutex_lock( &hoover_pool.lock );
+    pooled = hoover_pool.num_workers > 0;
+    for ( i = 0; pooled && i < num_blocks; i++ ) {
+        struct stream_slot *blk = &(stream->slots[i]);
+        blk->queued = 1;
+        blk->next_job = NULL;
+        if ( hoover_pool.tail )
+            hoover_pool.tail->next_job = blk;
+        else
+            hoover_pool.head = blk;
+        hoover_pool.tail = blk;
+    }
+    if ( pooled )
+        pthread_cond_broadcast( &hoover_pool.work );
+    pthread_mutex_unlock( &hoover_pool.lock );
+
+    /* fall back to compressing on the calling thread if no worker started */
+    for ( i = 0; !pooled && i < num_blocks; i++ )
+        deflate_parallel_block( &(stream->slots[i]) );
+
+    /* hash the original data while the blocks are being compressed */
+    t0 = hoover_stats_start();
+    stream->bss->hash->update( stream->bss->hash_stream, batch, batch_len );
+    hoover_stats_stop( HOOVER_STAGE_HASH, t0 );
+    stream->tot_bytes_read += batch_len;
+
+    if ( pooled ) {
+        pthread_mutex_lock( &hoover_pool.lock );
+        for ( i = 0; i < num_blocks; i++ )
+            while ( stream->slots[i].queued )
+                pthread_cond_wait( &hoover_pool.done, &hoover_pool.lock );
+        pthread_mutex_unlock( &hoover_pool.lock );
+    }
+    hoover_stats_stop( HOOVER_STAGE_COMPRESS, t_compress );
+
+    for ( i = 0; i < num_blocks; i++ ) {
+        if ( stream->slots[i].status != 0 )
+            return -1;
+        stream->crc = crc32_combine( stream->crc, stream->slots[i].crc, stream->slots[i].in_len );
+    }
+
+    /* keep the tail of this batch as history for the next one; a mapping
+     * already has it in place */
+    stream->dict_valid += batch_len;
+    if ( stream->dict_valid > HOOVER_DEFLATE_DICT_SIZE )
+        stream->dict_valid = HOOVER_DEFLATE_DICT_SIZE;
+    if ( !stream->map && batch_len > 0 )
+        memmove( stream->in_buf + HOOVER_DEFLATE_DICT_SIZE - stream->dict_valid,
+                 batch + batch_len - stream->dict_valid,
+                 stream->dict_valid );
+
+    stream->filled_slots = num_blocks;
+    stream->next_slot = 0;
+
+    /* an empty batch means the input ended exactly on a batch boundary */
+    if ( num_blocks == 0 )
+        return read_chunk_parallel( stream, chunk );
+
+    *chunk = &(stream->slots[stream->next_slot++]);
+    return 0;
+}
+
+/*
+ * Let go of one end of a relay.  Letting go of the reading end stops the
+ * thread that fills it at its next chunk.
+ */
+static void release_relay( struct hoover_hdo_relay *relay, int reader ) {
+    int refs, i;
+
+    pthread_mutex_lock( &(relay->lock) );
+    if ( reader )
+        relay->cancelled = 1;
+    refs = --(relay->refs);
+    pthread_cond_broadcast( &(relay->changed) );
+    pthread_mutex_unlock( &(relay->lock) );
+    if ( refs > 0 )
+        return;
+
+    for ( i = 0; i < relay->count; i++ )
+        free( relay->chunks[(relay->head + i) % relay->depth].data );
+    free( relay->chunks );
+    free( relay->current );
+    pthread_cond_destroy( &(relay->changed) );
+    pthread_mutex_destroy( &(relay->lock) );
+    free( relay );
+    return;
+}
+
+/*
+ * Hand the reading end of a relay its next chunk, waiting for one if need be.
+ * Returns the same as hoover_read_hdo_chunk().
+ */
+static int read_chunk_relay( struct hoover_data_obj *hdo, const void **chunk, size_t *len ) {
+    struct hoover_hdo_relay *relay = hdo->stream->relay;
+    int ret;
+
+    pthread_mutex_lock( &(relay->lock) );
+    free( relay->current );
+    relay->current = NULL;
+    while ( relay->count == 0 && !relay->finished )
+        pthread_cond_wait( &(relay->changed), &(relay->lock) );
+
+    if ( relay->count > 0 ) {
+        relay->current = relay->chunks[relay->head].data;
+        *chunk = relay->current;
+        *len = relay->chunks[relay->head].len;
+        relay->head = (relay->head + 1) % relay->depth;
+        relay->count--;
+        pthread_cond_broadcast( &(relay->changed) );
+        ret = 1;
+    }
+    else if ( relay->finished > 0 ) {
+        strncpy( hdo->hash, relay->result.hash, HASH_DIGEST_LENGTH_HEX );
+        strncpy( hdo->hash_orig, relay->result.hash_orig, HASH_DIGEST_LENGTH_HEX );
+        hdo->size = relay->result.size;
+        hdo->size_orig = relay->result.size_orig;
+        ret = 0;
+    }
+    else {
+        hdo->stream->fail = 1;
+        ret = -1;
+    }
+    pthread_mutex_unlock( &(relay->lock) );
+    return ret;
+}
+
+/*
+ * Tear down the streaming state attached to an HDO
+ */
+static void free_hdo_stream( struct hoover_hdo_stream *stream ) {
+    int i;
+    if ( stream->relay )
+        release_relay( stream->relay, 1 );
+    if ( stream->bss )
+        free_block_states( stream->bss );
+    if ( stream->slots ) {
+        /* slots are calloc'ed, so deflateEnd safely ignores any that were
+         * never initialized */
+        for ( i = 0; i < stream->num_slots; i++ ) {
+            deflateEnd( &(stream->slots[i].z_stream) );
+            free( stream->slots[i].out );
+        }
+        free( stream->slots );
+    }
+    free( stream->frame.out );
+    free( stream->in_buf );
+    if ( stream->map && !stream->map_borrowed )
+        munmap( (void *)stream->map, stream->map_len );
+    free( stream );
+    return;
+}
+
+/*
+ * Get up to len more bytes of input.  Mapped input is handed out in place and
+ * buf is ignored; otherwise the input is read into buf.  On return, *data
+ * points at the input, and stream->eof is set once the input is exhausted.
+ *
+ * Returns the number of bytes at *data, or -1 on error.
+ */
+static ssize_t read_input( struct hoover_hdo_stream *stream, unsigned char *buf, size_t len, const unsigned char **data ) {
+    size_t bytes_read = 0;
+    uint64_t t0;
+
+    if ( stream->map ) {
+        if ( len > stream->map_len - stream->map_pos )
+            len = stream->map_len - stream->map_pos;
+        *data = stream->map + stream->map_pos;
+        stream->map_pos += len;
+        if ( stream->map_pos == stream->map_len )
+            stream->eof = 1;
+        return len;
+    }
+
+    /* mapped input is read by the page faults of whatever touches it first,
+     * which is charged to hashing or compression */
+    *data = buf;
+    if ( stream->reader ) {
+        /* readers charge the time spent producing their input themselves */
+        while ( bytes_read < len ) {
+            ssize_t ret = stream->reader( stream->reader_arg, buf + bytes_read, len - bytes_read );
+            if ( ret < 0 )
+                return -1;
+            else if ( ret == 0 )
+                break;
+            bytes_read += ret;
+        }
+        if ( bytes_read < len )
+            stream->eof = 1;
+        return bytes_read;
+    }
+
+    t0 = hoover_stats_start();
+    if ( stream->fp ) {
+        bytes_read = fread( buf, 1, len, stream->fp );
+        if ( ferror(stream->fp) )
+            return -1;
+    }
+    else {
+        /* pipes may return less than asked for well before the end */
+        while ( bytes_read < len ) {
+            ssize_t ret = read( stream->fd, buf + bytes_read, len - bytes_read );
+            if ( ret < 0 && errno == EINTR )
+                continue;
+            else if ( ret < 0 )
+                return -1;
+            else if ( ret == 0 )
+                break;
+            bytes_read += ret;
+        }
+    }
+
+    hoover_stats_stop( HOOVER_STAGE_READ, t0 );
+
+    /* reads only come up short at the end of the file */
+    if ( bytes_read < len )
+        stream->eof = 1;
+    return bytes_read;
+}
+
+/*
+ * Map a regular file read-only so its data can be used without copying.  The
+ * file must not be truncated while it is mapped.
+ *
+ * Returns 0 if mapped, nonzero if the input must be read() instead.
+ */
+static int map_input( struct hoover_hdo_stream *stream ) {
+    struct stat st;
+    void *map;
+
+    if ( fstat(stream->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0
+    ||   lseek(stream->fd, 0, SEEK_CUR) != 0 )
+        return 1;
+
+    map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, stream->fd, 0 );
+    if ( map == MAP_FAILED )
+        return 1;
+
+    /* purely a hint, so failure is harmless */
+    posix_madvise( map, st.st_size, POSIX_MADV_SEQUENTIAL );
+
+    stream->map = map;
+    stream->map_len = st.st_size;
+    return 0;
+}
+
+/*
+ * gzip codec: a single zlib deflate stream with a gzip wrapper
+ */
+static int gzip_init( struct codec_stream *strm, int level, int num_threads ) {
+    z_stream *z;
+
+    if ( !(z = calloc(1, sizeof(*z))) )
+        return 1;
+
+    if ( (deflateInit2(
+            z,
+            level,
+            Z_DEFLATED,
+            15 + 16, /* 15 is default for deflateInit, +16 enables gzip */
+            8,
+            Z_DEFAULT_STRATEGY)) != Z_OK ) {
+        free(z);
+        return 1;
+    }
+
+    strm->state = z;
+    return 0;
+}
+
+static int gzip_compress( struct codec_stream *strm, int finish ) {
+    z_stream *z = strm->state;
+    int ret;
+
+    /* zlib counts bytes in uInts; anything beyond that is picked up on the
+     * next call */
+    z->next_in = (Bytef *)strm->next_in;
+    z->avail_in = strm->avail_in > UINT_MAX ? UINT_MAX : strm->avail_in;
+    z->next_out = strm->next_out;
+    z->avail_out = strm->avail_out > UINT_MAX ? UINT_MAX : strm->avail_out;
+
+    ret = deflate( z, finish ? Z_FINISH : Z_NO_FLUSH );
+
+    strm->avail_in -= z->next_in - strm->next_in;
+    strm->next_in = z->next_in;
+    strm->avail_out -= z->next_out - strm->next_out;
+    strm->next_out = z->next_out;
+
+    if ( ret == Z_STREAM_END )
+        return 1;
+    else if ( ret == Z_OK || ret == Z_BUF_ERROR )
+        return 0;
+    return -1;
+}
+
+/* only called between blocks, so zlib is given no input to flush along with
+ * its buffered data */
+static int gzip_set_level( struct codec_stream *strm, int level ) {
+    z_stream *z = strm->state;
+    int ret;
+
+    z->next_in = (Bytef *)strm->next_in;
+    z->avail_in = 0;
+    z->next_out = strm->next_out;
+    z->avail_out = strm->avail_out > UINT_MAX ? UINT_MAX : strm->avail_out;
+
+    ret = deflateParams( z, level, Z_DEFAULT_STRATEGY );
+
+    strm->avail_out -= z->next_out - strm->next_out;
+    strm->next_out = z->next_out;
+    return ret != Z_OK;
+}
+
+static void gzip_end( struct codec_stream *strm ) {
+    if ( strm->state ) {
+        deflateEnd( strm->state );
+        free( strm->state );
+        strm->state = NULL;
+    }
+    return;
+}
+
+static int gzip_decode_init( struct codec_stream *strm ) {
+    z_stream *z;
+
+    if ( !(z = calloc(1, sizeof(*z))) )
+        return 1;
+    if ( inflateInit2(z, 15 + 16) != Z_OK ) {
+        free(z);
+        return 1;
+    }
+    strm->state = z;
+    return 0;
+}
+
+static int gzip_decode( struct codec_stream *strm ) {
+    z_stream *z = strm->state;
+    int ret;
+
+    z->next_in = (Bytef *)strm->next_in;
+    z->avail_in = strm->avail_in > UINT_MAX ? UINT_MAX : strm->avail_in;
+    z->next_out = strm->next_out;
+    z->avail_out = strm->avail_out > UINT_MAX ? UINT_MAX : strm->avail_out;
+
+    ret = inflate( z, Z_NO_FLUSH );
+
+    strm->avail_in -= z->next_in - strm->next_in;
+    strm->next_in = z->next_in;
+    strm->avail_out -= z->next_out - strm->next_out;
+    strm->next_out = z->next_out;
+
+    /* gzip allows several members back to back */
+    if ( ret == Z_STREAM_END ) {
+        if ( inflateReset(z) != Z_OK )
+            return -1;
+        return strm->avail_in == 0 ? 1 : 0;
+    }
+    else if ( ret == Z_OK || ret == Z_BUF_ERROR )
+        return 0;
+    return -1;
+}
+
+static void gzip_decode_end( struct codec_stream *strm ) {
+    if ( strm->state ) {
+        inflateEnd( strm->state );
+        free( strm->state );
+        strm->state = NULL;
+    }
+    return;
+}
+
+/*
+ * none codec: store the original data as-is
+ */
+static int none_compress( struct codec_stream *strm, int finish ) {
+    size_t len = strm->avail_in < strm->avail_out ? strm->avail_in : strm->avail_out;
+
+    if ( len > 0 ) {
+        memcpy( strm->next_out, strm->next_in, len );
+        strm->next_in += len;
+        strm->avail_in -= len;
+        strm->next_out += len;
+        strm->avail_out -= len;
+    }
+
+    return ( finish && strm->avail_in == 0 ) ? 1 : 0;
+}
+
+/* any amount of stored data is complete */
+static int none_decode( struct codec_stream *strm ) {
+    none_compress( strm, 1 );
+    return strm->avail_in == 0 ? 1 : 0;
+}
+
+#ifdef HOOVER_HAVE_ZSTD
+/*
+ * zstd codec: a single zstd frame with a content checksum
+ */
+static int zstd_init( struct codec_stream *strm, int level, int num_threads ) {
+    ZSTD_CCtx *cctx;
+
+    if ( !(cctx = ZSTD_createCCtx()) )
+        return 1;
+
+    if ( ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level))
+    ||   ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1)) ) {
+        ZSTD_freeCCtx(cctx);
+        return 1;
+    }
+
+    /* libzstd compresses a single frame with its own worker threads; this
+     * fails harmlessly if it was built without multithreading support */
+    if ( num_threads > 1 )
+        ZSTD_CCtx_setParameter( cctx, ZSTD_c_nbWorkers, num_threads );
+
+    strm->state = cctx;
+    return 0;
+}
+
+static int zstd_compress( struct codec_stream *strm, int finish ) {
+    ZSTD_inBuffer in = { strm->next_in, strm->avail_in, 0 };
+    ZSTD_outBuffer out = { strm->next_out, strm->avail_out, 0 };
+    size_t remaining;
+
+    remaining = ZSTD_compressStream2( strm->state, &out, &in, finish ? ZSTD_e_end : ZSTD_e_continue );
+    if ( ZSTD_isError(remaining) )
+        return -1;
+
+    strm->next_in += in.pos;
+    strm->avail_in -= in.pos;
+    strm->next_out += out.pos;
+    strm->avail_out -= out.pos;
+
+    return ( finish && remaining == 0 ) ? 1 : 0;
+}
+
+static void zstd_end( struct codec_stream *strm ) {
+    ZSTD_freeCCtx( strm->state ); /* accepts NULL */
+    strm->state = NULL;
+    return;
+}
+
+static int zstd_decode_init( struct codec_stream *strm ) {
+    if ( !(strm->state = ZSTD_createDCtx()) )
+        return 1;
+    return 0;
+}
+
+static int zstd_decode( struct codec_stream *strm ) {
+    ZSTD_inBuffer in = { strm->next_in, strm->avail_in, 0 };
+    ZSTD_outBuffer out = { strm->next_out, strm->avail_out, 0 };
+    size_t remaining;
+
+    remaining = ZSTD_decompressStream( strm->state, &out, &in );
+    if ( ZSTD_isError(remaining) )
+        return -1;
+
+    strm->next_in += in.pos;
+    strm->avail_in -= in.pos;
+    strm->next_out += out.pos;
+    strm->avail_out -= out.pos;
+
+    /* 0 means a frame was completed and fully flushed */
+    return ( remaining == 0 && strm->avail_in == 0 ) ? 1 : 0;
+}
+
+static void zstd_decode_end( struct codec_stream *strm ) {
+    ZSTD_freeDCtx( strm->state ); /* accepts NULL */
+    strm->state = NULL;
+    return;
+}
+#endif
+
+#ifdef HOOVER_HAVE_LZ4
+/* largest piece of input handed to LZ4F_compressUpdate at once */
+#ifndef HOOVER_LZ4_CHUNK_SIZE
+    #define HOOVER_LZ4_CHUNK_SIZE (64 * 1024)
+#endif
+
+/*
+ * lz4 codec: a single lz4 frame with a content checksum.  LZ4F wants room for
+ *   its worst-case output up front, so compressed data is staged in buf and
+ *   copied out as space allows.
+ */
+struct lz4_state {
+    LZ4F_cctx *cctx;
+    LZ4F_preferences_t prefs;
+    unsigned char *buf;
+    size_t buf_size;
+    size_t buf_len;
+    size_t buf_pos;             /* bytes of buf already handed out */
+    int started;
+    int ended;
+};
+
+static int lz4_init( struct codec_stream *strm, int level, int num_threads ) {
+    struct lz4_state *lz;
+
+    if ( !(lz = calloc(1, sizeof(*lz))) )
+        return 1;
+
+    lz->prefs.compressionLevel = level;
+    lz->prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+    lz->buf_size = LZ4F_compressBound( HOOVER_LZ4_CHUNK_SIZE, &(lz->prefs) ) + LZ4F_HEADER_SIZE_MAX;
+
+    if ( LZ4F_isError(LZ4F_createCompressionContext(&(lz->cctx), LZ4F_VERSION))
+    ||   !(lz->buf = malloc(lz->buf_size)) ) {
+        LZ4F_freeCompressionContext( lz->cctx );
+        free( lz );
+        return 1;
+    }
+
+    strm->state = lz;
+    return 0;
+}
+
+static int lz4_compress( struct codec_stream *strm, int finish ) {
+    struct lz4_state *lz = strm->state;
+    size_t ret, len;
+
+    while ( 1 ) {
+        /* hand out whatever is already staged */
+        len = lz->buf_len - lz->buf_pos;
+        if ( len > strm->avail_out )
+            len = strm->avail_out;
+        memcpy( strm->next_out, lz->buf + lz->buf_pos, len );
+        strm->next_out += len;
+        strm->avail_out -= len;
+        lz->buf_pos += len;
+        if ( lz->buf_pos < lz->buf_len )
+            return 0;
+        lz->buf_pos = lz->buf_len = 0;
+
+        if ( !lz->started ) {
+            ret = LZ4F_compressBegin( lz->cctx, lz->buf, lz->buf_size, &(lz->prefs) );
+            lz->started = 1;
+        }
+        else if ( strm->avail_in > 0 ) {
+            len = strm->avail_in < HOOVER_LZ4_CHUNK_SIZE ? strm->avail_in : HOOVER_LZ4_CHUNK_SIZE;
+            ret = LZ4F_compressUpdate( lz->cctx, lz->buf, lz->buf_size, strm->next_in, len, NULL );
+            strm->next_in += len;
+            strm->avail_in -= len;
+        }
+        else if ( finish && !lz->ended ) {
+            ret = LZ4F_compressEnd( lz->cctx, lz->buf, lz->buf_size, NULL );
+            lz->ended = 1;
+        }
+        else {
+            return lz->ended ? 1 : 0;
+        }
+
+        if ( LZ4F_isError(ret) )
+            return -1;
+        lz->buf_len = ret;
+    }
+}
+
+static void lz4_end( struct codec_stream *strm ) {
+    struct lz4_state *lz = strm->state;
+    if ( lz ) {
+        LZ4F_freeCompressionContext( lz->cctx );
+        free( lz->buf );
+        free( lz );
+        strm->state = NULL;
+    }
+    return;
+}
+
+static int lz4_decode_init( struct codec_stream *strm ) {
+    LZ4F_dctx *dctx;
+    if ( LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)) )
+        return 1;
+    strm->state = dctx;
+    return 0;
+}
+
+static int lz4_decode( struct codec_stream *strm ) {
+    size_t in_len = strm->avail_in,
+           out_len = strm->avail_out,
+           ret;
+
+    ret = LZ4F_decompress( strm->state, strm->next_out, &out_len, strm->next_in, &in_len, NULL );
+    if ( LZ4F_isError(ret) )
+        return -1;
+
+    strm->next_in += in_len;
+    strm->avail_in -= in_len;
+    strm->next_out += out_len;
+    strm->avail_out -= out_len;
+
+    /* 0 means the frame is complete */
+    return ( ret == 0 && strm->avail_in == 0 ) ? 1 : 0;
+}
+
+static void lz4_decode_end( struct codec_stream *strm ) {
+    if ( strm->state )
+        LZ4F_freeDecompressionContext( strm->state );
+    strm->state = NULL;
+    return;
+}
+#endif
+
+/*
+ * All codecs compiled into this build.  The first entry is the fallback if
+ * HOOVER_COMPRESSION does not name a usable codec.
+ */
+static const struct hoover_codec hoover_codecs[] = {
+    { "gzip", "gz",  Z_DEFAULT_COMPRESSION, 0, 9, 1, gzip_init, gzip_compress, gzip_end,
+      gzip_decode_init, gzip_decode, gzip_decode_end, gzip_set_level },
+#ifdef HOOVER_HAVE_ZSTD
+    { "zstd", "zst", 3, -5, 19, 0, zstd_init, zstd_compress, zstd_end,
+      zstd_decode_init, zstd_decode, zstd_decode_end, NULL },
+#endif
+#ifdef HOOVER_HAVE_LZ4
+    { "lz4",  "lz4", 0, 0, 12, 0, lz4_init, lz4_compress, lz4_end,
+      lz4_decode_init, lz4_decode, lz4_decode_end, NULL },
+#endif
+    { "none", "",    0, 0, 0, 0, NULL, none_compress, NULL,
+      NULL, none_decode, NULL, NULL },
+};
+
+#define HOOVER_NUM_CODECS (sizeof(hoover_codecs) / sizeof(hoover_codecs[0]))
+
+/*
+ * sha1 and sha256 hashes through OpenSSL's EVP interface, which uses the SHA
+ * extensions of the CPU where they are available
+ */
+static void *evp_create( const EVP_MD *md ) {
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if ( ctx && EVP_DigestInit_ex(ctx, md, NULL) != 1 ) {
+        EVP_MD_CTX_free( ctx );
+        return NULL;
+    }
+    return ctx;
+}
+
+static void *sha1_create( void ) {
+    return evp_create( EVP_sha1() );
+}
+
+static void *sha256_create( void ) {
+    return evp_create( EVP_sha256() );
+}
+
+static void evp_update( void *ctx, const void *data, size_t len ) {
+    EVP_DigestUpdate( ctx, data, len );
+    return;
+}
+
+static void evp_final( void *ctx, unsigned char *digest ) {
+    EVP_DigestFinal_ex( ctx, digest, NULL );
+    EVP_MD_CTX_free( ctx );
+    return;
+}
+
+static void evp_destroy( void *ctx ) {
+    EVP_MD_CTX_free( ctx );
+    return;
+}
+
+#ifdef HOOVER_HAVE_XXHASH
+/*
+ * xxh3: 128-bit XXH3, written out in canonical (big-endian) byte order
+ */
+static void *xxh3_create( void ) {
+    XXH3_state_t *state = XXH3_createState();
+    if ( state && XXH3_128bits_reset(state) != XXH_OK ) {
+        XXH3_freeState( state );
+        return NULL;
+    }
+    return state;
+}
+
+static void xxh3_update( void *ctx, const void *data, size_t len ) {
+    XXH3_128bits_update( ctx, data, len );
+    return;
+}
+
+static void xxh3_final( void *ctx, unsigned char *digest ) {
+    XXH128_canonical_t canonical;
+    XXH128_canonicalFromHash( &canonical, XXH3_128bits_digest(ctx) );
+    memcpy( digest, canonical.digest, sizeof(canonical.digest) );
+    XXH3_freeState( ctx );
+    return;
+}
+
+static void xxh3_destroy( void *ctx ) {
+    XXH3_freeState( ctx );
+    return;
+}
+#endif
+
+#ifdef HOOVER_HAVE_BLAKE3
+/*
+ * blake3: 256-bit BLAKE3
+ */
+static void *blake3_create( void ) {
+    blake3_hasher *hasher = malloc( sizeof(*hasher) );
+    if ( hasher )
+        blake3_hasher_init( hasher );
+    return hasher;
+}
+
+static void blake3_update( void *ctx, const void *data, size_t len ) {
+    blake3_hasher_update( ctx, data, len );
+    return;
+}
+
+static void blake3_final( void *ctx, unsigned char *digest ) {
+    blake3_hasher_finalize( ctx, digest, BLAKE3_OUT_LEN );
+    free( ctx );
+    return;
+}
+
+static void blake3_destroy( void *ctx ) {
+    free( ctx );
+    return;
+}
+#endif
+
+/*
+ * All hashes compiled into this build.  The first entry is the fallback if
+ * HOOVER_HASH does not name a usable hash.
+ */
+static const struct hoover_hash hoover_hashes[] = {
+    { "sha1",   20, sha1_create,   evp_update,    evp_final,    evp_destroy },
+    { "sha256", 32, sha256_create, evp_update,    evp_final,    evp_destroy },
+#ifdef HOOVER_HAVE_XXHASH
+    { "xxh3",   16, xxh3_create,   xxh3_update,   xxh3_final,   xxh3_destroy },
+#endif
+#ifdef HOOVER_HAVE_BLAKE3
+    { "blake3", BLAKE3_OUT_LEN, blake3_create, blake3_update, blake3_final, blake3_destroy },
+#endif
+};
+
+#define HOOVER_NUM_HASHES (sizeof(hoover_hashes) / sizeof(hoover_hashes[0]))
+
+static const struct hoover_hash *find_hash( const char *name ) {
+    size_t i;
+    for ( i = 0; i < HOOVER_NUM_HASHES; i++ )
+        if ( strcmp(name, hoover_hashes[i].name) == 0 )
+            return &hoover_hashes[i];
+    return NULL;
+}
+
+/*
+ * Look up a codec by its name or its suffix, e.g., gzip or gz
+ */
+static const struct hoover_codec *find_codec( const char *name, size_t name_len ) {
+    size_t i;
+    for ( i = 0; i < HOOVER_NUM_CODECS; i++ ) {
+        const struct hoover_codec *c = &hoover_codecs[i];
+        if ( (strlen(c->name) == name_len && strncmp(name, c->name, name_len) == 0)
+        ||   (c->suffix[0] != '\0' && strlen(c->suffix) == name_len && strncmp(name, c->suffix, name_len) == 0) )
+            return c;
+    }
+    return NULL;
+}
+
+/*
+ * Apply HOOVER_COMPRESSION and HOOVER_HASH unless the application picked
+ * something else first
+ */
+static void init_defaults( void ) {
+    if ( hoover_codec == NULL && hoover_set_codec(HOOVER_COMPRESSION) != 0 ) {
+        hoover_codec = &hoover_codecs[0];
+        hoover_codec_level = hoover_codec->default_level;
+    }
+    if ( hoover_hash == NULL && hoover_set_hash(HOOVER_HASH) != 0 )
+        hoover_hash = &hoover_hashes[0];
+    return;
+}
+
+/*
+ * Find the calibrated block size of a kind of filesystem for the current codec
+ */
+static struct fs_block_size *find_fs_block_size( unsigned long fs_type ) {
+    int i;
+    for ( i = 0; i < hoover_num_fs_block_sizes; i++ )
+        if ( hoover_fs_block_sizes[i].fs_type == fs_type
+        &&   strcmp(hoover_fs_block_sizes[i].codec, hoover_codec->name) == 0 )
+            return &hoover_fs_block_sizes[i];
+    return NULL;
+}
+
+static int add_fs_block_size( unsigned long fs_type, const char *codec, size_t block_size ) {
+    struct fs_block_size *entry;
+    if ( hoover_num_fs_block_sizes == HOOVER_MAX_FS_BLOCK_SIZES )
+        return 1;
+    entry = &hoover_fs_block_sizes[hoover_num_fs_block_sizes++];
+    entry->fs_type = fs_type;
+    strncpy( entry->codec, codec, sizeof(entry->codec) - 1 );
+    entry->codec[sizeof(entry->codec) - 1] = '\0';
+    entry->block_size = block_size;
+    return 0;
+}
+
+/*
+ * Block size for an input of size bytes (0 if not known) read from fd (-1 if
+ * it is already in memory).  single_stream is set if the input will be
+ * compressed as one stream rather than as parallel blocks.
+ */
+static size_t pick_block_size( int fd, size_t size, int single_stream ) {
+    struct fs_block_size *calibrated;
+    struct statfs sfs;
+    struct stat st;
+    size_t block_size = hoover_block_size, input_size;
+    int have_stat = fd >= 0 && fstat(fd, &st) == 0;
+
+    if ( have_stat && S_ISREG(st.st_mode) && size == 0 )
+        size = st.st_size;
+
+    if ( block_size == HOOVER_BLOCK_AUTO ) {
+        block_size = HOOVER_BLK_SIZE;
+        if ( fd >= 0 && fstatfs(fd, &sfs) == 0
+        &&   (calibrated = find_fs_block_size((unsigned long)sfs.f_type)) ) {
+            block_size = calibrated->block_size;
+        }
+        else {
+            /* parallel filesystems report their stripe size here */
+            if ( have_stat && (size_t)st.st_blksize > block_size )
+                block_size = st.st_blksize;
+            /* a single stream only pays a call into the codec and the hash
+             * per block, while parallel blocks are each one thread's work */
+            if ( single_stream && size >= HOOVER_LARGE_INPUT && block_size < HOOVER_LARGE_BLK_SIZE )
+                block_size = HOOVER_LARGE_BLK_SIZE;
+        }
+    }
+
+    /* nothing is gained by blocks bigger than the input */
+    input_size = (size + HOOVER_BLK_SIZE_MIN - 1) / HOOVER_BLK_SIZE_MIN * HOOVER_BLK_SIZE_MIN;
+    if ( size > 0 && block_size > input_size )
+        block_size = input_size;
+
+    if ( block_size < HOOVER_BLK_SIZE_MIN )
+        block_size = HOOVER_BLK_SIZE_MIN;
+    if ( block_size > HOOVER_BLK_SIZE_MAX )
+        block_size = HOOVER_BLK_SIZE_MAX;
+    return block_size;
+}
+
+/*
+ * Seconds taken to turn the first HOOVER_CALIBRATE_BYTES of a file into HDO
+ * chunks of block_size, starting with none of it cached where the kernel
+ * allows; negative on error
+ */
+static double time_block_size( const char *path, size_t block_size ) {
+    struct hoover_data_obj *hdo;
+    struct timespec t0, t1;
+    const void *chunk;
+    size_t len;
+    int fd, ret = 0;
+
+    if ( (fd = open(path, O_RDONLY)) < 0 )
+        return -1.0;
+    posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
+
+    clock_gettime( CLOCK_MONOTONIC, &t0 );
+    if ( (hdo = hoover_open_hdo_fd(fd, block_size)) ) {
+        while ( hdo->stream->tot_bytes_read < HOOVER_CALIBRATE_BYTES
+        &&      (ret = hoover_read_hdo_chunk(hdo, &chunk, &len)) > 0 )
+            ;
+        free_hdo( hdo );
+    }
+    clock_gettime( CLOCK_MONOTONIC, &t1 );
+    close( fd );
+
+    if ( !hdo || ret < 0 )
+        return -1.0;
+    return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+/*******************************************************************************
+ * Global functions
+ ******************************************************************************/
+
+/*
+ * Set the number of threads used to compress each file.  Values greater than
+ * one enable parallel (pigz-style) compression of HDOs.  The compression
+ * workers are started when the first such HDO is opened and are shared by all
+ * HDOs of the process.
+ */
+void hoover_set_compress_threads( int num_threads ) {
+    hoover_compress_threads = num_threads > 1 ? num_threads : 1;
+    return;
+}
+
+/*
+ * Select the codec applied to HDOs opened from now on.  spec is a codec name
+ * (gzip, zstd, lz4, or none; the file suffixes gz and zst are also accepted),
+ * optionally followed by a colon and a compression level, e.g., "zstd:3".
+ * Codecs not compiled into this build are rejected.
+ *
+ * Returns 0 on success, nonzero if the spec is not usable.
+ */
+int hoover_set_codec( const char *spec ) {
+    const char *colon = strchr( spec, ':' );
+    size_t name_len = colon ? (size_t)(colon - spec) : strlen(spec);
+    const struct hoover_codec *codec = find_codec( spec, name_len );
+    long level;
+    char *end;
+
+    if ( !codec ) {
+        fprintf( stderr, "hoover_set_codec: unknown or unsupported codec '%.*s'\n", (int)name_len, spec );
+        return 1;
+    }
+
+    level = codec->default_level;
+    if ( colon ) {
+        level = strtol( colon + 1, &end, 10 );
+        if ( end == colon + 1 || *end != '\0' || level < codec->min_level || level > codec->max_level ) {
+            fprintf( stderr, "hoover_set_codec: %s level must be between %d and %d\n",
+                codec->name, codec->min_level, codec->max_level );
+            return 1;
+        }
+    }
+
+    hoover_codec = codec;
+    hoover_codec_level = (int)level;
+    return 0;
+}
+
+/*
+ * Choose whether HDOs opened from now on skip compressing data that would not
+ * shrink.  A mapped file or buffer whose samples all look incompressible is
+ * stored as is, with an empty compression field.  Codecs that can change
+ * level between blocks (gzip) also store each such block of any other input.
+ */
+void hoover_set_adaptive( int enable ) {
+    hoover_adaptive = enable;
+    return;
+}
+
+/*
+ * Use block_size for every HDO opened from now on with HOOVER_BLOCK_AUTO, or
+ * go back to picking one for each input if it is HOOVER_BLOCK_AUTO.
+ *
+ * Returns 0 on success, nonzero if block_size is out of range.
+ */
+int hoover_set_block_size( size_t block_size ) {
+    if ( block_size != HOOVER_BLOCK_AUTO
+    &&   (block_size < HOOVER_BLK_SIZE_MIN || block_size > HOOVER_BLK_SIZE_MAX) ) {
+        fprintf( stderr, "hoover_set_block_size: block size must be between %d and %d bytes\n",
+            HOOVER_BLK_SIZE_MIN, HOOVER_BLK_SIZE_MAX );
+        return 1;
+    }
+    hoover_block_size = block_size;
+    return 0;
+}
+
+/*
+ * Block size that HOOVER_BLOCK_AUTO stands for when reading or writing fd, or
+ * data already in memory if fd is -1.  size is the amount of data, or 0 to
+ * take it from fd.  In order of preference, this is
+ *
+ *   1. the size given to hoover_set_block_size()
+ *   2. the size measured for fd's kind of filesystem and the current codec by
+ *      hoover_calibrate_block_sizes() or loaded by hoover_load_block_sizes()
+ *   3. HOOVER_BLK_SIZE, or fd's st_blksize if that is bigger, or
+ *      HOOVER_LARGE_BLK_SIZE if that is bigger still and a large input will
+ *      be compressed as one stream
+ *
+ * but never more than size rounded up to HOOVER_BLK_SIZE_MIN.
+ */
+size_t hoover_pick_block_size( int fd, size_t size ) {
+    pthread_once( &hoover_defaults_once, init_defaults );
+    return pick_block_size( fd, size, !(hoover_codec->block_parallel && hoover_compress_threads > 1) );
+}
+
+/*
+ * Measure the block size that turns files into HDOs fastest on each kind of
+ * filesystem that paths are on and that does not have one yet.  Every
+ * candidate from 32 KiB to HOOVER_BLK_SIZE_MAX is tried on the same file, with
+ * the current codec and hash, after asking the kernel to drop the file from
+ * its cache.  Filesystems without a file of at least HOOVER_CALIBRATE_MIN_SIZE
+ * among the first HOOVER_CALIBRATE_FILES paths are left to the defaults.
+ *
+ * Must be called before any other thread opens an HDO.  The files read count
+ * towards the producer statistics if those are enabled.
+ *
+ * Returns the number of filesystems measured.
+ */
+int hoover_calibrate_block_sizes( char * const *paths, int num_paths ) {
+    struct {
+        unsigned long fs_type;
+        int path;
+        off_t size;
+    } fs[HOOVER_MAX_FS_BLOCK_SIZES];
+    struct statfs sfs;
+    struct stat st;
+    size_t block_size, best_size;
+    double secs, best_secs;
+    int num_fs = 0, num_measured = 0, i, j;
+
+    pthread_once( &hoover_defaults_once, init_defaults );
+
+    for ( i = 0; i < num_paths && i < HOOVER_CALIBRATE_FILES; i++ ) {
+        if ( stat(paths[i], &st) != 0 || !S_ISREG(st.st_mode) || statfs(paths[i], &sfs) != 0 )
+            continue;
+        if ( find_fs_block_size((unsigned long)sfs.f_type) )
+            continue;
+        for ( j = 0; j < num_fs; j++ )
+            if ( fs[j].fs_type == (unsigned long)sfs.f_type )
+                break;
+        if ( j == num_fs ) {
+            if ( num_fs == HOOVER_MAX_FS_BLOCK_SIZES )
+                continue;
+            fs[num_fs].fs_type = (unsigned long)sfs.f_type;
+            fs[num_fs].size = -1;
+            num_fs++;
+        }
+        if ( st.st_size > fs[j].size ) {
+            fs[j].path = i;
+            fs[j].size = st.st_size;
+        }
+    }
+
+    for ( j = 0; j < num_fs; j++ ) {
+        if ( fs[j].size < HOOVER_CALIBRATE_MIN_SIZE )
+            continue;
+        best_size = 0;
+        best_secs = 0.0;
+        for ( block_size = 32 * 1024; block_size <= HOOVER_BLK_SIZE_MAX; block_size *= 2 ) {
+            secs = time_block_size( paths[fs[j].path], block_size );
+            if ( secs >= 0.0 && (best_size == 0 || secs < best_secs) ) {
+                best_size = block_size;
+                best_secs = secs;
+            }
+        }
+        if ( best_size == 0 || add_fs_block_size(fs[j].fs_type, hoover_codec->name, best_size) != 0 )
+            continue;
+        fprintf( stderr, "hoover_calibrate_block_sizes: %zu-byte blocks for %s on filesystem type 0x%lx\n",
+            best_size, hoover_codec->name, fs[j].fs_type );
+        num_measured++;
+    }
+    return num_measured;
+}
+
+/*
+ * Add the block sizes in a file written by hoover_save_block_sizes() to those
+ * known already.  Each line holds a filesystem type in hex, a codec name, and
+ * a block size in bytes; lines starting with # are ignored.
+ *
+ * Returns 0 on success or if the file does not exist, nonzero on error.
+ */
+int hoover_load_block_sizes( const char *path ) {
+    char line[256], codec[16];
+    unsigned long fs_type;
+    size_t block_size;
+    FILE *fp;
+
+    if ( !(fp = fopen(path, "r")) )
+        return errno == ENOENT ? 0 : 1;
+
+    while ( fgets(line, sizeof(line), fp) ) {
+        if ( line[0] == '#' || line[0] == '\n' )
+            continue;
+        if ( sscanf(line, "%lx %15s %zu", &fs_type, codec, &block_size) != 3
+        ||   block_size < HOOVER_BLK_SIZE_MIN || block_size > HOOVER_BLK_SIZE_MAX ) {
+            fprintf( stderr, "hoover_load_block_sizes: ignoring bad line in %s: %s", path, line );
+            continue;
+        }
+        add_fs_block_size( fs_type, codec, block_size );
+    }
+    fclose( fp );
+    return 0;
+}
+
+/*
+ * Write every known block size to path, replacing whatever was there.  The
+ * file is written under a temporary name and renamed into place so that
+ * producers starting at the same time never read half of it.
+ *
+ * Returns 0 on success.
+ */
+int hoover_save_block_sizes( const char *path ) {
+    char tmp_path[PATH_MAX];
+    FILE *fp;
+    int i;
+
+    if ( snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid()) >= (int)sizeof(tmp_path) ) {
+        fprintf( stderr, "hoover_save_block_sizes: path too long: %s\n", path );
+        return 1;
+    }
+    if ( !(fp = fopen(tmp_path, "w")) ) {
+        fprintf( stderr, "hoover_save_block_sizes: could not open %s\n", tmp_path );
+        return 1;
+    }
+    fprintf( fp, "# filesystem type, codec, block size\n" );
+    for ( i = 0; i < hoover_num_fs_block_sizes; i++ )
+        fprintf( fp, "0x%lx %s %zu\n", hoover_fs_block_sizes[i].fs_type,
+            hoover_fs_block_sizes[i].codec, hoover_fs_block_sizes[i].block_size );
+
+    if ( fclose(fp) != 0 || rename(tmp_path, path) != 0 ) {
+        fprintf( stderr, "hoover_save_block_sizes: could not write %s\n", path );
+        remove( tmp_path );
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Select the integrity hash applied to HDOs opened from now on: sha1, sha256,
+ * and, if compiled in, xxh3 or blake3.
+ *
+ * Returns 0 on success, nonzero if the hash is not usable.
+ */
+int hoover_set_hash( const char *name ) {
+    const struct hoover_hash *hash = find_hash( name );
+    if ( !hash ) {
+        fprintf( stderr, "hoover_set_hash: unknown or unsupported hash '%s'\n", name );
+        return 1;
+    }
+    hoover_hash = hash;
+    return 0;
+}
+
+/*
+ * Name of the integrity hash that HDOs opened from now on will use, i.e., the
+ * hash_algo they will carry
+ */
+const char *hoover_get_hash( void ) {
+    pthread_once( &hoover_defaults_once, init_defaults );
+    return hoover_hash->name;
+}
+
+/*
+ * Choose whether HDOs opened from now on also hash their compressed payload.
+ * Without it, hdo->hash is empty and only hash_orig protects the data.
+ */
+void hoover_set_hash_compressed( int enable ) {
+    hoover_hash_compressed = enable;
+    return;
+}
+
+/*
+ * Hash a buffer with the named algorithm and write the hex digest (at most
+ * HASH_DIGEST_LENGTH_HEX bytes) into hash_hex.
+ *
+ * Returns 0 on success, nonzero if the hash is not usable.
+ */
+int hoover_hash_data( const char *name, const void *data, size_t len, char *hash_hex ) {
+    const struct hoover_hash *hash = find_hash( name );
+    unsigned char digest[HASH_DIGEST_MAX_LENGTH];
+    void *ctx;
+
+    if ( !hash || !(ctx = hash->create()) )
+        return 1;
+    hash->update( ctx, data, len );
+    hash->final( ctx, digest );
+    hoover_digest_to_hex( digest, hash->digest_len, hash_hex );
+    return 0;
+}
+
+/*
+ * Start checking an HDO payload that was hashed with hash_algo (sha1 if empty)
+ * and compressed with compression, e.g., as received from a tube.  If decode
+ * is set, the payload is also decompressed.
+ *
+ * Returns NULL if the hash, or the codec when decoding, is not supported by
+ * this build.
+ */
+struct hoover_hdo_decoder *hoover_open_hdo_decoder( const char *compression, const char *hash_algo, int decode ) {
+    struct hoover_hdo_decoder *decoder;
+    const struct hoover_hash *hash = find_hash( hash_algo[0] ? hash_algo : "sha1" );
+    const struct hoover_codec *codec = NULL;
+    size_t i;
+
+    if ( !hash ) {
+        fprintf( stderr, "hoover_open_hdo_decoder: unknown or unsupported hash '%s'\n", hash_algo );
+        return NULL;
+    }
+    if ( decode ) {
+        for ( i = 0; i < HOOVER_NUM_CODECS && !codec; i++ )
+            if ( strcmp(compression, hoover_codecs[i].suffix) == 0 )
+                codec = &hoover_codecs[i];
+        if ( !codec ) {
+            fprintf( stderr, "hoover_open_hdo_decoder: unknown or unsupported codec '%s'\n", compression );
+            return NULL;
+        }
+    }
+
+    if ( !(decoder = calloc(1, sizeof(*decoder))) )
+        return NULL;
+    decoder->hash = hash;
+    if ( !(decoder->hash_stream = hash->create()) ) {
+        free( decoder );
+        return NULL;
+    }
+    if ( codec ) {
+        decoder->codec = codec;
+        decoder->complete = codec->suffix[0] == '\0';
+        decoder->out_size = HOOVER_BLK_SIZE;
+        if ( !(decoder->hash_stream_orig = hash->create())
+        ||   !(decoder->out = malloc(decoder->out_size))
+        ||   (codec->decode_init && codec->decode_init(&(decoder->codec_stream)) != 0) ) {
+            decoder->codec = NULL;
+            hoover_close_hdo_decoder( decoder, NULL, NULL );
+            return NULL;
+        }
+    }
+    return decoder;
+}
+
+/*
+ * Feed the next piece of an HDO payload to a decoder.  When decoding, write
+ * (if not NULL) is called with each piece of decompressed data; a nonzero
+ * return from it stops decoding.
+ *
+ * Returns 0 on success, nonzero if the payload is corrupt or write failed.
+ */
+int hoover_decode_hdo_data( struct hoover_hdo_decoder *decoder, const void *data, size_t len,
+                            hoover_write_fn write, void *arg ) {
+    struct codec_stream *strm = &(decoder->codec_stream);
+    int ret;
+
+    if ( decoder->failed )
+        return 1;
+    decoder->hash->update( decoder->hash_stream, data, len );
+    if ( !decoder->codec )
+        return 0;
+
+    strm->next_in = data;
+    strm->avail_in = len;
+    do {
+        size_t produced;
+        const unsigned char *in = strm->next_in;
+
+        strm->next_out = decoder->out;
+        strm->avail_out = decoder->out_size;
+        if ( (ret = decoder->codec->decode(strm)) < 0 ) {
+            decoder->failed = 1;
+            return 1;
+        }
+
+        produced = decoder->out_size - strm->avail_out;
+        if ( produced > 0 ) {
+            decoder->hash->update( decoder->hash_stream_orig, decoder->out, produced );
+            if ( write && write(decoder->out, produced, arg) != 0 ) {
+                decoder->failed = 1;
+                return 1;
+            }
+        }
+        /* a call that did nothing says nothing about where the stream ends */
+        if ( produced == 0 && strm->next_in == in )
+            break;
+        decoder->complete = ret == 1;
+    } while ( strm->avail_in > 0 || strm->avail_out == 0 );
+
+    return 0;
+}
+
+/*
+ * Finish checking a payload and release the decoder.  The hex digests of the
+ * payload and, if it was decoded, of the decompressed data are written to
+ * hash and hash_orig (each may be NULL).  hash_orig is "" if not decoding.
+ *
+ * Returns 0 if the whole payload was valid, nonzero if it was corrupt or cut
+ * short.
+ */
+int hoover_close_hdo_decoder( struct hoover_hdo_decoder *decoder, char *hash, char *hash_orig ) {
+    unsigned char digest[HASH_DIGEST_MAX_LENGTH];
+    int ret = decoder->failed || (decoder->codec && !decoder->complete);
+
+    decoder->hash->final( decoder->hash_stream, digest );
+    if ( hash )
+        hoover_digest_to_hex( digest, decoder->hash->digest_len, hash );
+    if ( hash_orig )
+        hash_orig[0] = '\0';
+    if ( decoder->hash_stream_orig ) {
+        decoder->hash->final( decoder->hash_stream_orig, digest );
+        if ( hash_orig && decoder->codec )
+            hoover_digest_to_hex( digest, decoder->hash->digest_len, hash_orig );
+    }
+    if ( decoder->codec && decoder->codec->decode_end )
+        decoder->codec->decode_end( &(decoder->codec_stream) );
+    free( decoder->out );
+    free( decoder );
+    return ret;
+}
+
+/*
+ * Open a streaming HDO on a file.  No data is read until the caller pulls
+ * chunks with hoover_read_hdo_chunk(), and fp must remain open until the last
+ * chunk has been read.  The HDO's compression is known immediately, but its
+ * sizes and hashes are only valid once the end of the stream is reached.
+ */
+struct hoover_data_obj *hoover_open_hdo( FILE *fp, size_t block_size ) {
+    struct hoover_source source = { HOOVER_SOURCE_FILE, fp, -1, NULL, 0 };
+    return hoover_open_hdo_source( &source, block_size );
+}
+
+/*
+ * Open a streaming HDO on a file descriptor.  Regular files are mapped into
+ * memory and processed without being copied; anything else (pipes, sockets,
+ * character devices), and regular files whose offset is not at the start, is
+ * read() block by block.  fd must remain open until the last chunk has been
+ * read.
+ */
+struct hoover_data_obj *hoover_open_hdo_fd( int fd, size_t block_size ) {
+    struct hoover_source source = { HOOVER_SOURCE_FD, NULL, fd, NULL, 0 };
+    return hoover_open_hdo_source( &source, block_size );
+}
+
+/*
+ * Open a streaming HDO on data that is already in memory, such as a file that
+ * was read in ahead of time or a manifest that was just built.  buf is used in
+ * place and must remain valid until the last chunk has been read.
+ */
+struct hoover_data_obj *hoover_open_hdo_from_buffer( const void *buf, size_t len, size_t block_size ) {
+    struct hoover_source source = { HOOVER_SOURCE_BUFFER, NULL, -1, buf, len };
+    return hoover_open_hdo_source( &source, block_size );
+}
+
+/*
+ * Open a streaming HDO on any kind of source; the functions above are
+ * shorthands for this.  The source itself is copied and need not outlive the
+ * call, but whatever it refers to must remain valid until the last chunk has
+ * been read.  A block_size of HOOVER_BLOCK_AUTO picks one to suit the source;
+ * see hoover_pick_block_size().
+ */
+struct hoover_data_obj *hoover_open_hdo_source( const struct hoover_source *source, size_t block_size ) {
+    struct hoover_data_obj *hdo;
+    struct hoover_hdo_stream *stream;
+    const struct hoover_codec *codec;
+    int i;
+
+    if ( !(hdo = calloc(1, sizeof(*hdo))) )
+        return NULL;
+    if ( !(stream = calloc(1, sizeof(*stream))) ) {
+        free(hdo);
+        return NULL;
+    }
+    hdo->stream = stream;
+
+    pthread_once( &hoover_defaults_once, init_defaults );
+
+    stream->fp = NULL;
+    stream->fd = -1;
+    switch ( source->type ) {
+    case HOOVER_SOURCE_FILE:
+        stream->fp = source->fp;
+        break;
+    case HOOVER_SOURCE_FD:
+        stream->fd = source->fd;
+        map_input( stream );
+        break;
+    case HOOVER_SOURCE_BUFFER:
+        /* an empty buffer still needs a non-NULL map to read from */
+        stream->map = source->len > 0 ? source->buf : (const void *)"";
+        stream->map_len = source->len;
+        stream->map_borrowed = 1;
+        break;
+    case HOOVER_SOURCE_READER:
+        stream->reader = source->read;
+        stream->reader_arg = source->arg;
+        break;
+    }
+    stream->level = hoover_codec_level;
+    stream->cur_level = stream->level;
+    stream->crc = crc32(0L, Z_NULL, 0);
+
+    /* input that is all in memory can be sampled up front, and is not
+     * compressed at all if none of it would shrink */
+    codec = hoover_codec;
+    if ( hoover_adaptive && stream->map && codec->suffix[0] != '\0' ) {
+        size_t segment = stream->map_len / HOOVER_ADAPTIVE_SAMPLES;
+        for ( i = 0; i < HOOVER_ADAPTIVE_SAMPLES; i++ )
+            if ( worth_compressing(stream->map + i * segment, segment) )
+                break;
+        if ( i == HOOVER_ADAPTIVE_SAMPLES ) {
+            codec = find_codec( "none", 4 );
+            hoover_stats_count( HOOVER_COUNT_STORED_HDOS, 1 );
+        }
+    }
+    stream->adaptive = hoover_adaptive && codec->set_level;
+
+    /* codecs without pigz-style blocks are driven by a single thread, though
+     * they may use hoover_compress_threads internally */
+    stream->num_threads = codec->block_parallel ? hoover_compress_threads : 1;
+
+    if ( block_size == HOOVER_BLOCK_AUTO )
+        block_size = pick_block_size( stream->fp ? fileno(stream->fp) : stream->fd,
+                                      stream->map_len, stream->num_threads == 1 );
+    stream->block_size = block_size;
+
+    /* initialize block-based algorithm state stuctures here */
+    if ( !(stream->bss = init_block_states(codec, stream->level, hoover_compress_threads,
+                                          hoover_hash, hoover_hash_compressed)) ) {
+        free_hdo(hdo);
+        return NULL;
+    }
+    strncpy( hdo->compression, stream->bss->compression, COMPRESS_FIELD_LEN );
+    strncpy( hdo->hash_algo, hoover_hash->name, HASH_ALGO_FIELD_LEN );
+
+    if ( stream->num_threads > 1 ) {
+        start_compress_pool( stream->num_threads );
+        /* the history region sits immediately before the batch so that every
+         * block's dictionary is contiguous with its input */
+        stream->num_slots = stream->num_threads;
+        if ( !stream->map )
+            stream->in_buf = malloc( HOOVER_DEFLATE_DICT_SIZE + (size_t)stream->num_slots * block_size );
+        /* room for either the gzip header or the final block plus trailer */
+        stream->frame.out = malloc( 16 );
+        stream->frame.out_size = 16;
+    }
+    else {
+        stream->num_slots = 1;
+        if ( !stream->map )
+            stream->in_buf = malloc( block_size );
+    }
+    stream->slots = calloc( stream->num_slots, sizeof(*(stream->slots)) );
+    if ( (!stream->map && !stream->in_buf) || !stream->slots || (stream->num_threads > 1 && !stream->frame.out) ) {
+        free_hdo(hdo);
+        return NULL;
+    }
+
+    for ( i = 0; i < stream->num_slots; i++ ) {
+        struct stream_slot *slot = &(stream->slots[i]);
+        if ( stream->num_threads > 1 ) {
+            /* output buffers are sized on first use by deflate_parallel_block */
+            if ( deflateInit2(&(slot->z_stream), stream->level, Z_DEFLATED,
+                              -15, /* negative window bits = raw deflate */
+                              8, Z_DEFAULT_STRATEGY) != Z_OK ) {
+                free_hdo(hdo);
+                return NULL;
+            }
+            slot->level = stream->level;
+            slot->cur_level = stream->level;
+            slot->adaptive = stream->adaptive;
+        }
+        else {
+            if ( !(slot->out = malloc(block_size)) ) {
+                free_hdo(hdo);
+                return NULL;
+            }
+            slot->out_size = block_size;
+        }
+    }
+
+    return hdo;
+}
+
+/*
+ * Pull the next chunk of compressed payload out of a streaming HDO.  On
+ * success, *chunk and *len describe data that remains valid until the next
+ * call to hoover_read_hdo_chunk() or free_hdo().
+ *
+ * Returns 1 if a chunk was produced, 0 at the end of the stream (at which
+ * point the HDO's sizes and hashes are final), or -1 on error.
+ */
+int hoover_read_hdo_chunk( struct hoover_data_obj *hdo, const void **chunk, size_t *len ) {
+    struct hoover_hdo_stream *stream = hdo->stream;
+    struct stream_slot *slot;
+    uint64_t t0;
+    int ret;
+
+    *chunk = NULL;
+    *len = 0;
+    if ( !stream || stream->fail )
+        return -1;
+    if ( stream->relay )
+        return read_chunk_relay( hdo, chunk, len );
+
+    do {
+        if ( stream->done ) {
+            if ( stream->bss ) {
+                /* finalize block-based algorithm state structures here */
+                finalize_block_states( stream->bss );
+                strncpy( hdo->hash, stream->bss->hash_compressed_hex, HASH_DIGEST_LENGTH_HEX );
+                strncpy( hdo->hash_orig, stream->bss->hash_hex, HASH_DIGEST_LENGTH_HEX );
+                hdo->size = stream->tot_bytes_written;
+                hdo->size_orig = stream->tot_bytes_read;
+                hoover_stats_count( HOOVER_COUNT_HDOS, 1 );
+                hoover_stats_count( HOOVER_COUNT_BYTES_IN, hdo->size_orig );
+                hoover_stats_count( HOOVER_COUNT_BYTES_OUT, hdo->size );
+                free( stream->bss );
+                stream->bss = NULL;
+            }
+            return 0;
+        }
+
+        if ( stream->num_threads > 1 )
+            ret = read_chunk_parallel( stream, &slot );
+        else
+            ret = read_chunk_serial( stream, &slot );
+
+        if ( ret != 0 ) {
+            stream->fail = 1;
+            return -1;
+        }
+    } while ( slot->out_len == 0 );
+
+    /* update the hash of the compressed data */
+    if ( stream->bss->hash_stream_compressed ) {
+        t0 = hoover_stats_start();
+        stream->bss->hash->update( stream->bss->hash_stream_compressed, slot->out, slot->out_len );
+        hoover_stats_stop( HOOVER_STAGE_HASH_COMPRESSED, t0 );
+    }
+    stream->tot_bytes_written += slot->out_len;
 
-    /* init SHA calculator */
-    SHA1_Init( &(bss->sha_stream) );
-    SHA1_Init( &(bss->sha_stream_compressed) );
-    memset( bss->sha_hash, 0, SHA_DIGEST_LENGTH );
-    memset( bss->sha_hash_compressed, 0, SHA_DIGEST_LENGTH );
-    memset( bss->sha_hash_hex, 0, SHA_DIGEST_LENGTH_HEX );
-    memset( bss->sha_hash_compressed_hex, 0, SHA_DIGEST_LENGTH_HEX );
+    *chunk = slot->out;
+    *len = slot->out_len;
+    return 1;
+}
 
-    /* init zlib calculator */
-    (bss->z_stream).zalloc = Z_NULL;
-    (bss->z_stream).zfree = Z_NULL;
-    (bss->z_stream).opaque = Z_NULL;
+/*
+ * Open a streaming HDO that another thread fills with the chunks of src, so
+ * that src can be compressed in one thread while its chunks are sent from
+ * another.  The filling thread must call hoover_pump_hdo_relay() on *relay,
+ * which takes src over.  The HDO returned can be read and freed like any
+ * other streaming HDO, whether or not its relay has been pumped yet.
+ *
+ * Returns NULL on failure, in which case src still belongs to the caller.
+ */
+struct hoover_data_obj *hoover_open_hdo_relay( struct hoover_data_obj *src, int depth,
+                                               struct hoover_hdo_relay **relay ) {
+    struct hoover_data_obj *hdo;
+    struct hoover_hdo_relay *r;
 
-    if ( (deflateInit2(
-            &(bss->z_stream),
-            Z_DEFAULT_COMPRESSION,
-            Z_DEFLATED,
-            15 + 16, /* 15 is default for deflateInit, +16 enables gzip */
-            8,
-            Z_DEFAULT_STRATEGY)) != Z_OK ) {
-        free(bss);
+    if ( !src->stream || depth < 1 )
+        return NULL;
+    if ( !(hdo = calloc(1, sizeof(*hdo))) )
+        return NULL;
+    if ( !(hdo->stream = calloc(1, sizeof(*(hdo->stream))))
+    ||   !(r = calloc(1, sizeof(*r))) ) {
+        free( hdo->stream );
+        free( hdo );
         return NULL;
     }
-    strncpy(bss->compression, "gz", COMPRESS_FIELD_LEN);
+    if ( !(r->chunks = calloc(depth, sizeof(*(r->chunks)))) ) {
+        free( r );
+        free( hdo->stream );
+        free( hdo );
+        return NULL;
+    }
+    pthread_mutex_init( &(r->lock), NULL );
+    pthread_cond_init( &(r->changed), NULL );
+    r->src = src;
+    r->depth = depth;
+    r->refs = 2;
 
-    return bss;
+    hdo->stream->fd = -1;
+    hdo->stream->relay = r;
+    strncpy( hdo->compression, src->compression, COMPRESS_FIELD_LEN );
+    strncpy( hdo->hash_algo, src->hash_algo, HASH_ALGO_FIELD_LEN );
+
+    *relay = r;
+    return hdo;
 }
 
-int *finalize_block_states( struct block_state_structs *bss ) {
-    int i;
+/*
+ * Read every chunk of a relay's source HDO and pass it on, waiting whenever
+ * the relay is full.  The source HDO is freed and the relay let go of
+ * afterwards, even if the reading end has already been freed.
+ *
+ * Returns 0 once the whole source went through, -1 on error or if the
+ * reading end was freed first.
+ */
+int hoover_pump_hdo_relay( struct hoover_hdo_relay *relay ) {
+    struct relay_chunk *slot;
+    const void *chunk;
+    size_t len;
+    void *copy;
+    int ret, cancelled;
+
+    do {
+        pthread_mutex_lock( &(relay->lock) );
+        cancelled = relay->cancelled;
+        pthread_mutex_unlock( &(relay->lock) );
+        if ( cancelled ) {
+            ret = -1;
+            break;
+        }
+
+        /* the chunk is only valid until the next read, so the relay gets a
+         * copy of it */
+        if ( (ret = hoover_read_hdo_chunk(relay->src, &chunk, &len)) <= 0 )
+            break;
+        if ( !(copy = malloc(len)) ) {
+            ret = -1;
+            break;
+        }
+        memcpy( copy, chunk, len );
 
-    deflateEnd( &(bss->z_stream) );
-    SHA1_Final(bss->sha_hash, &(bss->sha_stream));
-    SHA1_Final(bss->sha_hash_compressed, &(bss->sha_stream_compressed));
+        pthread_mutex_lock( &(relay->lock) );
+        while ( relay->count == relay->depth && !relay->cancelled )
+            pthread_cond_wait( &(relay->changed), &(relay->lock) );
+        if ( relay->cancelled ) {
+            free( copy );
+        }
+        else {
+            slot = &(relay->chunks[(relay->head + relay->count) % relay->depth]);
+            slot->data = copy;
+            slot->len = len;
+            relay->count++;
+            pthread_cond_broadcast( &(relay->changed) );
+        }
+        pthread_mutex_unlock( &(relay->lock) );
+    } while ( 1 );
 
-    for ( i = 0; i < SHA_DIGEST_LENGTH; i++ )
-    {
-        sprintf( (char*)&(bss->sha_hash_hex[2*i]), "%02x", bss->sha_hash[i] );
-        sprintf( (char*)&(bss->sha_hash_compressed_hex[2*i]), "%02x", bss->sha_hash_compressed[i] );
+    pthread_mutex_lock( &(relay->lock) );
+    if ( ret == 0 ) {
+        strncpy( relay->result.hash, relay->src->hash, HASH_DIGEST_LENGTH_HEX );
+        strncpy( relay->result.hash_orig, relay->src->hash_orig, HASH_DIGEST_LENGTH_HEX );
+        relay->result.size = relay->src->size;
+        relay->result.size_orig = relay->src->size_orig;
     }
-    /* final character is \0 from when bss was initialized */
+    relay->finished = ret == 0 ? 1 : -1;
+    pthread_mutex_unlock( &(relay->lock) );
 
-    return 0;
+    free_hdo( relay->src );
+    relay->src = NULL;
+    release_relay( relay, 0 );
+    return ret;
 }
 
 /*
  * Read a file block by block, and pass these blocks through block-based
- * algorithms (hashing, compression, etc)
+ * algorithms (hashing, compression, etc).  The whole compressed payload is
+ * collected in memory; use hoover_open_hdo() to process it chunk by chunk
+ * instead.
  */
 struct hoover_data_obj *hoover_create_hdo( FILE *fp, size_t block_size ) {
-    void *buf,
-         *out_buf,
-         *p_out;
-    size_t out_buf_len,
-           bytes_read,
-           bytes_written,
-           tot_bytes_read = 0,
-           tot_bytes_written = 0;
-    struct block_state_structs *bss;
-    struct hoover_data_obj *hdo;
-    struct stat st;
-    int fail = 0;
-    int flush;
-
-    /* buf is filled from file, then processed (compress+hash) */
-    if ( !(buf = malloc( block_size )) ) return NULL;
+    struct hoover_source source = { HOOVER_SOURCE_FILE, fp, -1, NULL, 0 };
+    return hoover_create_hdo_source( &source, block_size );
+}
 
-    /* get file size so we know how big to allocate our buffer */
-    if ( fstat(fileno(fp), &st) != 0 ) {
-        free( buf );
-        return NULL;
-    }
+/*
+ * Same as hoover_create_hdo(), but reads from a file descriptor.  Regular
+ * files are mapped rather than copied; see hoover_open_hdo_fd().
+ */
+struct hoover_data_obj *hoover_create_hdo_fd( int fd, size_t block_size ) {
+    struct hoover_source source = { HOOVER_SOURCE_FD, NULL, fd, NULL, 0 };
+    return hoover_create_hdo_source( &source, block_size );
+}
 
-    /* worst-case, compression adds +10%; ideally it will reduce size */
-    out_buf_len = st.st_size * 1.1;
-    out_buf = malloc(out_buf_len);
-    if ( !out_buf ) {
-        free(buf);
-        return NULL;
-    }
-    p_out = out_buf;
+/*
+ * Same as hoover_create_hdo(), but compresses data that is already in memory
+ * without any intermediate file.  buf is not needed once this returns.
+ */
+struct hoover_data_obj *hoover_create_hdo_from_buffer( const void *buf, size_t len, size_t block_size ) {
+    struct hoover_source source = { HOOVER_SOURCE_BUFFER, NULL, -1, buf, len };
+    return hoover_create_hdo_source( &source, block_size );
+}
 
-    /* initialize block-based algorithm state stuctures here */
-    if ( !(bss = init_block_states()) ) {
-        free(buf);
-        free(out_buf);
-        return NULL;
-    }
+/*
+ * Same as hoover_create_hdo(), but for any kind of source
+ */
+struct hoover_data_obj *hoover_create_hdo_source( const struct hoover_source *source, size_t block_size ) {
+    struct hoover_data_obj *hdo;
+    struct stat st;
+    off_t size_hint = 0;
+    uint64_t t0 = hoover_stats_start();
 
-    do { /* loop until no more input */
-        bytes_read = fread(buf, 1, block_size, fp);
+    if ( source->type == HOOVER_SOURCE_BUFFER )
+        size_hint = source->len;
+    else if ( source->type != HOOVER_SOURCE_READER
+         &&   fstat(source->type == HOOVER_SOURCE_FILE ? fileno(source->fp) : source->fd, &st) == 0 )
+        size_hint = st.st_size;
 
-        if ( feof(fp) )
-            flush = Z_FINISH;
-        else
-            flush = Z_NO_FLUSH;
-
-        tot_bytes_read += bytes_read;
-        /* update the SHA1 of the pre-compressed data */
-        SHA1_Update( &(bss->sha_stream), buf, bytes_read );
-
-        /* set start of compression block */
-        (bss->z_stream).avail_in = bytes_read;
-        (bss->z_stream).next_in = (unsigned char*)buf;
-
-        do { /* loop until no more output */
-            /* avail_out = how big is the output buffer */
-            (bss->z_stream).avail_out = out_buf_len - tot_bytes_written;
-            /* next_out = pointer to the output buffer */
-            (bss->z_stream).next_out = (unsigned char*)out_buf + tot_bytes_written;
-
-            /* deflate updates avail_in and next_in as it consumes input data.
-               it may also update avail_out and next_out if it flushed any data,
-               but this is not necessarily the case since zlib may internally
-               buffer data */
-            if ( (deflate(&(bss->z_stream), flush)) != Z_OK ) {
-                fail = 1;
-                break;
-            }
-            bytes_written = ( (char*)((bss->z_stream).next_out) - (char *)p_out );
-            tot_bytes_written += bytes_written;
+    hdo = drain_hdo( hoover_open_hdo_source(source, block_size), size_hint );
+    hoover_stats_stop( HOOVER_STAGE_CREATE_HDO, t0 );
+    return hdo;
+}
 
-            /* update the SHA1 of the compressed */
-            SHA1_Update( &(bss->sha_stream_compressed), p_out, bytes_written );
+/*
+ * Pull all of a streaming HDO's payload into memory and turn it into a
+ * regular HDO.  size_hint is the size of the input, if known.
+ */
+static struct hoover_data_obj *drain_hdo( struct hoover_data_obj *hdo, off_t size_hint ) {
+    unsigned char *out_buf = NULL;
+    size_t out_len = 0,
+           out_size = 0;
+    const void *chunk;
+    size_t chunk_len;
+    int ret;
 
-            /* update the pointer - there may be a cleaner way to do this */
-            p_out = (bss->z_stream).next_out;
-        } while ( (bss->z_stream).avail_out == 0 );
-        if ( fail ) break;
-    } while ( bytes_read != 0 ); /* loop until we run out of input */
+    if ( !hdo )
+        return NULL;
 
-    assert( bss->z_stream.avail_in == 0 );
-    if ( bss->z_stream.avail_out != 0 )
-    {
-        deflate(&(bss->z_stream), flush);
-        bytes_written = ( (char*)((bss->z_stream).next_out) - (char *)p_out );
-        tot_bytes_written += bytes_written;
-        SHA1_Update( &(bss->sha_stream_compressed), p_out, bytes_written );
+    /* size the output buffer for the common case of compressible data; it
+     * grows if that guess turns out to be wrong */
+    if ( size_hint > 0 ) {
+        out_size = size_hint / 2 + 64;
+        if ( !(out_buf = malloc(out_size)) )
+            out_size = 0;
     }
 
-    assert( flush == Z_FINISH );
+    while ( (ret = hoover_read_hdo_chunk(hdo, &chunk, &chunk_len)) > 0 ) {
+        if ( append_output(&out_buf, &out_len, &out_size, chunk, chunk_len) != 0 ) {
+            ret = -1;
+            break;
+        }
+    }
 
-    /* finalize block-based algorithm state structures here */
-    finalize_block_states( bss );
+    /* the stream is no longer needed once the payload is in memory */
+    free_hdo_stream( hdo->stream );
+    hdo->stream = NULL;
 
-    /* create the hoover data object */
-    hdo = malloc(sizeof(*hdo));
-    if (!hdo) {
-        free(buf);
+    if ( ret < 0 ) {
         free(out_buf);
+        free(hdo);
         return NULL;
     }
-    strncpy( hdo->hash, bss->sha_hash_compressed_hex, SHA_DIGEST_LENGTH_HEX );
-    strncpy( hdo->hash_orig, bss->sha_hash_hex, SHA_DIGEST_LENGTH_HEX );
-    
-    hdo->size = tot_bytes_written;
-    hdo->data = realloc( out_buf, tot_bytes_written );
-    hdo->size_orig = tot_bytes_read;
-    strncpy(hdo->compression, bss->compression, COMPRESS_FIELD_LEN);
 
-    /* clean up */
-    free(buf);
+    assert( out_len == hdo->size );
+    hdo->data = realloc( out_buf, out_len );
 
     return hdo;
 }
@@ -224,6 +2499,8 @@ void free_hdo( struct hoover_data_obj *hdo ) {
         fprintf( stderr, "free_hdo: received NULL pointer\n" );
     }
     else {
+        if ( hdo->stream )
+            free_hdo_stream( hdo->stream );
         free( hdo->data );
         free( hdo );
     }
@@ -238,52 +2515,292 @@ void free_hoover_header( struct hoover_header *header ) {
     return;
 }
 
+/*
+ * A string that grows as it is appended to.  Its capacity doubles whenever it
+ * runs out, so appending is amortized constant time per byte.  If an
+ * allocation fails, the buffer is marked failed and further appends are
+ * ignored; strbuf_finish() then returns NULL.
+ */
+struct strbuf {
+    char *data;
+    size_t len;         /* bytes used, not counting the terminating '\0' */
+    size_t capacity;    /* bytes allocated */
+    int failed;
+};
+
+static void strbuf_init( struct strbuf *sb, size_t capacity ) {
+    sb->len = 0;
+    sb->capacity = capacity ? capacity : 64;
+    sb->failed = !(sb->data = malloc(sb->capacity));
+    if ( !sb->failed )
+        sb->data[0] = '\0';
+}
+
+/* make room for len more bytes plus the terminating '\0' */
+static int strbuf_reserve( struct strbuf *sb, size_t len ) {
+    size_t capacity;
+    char *data;
+
+    if ( sb->failed )
+        return -1;
+    if ( sb->len + len + 1 <= sb->capacity )
+        return 0;
+
+    for ( capacity = sb->capacity; capacity < sb->len + len + 1; capacity *= 2 );
+    if ( !(data = realloc(sb->data, capacity)) ) {
+        sb->failed = 1;
+        return -1;
+    }
+    sb->data = data;
+    sb->capacity = capacity;
+    return 0;
+}
+
+static void strbuf_append( struct strbuf *sb, const char *data, size_t len ) {
+    if ( strbuf_reserve(sb, len) != 0 )
+        return;
+    memcpy( sb->data + sb->len, data, len );
+    sb->len += len;
+    sb->data[sb->len] = '\0';
+}
+
+static void strbuf_puts( struct strbuf *sb, const char *s ) {
+    strbuf_append( sb, s, strlen(s) );
+}
+
+/*
+ * Length of the well-formed UTF-8 sequence at the start of s (at most n
+ * bytes), or 0 if it is not one
+ */
+static size_t utf8_sequence_len( const unsigned char *s, size_t n ) {
+    size_t len, i;
+    unsigned long code;
+
+    if ( s[0] < 0x80 ) return 1;
+    else if ( (s[0] & 0xe0) == 0xc0 ) { len = 2; code = s[0] & 0x1f; }
+    else if ( (s[0] & 0xf0) == 0xe0 ) { len = 3; code = s[0] & 0x0f; }
+    else if ( (s[0] & 0xf8) == 0xf0 ) { len = 4; code = s[0] & 0x07; }
+    else return 0;
+
+    if ( len > n )
+        return 0;
+    for ( i = 1; i < len; i++ ) {
+        if ( (s[i] & 0xc0) != 0x80 )
+            return 0;
+        code = (code << 6) | (s[i] & 0x3f);
+    }
+    /* reject overlong encodings, surrogates, and anything past U+10FFFF */
+    if ( (len == 2 && code < 0x80) || (len == 3 && code < 0x800) || (len == 4 && code < 0x10000)
+    ||   (code >= 0xd800 && code <= 0xdfff) || code > 0x10ffff )
+        return 0;
+    return len;
+}
+
+/*
+ * Append s as a quoted JSON string.  Quotes, backslashes, and control
+ * characters are escaped.  Bytes that are not valid UTF-8 cannot be
+ * represented in JSON, so each byte 0xXY is escaped as the lone surrogate
+ * \udcXY, as Python's surrogateescape error handler does.  Valid UTF-8 never
+ * encodes a surrogate, so readers can turn these back into the original bytes.
+ */
+static void strbuf_json_string( struct strbuf *sb, const char *s ) {
+    const unsigned char *p = (const unsigned char *)s, *run = p;
+    size_t n = strlen(s), seq;
+    char escape[8];
+
+    /* most strings need no escaping at all, so copy them in runs */
+    strbuf_reserve( sb, n + 2 );
+    strbuf_append( sb, "\"", 1 );
+    while ( *p ) {
+        if ( *p >= 0x20 && *p != '"' && *p != '\\' && *p < 0x80 ) {
+            p++;
+            continue;
+        }
+        if ( *p >= 0x80 && (seq = utf8_sequence_len(p, n - (p - (const unsigned char *)s))) > 0 ) {
+            p += seq;
+            continue;
+        }
+
+        strbuf_append( sb, (const char *)run, p - run );
+        if ( *p == '"' ) strbuf_append( sb, "\\\"", 2 );
+        else if ( *p == '\\' ) strbuf_append( sb, "\\\\", 2 );
+        else if ( *p == '\n' ) strbuf_append( sb, "\\n", 2 );
+        else if ( *p == '\t' ) strbuf_append( sb, "\\t", 2 );
+        else if ( *p == '\r' ) strbuf_append( sb, "\\r", 2 );
+        else {
+            snprintf( escape, sizeof(escape), "\\u%04x", *p < 0x80 ? *p : 0xdc00 | *p );
+            strbuf_append( sb, escape, 6 );
+        }
+        run = ++p;
+    }
+    strbuf_append( sb, (const char *)run, p - run );
+    strbuf_append( sb, "\"", 1 );
+}
+
+/* hand the built string to the caller, or NULL if an allocation failed */
+static char *strbuf_finish( struct strbuf *sb ) {
+    if ( sb->failed ) {
+        free( sb->data );
+        sb->data = NULL;
+    }
+    return sb->data;
+}
+
+/* rough size of one serialized header, used to size buffers up front */
+#define SERIALIZED_HEADER_LEN 384
+
+/*
+ * Append the JSON object for one header, given its digests in hex.  sha1sum
+ * keeps its historical name; hash_algo says which hash it is.
+ */
+static void append_header_json( struct strbuf *sb, const struct hoover_header_ref *header,
+                                const char *sha_hash, const char *hash_orig ) {
+    char size[24];
+
+    strbuf_puts( sb, "{ \"filename\": " );
+    strbuf_json_string( sb, header->filename );
+    strbuf_puts( sb, ", \"node_id\": " );
+    strbuf_json_string( sb, header->node_id );
+    strbuf_puts( sb, ", \"task_id\": " );
+    strbuf_json_string( sb, header->task_id );
+    strbuf_puts( sb, ", \"compression\": " );
+    strbuf_json_string( sb, header->compression );
+    strbuf_puts( sb, ", \"sha1sum\": " );
+    strbuf_json_string( sb, sha_hash );
+    strbuf_puts( sb, ", \"hash_orig\": " );
+    strbuf_json_string( sb, hash_orig );
+    strbuf_puts( sb, ", \"hash_algo\": " );
+    strbuf_json_string( sb, header->hash_algo );
+    snprintf( size, sizeof(size), "%ld", (long)header->size );
+    strbuf_puts( sb, ", \"size\": " );
+    strbuf_puts( sb, size );
+    strbuf_puts( sb, ", \"type\": " );
+    strbuf_json_string( sb, header->type );
+    strbuf_puts( sb, " }" );
+}
+
+/*
+ * Append the JSON object for a header_ref, whose digests are in binary
+ */
+static void append_ref_json( struct strbuf *sb, const struct hoover_header_ref *header ) {
+    char sha_hash[HASH_DIGEST_LENGTH_HEX], hash_orig[HASH_DIGEST_LENGTH_HEX];
+
+    hoover_digest_to_hex( header->sha_hash, header->sha_hash_len, sha_hash );
+    hoover_digest_to_hex( header->hash_orig, header->hash_orig_len, hash_orig );
+    append_header_json( sb, header, sha_hash, hash_orig );
+}
+
+/*
+ * Append the part of a manifest that holds headers first to last - 1, along
+ * with the brackets and commas around them
+ */
+static void append_manifest_json( struct strbuf *sb, const struct hoover_header_arena *headers,
+                                  int first, int last ) {
+    struct hoover_header_ref ref;
+    int i;
+
+    if ( first == 0 )
+        strbuf_append( sb, "[", 1 );
+    for ( i = first; i < last; i++ ) {
+        if ( i > 0 )
+            strbuf_append( sb, ",", 1 );
+        hoover_header_arena_get( headers, i, &ref );
+        append_ref_json( sb, &ref );
+    }
+    if ( last == headers->count )
+        strbuf_append( sb, "]", 1 );
+}
+
 /*
  * Generate the contents of a manifest file based on generated headers
  *
- * input: list of hoover headers
- * output: serialized list of hoover_headers (i.e., a json blob)
+ * input: arena of hoover headers
+ * output: serialized list of hoover_headers (i.e., a json blob), or NULL if
+ *         memory ran out
  *
- * Caveats:
- *   1. This is poor-man's JSON encoding.  I am not proud of it.
- *   2. We use very naive and inefficient memory management here--if
- *      performance is ever critical, this needs to be rewritten.
+ * Every header is appended to one growing buffer, so building a manifest
+ * takes time linear in the number of headers.  To send a manifest, use
+ * hoover_create_manifest_hdo() instead, which never holds all of it.
  */
-char *build_manifest( struct hoover_header **hoover_headers, int num_headers ) {
-    int i;
-    char *buf;
-    char *manifest = NULL;
-    const char *manifest_head = "[",
-               *manifest_tail = "]",
-               *manifest_join = ",";
-    /* nomenclature:  _len = product of strlen (no terminal \0 included)
-                     _size = number of bytes (must include terminal \0) */
-    size_t manifest_join_len = strlen(manifest_join);
-    size_t manifest_size, record_len;
-
-
-    /* initialize manifest */
-    manifest_size = sizeof(*manifest) * (strlen(manifest_head) + strlen(manifest_tail) + 1);
-    manifest = malloc(manifest_size);
-    strcpy( manifest, manifest_head );
-
-    /* add each header */
-    for (i = 0; i < num_headers; i++) {
-        buf = serialize_header(hoover_headers[i]);
-        /* the manifest_join_len is not necessary for i = 0, but whatever */
-        manifest_size += strlen(buf) + manifest_join_len;
-        manifest = realloc(manifest, manifest_size);
-
-        if (i > 0) {
-            strcat(manifest, manifest_join);
-        }
-        strcat(manifest, buf);
-        free(buf);
-    }
-    strcat( manifest, manifest_tail );
+char *build_manifest( const struct hoover_header_arena *headers ) {
+    struct strbuf sb;
+    uint64_t t0 = hoover_stats_start();
+    char *manifest;
+
+    strbuf_init( &sb, (size_t)headers->count * SERIALIZED_HEADER_LEN + 3 );
+    append_manifest_json( &sb, headers, 0, headers->count );
+    manifest = strbuf_finish( &sb );
+    hoover_stats_stop( HOOVER_STAGE_MANIFEST, t0 );
     return manifest;
 }
 
+/* headers serialized at a time while a manifest is streamed */
+#define HOOVER_MANIFEST_BATCH 256
+
+/* a manifest being serialized as hoover_create_manifest_hdo() reads it */
+struct manifest_reader {
+    const struct hoover_header_arena *headers;
+    int next;           /* first header not yet serialized */
+    int done;           /* the closing bracket has been serialized */
+    struct strbuf sb;   /* serialized batch */
+    size_t pos;         /* bytes of sb already read */
+};
+
+/*
+ * hoover_source reader that serializes a batch of headers whenever the last
+ * one has been read
+ */
+static ssize_t read_manifest( void *arg, void *buf, size_t len ) {
+    struct manifest_reader *reader = arg;
+    size_t bytes_read = 0, n;
+    uint64_t t0 = hoover_stats_start();
+    int last;
+
+    while ( bytes_read < len ) {
+        if ( reader->pos == reader->sb.len ) {
+            if ( reader->done )
+                break;
+            last = reader->headers->count - reader->next > HOOVER_MANIFEST_BATCH
+                 ? reader->next + HOOVER_MANIFEST_BATCH : reader->headers->count;
+            reader->sb.len = 0;
+            reader->pos = 0;
+            append_manifest_json( &(reader->sb), reader->headers, reader->next, last );
+            if ( reader->sb.failed )
+                return -1;
+            reader->next = last;
+            reader->done = last == reader->headers->count;
+        }
+        n = reader->sb.len - reader->pos;
+        if ( n > len - bytes_read )
+            n = len - bytes_read;
+        memcpy( (char *)buf + bytes_read, reader->sb.data + reader->pos, n );
+        reader->pos += n;
+        bytes_read += n;
+    }
+    hoover_stats_stop( HOOVER_STAGE_MANIFEST, t0 );
+    return bytes_read;
+}
+
+/*
+ * Same as manifest_to_hdo( build_manifest(headers), ... ), but the manifest is
+ * serialized a batch of headers at a time as the HDO's codec consumes it, so
+ * only the compressed manifest is ever held in full.
+ */
+struct hoover_data_obj *hoover_create_manifest_hdo( const struct hoover_header_arena *headers ) {
+    struct manifest_reader reader;
+    struct hoover_source source = { HOOVER_SOURCE_READER, NULL, -1, NULL, 0, read_manifest, &reader };
+    struct hoover_data_obj *hdo;
+
+    memset( &reader, 0, sizeof(reader) );
+    reader.headers = headers;
+    strbuf_init( &(reader.sb), HOOVER_MANIFEST_BATCH * SERIALIZED_HEADER_LEN );
+    if ( reader.sb.failed )
+        return NULL;
+    hdo = hoover_create_hdo_source( &source, HOOVER_BLOCK_AUTO );
+    free( reader.sb.data );
+    return hdo;
+}
+
 /*
  * Generate the hoover_header struct from a file
  */
@@ -303,14 +2820,19 @@ struct hoover_header *build_hoover_header( char *filename, struct hoover_data_ob
      * header->task_id
      * header->compress
      * header->sha_hash
+     * header->hash_orig
+     * header->hash_algo
      * header->type
      * header->size
      */
+    pthread_once( &hoover_ids_once, init_ids );
     strncpy(header->filename, filename, PATH_MAX);
-    get_hoover_node_id(header->node_id, HOST_NAME_MAX);
-    get_hoover_task_id(header->task_id, TASK_ID_LEN);
+    strncpy(header->node_id, hoover_node_id, HOST_NAME_MAX);
+    strncpy(header->task_id, hoover_task_id, TASK_ID_LEN);
     strncpy(header->compression, hdo->compression, COMPRESS_FIELD_LEN);
-    strncpy((char*)header->sha_hash, (const char*)hdo->hash, SHA_DIGEST_LENGTH_HEX);
+    strncpy((char*)header->sha_hash, (const char*)hdo->hash, HASH_DIGEST_LENGTH_HEX);
+    strncpy(header->hash_orig, hdo->hash_orig, HASH_DIGEST_LENGTH_HEX);
+    strncpy(header->hash_algo, hdo->hash_algo, HASH_ALGO_FIELD_LEN);
     header->size = hdo->size;
     strncpy(header->type, filetype, HDO_TYPE_FIELD_LEN);
 
@@ -325,6 +2847,27 @@ struct hoover_header *build_hoover_header( char *filename, struct hoover_data_ob
     return header;
 }
 
+/*
+ * Refresh the parts of a header that describe an HDO's payload.  Streaming
+ * HDOs only know their final size and hash once they have been drained, so
+ * tubes call this after sending one.
+ */
+void update_hoover_header( struct hoover_header *header, struct hoover_data_obj *hdo ) {
+    strncpy((char*)header->sha_hash, (const char*)hdo->hash, HASH_DIGEST_LENGTH_HEX);
+    strncpy(header->hash_orig, hdo->hash_orig, HASH_DIGEST_LENGTH_HEX);
+    header->size = hdo->size;
+    return;
+}
+
+/*
+ * Look up the node_id and task_id that every header of this process carries
+ */
+static void init_ids( void ) {
+    get_hoover_node_id( hoover_node_id, HOST_NAME_MAX );
+    get_hoover_task_id( hoover_task_id, TASK_ID_LEN );
+    return;
+}
+
 /*
  *  Get a unique node identifier for this host; used in Hoover headers
  */
@@ -358,82 +2901,350 @@ int get_hoover_task_id( char *name, size_t len ) {
 }
 
 /*
- * Serialized representation of a header.  Currently implemented as poor-man's
- * JSON encoder.
+ * Write a buffer in full at offset, retrying short writes.  Returns 0, or -1
+ * if the write failed.
+ */
+int hoover_pwrite_all( int fd, const void *buf, size_t len, off_t offset ) {
+    const char *p = buf;
+    while ( len > 0 ) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+            return -1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*
+ * Take an exclusive lock on a whole file, waiting for any other process that
+ * holds it.  The lock is dropped when the file is closed.
+ */
+int hoover_lock_file( int fd ) {
+    struct flock lock;
+    memset( &lock, 0, sizeof(lock) );
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    while ( fcntl(fd, F_SETLKW, &lock) != 0 ) {
+        if ( errno != EINTR )
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * 64-bit FNV-1a hash of a path, for tables keyed by file
+ */
+uint64_t hoover_hash_path( const char *path ) {
+    uint64_t h = 14695981039346656037ULL;
+    for ( ; *path; path++ ) {
+        h ^= (unsigned char)*path;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+ * Serialized representation of a header, as a JSON object.  Returns NULL if
+ * memory ran out.
  */
 char *serialize_header(struct hoover_header *header) {
-    size_t len;
-    char *buf;
+    struct hoover_header_ref ref;
+    struct strbuf sb;
 
-    const char *template = "{ \"filename\": \"%s\", \"node_id\": \"%s\", \"task_id\": \"%s\", \"compression\": \"%s\", \"sha1sum\": \"%s\", \"size\": %ld, \"type\": \"%s\" }";
+    /* the digests are passed on as they are, even if they are not hex */
+    hoover_header_view( header, &ref );
+    strbuf_init( &sb, SERIALIZED_HEADER_LEN );
+    append_header_json( &sb, &ref, (const char *)header->sha_hash, header->hash_orig );
+    return strbuf_finish( &sb );
+}
 
-    /* assume header is mostly fixed-size characters */
-    /* +24 chars = string representation up to a yottabyte */
-    len = sizeof(*header)+24;
+/*
+ * serialize_header() of a header_ref, e.g., one kept in a hoover_header_arena
+ */
+char *serialize_header_ref( const struct hoover_header_ref *header ) {
+    struct strbuf sb;
 
-    if (!(buf = malloc(len)))
-        return NULL;
+    strbuf_init( &sb, SERIALIZED_HEADER_LEN );
+    append_ref_json( &sb, header );
+    return strbuf_finish( &sb );
+}
 
-    snprintf( buf, len, template,
-        header->filename,
-        header->node_id,
-        header->task_id,
-        header->compression,
-        header->sha_hash,
-        header->size,
-        header->type );
-/*  printf( "serialize_header: trimming from %ld to %ld (strlen=%ld)\n",
-        sizeof(*header)+24,
-        sizeof(*buf) * strlen(buf) + 1,
-        strlen(buf) );
-        */
-    buf = realloc(buf, sizeof(*buf) * strlen(buf) + 1);
+/*
+ * Point a hoover_header_ref at the strings of a header.  Nothing is copied but
+ * the digests, so the view is only good while the header is.  Returns nonzero
+ * if a digest is not hex; it is then left empty.
+ */
+int hoover_header_view( const struct hoover_header *header, struct hoover_header_ref *ref ) {
+    int sha_len, orig_len;
 
-    return buf;
+    ref->filename = header->filename;
+    ref->node_id = header->node_id;
+    ref->task_id = header->task_id;
+    ref->compression = header->compression;
+    ref->type = header->type;
+    ref->hash_algo = header->hash_algo;
+    ref->size = header->size;
+    sha_len = hoover_digest_from_hex( (const char *)header->sha_hash, ref->sha_hash );
+    orig_len = hoover_digest_from_hex( header->hash_orig, ref->hash_orig );
+    ref->sha_hash_len = sha_len > 0 ? sha_len : 0;
+    ref->hash_orig_len = orig_len > 0 ? orig_len : 0;
+    return (sha_len < 0 || orig_len < 0) ? -1 : 0;
 }
 
 /*
- *  Convert a serialized manifest to an HDO so it can be sent over the wire.
- *
- *  Note that manifest_size should not include the terminal NULL character, as
- *  we do not want that that appearing in the HDO payload.
+ * Create an empty arena for headers
  */
-struct hoover_data_obj *manifest_to_hdo( char *manifest, size_t manifest_size ) {
-    /* Copy the manifest into a temporary file since hoover_create_hdo operates
-     * on FILE pointers.  On POSIX2008 systems we can use fmemopen(3) or
-     * open_memstream(3), but these aren't available on all systems (notably,
-     * macOS)
-     */
-    FILE *fp = tmpfile();
-    size_t bytes_left = manifest_size;
-    char *p = manifest;
-    do {
-        size_t write_size;
-        if ( bytes_left > HOOVER_BLK_SIZE )
-            write_size = HOOVER_BLK_SIZE;
-        else
-            write_size = bytes_left;
-        size_t bytes_written = fwrite( p, 1, write_size, fp );
-        if ( bytes_written != write_size ) {
-            perror("manifest_to_hoover: unable to write out manifest");
+struct hoover_header_arena *create_hoover_header_arena( void ) {
+    return calloc( 1, sizeof(struct hoover_header_arena) );
+}
+
+void free_hoover_header_arena( struct hoover_header_arena *arena ) {
+    struct hoover_arena_block *block, *next;
+
+    if ( arena == NULL ) {
+        fprintf( stderr, "free_hoover_header_arena: received NULL pointer\n" );
+        return;
+    }
+    for ( block = arena->blocks; block; block = next ) {
+        next = block->next;
+        free( block );
+    }
+    free( arena->entries );
+    free( arena );
+    return;
+}
+
+/*
+ * Set aside len bytes in the arena's blocks.  Returns NULL if memory ran out.
+ */
+static unsigned char *arena_alloc( struct hoover_header_arena *arena, size_t len ) {
+    struct hoover_arena_block *block = arena->blocks;
+    unsigned char *p;
+
+    if ( !block || block->size - block->used < len ) {
+        size_t size = len > HOOVER_ARENA_BLOCK_SIZE ? len : HOOVER_ARENA_BLOCK_SIZE;
+        if ( !(block = malloc(sizeof(*block) + size)) )
             return NULL;
+        block->used = 0;
+        block->size = size;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+    p = (unsigned char *)block->data + block->used;
+    block->used += len;
+    return p;
+}
+
+/*
+ * Find a string among those that the arena has already stored once, or store
+ * it.  Returns its index in arena->interned, or -1 if memory ran out or the
+ * arena already holds HOOVER_ARENA_INTERNED of them.
+ */
+static int arena_intern( struct hoover_header_arena *arena, const char *s ) {
+    size_t len = strlen(s) + 1;
+    char *copy;
+    int i;
+
+    for ( i = 0; i < arena->num_interned; i++ )
+        if ( strcmp(arena->interned[i], s) == 0 )
+            return i;
+    if ( arena->num_interned == HOOVER_ARENA_INTERNED ) {
+        fprintf( stderr, "hoover_header_arena_add: more than %d distinct ids, compressions, types, and hashes\n",
+                 HOOVER_ARENA_INTERNED );
+        return -1;
+    }
+    if ( !(copy = (char *)arena_alloc(arena, len)) )
+        return -1;
+    memcpy( copy, s, len );
+    arena->interned[arena->num_interned] = copy;
+    return arena->num_interned++;
+}
+
+/*
+ * Keep a copy of a header in the arena.  The header itself is not needed once
+ * this returns.  Returns 0 on success, nonzero if memory ran out, a digest is
+ * not hex, or the header has one distinct string too many.
+ */
+int hoover_header_arena_add( struct hoover_header_arena *arena, const struct hoover_header *header ) {
+    struct hoover_header_entry *entry;
+    struct hoover_header_ref ref;
+    unsigned char *data;
+    size_t filename_len = strlen(header->filename) + 1;
+    int node_id, task_id, compression, type, hash_algo;
+
+    if ( arena->count == arena->capacity ) {
+        int capacity = arena->capacity ? 2 * arena->capacity : 1024;
+        struct hoover_header_entry *entries = realloc( arena->entries, capacity * sizeof(*entries) );
+        if ( !entries )
+            return -1;
+        arena->entries = entries;
+        arena->capacity = capacity;
+    }
+
+    if ( hoover_header_view(header, &ref) != 0
+    ||   (node_id = arena_intern(arena, header->node_id)) < 0
+    ||   (task_id = arena_intern(arena, header->task_id)) < 0
+    ||   (compression = arena_intern(arena, header->compression)) < 0
+    ||   (type = arena_intern(arena, header->type)) < 0
+    ||   (hash_algo = arena_intern(arena, header->hash_algo)) < 0
+    ||   !(data = arena_alloc(arena, ref.sha_hash_len + ref.hash_orig_len + filename_len)) )
+        return -1;
+
+    memcpy( data, ref.sha_hash, ref.sha_hash_len );
+    memcpy( data + ref.sha_hash_len, ref.hash_orig, ref.hash_orig_len );
+    memcpy( data + ref.sha_hash_len + ref.hash_orig_len, header->filename, filename_len );
+
+    entry = &(arena->entries[arena->count]);
+    entry->data = data;
+    entry->size = header->size;
+    entry->node_id = node_id;
+    entry->task_id = task_id;
+    entry->compression = compression;
+    entry->type = type;
+    entry->hash_algo = hash_algo;
+    entry->sha_hash_len = ref.sha_hash_len;
+    entry->hash_orig_len = ref.hash_orig_len;
+
+    arena->count++;
+    return 0;
+}
+
+/*
+ * Expand the i'th header of the arena into a hoover_header_ref.  Its strings
+ * stay in the arena, so the view is good for as long as the arena is.
+ */
+void hoover_header_arena_get( const struct hoover_header_arena *arena, int i, struct hoover_header_ref *ref ) {
+    const struct hoover_header_entry *entry = &(arena->entries[i]);
+
+    ref->filename = (const char *)entry->data + entry->sha_hash_len + entry->hash_orig_len;
+    ref->node_id = arena->interned[entry->node_id];
+    ref->task_id = arena->interned[entry->task_id];
+    ref->compression = arena->interned[entry->compression];
+    ref->type = arena->interned[entry->type];
+    ref->hash_algo = arena->interned[entry->hash_algo];
+    ref->size = entry->size;
+    ref->sha_hash_len = entry->sha_hash_len;
+    ref->hash_orig_len = entry->hash_orig_len;
+    memcpy( ref->sha_hash, entry->data, entry->sha_hash_len );
+    memcpy( ref->hash_orig, entry->data + entry->sha_hash_len, entry->hash_orig_len );
+}
+
+/*
+ * Find the value of key in a flat JSON object and copy it into value as a
+ * string.  Escapes are undone and \\u escapes are written out as UTF-8.  The
+ * surrogates \\udc80 to \\udcff stand for the raw bytes 0x80 to 0xff (see
+ * strbuf_json_string()); other surrogates become '?'.  Returns 0 if the key
+ * was found and its value fit.
+ */
+static int json_field( const char *buf, size_t len, const char *key, char *value, size_t value_len ) {
+    const char *p = buf, *end = buf + len;
+    size_t key_len = strlen(key), n = 0;
+
+    /* keys are only ever found right after '{' or ',' */
+    while ( p < end ) {
+        while ( p < end && *p != '{' && *p != ',' ) {
+            if ( *p == '"' ) /* skip over string values */
+                for ( p++; p < end && *p != '"'; p++ )
+                    if ( *p == '\\' ) p++;
+            p++;
         }
-        else {
-            /* there is redundant state being tracked here, but this is easy */
-            p += bytes_written;
-            bytes_left -= bytes_written;
-        }
-    } while ( bytes_left != 0 );
+        for ( p++; p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'); p++ );
+        if ( p + key_len + 2 <= end && *p == '"' && strncmp(p + 1, key, key_len) == 0 && p[key_len + 1] == '"' )
+            break;
+    }
+    if ( p >= end )
+        return -1;
 
-    /* Create the HDO from the file we just populated */
-    if (fseek(fp, 0, SEEK_SET) != 0) {
-        perror("manifest_to_hoover: unable to rewind manifest file");
-        return NULL;
+    for ( p += key_len + 2; p < end && (*p == ' ' || *p == ':'); p++ );
+    if ( p < end && *p == '"' ) {
+        for ( p++; p < end && *p != '"'; p++ ) {
+            char c = *p;
+            if ( c == '\\' && p + 1 < end ) {
+                c = *(++p);
+                if ( c == 'n' ) c = '\n';
+                else if ( c == 't' ) c = '\t';
+                else if ( c == 'r' ) c = '\r';
+                else if ( c == 'b' ) c = '\b';
+                else if ( c == 'f' ) c = '\f';
+                else if ( c == 'u' && p + 4 < end ) {
+                    char hex[5] = { p[1], p[2], p[3], p[4], '\0' };
+                    unsigned long code = strtoul( hex, NULL, 16 );
+                    p += 4;
+                    /* flagged above the BMP so it is copied as one raw byte */
+                    if ( code >= 0xdc80 && code <= 0xdcff )
+                        code = 0x10000 | (code & 0xff);
+                    else if ( code >= 0xd800 && code <= 0xdfff )
+                        code = '?';
+                    if ( code >= 0x80 && code < 0x10000 ) {
+                        /* write all but the last byte of the UTF-8 encoding */
+                        if ( n + (code < 0x800 ? 2 : 3) >= value_len )
+                            return -1;
+                        if ( code < 0x800 )
+                            value[n++] = (char)(0xc0 | (code >> 6));
+                        else {
+                            value[n++] = (char)(0xe0 | (code >> 12));
+                            value[n++] = (char)(0x80 | ((code >> 6) & 0x3f));
+                        }
+                        code = 0x80 | (code & 0x3f);
+                    }
+                    c = (char)code;
+                }
+            }
+            if ( n + 1 >= value_len )
+                return -1;
+            value[n++] = c;
+        }
     }
-    struct hoover_data_obj *hdo = hoover_create_hdo( fp, HOOVER_BLK_SIZE );
+    else {
+        for ( ; p < end && *p != ',' && *p != '}' && *p != ' '; p++ ) {
+            if ( n + 1 >= value_len )
+                return -1;
+            value[n++] = *p;
+        }
+    }
+    value[n] = '\0';
+    return 0;
+}
+
+/*
+ * Rebuild a header from its serialized form, e.g., the header of a bundle
+ * member.  The payload hash may be called either sha1sum or sha_hash, so
+ * headers saved by the Python consumer are understood too.  Fields that are
+ * missing are left empty.
+ *
+ * Returns 0 on success, nonzero if buf is not a serialized header.
+ */
+int deserialize_header( const char *buf, size_t len, struct hoover_header *header ) {
+    char size[32] = "";
 
-    /* This close automatically unlinks the file due to tmpfile */
-    fclose(fp);
+    memset( header, 0, sizeof(*header) );
+    if ( len == 0 || buf[0] != '{' )
+        return 1;
 
-    return hdo;
+    json_field( buf, len, "filename", header->filename, sizeof(header->filename) );
+    json_field( buf, len, "node_id", header->node_id, sizeof(header->node_id) );
+    json_field( buf, len, "task_id", header->task_id, sizeof(header->task_id) );
+    json_field( buf, len, "compression", header->compression, sizeof(header->compression) );
+    json_field( buf, len, "type", header->type, sizeof(header->type) );
+    if ( json_field(buf, len, "sha1sum", (char *)header->sha_hash, sizeof(header->sha_hash)) != 0 )
+        json_field( buf, len, "sha_hash", (char *)header->sha_hash, sizeof(header->sha_hash) );
+    json_field( buf, len, "hash_orig", header->hash_orig, sizeof(header->hash_orig) );
+    json_field( buf, len, "hash_algo", header->hash_algo, sizeof(header->hash_algo) );
+    if ( json_field(buf, len, "size", size, sizeof(size)) == 0 )
+        header->size = strtoull( size, NULL, 10 );
+    return 0;
+}
+
+/*
+ *  Convert a serialized manifest to an HDO so it can be sent over the wire.
+ *
+ *  Note that manifest_size should not include the terminal NULL character, as
+ *  we do not want that that appearing in the HDO payload.
+ */
+struct hoover_data_obj *manifest_to_hdo( char *manifest, size_t manifest_size ) {
+    return hoover_create_hdo_from_buffer( manifest, manifest_size, HOOVER_BLOCK_AUTO );
 }
@@ -4,6 +4,8 @@
     #define __USE_POSIX
 #endif
 #include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 #ifdef __APPLE__
     #include <sys/syslimits.h>
@@ -12,12 +14,42 @@
     #include <linux/limits.h>
 #endif
 
-#include <openssl/sha.h>
-
 #ifndef HOOVER_BLK_SIZE
     #define HOOVER_BLK_SIZE 128 * 1024
 #endif
 
+/* block_size that has hooverio pick one for each input from its filesystem,
+ * its size and the codec; see hoover_pick_block_size().  Picked and explicit
+ * sizes alike must fall within HOOVER_BLK_SIZE_MIN and HOOVER_BLK_SIZE_MAX. */
+#define HOOVER_BLOCK_AUTO 0
+#ifndef HOOVER_BLK_SIZE_MIN
+    #define HOOVER_BLK_SIZE_MIN (4 * 1024)
+#endif
+#ifndef HOOVER_BLK_SIZE_MAX
+    #define HOOVER_BLK_SIZE_MAX (4 * 1024 * 1024)
+#endif
+
+/* codec used when neither the tube config nor the command line picks one;
+ * may include a level, e.g., "zst:3" */
+#ifndef HOOVER_COMPRESSION
+    #define HOOVER_COMPRESSION "gz"
+#endif
+
+/* skip compressing data that would not shrink by at least
+ * HOOVER_ADAPTIVE_MIN_GAIN percent; see hoover_set_adaptive() */
+#ifndef HOOVER_ADAPTIVE
+    #define HOOVER_ADAPTIVE 1
+#endif
+#ifndef HOOVER_ADAPTIVE_MIN_GAIN
+    #define HOOVER_ADAPTIVE_MIN_GAIN 5
+#endif
+
+/* integrity hash used when neither the tube config nor the command line picks
+ * one */
+#ifndef HOOVER_HASH
+    #define HOOVER_HASH "sha1"
+#endif
+
 #ifndef HOOVER_JOB_ID_VAR
     #define HOOVER_JOB_ID_VAR "SLURM_JOB_ID"
 #endif
@@ -25,23 +57,38 @@
     #define HOOVER_TASK_ID_VAR "SLURM_STEP_ID"
 #endif
 
-#define SHA_DIGEST_LENGTH_HEX (SHA_DIGEST_LENGTH * 2 + 1)
+#define HASH_DIGEST_MAX_LENGTH 32 /* largest digest of any supported hash */
+#define HASH_DIGEST_LENGTH_HEX (HASH_DIGEST_MAX_LENGTH * 2 + 1)
+#define HASH_ALGO_FIELD_LEN 16
 #define COMPRESS_FIELD_LEN 8
 #define TASK_ID_LEN 64
 #define HDO_TYPE_FIELD_LEN 64
 
+#ifndef HOOVER_TRANSFER_ID_LEN
+    #define HOOVER_TRANSFER_ID_LEN (HOST_NAME_MAX + 64)
+#endif
+
+struct hoover_hdo_stream; /* private to hooverio.c */
+struct hoover_hdo_relay;  /* private to hooverio.c */
+
 /*
  * hoover_data_obj describes a file that has been loaded into memory through
  *   hoover_create_hdo().  If this were C++, it would be derived from
  *   amqp_bytes_t
+ *
+ * HDOs created by hoover_open_hdo() are streaming: data is NULL and the
+ *   payload must instead be pulled chunk by chunk with hoover_read_hdo_chunk().
+ *   size, size_orig, and the hashes are only valid after the end of the stream.
  */
 struct hoover_data_obj {
     void *data;                            /* data payload of HDO */
     size_t size;                           /* size of *data */
     size_t size_orig;                      /* size of original data */
-    char hash[SHA_DIGEST_LENGTH_HEX];      /* checksum of the 'data' field */
-    char hash_orig[SHA_DIGEST_LENGTH_HEX]; /* checksum of original data */
+    char hash[HASH_DIGEST_LENGTH_HEX];      /* checksum of the 'data' field; "" if not computed */
+    char hash_orig[HASH_DIGEST_LENGTH_HEX]; /* checksum of original data */
+    char hash_algo[HASH_ALGO_FIELD_LEN];    /* algorithm of both checksums (e.g., "sha1") */
     char compression[COMPRESS_FIELD_LEN];  /* compression applied to 'data' field (e.g., "gz") */
+    struct hoover_hdo_stream *stream;      /* non-NULL if payload is streamed rather than in 'data' */
 };
 
 /* when adding new header entries, you must also modify create_amqp_header_table
@@ -53,22 +100,152 @@ struct hoover_header {
     char task_id[TASK_ID_LEN];             /* uniquely describes all HDOs associated with the output of a single parallel task */
     char compression[COMPRESS_FIELD_LEN];  /* compression algorithm applied to HDO data payload (e.g., "gz") */
     char type[HDO_TYPE_FIELD_LEN];         /* arb. string describing type; can be used downstream */
-    unsigned char sha_hash[SHA_DIGEST_LENGTH_HEX]; /* checksum of the HDO's data */
+    unsigned char sha_hash[HASH_DIGEST_LENGTH_HEX]; /* checksum of the HDO's data; "" if not computed */
+    char hash_orig[HASH_DIGEST_LENGTH_HEX]; /* checksum of the original data */
+    char hash_algo[HASH_ALGO_FIELD_LEN];    /* algorithm of both checksums (e.g., "sha1") */
     size_t size;                           /* size of *data */
 };
 
+/* hoover_header_ref is a read-only view of a header.  It does not own its
+ * strings: they live in a hoover_header_arena, or in the hoover_header that
+ * hoover_header_view() was given.  Its digests are kept in binary.
+ */
+struct hoover_header_ref {
+    const char *filename;
+    const char *node_id;
+    const char *task_id;
+    const char *compression;
+    const char *type;
+    const char *hash_algo;
+    size_t size;
+    uint8_t sha_hash_len;                          /* bytes of sha_hash; 0 if not computed */
+    uint8_t hash_orig_len;                         /* bytes of hash_orig */
+    unsigned char sha_hash[HASH_DIGEST_MAX_LENGTH];
+    unsigned char hash_orig[HASH_DIGEST_MAX_LENGTH];
+};
+
+/* hoover_header_arena keeps many headers, e.g., for a manifest, in far less
+ * memory than hoover_headers take.  Each header's binary digests and filename
+ * are packed back to back into large blocks, and the handful of distinct
+ * node_id, task_id, compression, type, and hash_algo values are stored once
+ * and referred to by their index in interned.  hoover_header_arena_get()
+ * expands a header back into a hoover_header_ref.
+ */
+#define HOOVER_ARENA_INTERNED 256
+
+struct hoover_header_entry {
+    const unsigned char *data;             /* sha_hash, hash_orig, then the filename and its '\0' */
+    uint64_t size;
+    uint8_t node_id;                       /* indices into the arena's interned */
+    uint8_t task_id;
+    uint8_t compression;
+    uint8_t type;
+    uint8_t hash_algo;
+    uint8_t sha_hash_len;                  /* bytes of sha_hash; 0 if not computed */
+    uint8_t hash_orig_len;                 /* bytes of hash_orig */
+};
+
+struct hoover_arena_block; /* private to hooverio.c */
+
+struct hoover_header_arena {
+    struct hoover_header_entry *entries;   /* one per header added, in order */
+    int count;
+    int capacity;
+    struct hoover_arena_block *blocks;     /* digest and string storage, newest first */
+    const char *interned[HOOVER_ARENA_INTERNED];
+    int num_interned;
+};
+
+/* hoover_chunk_info describes one piece of an HDO that was too big to send as
+ * a single message.  It travels in the message headers alongside the fields
+ * of the hoover_header.
+ */
+struct hoover_chunk_info {
+    char transfer_id[HOOVER_TRANSFER_ID_LEN]; /* same for all chunks of one HDO */
+    int64_t index;                            /* position of this chunk, from 0 */
+    int64_t count;                            /* total chunks, or 0 if not yet known */
+    char sha_hash[HASH_DIGEST_LENGTH_HEX];    /* checksum of this chunk's body */
+};
+
+/* hoover_source says where the input of an HDO comes from.  Only the fields
+ * that belong to its type are used.
+ */
+enum hoover_source_type {
+    HOOVER_SOURCE_FILE,                    /* read from fp with stdio */
+    HOOVER_SOURCE_FD,                      /* map or read() from fd */
+    HOOVER_SOURCE_BUFFER,                  /* use len bytes at buf in place */
+    HOOVER_SOURCE_READER                   /* call read(arg, buf, len) until it returns 0 */
+};
+
+struct hoover_source {
+    enum hoover_source_type type;
+    FILE *fp;
+    int fd;
+    const void *buf;
+    size_t len;
+    ssize_t (*read)( void *arg, void *buf, size_t len ); /* returns bytes read, 0 at the end, or -1 */
+    void *arg;
+};
+
+/* receives each piece of data produced by hoover_decode_hdo_data() */
+typedef int (*hoover_write_fn)( const void *data, size_t len, void *arg );
+
+struct hoover_hdo_decoder; /* private to hooverio.c */
+
 /*
  * function prototypes
  */
 struct hoover_data_obj *hoover_create_hdo( FILE *fp, size_t block_size );
+struct hoover_data_obj *hoover_open_hdo( FILE *fp, size_t block_size );
+struct hoover_data_obj *hoover_create_hdo_fd( int fd, size_t block_size );
+struct hoover_data_obj *hoover_open_hdo_fd( int fd, size_t block_size );
+struct hoover_data_obj *hoover_create_hdo_from_buffer( const void *buf, size_t len, size_t block_size );
+struct hoover_data_obj *hoover_open_hdo_from_buffer( const void *buf, size_t len, size_t block_size );
+struct hoover_data_obj *hoover_create_hdo_source( const struct hoover_source *source, size_t block_size );
+struct hoover_data_obj *hoover_open_hdo_source( const struct hoover_source *source, size_t block_size );
+int hoover_read_hdo_chunk( struct hoover_data_obj *hdo, const void **chunk, size_t *len );
+struct hoover_data_obj *hoover_open_hdo_relay( struct hoover_data_obj *src, int depth,
+                                               struct hoover_hdo_relay **relay );
+int hoover_pump_hdo_relay( struct hoover_hdo_relay *relay );
+void hoover_set_compress_threads( int num_threads );
+int hoover_set_codec( const char *spec );
+int hoover_set_hash( const char *name );
+const char *hoover_get_hash( void );
+void hoover_set_hash_compressed( int enable );
+void hoover_set_adaptive( int enable );
+int hoover_set_block_size( size_t block_size );
+size_t hoover_pick_block_size( int fd, size_t size );
+int hoover_calibrate_block_sizes( char * const *paths, int num_paths );
+int hoover_load_block_sizes( const char *path );
+int hoover_save_block_sizes( const char *path );
+int hoover_hash_data( const char *name, const void *data, size_t len, char *hash_hex );
+void hoover_digest_to_hex( const unsigned char *digest, size_t digest_len, char *hash_hex );
+int hoover_digest_from_hex( const char *hash_hex, unsigned char *digest );
 size_t hoover_write_hdo( FILE *fp, struct hoover_data_obj *hdo, size_t block_size );
+int hoover_pwrite_all( int fd, const void *buf, size_t len, off_t offset );
+int hoover_lock_file( int fd );
+uint64_t hoover_hash_path( const char *path );
+struct hoover_hdo_decoder *hoover_open_hdo_decoder( const char *compression, const char *hash_algo, int decode );
+int hoover_decode_hdo_data( struct hoover_hdo_decoder *decoder, const void *data, size_t len,
+                            hoover_write_fn write, void *arg );
+int hoover_close_hdo_decoder( struct hoover_hdo_decoder *decoder, char *hash, char *hash_orig );
 void free_hdo( struct hoover_data_obj *hdo );
 
 struct hoover_header *build_hoover_header( char *filename, struct hoover_data_obj *hdo, char *filetype );
+void update_hoover_header( struct hoover_header *header, struct hoover_data_obj *hdo );
 void free_hoover_header( struct hoover_header *header );
 char *serialize_header(struct hoover_header *header);
+char *serialize_header_ref( const struct hoover_header_ref *header );
+int deserialize_header( const char *buf, size_t len, struct hoover_header *header );
+int hoover_header_view( const struct hoover_header *header, struct hoover_header_ref *ref );
+
+struct hoover_header_arena *create_hoover_header_arena( void );
+void free_hoover_header_arena( struct hoover_header_arena *arena );
+int hoover_header_arena_add( struct hoover_header_arena *arena, const struct hoover_header *header );
+void hoover_header_arena_get( const struct hoover_header_arena *arena, int i, struct hoover_header_ref *ref );
 
-char *build_manifest( struct hoover_header **hoover_headers, int num_headers );
+char *build_manifest( const struct hoover_header_arena *headers );
+struct hoover_data_obj *hoover_create_manifest_hdo( const struct hoover_header_arena *headers );
 struct hoover_data_obj *manifest_to_hdo( char *manifest, size_t manifest_size );
 
 int get_hoover_node_id( char *name, size_t len );
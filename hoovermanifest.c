@@ -0,0 +1,263 @@
+/*******************************************************************************
+ *  hoovermanifest.c
+ *
+ *  Compact binary manifest with a string table and sorted indices
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hoovermanifest.h"
+#include "hooverstats.h"
+
+/* the string fields of each header, in record order */
+#define MANIFEST_NUM_STRINGS 6
+
+/*
+ * string_table stores each distinct string once.  slots is an open-addressed
+ *   hash table of offsets into data, plus one so that zero means empty.
+ */
+struct string_table {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    uint32_t *slots;
+    size_t num_slots;          /* always a power of two */
+    size_t count;              /* strings in the table */
+};
+
+/* record number with the key it is sorted by */
+struct sort_key {
+    const unsigned char *key;
+    size_t len;
+    uint32_t record;
+};
+
+/*******************************************************************************
+ * Private functions
+ ******************************************************************************/
+
+static void put_be( unsigned char *p, uint64_t value, int width ) {
+    int i;
+    for ( i = width - 1; i >= 0; i-- ) {
+        p[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+/* FNV-1a */
+static uint32_t hash_string( const unsigned char *s, size_t len ) {
+    uint32_t h = 2166136261u;
+    size_t i;
+    for ( i = 0; i < len; i++ ) {
+        h ^= s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ *  Double the number of slots and put every string back in
+ */
+static int grow_slots( struct string_table *table ) {
+    size_t num_slots = table->num_slots ? table->num_slots * 2 : 1024,
+           i, j;
+    uint32_t *slots;
+
+    if ( !(slots = calloc(num_slots, sizeof(*slots))) )
+        return -1;
+    for ( i = 0; i < table->num_slots; i++ ) {
+        const unsigned char *s;
+        if ( table->slots[i] == 0 )
+            continue;
+        s = table->data + table->slots[i] - 1;
+        j = hash_string( s, strlen((const char *)s) ) & (num_slots - 1);
+        while ( slots[j] != 0 )
+            j = (j + 1) & (num_slots - 1);
+        slots[j] = table->slots[i];
+    }
+    free( table->slots );
+    table->slots = slots;
+    table->num_slots = num_slots;
+    return 0;
+}
+
+/**
+ *  Add a string to the table if it is not there yet.  Returns its offset, or
+ *  -1 if memory ran out or the table would outgrow 32-bit offsets.
+ */
+static int64_t intern( struct string_table *table, const char *s ) {
+    size_t len = strlen(s), i;
+
+    if ( (table->count + 1) * 2 > table->num_slots && grow_slots(table) != 0 )
+        return -1;
+
+    i = hash_string( (const unsigned char *)s, len ) & (table->num_slots - 1);
+    while ( table->slots[i] != 0 ) {
+        if ( strcmp((const char *)table->data + table->slots[i] - 1, s) == 0 )
+            return table->slots[i] - 1;
+        i = (i + 1) & (table->num_slots - 1);
+    }
+
+    if ( table->size + len + 1 >= UINT32_MAX )
+        return -1;
+    if ( table->size + len + 1 > table->capacity ) {
+        size_t capacity = table->capacity ? table->capacity : 64 * 1024;
+        unsigned char *data;
+        while ( capacity < table->size + len + 1 )
+            capacity *= 2;
+        if ( !(data = realloc(table->data, capacity)) )
+            return -1;
+        table->data = data;
+        table->capacity = capacity;
+    }
+    memcpy( table->data + table->size, s, len + 1 );
+    table->slots[i] = table->size + 1;
+    table->count++;
+    table->size += len + 1;
+    return table->size - len - 1;
+}
+
+/* a hash_orig that equals the sha_hash is only indexed once */
+static int same_digests( const struct hoover_header_ref *h ) {
+    return h->sha_hash_len == h->hash_orig_len && memcmp(h->sha_hash, h->hash_orig, h->sha_hash_len) == 0;
+}
+
+/* byte order, with a key that is a prefix of another sorting first */
+static int compare_keys( const void *a, const void *b ) {
+    const struct sort_key *x = a, *y = b;
+    int ret = memcmp( x->key, y->key, x->len < y->len ? x->len : y->len );
+    if ( ret != 0 )
+        return ret;
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+/**
+ *  Write the record numbers of keys, sorted by key, starting at out
+ */
+static void write_index( unsigned char *out, struct sort_key *keys, int num_keys ) {
+    int i;
+    qsort( keys, num_keys, sizeof(*keys), compare_keys );
+    for ( i = 0; i < num_keys; i++ )
+        put_be( out + 4 * (size_t)i, keys[i].record, 4 );
+}
+
+/*******************************************************************************
+ * Global functions
+ ******************************************************************************/
+/**
+ *  Build a binary manifest of the given headers; see hoovermanifest.h for the
+ *  layout.  Returns a malloc'ed buffer and sets *len to its size, or returns
+ *  NULL if memory ran out or a header holds something that cannot be stored.
+ */
+unsigned char *build_binary_manifest( const struct hoover_header_arena *headers, size_t *len ) {
+    struct hoover_header_ref h;
+    struct string_table table;
+    struct sort_key *keys = NULL;
+    uint32_t *offsets = NULL;
+    unsigned char *out = NULL, *rec;
+    size_t records_offset, hash_index_offset, name_index_offset, strings_offset, total;
+    size_t num_keys = 0;
+    uint64_t t0 = hoover_stats_start();
+    int num_headers = headers->count;
+    int i, j, n = 0;
+
+    memset( &table, 0, sizeof(table) );
+
+    /* the string table comes last, so intern every string first */
+    if ( intern(&table, "") != 0
+    ||   !(offsets = malloc(sizeof(*offsets) * MANIFEST_NUM_STRINGS * (num_headers ? num_headers : 1))) )
+        goto fail;
+    for ( i = 0; i < num_headers; i++ ) {
+        const char *fields[MANIFEST_NUM_STRINGS];
+
+        hoover_header_arena_get( headers, i, &h );
+        fields[0] = h.filename;
+        fields[1] = h.node_id;
+        fields[2] = h.task_id;
+        fields[3] = h.compression;
+        fields[4] = h.type;
+        fields[5] = h.hash_algo;
+        for ( j = 0; j < MANIFEST_NUM_STRINGS; j++ ) {
+            int64_t offset = intern( &table, fields[j] );
+            if ( offset < 0 )
+                goto fail;
+            offsets[MANIFEST_NUM_STRINGS * i + j] = offset;
+        }
+        num_keys += (h.sha_hash_len > 0) + (h.hash_orig_len > 0 && !same_digests(&h));
+    }
+
+    records_offset = HOOVER_MANIFEST_HEADER_SIZE;
+    hash_index_offset = records_offset + (size_t)num_headers * HOOVER_MANIFEST_RECORD_SIZE;
+    name_index_offset = hash_index_offset + num_keys * 4;
+    strings_offset = name_index_offset + (size_t)num_headers * 4;
+    total = strings_offset + table.size;
+    if ( total >= UINT32_MAX ) {
+        fprintf( stderr, "build_binary_manifest: %d headers are too many for one manifest\n", num_headers );
+        goto fail;
+    }
+    if ( !(out = calloc(1, total))
+    ||   !(keys = malloc(sizeof(*keys) * (num_keys > (size_t)num_headers ? num_keys : (size_t)num_headers + 1))) )
+        goto fail;
+
+    memcpy( out, HOOVER_MANIFEST_MAGIC, HOOVER_MANIFEST_MAGIC_LEN );
+    put_be( out + 4, num_headers, 4 );
+    put_be( out + 8, HOOVER_MANIFEST_RECORD_SIZE, 4 );
+    put_be( out + 12, records_offset, 4 );
+    put_be( out + 16, hash_index_offset, 4 );
+    put_be( out + 20, name_index_offset, 4 );
+    put_be( out + 24, strings_offset, 4 );
+    put_be( out + 28, table.size, 4 );
+
+    for ( i = 0; i < num_headers; i++ ) {
+        hoover_header_arena_get( headers, i, &h );
+        rec = out + records_offset + (size_t)i * HOOVER_MANIFEST_RECORD_SIZE;
+        for ( j = 0; j < MANIFEST_NUM_STRINGS; j++ )
+            put_be( rec + 4 * j, offsets[MANIFEST_NUM_STRINGS * i + j], 4 );
+        put_be( rec + 24, h.size, 8 );
+        rec[32] = h.sha_hash_len;
+        rec[33] = h.hash_orig_len;
+        memcpy( rec + 36, h.sha_hash, h.sha_hash_len );
+        memcpy( rec + 36 + HASH_DIGEST_MAX_LENGTH, h.hash_orig, h.hash_orig_len );
+
+        /* sha_hash is empty under -O and for files skipped through the
+         * index, so a file can be found by either digest */
+        if ( h.sha_hash_len > 0 ) {
+            keys[n].key = rec + 36;
+            keys[n].len = h.sha_hash_len;
+            keys[n++].record = i;
+        }
+        if ( h.hash_orig_len > 0 && !same_digests(&h) ) {
+            keys[n].key = rec + 36 + HASH_DIGEST_MAX_LENGTH;
+            keys[n].len = h.hash_orig_len;
+            keys[n++].record = i | HOOVER_MANIFEST_ORIG_KEY;
+        }
+    }
+    write_index( out + hash_index_offset, keys, n );
+
+    for ( i = 0; i < num_headers; i++ ) {
+        hoover_header_arena_get( headers, i, &h );
+        keys[i].key = (const unsigned char *)h.filename;
+        keys[i].len = strlen(h.filename);
+        keys[i].record = i;
+    }
+    write_index( out + name_index_offset, keys, num_headers );
+
+    memcpy( out + strings_offset, table.data, table.size );
+
+    free( keys );
+    free( offsets );
+    free( table.data );
+    free( table.slots );
+    *len = total;
+    hoover_stats_stop( HOOVER_STAGE_MANIFEST, t0 );
+    return out;
+
+fail:
+    free( out );
+    free( keys );
+    free( offsets );
+    free( table.data );
+    free( table.slots );
+    return NULL;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hooverio.h"
+
+/* every binary manifest starts with these four bytes */
+#define HOOVER_MANIFEST_MAGIC "HVM1"
+#define HOOVER_MANIFEST_MAGIC_LEN 4
+
+#define HOOVER_MANIFEST_HEADER_SIZE 32
+#define HOOVER_MANIFEST_RECORD_SIZE (36 + 2 * HASH_DIGEST_MAX_LENGTH)
+
+/* set in a hash index entry whose key is the record's hash_orig */
+#define HOOVER_MANIFEST_ORIG_KEY 0x80000000u
+
+/*
+ * A binary manifest lists the same fields as the JSON one, but stores each
+ *   distinct string once and can be searched without being parsed.  All
+ *   integers are big-endian.  It is laid out as
+ *
+ *     char magic[4]              "HVM1"
+ *     uint32_t num_records
+ *     uint32_t record_size       (bytes per record; readers skip any extra)
+ *     uint32_t records_offset
+ *     uint32_t hash_index_offset
+ *     uint32_t name_index_offset
+ *     uint32_t strings_offset
+ *     uint32_t strings_size
+ *
+ *   followed by num_records fixed-width records, in the order of the headers:
+ *
+ *     uint32_t filename, node_id, task_id, compression, type, hash_algo
+ *                                (offsets into the string table)
+ *     uint64_t size
+ *     uint8_t sha_hash_len, hash_orig_len
+ *     uint16_t reserved
+ *     uint8_t sha_hash[32], hash_orig[32]   (binary digests, zero-padded)
+ *
+ *   The hash index lists every record under its sha_hash and under its
+ *   hash_orig, skipping empty digests and a hash_orig that equals the
+ *   sha_hash.  It holds (name_index_offset - hash_index_offset) / 4 uint32_t
+ *   record numbers, each with HOOVER_MANIFEST_ORIG_KEY set if it stands for
+ *   the record's hash_orig.  The name index holds num_records record numbers.
+ *   The indices are sorted by digest and by filename, comparing bytes as
+ *   unsigned and shorter keys first, so either can be binary searched.
+ *   The string table holds NUL-terminated strings and starts with "".
+ */
+
+unsigned char *build_binary_manifest( const struct hoover_header_arena *headers, size_t *len );
@@ -0,0 +1,660 @@
+/*******************************************************************************
+ *  hoovermem.c
+ *
+ *  Shared-memory ring buffer tube interface to Hoover.
+ ******************************************************************************/
+#if !defined(_XOPEN_SOURCE) || _XOPEN_SOURCE < 700
+    #define _XOPEN_SOURCE 700
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "hooverio.h"
+#include "hoovermem.h"
+#include "hooverstats.h"
+
+/* bytes before each message's header */
+#define RING_RECORD_PREFIX 16
+
+/* the buffer starts this far into the file, past the struct hoover_ring */
+#define RING_DATA_OFFSET ((sizeof(struct hoover_ring) + 63) & ~(size_t)63)
+
+/*******************************************************************************
+ * Private functions
+ ******************************************************************************/
+
+/**
+ *  Space taken in the ring by a message, rounded up to keep records aligned
+ */
+static uint64_t record_size( size_t header_len, size_t chunk_len, size_t body_len ) {
+    return ((uint64_t)RING_RECORD_PREFIX + header_len + chunk_len + body_len + 7) & ~(uint64_t)7;
+}
+
+/**
+ *  Copy len bytes into the ring at position pos, wrapping around its end
+ */
+static void ring_write( struct hoover_tube *tube, uint64_t pos, const void *src, size_t len ) {
+    uint64_t capacity = tube->ring->capacity,
+             offset = pos % capacity;
+    size_t first = len < capacity - offset ? len : capacity - offset;
+    memcpy( tube->data + offset, src, first );
+    memcpy( tube->data, (const char *)src + first, len - first );
+}
+
+/**
+ *  Copy len bytes out of the ring from position pos
+ */
+static void ring_read( struct hoover_tube *tube, uint64_t pos, void *dest, size_t len ) {
+    uint64_t capacity = tube->ring->capacity,
+             offset = pos % capacity;
+    size_t first = len < capacity - offset ? len : capacity - offset;
+    memcpy( dest, tube->data + offset, first );
+    memcpy( (char *)dest + first, tube->data, len - first );
+}
+
+/**
+ *  Take the ring's lock.  If a process died holding it, the ring is still
+ *  consistent, since head and tail only move once a message is fully copied.
+ */
+static int lock_ring( struct hoover_ring *ring ) {
+    int ret = pthread_mutex_lock( &(ring->lock) );
+    if ( ret == EOWNERDEAD ) {
+        fprintf( stderr, "lock_ring: a process died while holding the ring; recovering\n" );
+        ret = pthread_mutex_consistent( &(ring->lock) );
+    }
+    return ret;
+}
+
+/**
+ *  Lay out a new ring in a file that has just been sized for it
+ */
+static int init_ring( struct hoover_ring *ring, uint64_t capacity ) {
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+
+    memset( ring, 0, sizeof(*ring) );
+    ring->capacity = capacity;
+
+    if ( pthread_mutexattr_init(&mattr) != 0 )
+        return -1;
+    pthread_mutexattr_setpshared( &mattr, PTHREAD_PROCESS_SHARED );
+    pthread_mutexattr_setrobust( &mattr, PTHREAD_MUTEX_ROBUST );
+    if ( pthread_mutex_init(&(ring->lock), &mattr) != 0 ) {
+        pthread_mutexattr_destroy( &mattr );
+        return -1;
+    }
+    pthread_mutexattr_destroy( &mattr );
+
+    if ( pthread_condattr_init(&cattr) != 0 )
+        return -1;
+    pthread_condattr_setpshared( &cattr, PTHREAD_PROCESS_SHARED );
+    if ( pthread_cond_init(&(ring->not_empty), &cattr) != 0
+    ||   pthread_cond_init(&(ring->not_full), &cattr) != 0 ) {
+        pthread_condattr_destroy( &cattr );
+        return -1;
+    }
+    pthread_condattr_destroy( &cattr );
+
+    /* a ring is only used once it has its magic */
+    memcpy( ring->magic, HOOVER_RING_MAGIC, HOOVER_RING_MAGIC_LEN );
+    return 0;
+}
+
+/**
+ *  Map the ring in a file, creating it first if the file is new.  A lock on
+ *  the file keeps two processes from creating the same ring at once.
+ */
+static int attach_ring( struct hoover_tube *tube, const char *path, size_t ring_size ) {
+    struct flock fl;
+    struct stat st;
+    void *map = MAP_FAILED;
+    int fd, created = 0;
+
+    if ( (fd = open(path, O_RDWR | O_CREAT, 0600)) < 0 ) {
+        fprintf( stderr, "create_hoover_tube: cannot open %s: %s\n", path, strerror(errno) );
+        return -1;
+    }
+    memset( &fl, 0, sizeof(fl) );
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    if ( fcntl(fd, F_SETLKW, &fl) != 0 || fstat(fd, &st) != 0 ) {
+        fprintf( stderr, "create_hoover_tube: cannot lock %s: %s\n", path, strerror(errno) );
+        close( fd );
+        return -1;
+    }
+
+    if ( st.st_size == 0 ) {
+        if ( ring_size == 0 || ftruncate(fd, RING_DATA_OFFSET + ring_size) != 0 ) {
+            fprintf( stderr, "create_hoover_tube: cannot make a %zu-byte ring in %s\n", ring_size, path );
+            goto fail;
+        }
+        st.st_size = RING_DATA_OFFSET + ring_size;
+        created = 1;
+    }
+    else if ( (size_t)st.st_size <= RING_DATA_OFFSET ) {
+        fprintf( stderr, "create_hoover_tube: %s is not a ring\n", path );
+        goto fail;
+    }
+
+    map = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if ( map == MAP_FAILED ) {
+        fprintf( stderr, "create_hoover_tube: cannot map %s: %s\n", path, strerror(errno) );
+        goto fail;
+    }
+    tube->ring = map;
+    tube->data = (unsigned char *)map + RING_DATA_OFFSET;
+    tube->map_size = st.st_size;
+
+    if ( created ) {
+        if ( init_ring(tube->ring, ring_size) != 0 ) {
+            fprintf( stderr, "create_hoover_tube: cannot set up the ring in %s\n", path );
+            goto fail;
+        }
+    }
+    else if ( memcmp(tube->ring->magic, HOOVER_RING_MAGIC, HOOVER_RING_MAGIC_LEN) != 0
+         ||   tube->ring->capacity != (uint64_t)st.st_size - RING_DATA_OFFSET ) {
+        fprintf( stderr, "create_hoover_tube: %s is not a ring\n", path );
+        goto fail;
+    }
+
+    fl.l_type = F_UNLCK;
+    fcntl( fd, F_SETLK, &fl );
+    close( fd );
+    return 0;
+
+fail:
+    if ( map != MAP_FAILED )
+        munmap( map, st.st_size );
+    if ( created )
+        ftruncate( fd, 0 );
+    tube->ring = NULL;
+    close( fd );
+    return -1;
+}
+
+/**
+ *  Append one message to the ring.  chunk is NULL unless the message is one
+ *  piece of a split HDO.  If the ring is full, waits for room if wait is set.
+ *  Returns 0 on success, 1 if the ring is full and wait is not set, or -1 if
+ *  the message could never fit.
+ */
+static int ring_push( struct hoover_tube *tube, const char *header, const struct hoover_chunk_info *chunk,
+                      const void *body, size_t body_len, int wait ) {
+    struct hoover_ring *ring = tube->ring;
+    size_t header_len = strlen(header),
+           chunk_len = chunk ? sizeof(*chunk) : 0;
+    uint64_t need = record_size( header_len, chunk_len, body_len );
+    uint32_t prefix32[2];
+    uint64_t prefix64;
+
+    if ( header_len > UINT32_MAX || need > ring->capacity ) {
+        fprintf( stderr, "hoover_send_message: %zu-byte message does not fit in a %llu-byte ring\n",
+            body_len, (unsigned long long)ring->capacity );
+        return -1;
+    }
+    prefix32[0] = header_len;
+    prefix32[1] = chunk_len;
+    prefix64 = body_len;
+
+    if ( lock_ring(ring) != 0 )
+        return -1;
+    while ( ring->capacity - (ring->head - ring->tail) < need ) {
+        if ( !wait ) {
+            pthread_mutex_unlock( &(ring->lock) );
+            return 1;
+        }
+        pthread_cond_wait( &(ring->not_full), &(ring->lock) );
+    }
+
+    ring_write( tube, ring->head, prefix32, sizeof(prefix32) );
+    ring_write( tube, ring->head + sizeof(prefix32), &prefix64, sizeof(prefix64) );
+    ring_write( tube, ring->head + RING_RECORD_PREFIX, header, header_len );
+    if ( chunk )
+        ring_write( tube, ring->head + RING_RECORD_PREFIX + header_len, chunk, chunk_len );
+    ring_write( tube, ring->head + RING_RECORD_PREFIX + header_len + chunk_len, body, body_len );
+    ring->head += need;
+    ring->messages++;
+
+    pthread_cond_signal( &(ring->not_empty) );
+    pthread_mutex_unlock( &(ring->lock) );
+    return 0;
+}
+
+/**
+ *  Take the oldest message out of the ring, waiting up to timeout_ms for one.
+ *  Returns 1 if a message was taken, 0 on timeout, or -1 on error.
+ */
+static int ring_pop( struct hoover_tube *tube, struct hoover_message *msg, int timeout_ms ) {
+    struct hoover_ring *ring = tube->ring;
+    struct timespec deadline;
+    uint32_t prefix32[2];
+    uint64_t prefix64;
+    char *header;
+
+    clock_gettime( CLOCK_REALTIME, &deadline );
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if ( deadline.tv_nsec >= 1000000000 ) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    if ( lock_ring(ring) != 0 )
+        return -1;
+    while ( ring->messages == 0 ) {
+        if ( timeout_ms <= 0
+        ||   pthread_cond_timedwait(&(ring->not_empty), &(ring->lock), &deadline) == ETIMEDOUT ) {
+            if ( ring->messages > 0 )
+                break;
+            pthread_mutex_unlock( &(ring->lock) );
+            return 0;
+        }
+    }
+
+    ring_read( tube, ring->tail, prefix32, sizeof(prefix32) );
+    ring_read( tube, ring->tail + sizeof(prefix32), &prefix64, sizeof(prefix64) );
+    header = malloc( prefix32[0] + 1 );
+    msg->body = malloc( prefix64 ? prefix64 : 1 );
+    if ( !header || !msg->body ) {
+        fprintf( stderr, "hoover_receive_message: could not allocate a %llu-byte message\n",
+            (unsigned long long)prefix64 );
+        pthread_mutex_unlock( &(ring->lock) );
+        free( header );
+        free( msg->body );
+        msg->body = NULL;
+        return -1;
+    }
+    ring_read( tube, ring->tail + RING_RECORD_PREFIX, header, prefix32[0] );
+    if ( prefix32[1] == sizeof(msg->chunk) ) {
+        ring_read( tube, ring->tail + RING_RECORD_PREFIX + prefix32[0], &(msg->chunk), prefix32[1] );
+        msg->has_chunk = 1;
+    }
+    ring_read( tube, ring->tail + RING_RECORD_PREFIX + prefix32[0] + prefix32[1], msg->body, prefix64 );
+    header[prefix32[0]] = '\0';
+    msg->size = prefix64;
+    ring->tail += record_size( prefix32[0], prefix32[1], prefix64 );
+    ring->messages--;
+
+    /* senders may each be waiting for a different amount of room */
+    pthread_cond_broadcast( &(ring->not_full) );
+    pthread_mutex_unlock( &(ring->lock) );
+
+    if ( deserialize_header(header, prefix32[0], &(msg->header)) != 0 )
+        fprintf( stderr, "hoover_receive_message: message has a malformed header\n" );
+    free( header );
+    return 1;
+}
+
+/**
+ *  Parse a size with an optional k, m, or g suffix
+ */
+static size_t parse_ring_size( const char *str ) {
+    char *end;
+    size_t size = strtoull( str, &end, 10 );
+    switch ( *end ) {
+        case 'g': case 'G': size *= 1024; /* fall through */
+        case 'm': case 'M': size *= 1024; /* fall through */
+        case 'k': case 'K': size *= 1024;
+    }
+    return size;
+}
+
+/*******************************************************************************
+ * Global functions
+ ******************************************************************************/
+/**
+ *  Load ring configuration parameters from the environment
+ */
+struct hoover_tube_config *read_tube_config(void) {
+    struct hoover_tube_config *config;
+    const char *value;
+
+    if ( !(config = calloc(1, sizeof(struct hoover_tube_config))) )
+        return NULL;
+    value = getenv( HOOVER_RING_VAR );
+    strncpy( config->path, value && value[0] ? value : HOOVER_RING_PATH, PATH_MAX - 1 );
+    value = getenv( HOOVER_RING_SIZE_VAR );
+    config->ring_size = value && value[0] ? parse_ring_size(value) : HOOVER_RING_SIZE;
+    config->hash_compressed = 1;
+    config->adaptive_compression = HOOVER_ADAPTIVE;
+    return config;
+}
+
+/**
+ *  Save ring configuration parameters in the form read_tube_config() takes
+ */
+void save_tube_config(struct hoover_tube_config *config, FILE *out) {
+    fprintf( out, "%s=%s\n", HOOVER_RING_VAR, config->path );
+    fprintf( out, "%s=%zu\n", HOOVER_RING_SIZE_VAR, config->ring_size );
+    return;
+}
+
+/**
+ * Destroy hoover_tube_config and free all strings
+ */
+void free_tube_config(struct hoover_tube_config *config) {
+    if ( config == NULL ) {
+        fprintf( stderr, "free_tube_config: received NULL pointer\n" );
+        return;
+    }
+    free(config->compression);
+    free(config->hash);
+    free(config->index_file);
+    free(config->spool_dir);
+    free(config->stats_file);
+    free(config->block_size_cache);
+    free(config->output_dir);
+    free(config->chunk_dir);
+    free(config);
+    return;
+}
+
+/**
+ *  Map the ring, creating it if no process has yet.  Every tube on the same
+ *  ring shares its messages, whichever process it is in.
+ */
+struct hoover_tube *create_hoover_tube(struct hoover_tube_config *config) {
+    struct hoover_tube *tube;
+
+    if ( !(tube = calloc(1, sizeof(struct hoover_tube))) )
+        return NULL;
+    strncpy( tube->path, config->path, PATH_MAX - 1 );
+    if ( attach_ring(tube, config->path, config->ring_size) != 0 ) {
+        free( tube );
+        return NULL;
+    }
+    return tube;
+}
+
+/**
+ * Unmap the ring.  It stays in its file, with any messages still in it, until
+ * the file is removed.
+ */
+void free_hoover_tube( struct hoover_tube *tube ) {
+    if ( tube == NULL ) {
+        fprintf( stderr, "free_hoover_tube: received NULL pointer\n" );
+        return;
+    }
+    while ( tube->redeliver ) {
+        struct hoover_message *next = tube->redeliver->next;
+        fprintf( stderr, "free_hoover_tube: dropping requeued %s\n", tube->redeliver->header.filename );
+        free( tube->redeliver->body );
+        free( tube->redeliver );
+        tube->redeliver = next;
+    }
+    munmap( tube->ring, tube->map_size );
+    free(tube);
+    return;
+}
+
+/**
+ * Largest body of one message; a quarter of the ring at most, so that a
+ * split HDO never has to wait for the ring to be empty
+ */
+static size_t ring_chunk_size( struct hoover_tube *tube ) {
+    uint64_t max_len = tube->ring->capacity / 4;
+    return max_len < HOOVER_RING_CHUNK_SIZE ? (size_t)max_len : HOOVER_RING_CHUNK_SIZE;
+}
+
+/**
+ * Push one chunk of a split HDO, stamping it with its own checksum.  Chunks
+ * are hashed with the same algorithm as the HDO itself.
+ */
+static int push_chunk( struct hoover_tube *tube,
+                       struct hoover_header *header,
+                       const char *serialized,
+                       struct hoover_chunk_info *chunk,
+                       const void *data,
+                       size_t len ) {
+    if ( hoover_hash_data(header->hash_algo, data, len, chunk->sha_hash) != 0 ) {
+        fprintf( stderr, "push_chunk: cannot hash chunk with %s\n", header->hash_algo );
+        return -1;
+    }
+    return ring_push( tube, serialized, chunk, data, len, 1 );
+}
+
+/**
+ * Split an HDO into messages of at most ring_chunk_size() bytes, the same way
+ * hooverrmq.c splits them, so that consumers reassemble them by transfer_id.
+ * A streaming HDO is read one chunk at a time, and only its last chunk carries
+ * a nonzero chunk_count along with the final hash and size of the whole HDO.
+ * A streaming HDO that turns out to fit in one chunk is sent in one piece.
+ */
+static int send_chunked_message( struct hoover_tube *tube,
+                                 struct hoover_data_obj *hdo,
+                                 struct hoover_header *header ) {
+    static unsigned long transfer_count = 0;
+    struct hoover_chunk_info chunk;
+    size_t max_len = ring_chunk_size( tube );
+    char *serialized = NULL;
+    int errors = 0;
+
+    memset( &chunk, 0, sizeof(chunk) );
+    snprintf( chunk.transfer_id, HOOVER_TRANSFER_ID_LEN, "%s.%d.%ld.%lu",
+        header->node_id, (int)getpid(), (long)time(NULL), ++transfer_count );
+
+    if ( !hdo->stream ) {
+        size_t offset = 0, len;
+        if ( !(serialized = serialize_header(header)) ) {
+            fprintf( stderr, "hoover_send_message: could not serialize header of %s\n", header->filename );
+            return -1;
+        }
+        chunk.count = hdo->size ? (hdo->size + max_len - 1) / max_len : 1;
+        do {
+            len = hdo->size - offset;
+            if ( len > max_len )
+                len = max_len;
+            if ( push_chunk( tube, header, serialized, &chunk, (char *)hdo->data + offset, len ) != 0 )
+                errors++;
+            offset += len;
+            chunk.index++;
+        } while ( offset < hdo->size );
+        free( serialized );
+        return errors ? -1 : 0;
+    }
+
+    /* a full buffer is only pushed once more data shows up, so that the last
+     * chunk can be marked as such */
+    unsigned char *buf;
+    const void *data;
+    size_t buf_len = 0, len, n;
+    int ret;
+
+    if ( !(buf = malloc(max_len)) ) {
+        fprintf( stderr, "hoover_send_message: could not allocate chunk buffer\n" );
+        return -1;
+    }
+    while ( (ret = hoover_read_hdo_chunk(hdo, &data, &len)) > 0 ) {
+        while ( len > 0 ) {
+            if ( buf_len == max_len ) {
+                /* the header of every chunk but the last is not final yet */
+                if ( !serialized && !(serialized = serialize_header(header)) ) {
+                    ret = -1;
+                    break;
+                }
+                if ( push_chunk( tube, header, serialized, &chunk, buf, buf_len ) != 0 )
+                    errors++;
+                chunk.index++;
+                buf_len = 0;
+            }
+            n = max_len - buf_len;
+            if ( n > len )
+                n = len;
+            memcpy( buf + buf_len, data, n );
+            buf_len += n;
+            data = (const char *)data + n;
+            len -= n;
+        }
+        if ( ret < 0 )
+            break;
+    }
+    free( serialized );
+    if ( ret < 0 ) {
+        fprintf( stderr, "hoover_send_message: failed to read HDO stream of %s\n", header->filename );
+        free( buf );
+        return -1;
+    }
+
+    update_hoover_header( header, hdo );
+    if ( !(serialized = serialize_header(header)) ) {
+        fprintf( stderr, "hoover_send_message: could not serialize header of %s\n", header->filename );
+        free( buf );
+        return -1;
+    }
+    if ( chunk.index == 0 ) {
+        ret = ring_push( tube, serialized, NULL, buf, buf_len, 1 );
+    }
+    else {
+        chunk.count = chunk.index + 1;
+        ret = push_chunk( tube, header, serialized, &chunk, buf, buf_len );
+    }
+    if ( ret != 0 )
+        errors++;
+    free( serialized );
+    free( buf );
+    return errors ? -1 : 0;
+}
+
+/**
+ * Copy an HDO into the ring, waiting for room if the ring is full.  Streaming
+ * HDOs, and HDOs too big for one message, are split into chunks.  Returns 0
+ * once every message is in the ring.
+ */
+static int send_message( struct hoover_tube *tube,
+                         struct hoover_data_obj *hdo,
+                         struct hoover_header *header ) {
+    char *serialized;
+    int ret;
+
+    if ( hdo->stream || hdo->size > ring_chunk_size(tube) ) {
+        if ( (ret = send_chunked_message(tube, hdo, header)) != 0 )
+            tube->failed++;
+        return ret;
+    }
+
+    if ( !(serialized = serialize_header(header)) ) {
+        fprintf( stderr, "hoover_send_message: could not serialize header of %s\n", header->filename );
+        tube->failed++;
+        return -1;
+    }
+    if ( (ret = ring_push(tube, serialized, NULL, hdo->data, hdo->size, 1)) != 0 )
+        tube->failed++;
+
+    free( serialized );
+    return ret;
+}
+
+/**
+ * Send a message and charge the time it took to the send stage.  hdo->size is
+ * final by the time a streaming HDO has been sent.
+ */
+int hoover_send_message( struct hoover_tube *tube,
+                         struct hoover_data_obj *hdo,
+                         struct hoover_header *header ) {
+    uint64_t t0 = hoover_stats_start();
+    int ret = send_message( tube, hdo, header );
+    hoover_stats_stop( HOOVER_STAGE_SEND, t0 );
+    hoover_stats_count( HOOVER_COUNT_MESSAGES, 1 );
+    hoover_stats_count( HOOVER_COUNT_MESSAGE_BYTES, hdo->size );
+    return ret;
+}
+
+/**
+ * Messages are in the ring as soon as hoover_send_message() returns, so there
+ * is nothing to wait for.  Returns the number of messages that could not be
+ * sent since the last flush.
+ */
+int hoover_flush_tube( struct hoover_tube *tube ) {
+    int failed = tube->failed;
+    tube->failed = 0;
+    hoover_stats_count( HOOVER_COUNT_FAILED, failed );
+    return failed;
+}
+
+/**
+ * Wait up to timeout_ms milliseconds for a message and take it out of the
+ * ring.  Returns 1 and sets *msg if a message was taken, 0 on timeout, or -1
+ * on error.
+ */
+int hoover_receive_message( struct hoover_tube *tube, struct hoover_message **msg, int timeout_ms ) {
+    struct hoover_message *m;
+    int ret;
+
+    /* messages that were requeued while the ring was full go first */
+    if ( tube->redeliver ) {
+        *msg = tube->redeliver;
+        if ( !(tube->redeliver = tube->redeliver->next) )
+            tube->redeliver_tail = NULL;
+        (*msg)->next = NULL;
+        return 1;
+    }
+    if ( !(m = calloc(1, sizeof(*m))) ) {
+        fprintf( stderr, "hoover_receive_message: could not allocate message\n" );
+        return -1;
+    }
+    if ( (ret = ring_pop(tube, m, timeout_ms)) == 1 )
+        *msg = m;
+    else
+        free( m );
+    return ret;
+}
+
+/**
+ * Free a message's body and the message
+ */
+static void free_message( struct hoover_message *msg ) {
+    free( msg->body );
+    free( msg );
+    return;
+}
+
+/**
+ * The message is already out of the ring, so just free it.
+ */
+int hoover_ack_message( struct hoover_tube *tube, struct hoover_message *msg ) {
+    free_message( msg );
+    return 0;
+}
+
+/**
+ * Give a message back.  If requeue is set, it goes back into the ring behind
+ * whatever is there; otherwise it is dropped.  The thread that settles
+ * messages is also the one that empties the ring, so a requeue never waits
+ * for room.  If the ring is full, the tube keeps the message and hands it out
+ * again before anything in the ring.
+ */
+int hoover_reject_message( struct hoover_tube *tube, struct hoover_message *msg, int requeue ) {
+    char *serialized;
+    int ret = 0;
+
+    if ( !requeue ) {
+        fprintf( stderr, "hoover_reject_message: dropping %s\n", msg->header.filename );
+    }
+    else if ( !(serialized = serialize_header(&(msg->header))) ) {
+        fprintf( stderr, "hoover_reject_message: could not requeue %s\n", msg->header.filename );
+        ret = -1;
+    }
+    else {
+        ret = ring_push( tube, serialized, msg->has_chunk ? &(msg->chunk) : NULL, msg->body, msg->size, 0 );
+        free( serialized );
+        if ( ret == 1 ) {
+            msg->next = NULL;
+            if ( tube->redeliver_tail )
+                tube->redeliver_tail->next = msg;
+            else
+                tube->redeliver = msg;
+            tube->redeliver_tail = msg;
+            return 0;
+        }
+    }
+    free_message( msg );
+    return ret;
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "hooverio.h"
+
+/* environment variables that pick the ring a tube attaches to and, if the
+ * ring does not exist yet, how big it is made */
+#ifndef HOOVER_RING_VAR
+    #define HOOVER_RING_VAR "HOOVER_RING"
+#endif
+#ifndef HOOVER_RING_SIZE_VAR
+    #define HOOVER_RING_SIZE_VAR "HOOVER_RING_SIZE"
+#endif
+
+/* where the ring lives unless HOOVER_RING says otherwise; /dev/shm is tmpfs,
+ * so the ring never touches a disk */
+#ifndef HOOVER_RING_PATH
+    #define HOOVER_RING_PATH "/dev/shm/hoover.ring"
+#endif
+
+/* bytes of messages the ring can hold unless HOOVER_RING_SIZE says otherwise */
+#ifndef HOOVER_RING_SIZE
+    #define HOOVER_RING_SIZE (64 * 1024 * 1024)
+#endif
+
+/* HDOs bigger than this, or a quarter of the ring if that is smaller, are
+ * split into chunks that consumers reassemble */
+#ifndef HOOVER_RING_CHUNK_SIZE
+    #define HOOVER_RING_CHUNK_SIZE (4 * 1024 * 1024)
+#endif
+
+/* every ring starts with these eight bytes once it is ready to use */
+#define HOOVER_RING_MAGIC "HVRING1"
+#define HOOVER_RING_MAGIC_LEN 8
+
+struct hoover_tube_config {
+    char path[PATH_MAX];      /* file that holds the ring */
+    size_t ring_size;         /* bytes of messages if the ring is created */
+    char *compression;        /* codec spec for hoover_set_codec(), or NULL */
+    char *hash;               /* hash for hoover_set_hash(), or NULL */
+    int hash_compressed;      /* also hash the compressed payload */
+    int adaptive_compression; /* store data that would not shrink */
+    size_t block_size;        /* bytes read at a time; 0 = pick for each file */
+    char *block_size_cache;   /* calibrate block sizes and keep them here, or NULL */
+    size_t bundle_size;       /* bundle small HDOs into messages this big; 0 = off */
+    int bundle_count;         /* most HDOs per bundle; 0 = default */
+    char *index_file;         /* remembers delivered files across runs, or NULL */
+    char *spool_dir;          /* journal messages here before sending, or NULL */
+    int binary_manifest;      /* send the manifest in the binary format, not JSON */
+    char *stats_file;         /* producers write their statistics here, or NULL */
+    int stats_interval;       /* seconds between statistics updates; 0 = only at exit */
+    int prefetch;             /* unused; messages are taken one at a time */
+    char *output_dir;         /* where consumers write received files, or NULL */
+    char *chunk_dir;          /* where consumers stage chunks of split HDOs, or NULL */
+    int decompress;           /* consumers decode files after verifying them */
+};
+
+/*
+ * hoover_ring is the start of the shared file.  The bytes after it are a
+ *   circular buffer of messages, each of them
+ *
+ *     uint32_t header_len
+ *     uint32_t chunk_len     (0, or sizeof(struct hoover_chunk_info))
+ *     uint64_t body_len
+ *     char header[]          (serialize_header() of the message's header)
+ *     char chunk[]           (the hoover_chunk_info of one piece of a split HDO)
+ *     char body[]
+ *
+ *   in the byte order of the machine, wrapping around the end of the buffer
+ *   as needed.  head and tail only ever grow; head - tail bytes are in use.
+ *   Every process that maps the ring shares the lock and condition variables.
+ */
+struct hoover_ring {
+    char magic[HOOVER_RING_MAGIC_LEN];
+    uint64_t capacity;        /* bytes in the circular buffer */
+    uint64_t head;            /* where the next message is written */
+    uint64_t tail;            /* where the next message is read */
+    uint64_t messages;        /* messages in the buffer */
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+/* a tube is one process's mapping of a ring */
+struct hoover_tube {
+    char path[PATH_MAX];
+    struct hoover_ring *ring;
+    unsigned char *data;      /* the circular buffer */
+    size_t map_size;
+    int failed;               /* messages not sent since the last flush */
+    struct hoover_message *redeliver; /* requeued while the ring was full */
+    struct hoover_message *redeliver_tail;
+};
+
+/* hoover_message is one message copied out of the ring by
+   hoover_receive_message().  It no longer takes up room in the ring, and is
+   written back to it if it is requeued.  If the ring is full at the time, it
+   is kept by the tube and received again before anything in the ring. */
+struct hoover_message {
+    struct hoover_header header;
+    int has_chunk;            /* 1 if the message is one piece of a split HDO */
+    struct hoover_chunk_info chunk;
+    void *body;               /* malloced copy of the message body */
+    size_t size;
+    int local;                /* always 0; every message carries its hashes */
+    struct hoover_message *next; /* next message waiting to be redelivered */
+};
+
+struct hoover_tube *create_hoover_tube(struct hoover_tube_config *config);
+void free_hoover_tube(struct hoover_tube *tube);
+
+struct hoover_tube_config *read_tube_config(void);
+void save_tube_config(struct hoover_tube_config *config, FILE *out);
+void free_tube_config(struct hoover_tube_config *config);
+
+int hoover_send_message(struct hoover_tube *tube,
+                        struct hoover_data_obj *hdo,
+                        struct hoover_header *header);
+int hoover_flush_tube(struct hoover_tube *tube);
+
+int hoover_receive_message(struct hoover_tube *tube,
+                           struct hoover_message **msg,
+                           int timeout_ms);
+int hoover_ack_message(struct hoover_tube *tube, struct hoover_message *msg);
+int hoover_reject_message(struct hoover_tube *tube,
+                          struct hoover_message *msg,
+                          int requeue);
@@ -0,0 +1,156 @@
+/*******************************************************************************
+ *  hooverqueue.c
+ *
+ *  Bounded producer/consumer queue used to hand work between Hoover threads
+ ******************************************************************************/
+#if !defined(_XOPEN_SOURCE) || _XOPEN_SOURCE < 700
+    #define _XOPEN_SOURCE 700
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "hooverqueue.h"
+
+/*******************************************************************************
+ * Private functions
+ ******************************************************************************/
+
+/**
+ *  Take the oldest item off of a queue whose lock is held; returns NULL if the
+ *  queue is empty
+ */
+static void *take_item( struct hoover_queue *queue ) {
+    void *item;
+
+    if ( queue->count == 0 )
+        return NULL;
+
+    item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+
+    pthread_cond_signal( &(queue->not_full) );
+    return item;
+}
+
+/*******************************************************************************
+ * Global functions
+ ******************************************************************************/
+
+/**
+ *  Create an empty queue that can hold up to capacity items
+ */
+struct hoover_queue *create_hoover_queue( size_t capacity ) {
+    struct hoover_queue *queue;
+
+    if ( capacity == 0 )
+        return NULL;
+
+    if ( !(queue = calloc(1, sizeof(*queue))) )
+        return NULL;
+
+    if ( !(queue->items = calloc(capacity, sizeof(*(queue->items)))) ) {
+        free(queue);
+        return NULL;
+    }
+    queue->capacity = capacity;
+
+    pthread_mutex_init( &(queue->lock), NULL );
+    pthread_cond_init( &(queue->not_empty), NULL );
+    pthread_cond_init( &(queue->not_full), NULL );
+
+    return queue;
+}
+
+/**
+ *  Destroy a queue.  Any items still queued are NOT freed.
+ */
+void free_hoover_queue( struct hoover_queue *queue ) {
+    if ( queue == NULL ) {
+        fprintf( stderr, "free_hoover_queue: received NULL pointer\n" );
+        return;
+    }
+    pthread_mutex_destroy( &(queue->lock) );
+    pthread_cond_destroy( &(queue->not_empty) );
+    pthread_cond_destroy( &(queue->not_full) );
+    free(queue->items);
+    free(queue);
+    return;
+}
+
+/**
+ *  Append an item to the queue, blocking while the queue is full.  Returns 0 on
+ *  success or nonzero if the queue was closed before the item could be added.
+ */
+int hoover_queue_push( struct hoover_queue *queue, void *item ) {
+    pthread_mutex_lock( &(queue->lock) );
+    while ( queue->count == queue->capacity && !queue->closed )
+        pthread_cond_wait( &(queue->not_full), &(queue->lock) );
+
+    if ( queue->closed ) {
+        pthread_mutex_unlock( &(queue->lock) );
+        return 1;
+    }
+
+    queue->items[(queue->head + queue->count) % queue->capacity] = item;
+    queue->count++;
+
+    pthread_cond_signal( &(queue->not_empty) );
+    pthread_mutex_unlock( &(queue->lock) );
+    return 0;
+}
+
+/**
+ *  Remove the oldest item from the queue, blocking while the queue is empty.
+ *  Returns NULL once the queue has been closed and drained.
+ */
+void *hoover_queue_pop( struct hoover_queue *queue ) {
+    void *item;
+
+    pthread_mutex_lock( &(queue->lock) );
+    while ( queue->count == 0 && !queue->closed )
+        pthread_cond_wait( &(queue->not_empty), &(queue->lock) );
+
+    item = take_item( queue );
+    pthread_mutex_unlock( &(queue->lock) );
+    return item;
+}
+
+/**
+ *  Like hoover_queue_pop(), but give up once timeout seconds pass without an
+ *  item arriving.  *timed_out tells that apart from the queue being closed.
+ */
+void *hoover_queue_pop_timed( struct hoover_queue *queue, int timeout, int *timed_out ) {
+    struct timespec deadline;
+    void *item;
+
+    clock_gettime( CLOCK_REALTIME, &deadline );
+    deadline.tv_sec += timeout;
+    *timed_out = 0;
+
+    pthread_mutex_lock( &(queue->lock) );
+    while ( queue->count == 0 && !queue->closed ) {
+        if ( pthread_cond_timedwait(&(queue->not_empty), &(queue->lock), &deadline) == ETIMEDOUT ) {
+            *timed_out = queue->count == 0 && !queue->closed;
+            break;
+        }
+    }
+
+    item = take_item( queue );
+    pthread_mutex_unlock( &(queue->lock) );
+    return item;
+}
+
+/**
+ *  Mark the queue as closed and wake up everyone waiting on it
+ */
+void hoover_queue_close( struct hoover_queue *queue ) {
+    pthread_mutex_lock( &(queue->lock) );
+    queue->closed = 1;
+    pthread_cond_broadcast( &(queue->not_empty) );
+    pthread_cond_broadcast( &(queue->not_full) );
+    pthread_mutex_unlock( &(queue->lock) );
+    return;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * hoover_queue is a bounded, thread-safe FIFO of opaque pointers.  Producers
+ *   block in hoover_queue_push() while the queue is full, and consumers block
+ *   in hoover_queue_pop() while it is empty.  Once a queue is closed, pushes
+ *   fail and pops drain whatever is left before returning NULL.
+ */
+struct hoover_queue {
+    void **items;             /* ring of queued items */
+    size_t capacity;          /* max number of items in the ring */
+    size_t head;              /* index of the oldest item */
+    size_t count;             /* number of items currently queued */
+    int closed;               /* nonzero once no more items will be pushed */
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+struct hoover_queue *create_hoover_queue( size_t capacity );
+void free_hoover_queue( struct hoover_queue *queue );
+
+int hoover_queue_push( struct hoover_queue *queue, void *item );
+void *hoover_queue_pop( struct hoover_queue *queue );
+void *hoover_queue_pop_timed( struct hoover_queue *queue, int timeout, int *timed_out );
+void hoover_queue_close( struct hoover_queue *queue );
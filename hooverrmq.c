@@ -16,9 +16,11 @@
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
+#include <poll.h>
 
 #include "hooverio.h"
 #include "hooverrmq.h"
+#include "hooverstats.h"
 
 #ifndef HOOVER_APP_ID
     #define HOOVER_APP_ID "hoover-producer"
@@ -30,8 +32,10 @@
 static int parse_amqp_response(amqp_rpc_reply_t x, char const *context, int die);
 static char *trim(char *string);
 char *select_server(struct hoover_tube_config *config);
-static amqp_table_t *create_amqp_header_table( struct hoover_header *header );
+static amqp_table_t *create_amqp_header_table( const struct hoover_header_ref *header,
+                                               struct hoover_chunk_info *chunk );
 static void free_amqp_header_table( amqp_table_t *table );
+static void free_publish( struct hoover_publish *msg );
 
 /**
  *  Randomly select a server from the list of servers, then pop it off the list
@@ -122,42 +126,53 @@ static int parse_amqp_response(amqp_rpc_reply_t x, char const *context, int die)
 }
 
 /**
- *  Convert a hoover_header into an AMQP table to be attached to a message
+ *  Convert a hoover_header_ref into an AMQP table to be attached to a message.
+ *  If chunk is not NULL, the fields that describe one piece of a split HDO are
+ *  appended.  The digests are written out in hex after the table's entries,
+ *  so that they last as long as the table.
  */
-#define HOOVER_HEADER_ENTRIES 7 /* number of elements in struct hoover_header */
-static amqp_table_t *create_amqp_header_table( struct hoover_header *header ) {
+#define HOOVER_HEADER_ENTRIES 9 /* number of elements in struct hoover_header */
+#define HOOVER_CHUNK_ENTRIES 4  /* number of elements in struct hoover_chunk_info */
+static amqp_table_t *create_amqp_header_table( const struct hoover_header_ref *header,
+                                               struct hoover_chunk_info *chunk ) {
     amqp_table_t *table;
     amqp_table_entry_t *entries;
+    int num_entries = HOOVER_HEADER_ENTRIES + (chunk ? HOOVER_CHUNK_ENTRIES : 0);
+    char *sha_hash, *hash_orig;
 
     if ( !(table = malloc(sizeof(*table))) )
         return NULL;
-    if ( !(entries = malloc(HOOVER_HEADER_ENTRIES * sizeof(*entries))) ) {
+    if ( !(entries = malloc(num_entries * sizeof(*entries) + 2 * HASH_DIGEST_LENGTH_HEX)) ) {
         free(table);
         return NULL;
     }
+    sha_hash = (char *)(entries + num_entries);
+    hash_orig = sha_hash + HASH_DIGEST_LENGTH_HEX;
+    hoover_digest_to_hex( header->sha_hash, header->sha_hash_len, sha_hash );
+    hoover_digest_to_hex( header->hash_orig, header->hash_orig_len, hash_orig );
 
-    table->num_entries = HOOVER_HEADER_ENTRIES;
+    table->num_entries = num_entries;
 
     /* Set headers */
     entries[0].key = amqp_cstring_bytes("filename");
     entries[0].value.kind = AMQP_FIELD_KIND_UTF8;
-    entries[0].value.value.bytes = amqp_cstring_bytes(header->filename);
+    entries[0].value.value.bytes = amqp_cstring_bytes((char*)header->filename);
 
     entries[1].key = amqp_cstring_bytes("node_id");
     entries[1].value.kind = AMQP_FIELD_KIND_UTF8;
-    entries[1].value.value.bytes = amqp_cstring_bytes(header->node_id);
+    entries[1].value.value.bytes = amqp_cstring_bytes((char*)header->node_id);
 
     entries[2].key = amqp_cstring_bytes("task_id");
     entries[2].value.kind = AMQP_FIELD_KIND_UTF8;
-    entries[2].value.value.bytes = amqp_cstring_bytes(header->task_id);
+    entries[2].value.value.bytes = amqp_cstring_bytes((char*)header->task_id);
 
     entries[3].key = amqp_cstring_bytes("compression");
     entries[3].value.kind = AMQP_FIELD_KIND_UTF8;
-    entries[3].value.value.bytes = amqp_cstring_bytes(header->compression);
+    entries[3].value.value.bytes = amqp_cstring_bytes((char*)header->compression);
 
     entries[4].key = amqp_cstring_bytes("sha_hash");
     entries[4].value.kind = AMQP_FIELD_KIND_UTF8;
-    entries[4].value.value.bytes = amqp_cstring_bytes((char*)header->sha_hash);
+    entries[4].value.value.bytes = amqp_cstring_bytes(sha_hash);
 
     entries[5].key = amqp_cstring_bytes("size");
     entries[5].value.kind = AMQP_FIELD_KIND_I64;
@@ -167,6 +182,32 @@ static amqp_table_t *create_amqp_header_table( struct hoover_header *header ) {
     entries[6].value.kind = AMQP_FIELD_KIND_UTF8;
     entries[6].value.value.bytes = amqp_cstring_bytes((char*)header->type);
 
+    entries[7].key = amqp_cstring_bytes("hash_orig");
+    entries[7].value.kind = AMQP_FIELD_KIND_UTF8;
+    entries[7].value.value.bytes = amqp_cstring_bytes(hash_orig);
+
+    entries[8].key = amqp_cstring_bytes("hash_algo");
+    entries[8].value.kind = AMQP_FIELD_KIND_UTF8;
+    entries[8].value.value.bytes = amqp_cstring_bytes((char*)header->hash_algo);
+
+    if ( chunk ) {
+        entries[9].key = amqp_cstring_bytes("transfer_id");
+        entries[9].value.kind = AMQP_FIELD_KIND_UTF8;
+        entries[9].value.value.bytes = amqp_cstring_bytes(chunk->transfer_id);
+
+        entries[10].key = amqp_cstring_bytes("chunk_index");
+        entries[10].value.kind = AMQP_FIELD_KIND_I64;
+        entries[10].value.value.i64 = chunk->index;
+
+        entries[11].key = amqp_cstring_bytes("chunk_count");
+        entries[11].value.kind = AMQP_FIELD_KIND_I64;
+        entries[11].value.value.i64 = chunk->count;
+
+        entries[12].key = amqp_cstring_bytes("chunk_sha_hash");
+        entries[12].value.kind = AMQP_FIELD_KIND_UTF8;
+        entries[12].value.value.bytes = amqp_cstring_bytes(chunk->sha_hash);
+    }
+
     table->entries = entries;
 
     return table;
@@ -186,16 +227,20 @@ static void free_amqp_header_table( amqp_table_t *table ) {
  ******************************************************************************/
 
 /**
- *  Load RabbitMQ configuration parameters
+ *  Load RabbitMQ configuration parameters from HOOVER_CONFIG_FILE, or from the
+ *  file named by the HOOVER_CONFIG environment variable if it is set
  */
 struct hoover_tube_config *read_tube_config(void) {
-    FILE *fp = fopen(HOOVER_CONFIG_FILE, "r");
+    const char *path = getenv(HOOVER_CONFIG_VAR);
+    FILE *fp = fopen(path && path[0] ? path : HOOVER_CONFIG_FILE, "r");
     if (fp == NULL) return NULL;
 
     struct hoover_tube_config *config = (struct hoover_tube_config *) malloc(sizeof(struct hoover_tube_config));
     if ( !config ) return NULL;
 
     memset(config, 0, sizeof(struct hoover_tube_config));
+    config->hash_compressed = 1;
+    config->adaptive_compression = HOOVER_ADAPTIVE;
     
     char *p = NULL;
     size_t ps = 0;
@@ -256,6 +301,56 @@ struct hoover_tube_config *read_tube_config(void) {
             config->routing_key = strdup(value);
         } else if (strcmp(key, "maxTransmitSize") == 0 || strcmp(key, "max_transmit_size") == 0) {
             config->max_transmit_size = strtoul(value, NULL, 10);
+        } else if (strcmp(key, "compression") == 0) {
+            config->compression = strdup(value);
+        } else if (strcmp(key, "hash") == 0) {
+            config->hash = strdup(value);
+        } else if (strcmp(key, "hash_compressed") == 0) {
+            config->hash_compressed = atoi(value);
+        } else if (strcmp(key, "adaptive_compression") == 0) {
+            config->adaptive_compression = atoi(value);
+        } else if (strcmp(key, "block_size") == 0) {
+            config->block_size = strtoul(value, NULL, 10);
+        } else if (strcmp(key, "block_size_cache") == 0) {
+            config->block_size_cache = strdup(value);
+        } else if (strcmp(key, "bundle_size") == 0) {
+            config->bundle_size = strtoul(value, NULL, 10);
+        } else if (strcmp(key, "bundle_count") == 0) {
+            config->bundle_count = atoi(value);
+        } else if (strcmp(key, "index_file") == 0) {
+            config->index_file = strdup(value);
+        } else if (strcmp(key, "spool_dir") == 0) {
+            config->spool_dir = strdup(value);
+        } else if (strcmp(key, "manifest_format") == 0) {
+            if (strcmp(value, "binary") == 0)
+                config->binary_manifest = 1;
+            else if (strcmp(value, "json") == 0)
+                config->binary_manifest = 0;
+            else
+                fprintf( stderr, "unknown manifest_format %s; using json\n", value );
+        } else if (strcmp(key, "stats_file") == 0) {
+            config->stats_file = strdup(value);
+        } else if (strcmp(key, "stats_interval") == 0) {
+            config->stats_interval = atoi(value);
+        } else if (strcmp(key, "max_in_flight") == 0) {
+            config->max_in_flight = atoi(value);
+        } else if (strcmp(key, "connections") == 0) {
+            config->connections = atoi(value);
+        } else if (strcmp(key, "placement") == 0) {
+            if (strcmp(value, "least_bytes") == 0)
+                config->placement = HOOVER_PLACE_LEAST_BYTES;
+            else if (strcmp(value, "round_robin") == 0)
+                config->placement = HOOVER_PLACE_ROUND_ROBIN;
+            else
+                fprintf( stderr, "unknown placement %s; using round_robin\n", value );
+        } else if (strcmp(key, "prefetch") == 0) {
+            config->prefetch = atoi(value);
+        } else if (strcmp(key, "output_dir") == 0) {
+            config->output_dir = strdup(value);
+        } else if (strcmp(key, "chunk_dir") == 0) {
+            config->chunk_dir = strdup(value);
+        } else if (strcmp(key, "decompress") == 0) {
+            config->decompress = atoi(value);
         } else if (strcmp(key, "use_ssl") == 0) {
             config->use_ssl = atoi(value);
         }
@@ -286,6 +381,26 @@ void save_tube_config(struct hoover_tube_config *config, FILE *out) {
     fprintf(out, "queue: %s\n", config->queue);
     fprintf(out, "routing_key: %s\n", config->routing_key);
     fprintf(out, "max_transmit_size: %lu\n", config->max_transmit_size);
+    fprintf(out, "compression: %s\n", config->compression);
+    fprintf(out, "hash: %s\n", config->hash);
+    fprintf(out, "hash_compressed: %d\n", config->hash_compressed);
+    fprintf(out, "adaptive_compression: %d\n", config->adaptive_compression);
+    fprintf(out, "block_size: %lu\n", config->block_size);
+    fprintf(out, "block_size_cache: %s\n", config->block_size_cache);
+    fprintf(out, "bundle_size: %lu\n", config->bundle_size);
+    fprintf(out, "bundle_count: %d\n", config->bundle_count);
+    fprintf(out, "index_file: %s\n", config->index_file);
+    fprintf(out, "spool_dir: %s\n", config->spool_dir);
+    fprintf(out, "manifest_format: %s\n", config->binary_manifest ? "binary" : "json");
+    fprintf(out, "stats_file: %s\n", config->stats_file);
+    fprintf(out, "stats_interval: %d\n", config->stats_interval);
+    fprintf(out, "max_in_flight: %d\n", config->max_in_flight);
+    fprintf(out, "connections: %d\n", config->connections);
+    fprintf(out, "placement: %s\n", config->placement == HOOVER_PLACE_LEAST_BYTES ? "least_bytes" : "round_robin");
+    fprintf(out, "prefetch: %d\n", config->prefetch);
+    fprintf(out, "output_dir: %s\n", config->output_dir);
+    fprintf(out, "chunk_dir: %s\n", config->chunk_dir);
+    fprintf(out, "decompress: %d\n", config->decompress);
     fprintf(out, "use_ssl: %d\n", config->use_ssl);
 
     return;
@@ -316,51 +431,98 @@ void free_tube_config( struct hoover_tube_config *config ) {
     if (config->exchange_type != NULL) free(config->exchange_type);
     if (config->queue         != NULL) free(config->queue);
     if (config->routing_key   != NULL) free(config->routing_key); /* note that hoover_tube aliases this string */
+    if (config->compression   != NULL) free(config->compression);
+    if (config->hash          != NULL) free(config->hash);
+    if (config->index_file    != NULL) free(config->index_file);
+    if (config->spool_dir     != NULL) free(config->spool_dir);
+    if (config->stats_file    != NULL) free(config->stats_file);
+    if (config->block_size_cache != NULL) free(config->block_size_cache);
+    if (config->output_dir    != NULL) free(config->output_dir);
+    if (config->chunk_dir     != NULL) free(config->chunk_dir);
 
     free(config);
     return;
 }
 
 /**
- *  Create a tube and get to a state where it can be used to send HDOs
+ * Drop a link's connection to its broker, if there is one.  Messages that were
+ * still awaiting a confirm stay in the link's in_flight slots.
  */
-struct hoover_tube *create_hoover_tube(struct hoover_tube_config *config) {
+static void close_link( struct hoover_link *link ) {
+    if ( link->connection ) {
+        parse_amqp_response(amqp_connection_close(link->connection, AMQP_REPLY_SUCCESS), "connection close", false);
+        amqp_destroy_connection(link->connection);
+    }
+    link->connection = NULL;
+    link->socket = NULL;
+    link->consuming = 0;
+    return;
+}
+
+/**
+ * Is another live link of this tube already connected to hostname?
+ */
+static int server_in_use( struct hoover_tube *tube, struct hoover_link *link, const char *hostname ) {
+    int i;
+    for ( i = 0; i < tube->num_links; i++ ) {
+        if ( &(tube->links[i]) != link
+        &&   tube->links[i].connection
+        &&   tube->links[i].hostname
+        &&   strcmp(tube->links[i].hostname, hostname) == 0 )
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Connect a link to one of the configured servers, log in, open a channel in
+ * confirm mode, and declare the exchange.  As long as there are enough
+ * servers to go around, servers that other links of the tube are using are
+ * skipped.  Returns 0 on success.
+ */
+static int open_link( struct hoover_tube *tube, struct hoover_link *link ) {
+    struct hoover_tube_config *config = tube->config;
     int connected, status;
     char *hostname;
-    struct hoover_tube *tube;
     amqp_rpc_reply_t reply;
 
-    if (!(tube = malloc(sizeof(*tube))))
-        return NULL;
-    memset(tube, 0, sizeof(*tube));
+    /* every server is a candidate each time a link is opened */
+    config->remaining_hosts = config->max_hosts;
 
     /* establish socket */
     for (connected = 0, hostname = select_server(config);
                         hostname != NULL;
                         hostname = select_server(config) ) {
+        if ( tube->num_links <= config->max_hosts && server_in_use(tube, link, hostname) )
+            continue;
+
         printf( "Attempting to connect to %s:%d\n", hostname, config->port );
-        tube->connection = amqp_new_connection();
+        link->connection = amqp_new_connection();
 
         if ( config->use_ssl )
-            tube->socket = amqp_ssl_socket_new(tube->connection);
+            link->socket = amqp_ssl_socket_new(link->connection);
         else
-            tube->socket = amqp_tcp_socket_new(tube->connection);
+            link->socket = amqp_tcp_socket_new(link->connection);
 
-        if (tube->socket == NULL) {
+        if (link->socket == NULL) {
             fprintf(stderr, "Failed to create socket!\n");
-            free_hoover_tube(tube);
-            return NULL;
+            amqp_destroy_connection(link->connection);
+            link->connection = NULL;
+            return -1;
         }
 
         if ( config->use_ssl ) {
-            amqp_ssl_socket_set_verify_peer(tube->socket, 0);
-            amqp_ssl_socket_set_verify_hostname(tube->socket, 0);
+            amqp_ssl_socket_set_verify_peer(link->socket, 0);
+            amqp_ssl_socket_set_verify_hostname(link->socket, 0);
         }
 
-        status = amqp_socket_open(tube->socket, hostname, config->port);
+        status = amqp_socket_open(link->socket, hostname, config->port);
 
         if (status != 0) {
             fprintf( stderr, "Failed to connect to %s:%d; moving on...\n", hostname, config->port );
+            amqp_destroy_connection(link->connection);
+            link->connection = NULL;
+            link->socket = NULL;
         }
         else {
             connected = 1;
@@ -371,13 +533,13 @@ struct hoover_tube *create_hoover_tube(struct hoover_tube_config *config) {
     /* make sure connection exists */
     if (!connected) {
         fprintf(stderr, "Failed to connect to any servers!\n");
-        free_hoover_tube(tube);
-        return NULL;
+        return -1;
     }
+    link->hostname = hostname;
 
     /* authenticate */
     reply = amqp_login(
-        tube->connection,       /* amqp_connection_state_t state */
+        link->connection,       /* amqp_connection_state_t state */
         config->vhost,          /* char const *vhost */
         0,                      /* int channel_max */
         131072,                 /* int frame_max */
@@ -387,26 +549,30 @@ struct hoover_tube *create_hoover_tube(struct hoover_tube_config *config) {
         config->password);
 
     if ( parse_amqp_response(reply, "login", false) ) {
-        free_hoover_tube(tube);
-        return NULL;
+        close_link(link);
+        return -1;
     }
 
     /* open channel */
-    tube->channel = 1;
-    amqp_channel_open(tube->connection, tube->channel);
-    if ( parse_amqp_response(amqp_get_rpc_reply(tube->connection), "channel open", false) ) {
-        free_hoover_tube(tube);
-        return NULL;
+    link->channel = 1;
+    amqp_channel_open(link->connection, link->channel);
+    if ( parse_amqp_response(amqp_get_rpc_reply(link->connection), "channel open", false) ) {
+        close_link(link);
+        return -1;
     }
 
-    /* exchange/routing_key required to send messages, so include them in the
-     * tube */
-    tube->exchange = amqp_cstring_bytes(config->exchange);
-    tube->routing_key = amqp_cstring_bytes(config->routing_key);
+    /* have the broker ack (or nack) every message it takes responsibility for.
+     * Delivery tags restart from 1 on every new channel. */
+    amqp_confirm_select(link->connection, link->channel);
+    if ( parse_amqp_response(amqp_get_rpc_reply(link->connection), "confirm select", false) ) {
+        close_link(link);
+        return -1;
+    }
+    link->next_tag = 0;
 
     amqp_exchange_declare(
-        tube->connection,                         /* amqp_connection_state_t state */
-        tube->channel,                            /* amqp_channel_t channel */
+        link->connection,                         /* amqp_connection_state_t state */
+        link->channel,                            /* amqp_channel_t channel */
         tube->exchange,                           /* amqp_bytes_t exchange */
         amqp_cstring_bytes(config->exchange_type),/* amqp_bytes_t type */
         0,                                        /* amqp_boolean_t passive */
@@ -415,10 +581,64 @@ struct hoover_tube *create_hoover_tube(struct hoover_tube_config *config) {
         0,                                        /* amqp_boolean_t internal */
         amqp_empty_table                          /* amqp_table_t arguments */
     );
-    if ( parse_amqp_response(amqp_get_rpc_reply(tube->connection), "exchange declare", false) ) {
+    if ( parse_amqp_response(amqp_get_rpc_reply(link->connection), "exchange declare", false) ) {
+        close_link(link);
+        return -1;
+    }
+
+    link->epoch++;
+    return 0;
+}
+
+/**
+ *  Create a tube and get to a state where it can be used to send HDOs.  The
+ *  tube is usable as long as at least one of its links could be opened.
+ */
+struct hoover_tube *create_hoover_tube(struct hoover_tube_config *config) {
+    struct hoover_tube *tube;
+    int i, num_up = 0;
+
+    if (!(tube = malloc(sizeof(*tube))))
+        return NULL;
+    memset(tube, 0, sizeof(*tube));
+
+    /* exchange/routing_key required to send messages, so include them in the
+     * tube */
+    tube->config = config;
+    tube->exchange = amqp_cstring_bytes(config->exchange);
+    tube->routing_key = amqp_cstring_bytes(config->routing_key);
+    tube->max_transmit_size = config->max_transmit_size;
+    tube->max_in_flight = config->max_in_flight > 0 ? config->max_in_flight : HOOVER_MAX_IN_FLIGHT;
+    tube->placement = config->placement;
+    tube->num_links = config->connections > 0 ? config->connections : 1;
+    if ( tube->num_links > HOOVER_MAX_CONNECTIONS )
+        tube->num_links = HOOVER_MAX_CONNECTIONS;
+
+    if ( !(tube->links = calloc(tube->num_links, sizeof(*(tube->links)))) ) {
+        fprintf(stderr, "create_hoover_tube: could not allocate %d links\n", tube->num_links);
+        free(tube);
+        return NULL;
+    }
+
+    for ( i = 0; i < tube->num_links; i++ ) {
+        struct hoover_link *link = &(tube->links[i]);
+        if ( !(link->in_flight = calloc(tube->max_in_flight, sizeof(*(link->in_flight)))) ) {
+            fprintf(stderr, "create_hoover_tube: could not allocate %d in-flight slots\n", tube->max_in_flight);
+            free_hoover_tube(tube);
+            return NULL;
+        }
+        if ( open_link(tube, link) == 0 )
+            num_up++;
+        else
+            link->down_since = time(NULL);
+    }
+
+    if ( num_up == 0 ) {
         free_hoover_tube(tube);
         return NULL;
     }
+    if ( num_up < tube->num_links )
+        fprintf(stderr, "create_hoover_tube: only %d of %d connections are up\n", num_up, tube->num_links);
 
     return tube;
 }
@@ -428,41 +648,81 @@ struct hoover_tube *create_hoover_tube(struct hoover_tube_config *config) {
  *
  * Note that semantics are a little different in that this function not only
  * frees memory structures, but it also safely tears down communication with the
- * RabbitMQ broker.
+ * RabbitMQ broker.  Messages that have not been confirmed yet are waited for
+ * first; call hoover_flush_tube() beforehand to find out whether they made it.
  */
 void free_hoover_tube( struct hoover_tube *tube ) {
+    int i, j;
     if ( tube == NULL ) {
         fprintf( stderr, "free_hoover_tube: received NULL pointer\n" );
         return;
     }
+    if ( tube->links && hoover_flush_tube(tube) != 0 )
+        fprintf( stderr, "free_hoover_tube: some messages were never confirmed by the broker\n" );
+
     /* Closes all channels, notifies broker of shutdown, closes the socket, then
      * destroys the connection */
-    if ( tube->connection ) {
-        parse_amqp_response(amqp_connection_close(tube->connection, AMQP_REPLY_SUCCESS), "connection close", false);
-        amqp_destroy_connection(tube->connection);
+    for ( i = 0; tube->links && i < tube->num_links; i++ ) {
+        close_link(&(tube->links[i]));
+        if ( tube->links[i].in_flight ) {
+            for ( j = 0; j < tube->max_in_flight; j++ )
+                free_publish(&(tube->links[i].in_flight[j]));
+            free(tube->links[i].in_flight);
+        }
     }
-
+    free(tube->links);
+    for ( i = 0; i < tube->num_pending; i++ )
+        free_publish(&(tube->pending[i]));
+    free(tube->pending);
+    if ( tube->queue.bytes )
+        amqp_bytes_free(tube->queue);
     free(tube);
     return;
 }
 
 /**
- * Convert Hoover structures into an AMQP message and send it
+ * Free the body and header strings that a message owns
  */
-void hoover_send_message( struct hoover_tube *tube,
-                          struct hoover_data_obj *hdo,
-                          struct hoover_header *header ) {
-    amqp_rpc_reply_t reply;
-    amqp_basic_properties_t props;
-    amqp_table_t *table;
-    amqp_bytes_t body;
+static void free_publish( struct hoover_publish *msg ) {
+    free(msg->body.bytes);
+    free(msg->strings);
+    msg->body.bytes = NULL;
+    msg->body.len = 0;
+    msg->strings = NULL;
+    return;
+}
 
-    /* convert HDO to amqp_bytes_t */
-    body.len = hdo->size;
-    body.bytes = hdo->data;
+/**
+ * Forget about a message, either because the broker has it, because we have
+ * given up on it, or because it is moving to another link.
+ */
+static void release_slot( struct hoover_link *link, struct hoover_publish *slot ) {
+    link->bytes_in_flight -= slot->body.len;
+    link->num_in_flight--;
+    free_publish(slot);
+    slot->delivery_tag = 0;
+    return;
+}
 
-    /* create the amqp_table that contains the header metadata */
-    table = create_amqp_header_table( header );
+/**
+ * Hand one message to a link's broker.  The message is not safe until the
+ * broker confirms it; see handle_confirm().  Returns 0 if the message was
+ * written to the connection.
+ */
+static int publish_slot( struct hoover_tube *tube, struct hoover_link *link, struct hoover_publish *slot ) {
+    amqp_basic_properties_t props;
+    amqp_table_t *table;
+    uint64_t t0;
+    int status;
+
+    /* create the amqp_table that contains the header metadata.  Nothing has
+     * gone out on the channel yet, so just give up on the message. */
+    if ( !(table = create_amqp_header_table( &(slot->header), slot->has_chunk ? &(slot->chunk) : NULL )) ) {
+        fprintf( stderr, "publish message: could not allocate header table for %s\n", slot->header.filename );
+        tube->failed++;
+        release_slot( link, slot );
+        return 0;
+    }
 
     /* TODO: figure out what these flags mean */
     memset( &props, 0, sizeof(props) );
@@ -474,21 +734,961 @@ void hoover_send_message( struct hoover_tube *tube,
     props.app_id = amqp_cstring_bytes(HOOVER_APP_ID);
 
     /* Send the actual AMQP message */
-    amqp_basic_publish(
-        tube->connection,   /* amqp_connection_state_t state */
-        tube->channel,      /* amqp_channel_t channel */
+    t0 = hoover_stats_start();
+    status = amqp_basic_publish(
+        link->connection,   /* amqp_connection_state_t state */
+        link->channel,      /* amqp_channel_t channel */
         tube->exchange,     /* amqp_bytes_t exchange */
         tube->routing_key,  /* amqp_bytes_t routing_key */
         0,                  /* amqp_boolean_t mandatory */
         0,                  /* amqp_boolean_t immediate */
         &props,             /* amqp_basic_properties_t *properties */
-        body                /* amqp_bytes_t body */
+        slot->body          /* amqp_bytes_t body */
     );
 
+    hoover_stats_stop( HOOVER_STAGE_PUBLISH, t0 );
     free_amqp_header_table(table);
 
-    reply = amqp_get_rpc_reply(tube->connection);
-    parse_amqp_response(reply, "publish message", true);
+    /* the broker numbers every publish on a confirm-mode channel, whether or
+     * not it makes it there.  Anything published before was nacked, lost with
+     * a connection, or moved off of a link that went down */
+    slot->delivery_tag = ++(link->next_tag);
+    if ( slot->attempts > 0 )
+        hoover_stats_count( HOOVER_COUNT_RETRIES, 1 );
+    slot->attempts++;
+
+    if ( status != AMQP_STATUS_OK ) {
+        fprintf( stderr, "publish message to %s: %s\n", link->hostname, amqp_error_string2(status) );
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Publish a message again after the broker rejected or lost it.  Returns -1 if
+ * the connection is unusable; running out of attempts is not an error here.
+ */
+static int retry_slot( struct hoover_tube *tube, struct hoover_link *link, struct hoover_publish *slot ) {
+    if ( slot->attempts > HOOVER_PUBLISH_RETRIES ) {
+        fprintf( stderr, "giving up on %s after %d attempts\n", slot->header.filename, slot->attempts );
+        tube->failed++;
+        release_slot( link, slot );
+        return 0;
+    }
+    fprintf( stderr, "republishing %s to %s (attempt %d)\n", slot->header.filename, link->hostname, slot->attempts + 1 );
+    return publish_slot( tube, link, slot );
+}
+
+/**
+ * Apply a basic.ack or basic.nack to the messages it covers.  If multiple is
+ * set, it covers every outstanding delivery tag up to and including tag.
+ */
+static int handle_confirm( struct hoover_tube *tube, struct hoover_link *link, uint64_t tag, int multiple, int ack ) {
+    struct hoover_publish *slot;
+    uint64_t last_tag = link->next_tag; /* retries get tags past this one */
+    int i;
+
+    for ( i = 0; i < tube->max_in_flight; i++ ) {
+        slot = &(link->in_flight[i]);
+        if ( slot->delivery_tag == 0 || slot->delivery_tag > last_tag )
+            continue;
+        if ( !(slot->delivery_tag == tag || (multiple && slot->delivery_tag < tag)) )
+            continue;
+
+        if ( ack )
+            release_slot( link, slot );
+        else if ( retry_slot( tube, link, slot ) != 0 )
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Process whatever confirms a link's broker has sent.  If block is set, wait
+ * up to HOOVER_CONFIRM_TIMEOUT seconds for at least one frame to arrive.
+ * Returns -1 if the connection or channel has failed.
+ */
+static int process_confirms( struct hoover_tube *tube, struct hoover_link *link, int block ) {
+    amqp_frame_t frame;
+    struct timeval timeout;
+    int status, ret = 0;
+
+    if ( !link->connection )
+        return -1;
+
+    while ( ret == 0 ) {
+        timeout.tv_sec = block ? HOOVER_CONFIRM_TIMEOUT : 0;
+        timeout.tv_usec = 0;
+        status = amqp_simple_wait_frame_noblock(link->connection, &frame, &timeout);
+        if ( status == AMQP_STATUS_TIMEOUT ) {
+            if ( block ) {
+                fprintf( stderr, "process confirms: no reply from %s in %d seconds\n", link->hostname, HOOVER_CONFIRM_TIMEOUT );
+                return -1;
+            }
+            return 0;
+        }
+        else if ( status != AMQP_STATUS_OK ) {
+            fprintf( stderr, "process confirms: %s: %s\n", link->hostname, amqp_error_string2(status) );
+            return -1;
+        }
+        block = 0; /* only wait for the first frame */
+
+        /* skip heartbeats and the content of any basic.return */
+        if ( frame.frame_type != AMQP_FRAME_METHOD )
+            continue;
+
+        switch ( frame.payload.method.id ) {
+        case AMQP_BASIC_ACK_METHOD: {
+            amqp_basic_ack_t *m = (amqp_basic_ack_t *)frame.payload.method.decoded;
+            ret = handle_confirm( tube, link, m->delivery_tag, m->multiple, true );
+            break;
+        }
+        case AMQP_BASIC_NACK_METHOD: {
+            amqp_basic_nack_t *m = (amqp_basic_nack_t *)frame.payload.method.decoded;
+            fprintf( stderr, "process confirms: %s nacked delivery tag %lu\n", link->hostname, (unsigned long)m->delivery_tag );
+            ret = handle_confirm( tube, link, m->delivery_tag, m->multiple, false );
+            break;
+        }
+        case AMQP_CHANNEL_CLOSE_METHOD: {
+            amqp_channel_close_t *m = (amqp_channel_close_t *)frame.payload.method.decoded;
+            fprintf( stderr, "process confirms: %s: server channel error %d, message: %.*s\n",
+                link->hostname, m->reply_code, (int)m->reply_text.len, (char *)m->reply_text.bytes );
+            ret = -1;
+            break;
+        }
+        case AMQP_CONNECTION_CLOSE_METHOD: {
+            amqp_connection_close_t *m = (amqp_connection_close_t *)frame.payload.method.decoded;
+            fprintf( stderr, "process confirms: %s: server connection error %d, message: %.*s\n",
+                link->hostname, m->reply_code, (int)m->reply_text.len, (char *)m->reply_text.bytes );
+            ret = -1;
+            break;
+        }
+        default:
+            break;
+        }
+        amqp_maybe_release_buffers(link->connection);
+    }
+    return ret;
+}
+
+/**
+ * Set a message aside to be published again by send_pending().  The tube takes
+ * ownership of msg->body and msg->strings; the message is given up on if there
+ * is no room.
+ */
+static void add_pending( struct hoover_tube *tube, struct hoover_publish *msg ) {
+    if ( tube->num_pending == tube->max_pending ) {
+        int max_pending = tube->max_pending ? 2 * tube->max_pending : tube->max_in_flight;
+        struct hoover_publish *pending = realloc(tube->pending, max_pending * sizeof(*pending));
+        if ( !pending ) {
+            fprintf( stderr, "giving up on %s; no room to hold it for republishing\n", msg->header.filename );
+            tube->failed++;
+            free_publish( msg );
+            return;
+        }
+        tube->pending = pending;
+        tube->max_pending = max_pending;
+    }
+    tube->pending[tube->num_pending] = *msg;
+    tube->pending[tube->num_pending].delivery_tag = 0;
+    tube->num_pending++;
+    tube->bytes_pending += msg->body.len;
+    return;
+}
+
+/**
+ * Replace a link's failed connection and republish everything that was not
+ * confirmed on the old one, since the broker may or may not have stored it.
+ * Consumers already see duplicates with the same hashes as harmless.  If no
+ * server will take the link, it stays down and its messages are set aside for
+ * send_pending() to move to the tube's other links.  Returns -1 if the link
+ * is down.
+ */
+static int recover_link( struct hoover_tube *tube, struct hoover_link *link ) {
+    struct hoover_publish msg;
+    int i, ret;
+
+    do {
+        close_link( link );
+
+        if ( open_link( tube, link ) != 0 ) {
+            link->down_since = time(NULL);
+            for ( i = 0; i < tube->max_in_flight; i++ ) {
+                if ( link->in_flight[i].delivery_tag == 0 )
+                    continue;
+                /* the body and strings move with the message */
+                msg = link->in_flight[i];
+                link->in_flight[i].body.bytes = NULL;
+                link->in_flight[i].strings = NULL;
+                release_slot( link, &(link->in_flight[i]) );
+                add_pending( tube, &msg );
+            }
+            return -1;
+        }
+
+        for ( i = 0, ret = 0; ret == 0 && i < tube->max_in_flight; i++ ) {
+            if ( link->in_flight[i].delivery_tag != 0 )
+                ret = retry_slot( tube, link, &(link->in_flight[i]) );
+        }
+    } while ( ret != 0 );
+
+    return 0;
+}
+
+/**
+ * Try to reopen links that have been down for a while.  If no link is up at
+ * all, every down link is retried right away.
+ */
+static void revive_links( struct hoover_tube *tube ) {
+    time_t now = time(NULL);
+    int i, num_up = 0;
+
+    for ( i = 0; i < tube->num_links; i++ )
+        if ( tube->links[i].connection )
+            num_up++;
+
+    for ( i = 0; i < tube->num_links; i++ ) {
+        struct hoover_link *link = &(tube->links[i]);
+        if ( link->connection )
+            continue;
+        if ( num_up > 0 && now - link->down_since < HOOVER_RECONNECT_INTERVAL )
+            continue;
+        if ( open_link( tube, link ) == 0 )
+            num_up++;
+        else
+            link->down_since = now;
+    }
+    return;
+}
+
+/**
+ * Pick the link that should carry a message of len bytes, then wait until
+ * that link has room for it in its window of unconfirmed messages, and the
+ * tube as a whole holds no more than HOOVER_MAX_HELD_BYTES for republishing.
+ * Returns NULL if every link is down.
+ */
+static struct hoover_link *choose_link( struct hoover_tube *tube, size_t len ) {
+    struct hoover_link *link, *busiest;
+    size_t held;
+    uint64_t t0;
+    int i, n, room, status;
+
+    /* collect any confirms that have already arrived so that the window
+     * sizes are current */
+    for ( i = 0; i < tube->num_links; i++ ) {
+        link = &(tube->links[i]);
+        if ( link->connection && link->num_in_flight > 0 && process_confirms(tube, link, false) != 0 )
+            recover_link(tube, link);
+    }
+    revive_links(tube);
+
+    while ( 1 ) {
+        link = NULL;
+        for ( n = 0; n < tube->num_links; n++ ) {
+            struct hoover_link *candidate = &(tube->links[(tube->next_link + n) % tube->num_links]);
+            if ( !candidate->connection )
+                continue;
+            if ( tube->placement == HOOVER_PLACE_ROUND_ROBIN ) {
+                link = candidate;
+                break;
+            }
+            if ( !link || candidate->bytes_in_flight < link->bytes_in_flight )
+                link = candidate;
+        }
+        if ( !link )
+            return NULL;
+
+        /* only confirms can make the tube hold less, so the busiest link
+         * is waited for if the tube holds too much */
+        held = tube->bytes_pending;
+        busiest = NULL;
+        for ( n = 0; n < tube->num_links; n++ ) {
+            struct hoover_link *candidate = &(tube->links[n]);
+            held += candidate->bytes_in_flight;
+            if ( candidate->connection && candidate->num_in_flight > 0
+            &&   (!busiest || candidate->bytes_in_flight > busiest->bytes_in_flight) )
+                busiest = candidate;
+        }
+
+        room = link->num_in_flight < tube->max_in_flight
+            && ( link->num_in_flight == 0 || link->bytes_in_flight + len <= HOOVER_MAX_IN_FLIGHT_BYTES );
+        if ( room && ( !busiest || held + len <= HOOVER_MAX_HELD_BYTES ) ) {
+            tube->next_link = (int)(link - tube->links + 1) % tube->num_links;
+            return link;
+        }
+
+        /* the link's window is full, or the tube holds too much, so wait
+         * for a broker to catch up */
+        if ( room )
+            link = busiest;
+        t0 = hoover_stats_start();
+        status = process_confirms( tube, link, true );
+        hoover_stats_stop( HOOVER_STAGE_CONFIRM, t0 );
+        if ( status != 0 )
+            recover_link(tube, link);
+    }
+}
+
+/**
+ * Put a message on one of the tube's links.  The tube takes ownership of
+ * msg->body and msg->strings.  Returns -1 if every link is down and the message was dropped.
+ */
+static int queue_publish( struct hoover_tube *tube, struct hoover_publish *msg ) {
+    struct hoover_link *link;
+    struct hoover_publish *slot = NULL;
+    int i;
+
+    if ( msg->attempts > HOOVER_PUBLISH_RETRIES ) {
+        fprintf( stderr, "giving up on %s after %d attempts\n", msg->header.filename, msg->attempts );
+        tube->failed++;
+        free_publish( msg );
+        return -1;
+    }
+
+    if ( !(link = choose_link(tube, msg->body.len)) ) {
+        fprintf( stderr, "dropping %s; no broker is reachable\n", msg->header.filename );
+        tube->failed++;
+        free_publish( msg );
+        return -1;
+    }
+
+    for ( i = 0; i < tube->max_in_flight; i++ ) {
+        if ( link->in_flight[i].delivery_tag == 0 ) {
+            slot = &(link->in_flight[i]);
+            break;
+        }
+    }
+    *slot = *msg;
+    link->num_in_flight++;
+    link->bytes_in_flight += slot->body.len;
+
+    /* the slot now holds a tag, so a failed publish is retried along with
+     * everything else that was in flight on this link */
+    if ( publish_slot(tube, link, slot) != 0 )
+        recover_link(tube, link);
+
+    return 0;
+}
 
+/**
+ * Publish the messages that were set aside when their link went down.  A
+ * message that fails again is set aside again, but only published on the next
+ * call, so every message gets at most one attempt here.
+ */
+static void send_pending( struct hoover_tube *tube ) {
+    struct hoover_publish msg;
+    int n = tube->num_pending;
+
+    /* messages set aside from here on go after these */
+    while ( n-- > 0 && tube->num_pending > 0 ) {
+        msg = tube->pending[0];
+        tube->num_pending--;
+        tube->bytes_pending -= msg.body.len;
+        memmove( tube->pending, tube->pending + 1, tube->num_pending * sizeof(*(tube->pending)) );
+        queue_publish( tube, &msg );
+    }
     return;
 }
+
+/**
+ * Keep a compact copy of a header for as long as its message is unconfirmed.
+ * Its strings are packed into one allocation, msg->strings.  Returns nonzero
+ * if memory ran out or a digest is not hex.
+ */
+static int hold_header( struct hoover_publish *msg, struct hoover_header *header ) {
+    const char *fields[] = { header->filename, header->node_id, header->task_id,
+                             header->compression, header->type, header->hash_algo };
+    const char **copies[] = { &(msg->header.filename), &(msg->header.node_id), &(msg->header.task_id),
+                              &(msg->header.compression), &(msg->header.type), &(msg->header.hash_algo) };
+    size_t lens[sizeof(fields) / sizeof(fields[0])], total = 0, i;
+    char *p;
+
+    if ( hoover_header_view(header, &(msg->header)) != 0 ) {
+        fprintf( stderr, "publish message: %s has a malformed hash\n", header->filename );
+        return -1;
+    }
+    for ( i = 0; i < sizeof(fields) / sizeof(fields[0]); i++ )
+        total += (lens[i] = strlen(fields[i]) + 1);
+    if ( !(p = msg->strings = malloc(total)) ) {
+        fprintf( stderr, "publish message: could not allocate header of %s\n", header->filename );
+        return -1;
+    }
+    for ( i = 0; i < sizeof(fields) / sizeof(fields[0]); i++ ) {
+        memcpy( p, fields[i], lens[i] );
+        *copies[i] = p;
+        p += lens[i];
+    }
+    return 0;
+}
+
+/**
+ * Queue one AMQP message for publishing.  chunk is NULL unless the message
+ * carries one piece of an HDO that was split across several messages.  The
+ * tube keeps body until the broker confirms the message; if take_body is set,
+ * the tube takes ownership of body.bytes (which must come from malloc)
+ * instead of copying it.
+ *
+ * Blocks only while the chosen link's window of unconfirmed messages is full.
+ */
+static int publish_body( struct hoover_tube *tube,
+                         struct hoover_header *header,
+                         struct hoover_chunk_info *chunk,
+                         amqp_bytes_t body,
+                         int take_body ) {
+    struct hoover_publish msg;
+    int ret;
+
+    memset( &msg, 0, sizeof(msg) );
+    if ( hold_header(&msg, header) != 0 )
+        return -1;
+    msg.has_chunk = chunk != NULL;
+    if ( chunk )
+        msg.chunk = *chunk;
+    if ( take_body ) {
+        msg.body = body;
+    }
+    else {
+        msg.body.len = body.len;
+        if ( !(msg.body.bytes = malloc(body.len ? body.len : 1)) ) {
+            fprintf( stderr, "publish message: could not allocate %lu bytes\n", (unsigned long)body.len );
+            free( msg.strings );
+            return -1;
+        }
+        memcpy( msg.body.bytes, body.bytes, body.len );
+    }
+
+    ret = queue_publish( tube, &msg );
+    send_pending( tube );
+    return ret;
+}
+
+/**
+ * Publish one chunk of a split HDO, stamping it with its own checksum.  Chunks
+ * are hashed with the same algorithm as the HDO itself.
+ */
+static int publish_chunk( struct hoover_tube *tube,
+                          struct hoover_header *header,
+                          struct hoover_chunk_info *chunk,
+                          const void *data,
+                          size_t len ) {
+    amqp_bytes_t body;
+
+    if ( hoover_hash_data(header->hash_algo, data, len, chunk->sha_hash) != 0 ) {
+        fprintf( stderr, "publish_chunk: cannot hash chunk with %s\n", header->hash_algo );
+        return -1;
+    }
+
+    body.len = len;
+    body.bytes = (void *)data;
+    return publish_body( tube, header, chunk, body, false );
+}
+
+/**
+ * Split an HDO into messages of at most max_transmit_size bytes, or
+ * HOOVER_STREAM_CHUNK_SIZE if that is not set.  Chunks are independent
+ * messages, so the broker is free to spread them across consumers; consumers
+ * use the transfer_id to reassemble them.
+ *
+ * The total number of chunks in a streaming HDO is not known until the stream
+ * ends, so only its last chunk carries a nonzero chunk_count along with the
+ * final hash and size of the whole HDO.  A stream that turns out to fit in
+ * one chunk is sent in one piece.
+ */
+static int send_chunked_message( struct hoover_tube *tube,
+                                 struct hoover_data_obj *hdo,
+                                 struct hoover_header *header ) {
+    static unsigned long transfer_count = 0;
+    struct hoover_chunk_info chunk;
+    size_t max_len = tube->max_transmit_size ? tube->max_transmit_size : HOOVER_STREAM_CHUNK_SIZE;
+    int errors = 0;
+
+    memset( &chunk, 0, sizeof(chunk) );
+    snprintf( chunk.transfer_id, HOOVER_TRANSFER_ID_LEN, "%s.%d.%ld.%lu",
+        header->node_id, (int)getpid(), (long)time(NULL), ++transfer_count );
+
+    if ( !hdo->stream ) {
+        size_t offset = 0, len;
+        chunk.count = hdo->size ? (hdo->size + max_len - 1) / max_len : 1;
+        do {
+            len = hdo->size - offset;
+            if ( len > max_len )
+                len = max_len;
+            if ( publish_chunk( tube, header, &chunk, (char *)hdo->data + offset, len ) != 0 )
+                errors++;
+            offset += len;
+            chunk.index++;
+        } while ( offset < hdo->size );
+        return errors ? -1 : 0;
+    }
+
+    /* repackage the stream's chunks into messages of exactly max_len bytes.
+     * A full buffer is only published once more data shows up, so that the
+     * last message can be marked as such. */
+    unsigned char *buf;
+    const void *data;
+    size_t buf_len = 0, len, n;
+    int ret;
+
+    if ( !(buf = malloc(max_len)) ) {
+        fprintf( stderr, "hoover_send_message: could not allocate chunk buffer\n" );
+        return -1;
+    }
+    while ( (ret = hoover_read_hdo_chunk(hdo, &data, &len)) > 0 ) {
+        while ( len > 0 ) {
+            if ( buf_len == max_len ) {
+                if ( publish_chunk( tube, header, &chunk, buf, buf_len ) != 0 )
+                    errors++;
+                chunk.index++;
+                buf_len = 0;
+            }
+            n = max_len - buf_len;
+            if ( n > len )
+                n = len;
+            memcpy( buf + buf_len, data, n );
+            buf_len += n;
+            data = (const char *)data + n;
+            len -= n;
+        }
+    }
+    if ( ret < 0 ) {
+        fprintf( stderr, "hoover_send_message: failed to read HDO stream\n" );
+        free( buf );
+        return -1;
+    }
+
+    update_hoover_header( header, hdo );
+    if ( chunk.index == 0 ) {
+        amqp_bytes_t body;
+        body.len = buf_len;
+        body.bytes = buf;
+        /* the tube keeps the buffer until the broker confirms it */
+        return publish_body( tube, header, NULL, body, true );
+    }
+    chunk.count = chunk.index + 1;
+    if ( publish_chunk( tube, header, &chunk, buf, buf_len ) != 0 )
+        errors++;
+    free( buf );
+    return errors ? -1 : 0;
+}
+
+/**
+ * Convert Hoover structures into an AMQP message and send it.  Streaming HDOs
+ * are always sent in chunks, since an AMQP message must declare its size up
+ * front.  If the tube has a max_transmit_size, other HDOs that exceed it are
+ * split across several messages too.
+ *
+ * Returns as soon as the message is on its way; a return of 0 only means that
+ * it was published.  Use hoover_flush_tube() to find out whether the broker
+ * actually accepted it.
+ */
+static int send_message( struct hoover_tube *tube,
+                         struct hoover_data_obj *hdo,
+                         struct hoover_header *header ) {
+    amqp_bytes_t body;
+
+    if ( hdo->stream
+    ||   (tube->max_transmit_size > 0 && hdo->size > tube->max_transmit_size) ) {
+        return send_chunked_message( tube, hdo, header );
+    }
+
+    /* convert HDO to amqp_bytes_t */
+    body.len = hdo->size;
+    body.bytes = hdo->data;
+    return publish_body( tube, header, NULL, body, false );
+}
+
+/**
+ * Send a message and charge the time it took to the send stage.  hdo->size is
+ * final by the time a streaming HDO has been sent.
+ */
+int hoover_send_message( struct hoover_tube *tube,
+                         struct hoover_data_obj *hdo,
+                         struct hoover_header *header ) {
+    uint64_t t0 = hoover_stats_start();
+    int ret = send_message( tube, hdo, header );
+    hoover_stats_stop( HOOVER_STAGE_SEND, t0 );
+    hoover_stats_count( HOOVER_COUNT_MESSAGES, 1 );
+    hoover_stats_count( HOOVER_COUNT_MESSAGE_BYTES, hdo->size );
+    return ret;
+}
+
+/**
+ * Wait until the brokers have confirmed every message published on this tube,
+ * republishing any that they nack or that are lost with a connection.  Returns
+ * the number of messages that could not be delivered since the last flush, so
+ * 0 means that everything sent so far is safely with a broker.
+ */
+int hoover_flush_tube( struct hoover_tube *tube ) {
+    uint64_t t0;
+    int i, failed, pending, status;
+
+    do {
+        send_pending( tube );
+        pending = 0;
+        for ( i = 0; i < tube->num_links; i++ ) {
+            struct hoover_link *link = &(tube->links[i]);
+            if ( link->num_in_flight == 0 )
+                continue;
+            pending = 1;
+            t0 = hoover_stats_start();
+            status = process_confirms( tube, link, true );
+            hoover_stats_stop( HOOVER_STAGE_CONFIRM, t0 );
+            if ( status != 0 )
+                recover_link(tube, link);
+        }
+    } while ( pending || tube->num_pending > 0 );
+
+    failed = tube->failed;
+    tube->failed = 0;
+    hoover_stats_count( HOOVER_COUNT_FAILED, failed );
+    return failed;
+}
+
+/*******************************************************************************
+ * Receiving messages
+ ******************************************************************************/
+
+/**
+ * Copy a string-valued header into a fixed-size field, truncating if needed.
+ */
+static void copy_header_string( amqp_field_value_t *value, char *dest, size_t dest_len ) {
+    size_t len;
+    if ( value->kind != AMQP_FIELD_KIND_UTF8 && value->kind != AMQP_FIELD_KIND_BYTES )
+        return;
+    len = value->value.bytes.len < dest_len - 1 ? value->value.bytes.len : dest_len - 1;
+    memcpy( dest, value->value.bytes.bytes, len );
+    dest[len] = '\0';
+    return;
+}
+
+/**
+ * Read an integer-valued header of any width.
+ */
+static int64_t header_integer( amqp_field_value_t *value ) {
+    switch ( value->kind ) {
+    case AMQP_FIELD_KIND_I8:  return value->value.i8;
+    case AMQP_FIELD_KIND_U8:  return value->value.u8;
+    case AMQP_FIELD_KIND_I16: return value->value.i16;
+    case AMQP_FIELD_KIND_U16: return value->value.u16;
+    case AMQP_FIELD_KIND_I32: return value->value.i32;
+    case AMQP_FIELD_KIND_U32: return value->value.u32;
+    case AMQP_FIELD_KIND_I64: return value->value.i64;
+    case AMQP_FIELD_KIND_U64: return (int64_t)value->value.u64;
+    default:                  return 0;
+    }
+}
+
+/**
+ * Convert the AMQP table attached to a message back into a hoover_header and,
+ * if the message is one chunk of a split HDO, a hoover_chunk_info.  The
+ * inverse of create_amqp_header_table().
+ */
+static void parse_amqp_header_table( amqp_table_t *table, struct hoover_message *msg ) {
+    struct hoover_header *header = &(msg->header);
+    struct hoover_chunk_info *chunk = &(msg->chunk);
+    int i;
+
+    for ( i = 0; i < table->num_entries; i++ ) {
+        amqp_table_entry_t *entry = &(table->entries[i]);
+        char key[32];
+        size_t len = entry->key.len < sizeof(key) - 1 ? entry->key.len : sizeof(key) - 1;
+
+        memcpy( key, entry->key.bytes, len );
+        key[len] = '\0';
+
+        if ( strcmp(key, "filename") == 0 )
+            copy_header_string( &(entry->value), header->filename, sizeof(header->filename) );
+        else if ( strcmp(key, "node_id") == 0 )
+            copy_header_string( &(entry->value), header->node_id, sizeof(header->node_id) );
+        else if ( strcmp(key, "task_id") == 0 )
+            copy_header_string( &(entry->value), header->task_id, sizeof(header->task_id) );
+        else if ( strcmp(key, "compression") == 0 )
+            copy_header_string( &(entry->value), header->compression, sizeof(header->compression) );
+        else if ( strcmp(key, "sha_hash") == 0 )
+            copy_header_string( &(entry->value), (char*)header->sha_hash, sizeof(header->sha_hash) );
+        else if ( strcmp(key, "size") == 0 )
+            header->size = header_integer( &(entry->value) );
+        else if ( strcmp(key, "type") == 0 )
+            copy_header_string( &(entry->value), header->type, sizeof(header->type) );
+        else if ( strcmp(key, "hash_orig") == 0 )
+            copy_header_string( &(entry->value), header->hash_orig, sizeof(header->hash_orig) );
+        else if ( strcmp(key, "hash_algo") == 0 )
+            copy_header_string( &(entry->value), header->hash_algo, sizeof(header->hash_algo) );
+        else if ( strcmp(key, "transfer_id") == 0 ) {
+            copy_header_string( &(entry->value), chunk->transfer_id, sizeof(chunk->transfer_id) );
+            msg->has_chunk = chunk->transfer_id[0] != '\0';
+        }
+        else if ( strcmp(key, "chunk_index") == 0 )
+            chunk->index = header_integer( &(entry->value) );
+        else if ( strcmp(key, "chunk_count") == 0 )
+            chunk->count = header_integer( &(entry->value) );
+        else if ( strcmp(key, "chunk_sha_hash") == 0 )
+            copy_header_string( &(entry->value), chunk->sha_hash, sizeof(chunk->sha_hash) );
+    }
+    return;
+}
+
+/**
+ * Declare the tube's queue on a link, bind it to the exchange, and start
+ * consuming from it with at most prefetch unacknowledged deliveries.  If the
+ * configuration names no queue, the first link has the broker name one and
+ * every other link shares it, so that each message is only delivered once.
+ */
+static int start_consuming( struct hoover_tube *tube, struct hoover_link *link ) {
+    struct hoover_tube_config *config = tube->config;
+    amqp_queue_declare_ok_t *declared;
+    amqp_bytes_t queue;
+    int prefetch = config->prefetch > 0 ? config->prefetch : HOOVER_PREFETCH;
+
+    if ( tube->queue.bytes )
+        queue = tube->queue;
+    else
+        queue = amqp_cstring_bytes( config->queue ? config->queue : "" );
+
+    declared = amqp_queue_declare(
+        link->connection,   /* amqp_connection_state_t state */
+        link->channel,      /* amqp_channel_t channel */
+        queue,              /* amqp_bytes_t queue */
+        0,                  /* amqp_boolean_t passive */
+        0,                  /* amqp_boolean_t durable */
+        0,                  /* amqp_boolean_t exclusive */
+        0,                  /* amqp_boolean_t auto_delete */
+        amqp_empty_table    /* amqp_table_t arguments */
+    );
+    if ( parse_amqp_response(amqp_get_rpc_reply(link->connection), "queue declare", false) || !declared )
+        return -1;
+    if ( !tube->queue.bytes ) {
+        tube->queue = amqp_bytes_malloc_dup( declared->queue.len ? declared->queue : queue );
+        if ( !tube->queue.bytes ) {
+            fprintf( stderr, "start_consuming: could not allocate queue name\n" );
+            return -1;
+        }
+    }
+
+    amqp_queue_bind(link->connection, link->channel, tube->queue, tube->exchange, tube->routing_key, amqp_empty_table);
+    if ( parse_amqp_response(amqp_get_rpc_reply(link->connection), "queue bind", false) )
+        return -1;
+
+    amqp_basic_qos(link->connection, link->channel, 0, prefetch, 0);
+    if ( parse_amqp_response(amqp_get_rpc_reply(link->connection), "basic qos", false) )
+        return -1;
+
+    amqp_basic_consume(
+        link->connection,   /* amqp_connection_state_t state */
+        link->channel,      /* amqp_channel_t channel */
+        tube->queue,        /* amqp_bytes_t queue */
+        amqp_empty_bytes,   /* amqp_bytes_t consumer_tag */
+        0,                  /* amqp_boolean_t no_local */
+        0,                  /* amqp_boolean_t no_ack */
+        0,                  /* amqp_boolean_t exclusive */
+        amqp_empty_table    /* amqp_table_t arguments */
+    );
+    if ( parse_amqp_response(amqp_get_rpc_reply(link->connection), "basic consume", false) )
+        return -1;
+
+    link->consuming = 1;
+    return 0;
+}
+
+/**
+ * Take one delivery off a link without blocking.  Returns 1 and sets *msg if
+ * there was one, 0 if there was none, or -1 if the link has failed.
+ */
+static int consume_link( struct hoover_tube *tube, int i, struct hoover_message **msg ) {
+    struct hoover_link *link = &(tube->links[i]);
+    struct hoover_message *m;
+    struct timeval no_wait = { 0, 0 };
+    amqp_rpc_reply_t reply;
+    amqp_frame_t frame;
+
+    if ( !(m = calloc(1, sizeof(*m))) ) {
+        fprintf( stderr, "consume_link: could not allocate message\n" );
+        return 0;
+    }
+
+    amqp_maybe_release_buffers(link->connection);
+    reply = amqp_consume_message(link->connection, &(m->envelope), &no_wait, 0);
+
+    if ( reply.reply_type == AMQP_RESPONSE_NORMAL ) {
+        if ( m->envelope.message.properties._flags & AMQP_BASIC_HEADERS_FLAG )
+            parse_amqp_header_table( &(m->envelope.message.properties.headers), m );
+        m->body = m->envelope.message.body.bytes;
+        m->size = m->envelope.message.body.len;
+        m->link = i;
+        m->epoch = link->epoch;
+        *msg = m;
+        return 1;
+    }
+    free(m);
+
+    if ( reply.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION
+    &&   reply.library_error == AMQP_STATUS_TIMEOUT )
+        return 0;
+
+    /* something other than a delivery arrived; most likely the broker is
+     * closing the channel or connection */
+    if ( reply.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION
+    &&   reply.library_error == AMQP_STATUS_UNEXPECTED_STATE ) {
+        if ( amqp_simple_wait_frame_noblock(link->connection, &frame, &no_wait) != AMQP_STATUS_OK )
+            return 0;
+        if ( frame.frame_type != AMQP_FRAME_METHOD )
+            return 0;
+        if ( frame.payload.method.id == AMQP_CHANNEL_CLOSE_METHOD ) {
+            amqp_channel_close_t *c = (amqp_channel_close_t *)frame.payload.method.decoded;
+            fprintf( stderr, "consume message: %s: server channel error %d, message: %.*s\n",
+                link->hostname, c->reply_code, (int)c->reply_text.len, (char *)c->reply_text.bytes );
+            return -1;
+        }
+        if ( frame.payload.method.id == AMQP_CONNECTION_CLOSE_METHOD ) {
+            amqp_connection_close_t *c = (amqp_connection_close_t *)frame.payload.method.decoded;
+            fprintf( stderr, "consume message: %s: server connection error %d, message: %.*s\n",
+                link->hostname, c->reply_code, (int)c->reply_text.len, (char *)c->reply_text.bytes );
+            return -1;
+        }
+        return 0;
+    }
+
+    parse_amqp_response(reply, "consume message", false);
+    return -1;
+}
+
+/**
+ * Milliseconds on a clock that only moves forward
+ */
+static int64_t now_ms( void ) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Wait up to timeout_ms milliseconds for a message from any of the tube's
+ * links.  Consuming starts on each link the first time this is called after
+ * it is opened, and the links take turns so that a busy one cannot starve the
+ * others.  Returns 1 and sets *msg if a message arrived, 0 on timeout, or -1
+ * if no link could be opened.
+ *
+ * The message must be settled with hoover_ack_message() or
+ * hoover_reject_message().  rabbitmq-c connections are not thread-safe, so only
+ * the thread that receives from a tube may settle its messages.
+ */
+int hoover_receive_message( struct hoover_tube *tube, struct hoover_message **msg, int timeout_ms ) {
+    struct pollfd fds[HOOVER_MAX_CONNECTIONS];
+    int which[HOOVER_MAX_CONNECTIONS];
+    int64_t deadline = now_ms() + timeout_ms;
+    int i, n, num_fds, num_up, ret;
+
+    while ( 1 ) {
+        revive_links( tube );
+
+        num_fds = 0;
+        num_up = 0;
+        for ( n = 0; n < tube->num_links; n++ ) {
+            struct hoover_link *link;
+            i = (tube->next_link + n) % tube->num_links;
+            link = &(tube->links[i]);
+            if ( !link->connection )
+                continue;
+            if ( !link->consuming && start_consuming(tube, link) != 0 ) {
+                close_link( link );
+                link->down_since = time(NULL);
+                continue;
+            }
+            num_up++;
+
+            /* frames that were already read off the socket will not wake up
+             * poll(), so drain them first */
+            if ( amqp_frames_enqueued(link->connection) || amqp_data_in_buffer(link->connection) ) {
+                ret = consume_link( tube, i, msg );
+                if ( ret == 1 ) {
+                    tube->next_link = (i + 1) % tube->num_links;
+                    return 1;
+                }
+                else if ( ret < 0 ) {
+                    close_link( link );
+                    link->down_since = time(NULL);
+                    num_up--;
+                    continue;
+                }
+            }
+            fds[num_fds].fd = amqp_get_sockfd(link->connection);
+            fds[num_fds].events = POLLIN;
+            fds[num_fds].revents = 0;
+            which[num_fds] = i;
+            num_fds++;
+        }
+
+        if ( num_up == 0 )
+            return -1;
+
+        timeout_ms = (int)(deadline - now_ms());
+        if ( timeout_ms < 0 )
+            return 0;
+        if ( poll(fds, num_fds, timeout_ms) <= 0 )
+            continue;
+
+        for ( n = 0; n < num_fds; n++ ) {
+            if ( !fds[n].revents )
+                continue;
+            i = which[n];
+            ret = consume_link( tube, i, msg );
+            if ( ret == 1 ) {
+                tube->next_link = (i + 1) % tube->num_links;
+                return 1;
+            }
+            else if ( ret < 0 ) {
+                close_link( &(tube->links[i]) );
+                tube->links[i].down_since = time(NULL);
+            }
+        }
+    }
+}
+
+/**
+ * Ack, nack, or requeue a message, then free it.  If the link it arrived on
+ * has failed since, the broker has already put it back on the queue, so there
+ * is nothing left to settle.
+ */
+static int settle_message( struct hoover_tube *tube, struct hoover_message *msg, int ack, int requeue ) {
+    struct hoover_link *link = &(tube->links[msg->link]);
+    uint64_t tag = msg->envelope.delivery_tag;
+    int status, ret = 0;
+
+    if ( !link->connection || link->epoch != msg->epoch ) {
+        fprintf( stderr, "settle message: connection lost since delivery tag %lu arrived; it will be redelivered\n",
+            (unsigned long)tag );
+        ret = -1;
+    }
+    else {
+        if ( ack )
+            status = amqp_basic_ack(link->connection, link->channel, tag, 0);
+        else
+            status = amqp_basic_nack(link->connection, link->channel, tag, 0, requeue);
+        if ( status != AMQP_STATUS_OK ) {
+            fprintf( stderr, "settle message: %s: %s\n", link->hostname, amqp_error_string2(status) );
+            close_link( link );
+            link->down_since = time(NULL);
+            ret = -1;
+        }
+    }
+
+    amqp_destroy_envelope( &(msg->envelope) );
+    free( msg );
+    return ret;
+}
+
+/**
+ * Tell the broker that a message has been dealt with, and free it.
+ */
+int hoover_ack_message( struct hoover_tube *tube, struct hoover_message *msg ) {
+    return settle_message( tube, msg, true, false );
+}
+
+/**
+ * Hand a message back to the broker, and free it.  If requeue is set, it will
+ * be delivered again, possibly to another consumer; otherwise it is dropped
+ * or dead-lettered.
+ */
+int hoover_reject_message( struct hoover_tube *tube, struct hoover_message *msg, int requeue ) {
+    return settle_message( tube, msg, false, requeue );
+}
@@ -1,6 +1,7 @@
 #include <amqp_ssl_socket.h>
 #include <amqp_tcp_socket.h>
 #include <amqp_framing.h>
+#include <time.h>
 
 #include "hooverio.h"
 
@@ -8,13 +9,72 @@
 #define HOOVER_MAX_SERVERS 256
 #endif
 
+/* most connections a single tube may stripe messages across */
+#ifndef HOOVER_MAX_CONNECTIONS
+#define HOOVER_MAX_CONNECTIONS 64
+#endif
+
+/* seconds to leave a failed connection down before trying to reopen it */
+#ifndef HOOVER_RECONNECT_INTERVAL
+#define HOOVER_RECONNECT_INTERVAL 30
+#endif
+
+/* publishes that may await a broker confirm at once; see max_in_flight */
+#ifndef HOOVER_MAX_IN_FLIGHT
+#define HOOVER_MAX_IN_FLIGHT 64
+#endif
+
+/* bytes of message bodies that may await a broker confirm at once */
+#ifndef HOOVER_MAX_IN_FLIGHT_BYTES
+#define HOOVER_MAX_IN_FLIGHT_BYTES (256 * 1024 * 1024)
+#endif
+
+/* bytes of message bodies that a tube keeps for republishing, over all of its
+ * links and the messages set aside from links that went down */
+#ifndef HOOVER_MAX_HELD_BYTES
+#define HOOVER_MAX_HELD_BYTES (512 * 1024 * 1024)
+#endif
+
+/* bytes of a streaming HDO sent in each message unless max_transmit_size is
+ * set; a stream is never held in memory as a whole */
+#ifndef HOOVER_STREAM_CHUNK_SIZE
+#define HOOVER_STREAM_CHUNK_SIZE (8 * 1024 * 1024)
+#endif
+
+/* times a nacked or lost message is republished before giving up on it */
+#ifndef HOOVER_PUBLISH_RETRIES
+#define HOOVER_PUBLISH_RETRIES 3
+#endif
+
+/* seconds to wait for a confirm before assuming the connection is dead */
+#ifndef HOOVER_CONFIRM_TIMEOUT
+#define HOOVER_CONFIRM_TIMEOUT 60
+#endif
+
+/* unacknowledged messages a consumer may hold per connection; see prefetch */
+#ifndef HOOVER_PREFETCH
+#define HOOVER_PREFETCH 64
+#endif
+
 #ifndef HOOVER_CONFIG_FILE
 #define HOOVER_CONFIG_FILE "/etc/opt/nersc/slurmd_log_rotate_mq.conf"
 #endif
 
+/* environment variable that names another config file, e.g. for tests */
+#ifndef HOOVER_CONFIG_VAR
+#define HOOVER_CONFIG_VAR "HOOVER_CONFIG"
+#endif
+
 /*
  * Global structures
  */
+
+/* how a tube with several connections picks one for each message */
+enum hoover_placement {
+    HOOVER_PLACE_ROUND_ROBIN = 0,  /* take turns */
+    HOOVER_PLACE_LEAST_BYTES       /* fewest unconfirmed bytes */
+};
+
 struct hoover_tube_config {
     char *servers[HOOVER_MAX_SERVERS];
     int max_hosts;
@@ -28,18 +88,95 @@ struct hoover_tube_config {
     char *queue;
     char *routing_key;
     size_t max_transmit_size;
+    char *compression;        /* codec spec for hoover_set_codec(), or NULL */
+    char *hash;               /* hash for hoover_set_hash(), or NULL */
+    int hash_compressed;      /* also hash the compressed payload */
+    int adaptive_compression; /* store data that would not shrink */
+    size_t block_size;        /* bytes read at a time; 0 = pick for each file */
+    char *block_size_cache;   /* calibrate block sizes and keep them here, or NULL */
+    size_t bundle_size;       /* bundle small HDOs into messages this big; 0 = off */
+    int bundle_count;         /* most HDOs per bundle; 0 = default */
+    char *index_file;         /* remembers delivered files across runs, or NULL */
+    char *spool_dir;          /* journal messages here before sending, or NULL */
+    int binary_manifest;      /* send the manifest in the binary format, not JSON */
+    char *stats_file;         /* producers write their statistics here, or NULL */
+    int stats_interval;       /* seconds between statistics updates; 0 = only at exit */
+    int max_in_flight;        /* unconfirmed publishes allowed per connection; 0 = default */
+    int connections;          /* brokers to stripe messages across; 0 = 1 */
+    enum hoover_placement placement;
+    int prefetch;             /* unacked deliveries a consumer may hold per connection; 0 = default */
+    char *output_dir;         /* where consumers write received files, or NULL */
+    char *chunk_dir;          /* where consumers stage chunks of split HDOs, or NULL */
+    int decompress;           /* consumers decode files after verifying them */
     int use_ssl;
 };
 
-/* Each hoover_tube just aggregates a connection, a socket, a channel, and an
-   exchange into a single object for simplicity.  For simple message passing,
-   we only need to define one of each to send messages. */
-struct hoover_tube {
+/* hoover_publish is one message that has been handed to the broker but not yet
+   confirmed.  It keeps everything needed to publish the message again, since
+   the HDO it came from is long gone by the time the broker nacks it. */
+struct hoover_publish {
+    uint64_t delivery_tag;                    /* broker's sequence number; 0 = free slot */
+    int attempts;                             /* times this message has been published */
+    int has_chunk;                            /* message is one chunk of a split HDO */
+    struct hoover_header_ref header;          /* strings point into strings */
+    char *strings;                            /* private copy of the header's strings */
+    struct hoover_chunk_info chunk;
+    amqp_bytes_t body;                        /* private copy of the message body */
+};
+
+/* A hoover_link is one connection to one broker.  Its channel is in confirm
+   mode, so publishes are pipelined: up to max_in_flight messages may be
+   awaiting an ack from the broker at once. */
+struct hoover_link {
     amqp_socket_t *socket;
     amqp_channel_t channel; /* I have no idea why channel passed around by value by rabbitmq-c */
-    amqp_connection_state_t connection;
+    amqp_connection_state_t connection; /* NULL while the link is down */
+    char *hostname;                     /* aliases the tube config's servers */
+    time_t down_since;                  /* when the link last failed */
+    struct hoover_publish *in_flight;   /* max_in_flight slots */
+    int num_in_flight;
+    size_t bytes_in_flight;
+    uint64_t next_tag;                  /* delivery tag of the last publish */
+    int consuming;                      /* basic.consume has been issued on the channel */
+    unsigned long epoch;                /* times the link has been opened */
+};
+
+/* Each hoover_tube just aggregates connections, sockets, channels, and an
+   exchange into a single object for simplicity.  Messages are spread across
+   one link per broker so that a single TCP stream does not limit how fast a
+   node can drain, and a message whose link fails is moved to another one. */
+struct hoover_tube {
     amqp_bytes_t exchange;
     amqp_bytes_t routing_key;
+    size_t max_transmit_size; /* largest message body to send; 0 = unlimited */
+    struct hoover_tube_config *config; /* to reconnect after a broker goes away */
+    struct hoover_link *links;
+    int num_links;
+    enum hoover_placement placement;
+    int next_link;                     /* next turn for round-robin placement */
+    int max_in_flight;
+    int failed;                        /* messages given up on since the last flush */
+    struct hoover_publish *pending;    /* messages waiting to be published again */
+    int num_pending;
+    int max_pending;
+    size_t bytes_pending;              /* bytes of bodies in pending */
+    amqp_bytes_t queue;                /* queue consumed from, once declared */
+};
+
+/* hoover_message is one message taken off a tube by hoover_receive_message().
+   The broker will not hand it to another consumer unless the connection it
+   arrived on fails before it is settled with hoover_ack_message() or
+   hoover_reject_message(). */
+struct hoover_message {
+    struct hoover_header header;
+    int has_chunk;                     /* message is one chunk of a split HDO */
+    struct hoover_chunk_info chunk;
+    void *body;                        /* message body; owned by the envelope */
+    size_t size;
+    int local;                         /* never crossed a network; always 0 here */
+    int link;                          /* link the message arrived on */
+    unsigned long epoch;               /* that link's epoch at the time */
+    amqp_envelope_t envelope;
 };
 
 struct hoover_tube *create_hoover_tube(struct hoover_tube_config *config);
@@ -49,6 +186,15 @@ struct hoover_tube_config *read_tube_config();
 void save_tube_config(struct hoover_tube_config *config, FILE *out);
 void free_tube_config(struct hoover_tube_config *config);
 
-void hoover_send_message(struct hoover_tube *tube,
-                         struct hoover_data_obj *hdo,
-                         struct hoover_header *header);
+int hoover_send_message(struct hoover_tube *tube,
+                        struct hoover_data_obj *hdo,
+                        struct hoover_header *header);
+int hoover_flush_tube(struct hoover_tube *tube);
+
+int hoover_receive_message(struct hoover_tube *tube,
+                           struct hoover_message **msg,
+                           int timeout_ms);
+int hoover_ack_message(struct hoover_tube *tube, struct hoover_message *msg);
+int hoover_reject_message(struct hoover_tube *tube,
+                          struct hoover_message *msg,
+                          int requeue);
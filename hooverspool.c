@@ -0,0 +1,543 @@
+/*******************************************************************************
+ *  hooverspool.c
+ *
+ *  Write-ahead spool of messages on local disk, so that messages that could
+ *  not be delivered are kept until a broker can take them
+ ******************************************************************************/
+#if !defined(_XOPEN_SOURCE) || _XOPEN_SOURCE < 700
+    #define _XOPEN_SOURCE 700
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <zlib.h>
+
+#include "hooverspool.h"
+
+#define HOOVER_SPOOL_MAGIC "HVS1"
+#define HOOVER_SPOOL_ENTRY_MAGIC "HVSE"
+#define HOOVER_SPOOL_HEADER_LEN 8  /* magic + uint32_t version */
+#define HOOVER_SPOOL_JOURNAL "journal"
+#define HOOVER_SPOOL_CHECKPOINT "checkpoint"
+
+/* what precedes every entry in the journal; the payload follows, then the
+ * encoded header */
+struct spool_entry {
+    char magic[4];
+    uint32_t header_len;
+    uint64_t payload_len;
+    uint32_t crc;                          /* crc32 of payload, then header */
+    uint32_t reserved;
+};
+
+/* one of the two slots of the checkpoint file */
+struct spool_checkpoint {
+    uint64_t seq;
+    uint64_t offset;
+    uint32_t crc;                          /* crc32 of seq and offset */
+    uint32_t reserved;
+};
+
+/* largest encoded header: eight strings with 16-bit lengths, then the size */
+#define SPOOL_HEADER_MAX (sizeof(struct hoover_header) + 8 * sizeof(uint16_t) + sizeof(uint64_t))
+
+/*******************************************************************************
+ * Private functions
+ ******************************************************************************/
+
+/**
+ *  Read a buffer in full; returns -1 on error or if the file is too short
+ */
+static int read_all( int fd, void *buf, size_t len, off_t offset ) {
+    char *p = buf;
+    while ( len > 0 ) {
+        ssize_t n = pread(fd, p, len, offset);
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+            return -1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+ *  Encode the fields of a header that need to survive in the journal.  Returns
+ *  the encoded length.
+ */
+static size_t encode_header( struct hoover_header *header, unsigned char *buf ) {
+    const char *fields[] = { header->filename, header->node_id, header->task_id,
+                             header->compression, header->type,
+                             (const char *)header->sha_hash, header->hash_orig,
+                             header->hash_algo };
+    size_t i, len = 0;
+    uint64_t size = header->size;
+
+    for ( i = 0; i < sizeof(fields) / sizeof(*fields); i++ ) {
+        uint16_t field_len = strlen(fields[i]);
+        memcpy( buf + len, &field_len, sizeof(field_len) );
+        memcpy( buf + len + sizeof(field_len), fields[i], field_len );
+        len += sizeof(field_len) + field_len;
+    }
+    memcpy( buf + len, &size, sizeof(size) );
+    return len + sizeof(size);
+}
+
+/**
+ *  Decode a header written by encode_header().  Returns -1 if it does not fit.
+ */
+static int decode_header( const unsigned char *buf, size_t len, struct hoover_header *header ) {
+    struct { char *field; size_t max; } fields[] = {
+        { header->filename, sizeof(header->filename) },
+        { header->node_id, sizeof(header->node_id) },
+        { header->task_id, sizeof(header->task_id) },
+        { header->compression, sizeof(header->compression) },
+        { header->type, sizeof(header->type) },
+        { (char *)header->sha_hash, sizeof(header->sha_hash) },
+        { header->hash_orig, sizeof(header->hash_orig) },
+        { header->hash_algo, sizeof(header->hash_algo) },
+    };
+    size_t i, pos = 0;
+    uint64_t size;
+
+    memset( header, 0, sizeof(*header) );
+    for ( i = 0; i < sizeof(fields) / sizeof(*fields); i++ ) {
+        uint16_t field_len;
+        if ( pos + sizeof(field_len) > len )
+            return -1;
+        memcpy( &field_len, buf + pos, sizeof(field_len) );
+        pos += sizeof(field_len);
+        if ( field_len >= fields[i].max || pos + field_len > len )
+            return -1;
+        memcpy( fields[i].field, buf + pos, field_len );
+        pos += field_len;
+    }
+    if ( pos + sizeof(size) != len )
+        return -1;
+    memcpy( &size, buf + pos, sizeof(size) );
+    header->size = size;
+    return 0;
+}
+
+/**
+ *  Check the entry at offset.  Returns the offset of the next entry, or -1 if
+ *  this one is incomplete or damaged.
+ */
+static off_t check_entry( int fd, off_t offset, off_t file_size, unsigned char *buf, size_t buf_len ) {
+    struct spool_entry entry;
+    struct hoover_header header;
+    off_t pos, payload_end, entry_end;
+    uLong crc = crc32(0L, Z_NULL, 0);
+
+    if ( file_size - offset < (off_t)sizeof(entry)
+    ||   read_all(fd, &entry, sizeof(entry), offset) != 0
+    ||   memcmp(entry.magic, HOOVER_SPOOL_ENTRY_MAGIC, 4) != 0
+    ||   entry.header_len > SPOOL_HEADER_MAX
+    ||   entry.payload_len > (uint64_t)(file_size - offset) )
+        return -1;
+
+    payload_end = offset + sizeof(entry) + entry.payload_len;
+    entry_end = payload_end + entry.header_len;
+    if ( entry_end > file_size )
+        return -1;
+
+    for ( pos = offset + sizeof(entry); pos < entry_end; ) {
+        size_t len = buf_len;
+        if ( pos < payload_end && (off_t)len > payload_end - pos )
+            len = payload_end - pos;  /* keep the header in one read */
+        if ( (off_t)len > entry_end - pos )
+            len = entry_end - pos;
+        if ( read_all(fd, buf, len, pos) != 0 )
+            return -1;
+        crc = crc32(crc, buf, len);
+        pos += len;
+    }
+    if ( crc != entry.crc || decode_header(buf, entry.header_len, &header) != 0 )
+        return -1;
+
+    return entry_end;
+}
+
+/**
+ *  Write an empty journal header
+ */
+static int reset_journal( int fd ) {
+    char header[HOOVER_SPOOL_HEADER_LEN];
+    uint32_t version = 1;
+
+    memcpy( header, HOOVER_SPOOL_MAGIC, 4 );
+    memcpy( header + 4, &version, 4 );
+    if ( ftruncate(fd, 0) != 0 || hoover_pwrite_all(fd, header, sizeof(header), 0) != 0 )
+        return -1;
+    return fsync(fd);
+}
+
+/**
+ *  Record that everything before offset has been confirmed
+ */
+static int write_checkpoint( struct hoover_spool *spool, off_t offset ) {
+    struct spool_checkpoint cp;
+
+    memset( &cp, 0, sizeof(cp) );
+    cp.seq = spool->checkpoint_seq + 1;
+    cp.offset = offset;
+    cp.crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)&cp, offsetof(struct spool_checkpoint, crc));
+
+    /* never overwrite the slot holding the last good checkpoint */
+    if ( hoover_pwrite_all(spool->checkpoint_fd, &cp, sizeof(cp), (cp.seq % 2) * sizeof(cp)) != 0
+    ||   fsync(spool->checkpoint_fd) != 0 ) {
+        fprintf( stderr, "write_checkpoint: could not write checkpoint in %s\n", spool->dir );
+        return -1;
+    }
+    spool->checkpoint_seq = cp.seq;
+    spool->checkpoint = offset;
+    return 0;
+}
+
+/**
+ *  Find the latest valid checkpoint
+ */
+static void read_checkpoint( struct hoover_spool *spool ) {
+    struct spool_checkpoint cp[2];
+    int i;
+
+    spool->checkpoint_seq = 0;
+    spool->checkpoint = HOOVER_SPOOL_HEADER_LEN;
+
+    memset( cp, 0, sizeof(cp) );
+    for ( i = 0; i < 2; i++ ) {
+        if ( read_all(spool->checkpoint_fd, &cp[i], sizeof(cp[i]), i * sizeof(cp[i])) != 0 )
+            continue;
+        if ( cp[i].crc != crc32(crc32(0L, Z_NULL, 0), (const Bytef *)&cp[i], offsetof(struct spool_checkpoint, crc)) )
+            continue;
+        if ( cp[i].seq >= spool->checkpoint_seq ) {
+            spool->checkpoint_seq = cp[i].seq;
+            spool->checkpoint = cp[i].offset;
+        }
+    }
+    return;
+}
+
+/**
+ *  Load the journal's header and checkpoint, and cut off anything after the
+ *  last complete entry
+ */
+static int load_spool( struct hoover_spool *spool ) {
+    char header[HOOVER_SPOOL_HEADER_LEN];
+    unsigned char *buf;
+    struct stat st;
+    off_t offset, next;
+    ssize_t n;
+
+    if ( fstat(spool->fd, &st) != 0 )
+        return -1;
+    if ( st.st_size == 0 ) {
+        if ( reset_journal(spool->fd) != 0 )
+            return -1;
+        st.st_size = HOOVER_SPOOL_HEADER_LEN;
+    }
+
+    n = pread( spool->fd, header, sizeof(header), 0 );
+    if ( n != sizeof(header) || memcmp(header, HOOVER_SPOOL_MAGIC, 4) != 0 ) {
+        fprintf( stderr, "load_spool: %s/%s is not a spool journal\n", spool->dir, HOOVER_SPOOL_JOURNAL );
+        return -1;
+    }
+
+    read_checkpoint( spool );
+
+    /* a journal that ends before the checkpoint was emptied, or lost writes
+     * that were confirmed anyway */
+    if ( spool->checkpoint < HOOVER_SPOOL_HEADER_LEN || spool->checkpoint > st.st_size ) {
+        if ( reset_journal(spool->fd) != 0 || write_checkpoint(spool, HOOVER_SPOOL_HEADER_LEN) != 0 )
+            return -1;
+        st.st_size = HOOVER_SPOOL_HEADER_LEN;
+    }
+
+    if ( !(buf = malloc(SPOOL_HEADER_MAX > HOOVER_BLK_SIZE ? SPOOL_HEADER_MAX : HOOVER_BLK_SIZE)) )
+        return -1;
+    offset = spool->checkpoint;
+    while ( offset < st.st_size ) {
+        next = check_entry( spool->fd, offset, st.st_size, buf,
+                            SPOOL_HEADER_MAX > HOOVER_BLK_SIZE ? SPOOL_HEADER_MAX : HOOVER_BLK_SIZE );
+        if ( next < 0 )
+            break;
+        offset = next;
+        spool->num_unsent++;
+    }
+    free(buf);
+
+    /* a crash in the middle of an append leaves a partial entry behind */
+    if ( offset < st.st_size ) {
+        fprintf( stderr, "load_spool: discarding damaged entries at the end of %s/%s\n",
+                 spool->dir, HOOVER_SPOOL_JOURNAL );
+        if ( ftruncate(spool->fd, offset) != 0 || fsync(spool->fd) != 0 )
+            return -1;
+    }
+
+    spool->sent = spool->checkpoint;
+    spool->end = offset;
+    return 0;
+}
+
+/**
+ *  Give up on an entry that was partly appended
+ */
+static int abandon_append( struct hoover_spool *spool, struct hoover_header *header ) {
+    fprintf( stderr, "hoover_spool_append: could not spool %s\n", header->filename );
+    if ( ftruncate(spool->fd, spool->end) != 0 )
+        fprintf( stderr, "hoover_spool_append: could not truncate %s/%s\n", spool->dir, HOOVER_SPOOL_JOURNAL );
+    return -1;
+}
+
+/**
+ *  Release the mapping behind the last entry handed out
+ */
+static void release_entry( struct hoover_spool *spool ) {
+    if ( spool->map )
+        munmap( spool->map, spool->map_len );
+    spool->map = NULL;
+    spool->map_len = 0;
+    return;
+}
+
+/*******************************************************************************
+ * Global functions
+ ******************************************************************************/
+
+/**
+ *  Open (creating if necessary) the spool kept in dir.  The spool stays locked
+ *  against other producers until it is closed.
+ */
+struct hoover_spool *open_hoover_spool( const char *dir ) {
+    struct hoover_spool *spool;
+    size_t path_len = strlen(dir) + sizeof(HOOVER_SPOOL_CHECKPOINT) + 1;
+    char *path;
+
+    if ( mkdir(dir, 0700) != 0 && errno != EEXIST ) {
+        fprintf( stderr, "open_hoover_spool: could not create %s\n", dir );
+        return NULL;
+    }
+
+    if ( !(spool = calloc(1, sizeof(*spool))) )
+        return NULL;
+    spool->fd = -1;
+    spool->checkpoint_fd = -1;
+    if ( !(spool->dir = strdup(dir)) || !(path = malloc(path_len)) ) {
+        close_hoover_spool(spool);
+        return NULL;
+    }
+
+    snprintf( path, path_len, "%s/%s", dir, HOOVER_SPOOL_JOURNAL );
+    if ( (spool->fd = open(path, O_RDWR | O_CREAT, 0600)) < 0 || hoover_lock_file(spool->fd) != 0 ) {
+        fprintf( stderr, "open_hoover_spool: could not open and lock %s\n", path );
+        free(path);
+        close_hoover_spool(spool);
+        return NULL;
+    }
+    snprintf( path, path_len, "%s/%s", dir, HOOVER_SPOOL_CHECKPOINT );
+    if ( (spool->checkpoint_fd = open(path, O_RDWR | O_CREAT, 0600)) < 0 ) {
+        fprintf( stderr, "open_hoover_spool: could not open %s\n", path );
+        free(path);
+        close_hoover_spool(spool);
+        return NULL;
+    }
+    free(path);
+
+    if ( load_spool(spool) != 0 ) {
+        fprintf( stderr, "open_hoover_spool: could not load %s\n", dir );
+        close_hoover_spool(spool);
+        return NULL;
+    }
+
+    return spool;
+}
+
+/**
+ *  Make everything that was appended durable, then release the spool.  Entries
+ *  that were handed out but not checkpointed will be handed out again by the
+ *  next open_hoover_spool().
+ */
+void close_hoover_spool( struct hoover_spool *spool ) {
+    if ( spool == NULL ) {
+        fprintf( stderr, "close_hoover_spool: received NULL pointer\n" );
+        return;
+    }
+    release_entry( spool );
+    if ( spool->fd >= 0 ) {
+        hoover_spool_sync( spool );
+        close(spool->fd); /* also drops the lock */
+    }
+    if ( spool->checkpoint_fd >= 0 )
+        close(spool->checkpoint_fd);
+    free(spool->dir);
+    free(spool);
+    return;
+}
+
+/**
+ *  Append an HDO and its header to the journal.  A streaming HDO is drained in
+ *  the process, and its header is brought up to date.  The entry is not
+ *  durable until hoover_spool_sync() or hoover_spool_checkpoint().
+ */
+int hoover_spool_append( struct hoover_spool *spool, struct hoover_data_obj *hdo, struct hoover_header *header ) {
+    struct spool_entry entry;
+    unsigned char *buf;
+    off_t offset = spool->end + sizeof(entry);
+    uLong crc = crc32(0L, Z_NULL, 0);
+    uint64_t payload_len = 0;
+    size_t header_len;
+
+    if ( hdo->stream ) {
+        const void *chunk;
+        size_t len;
+        int ret;
+        while ( (ret = hoover_read_hdo_chunk(hdo, &chunk, &len)) > 0 ) {
+            if ( hoover_pwrite_all(spool->fd, chunk, len, offset + payload_len) != 0 )
+                break;
+            crc = crc32(crc, chunk, len);
+            payload_len += len;
+        }
+        if ( ret != 0 )
+            return abandon_append( spool, header );
+        update_hoover_header( header, hdo );
+    }
+    else {
+        if ( hdo->size > 0 && hoover_pwrite_all(spool->fd, hdo->data, hdo->size, offset) != 0 )
+            return abandon_append( spool, header );
+        crc = crc32(crc, hdo->data, hdo->size);
+        payload_len = hdo->size;
+    }
+
+    if ( !(buf = malloc(SPOOL_HEADER_MAX)) )
+        return abandon_append( spool, header );
+    header_len = encode_header( header, buf );
+    crc = crc32(crc, buf, header_len);
+
+    memset( &entry, 0, sizeof(entry) );
+    memcpy( entry.magic, HOOVER_SPOOL_ENTRY_MAGIC, 4 );
+    entry.header_len = header_len;
+    entry.payload_len = payload_len;
+    entry.crc = crc;
+    if ( hoover_pwrite_all(spool->fd, buf, header_len, offset + payload_len) != 0
+    ||   hoover_pwrite_all(spool->fd, &entry, sizeof(entry), spool->end) != 0 ) {
+        free(buf);
+        return abandon_append( spool, header );
+    }
+    free(buf);
+
+    spool->end = offset + payload_len + header_len;
+    spool->num_unsent++;
+    spool->dirty = 1;
+    return 0;
+}
+
+/**
+ *  Hand out the next entry that has not been sent yet.  *hdo and *header
+ *  belong to the spool and remain valid until the next call.
+ *
+ *  Returns 1 if an entry was handed out, 0 if there are none left, or -1 on
+ *  error.
+ */
+int hoover_spool_next( struct hoover_spool *spool, struct hoover_data_obj **hdo, struct hoover_header **header ) {
+    static char empty[1];
+    struct spool_entry entry;
+    unsigned char *buf;
+    off_t payload_offset, map_offset;
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    release_entry( spool );
+    if ( spool->sent >= spool->end )
+        return 0;
+
+    if ( read_all(spool->fd, &entry, sizeof(entry), spool->sent) != 0 )
+        return -1;
+    if ( !(buf = malloc(entry.header_len)) )
+        return -1;
+    payload_offset = spool->sent + sizeof(entry);
+    if ( read_all(spool->fd, buf, entry.header_len, payload_offset + entry.payload_len) != 0
+    ||   decode_header(buf, entry.header_len, &(spool->header)) != 0 ) {
+        fprintf( stderr, "hoover_spool_next: damaged entry in %s\n", spool->dir );
+        free(buf);
+        return -1;
+    }
+    free(buf);
+
+    /* the payload is sent straight out of the page cache */
+    memset( &(spool->hdo), 0, sizeof(spool->hdo) );
+    spool->hdo.data = empty;
+    if ( entry.payload_len > 0 ) {
+        map_offset = payload_offset - payload_offset % page_size;
+        spool->map_len = entry.payload_len + (payload_offset - map_offset);
+        spool->map = mmap( NULL, spool->map_len, PROT_READ, MAP_SHARED, spool->fd, map_offset );
+        if ( spool->map == MAP_FAILED ) {
+            spool->map = NULL;
+            spool->map_len = 0;
+            return -1;
+        }
+        spool->hdo.data = (char *)spool->map + (payload_offset - map_offset);
+    }
+    spool->hdo.size = entry.payload_len;
+    memcpy( spool->hdo.hash, spool->header.sha_hash, HASH_DIGEST_LENGTH_HEX );
+    memcpy( spool->hdo.hash_orig, spool->header.hash_orig, HASH_DIGEST_LENGTH_HEX );
+    memcpy( spool->hdo.hash_algo, spool->header.hash_algo, HASH_ALGO_FIELD_LEN );
+    memcpy( spool->hdo.compression, spool->header.compression, COMPRESS_FIELD_LEN );
+
+    spool->sent = payload_offset + entry.payload_len + entry.header_len;
+    spool->num_unsent--;
+    spool->num_unconfirmed++;
+
+    *hdo = &(spool->hdo);
+    *header = &(spool->header);
+    return 1;
+}
+
+/**
+ *  Record that every entry handed out so far has been confirmed.  The journal
+ *  is emptied once nothing is left in it.
+ */
+int hoover_spool_checkpoint( struct hoover_spool *spool ) {
+    if ( spool->sent == spool->checkpoint )
+        return 0;
+    if ( write_checkpoint(spool, spool->sent) != 0 )
+        return -1;
+    spool->num_unconfirmed = 0;
+
+    if ( spool->sent == spool->end ) {
+        release_entry( spool );
+        if ( reset_journal(spool->fd) != 0 || write_checkpoint(spool, HOOVER_SPOOL_HEADER_LEN) != 0 )
+            return -1;
+        spool->sent = spool->end = HOOVER_SPOOL_HEADER_LEN;
+        spool->dirty = 0;
+    }
+    return 0;
+}
+
+/**
+ *  Make every appended entry durable
+ */
+int hoover_spool_sync( struct hoover_spool *spool ) {
+    if ( !spool->dirty )
+        return 0;
+    if ( fsync(spool->fd) != 0 ) {
+        fprintf( stderr, "hoover_spool_sync: could not sync %s\n", spool->dir );
+        return -1;
+    }
+    spool->dirty = 0;
+    return 0;
+}
+
+/**
+ *  Number of entries in the spool that have not been confirmed
+ */
+size_t hoover_spool_pending( struct hoover_spool *spool ) {
+    return spool->num_unsent + spool->num_unconfirmed;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "hooverio.h"
+
+/* spooled messages sent between checkpoints while draining */
+#ifndef HOOVER_SPOOL_CHECKPOINT_INTERVAL
+    #define HOOVER_SPOOL_CHECKPOINT_INTERVAL 256
+#endif
+
+/* seconds that producer -D waits before retrying the brokers */
+#ifndef HOOVER_SPOOL_RETRY_INTERVAL
+    #define HOOVER_SPOOL_RETRY_INTERVAL 30
+#endif
+
+/*
+ * hoover_spool is a write-ahead journal of messages on local disk (or tmpfs).
+ *   Each entry holds an HDO's payload exactly as it would have been sent,
+ *   followed by its header.  Messages are appended to the journal before they
+ *   are sent and are read back out of it to be sent, so a message that is
+ *   lost because the brokers are unreachable or the producer dies can be sent
+ *   again later without touching its original file.
+ *
+ *   The checkpoint is the journal offset up to which every message has been
+ *   confirmed by the broker.  It is kept in a separate file with two slots
+ *   that are written alternately, so a torn write only loses the latest
+ *   checkpoint and causes a few messages to be sent twice.  A torn entry at
+ *   the end of the journal is cut off when the spool is opened.  Once every
+ *   entry has been confirmed, the journal is emptied.
+ *
+ *   Entries are stored in native byte order, since the spool never leaves the
+ *   node that wrote it.  Only one process may have a spool open at a time.
+ */
+struct hoover_spool {
+    char *dir;
+    int fd;                                /* journal; also holds the lock */
+    int checkpoint_fd;
+    uint64_t checkpoint_seq;               /* sequence number of the last checkpoint */
+    off_t checkpoint;                      /* everything before this was confirmed */
+    off_t sent;                            /* everything before this was handed out */
+    off_t end;                             /* end of the last complete entry */
+    size_t num_unsent;                     /* entries between sent and end */
+    size_t num_unconfirmed;                /* entries between checkpoint and sent */
+    int dirty;                             /* appended since the last fsync */
+    struct hoover_data_obj hdo;            /* last entry handed out */
+    struct hoover_header header;
+    void *map;                             /* mapping that backs hdo.data */
+    size_t map_len;
+};
+
+struct hoover_spool *open_hoover_spool( const char *dir );
+void close_hoover_spool( struct hoover_spool *spool );
+
+int hoover_spool_append( struct hoover_spool *spool, struct hoover_data_obj *hdo, struct hoover_header *header );
+int hoover_spool_next( struct hoover_spool *spool, struct hoover_data_obj **hdo, struct hoover_header **header );
+int hoover_spool_checkpoint( struct hoover_spool *spool );
+int hoover_spool_sync( struct hoover_spool *spool );
+size_t hoover_spool_pending( struct hoover_spool *spool );
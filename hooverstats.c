@@ -0,0 +1,252 @@
+/*******************************************************************************
+ *  hooverstats.c
+ *
+ *  Per-stage counters and latency histograms for Hoover producers, written out
+ *  as JSON or as a Prometheus textfile-collector file
+ ******************************************************************************/
+#if !defined(_XOPEN_SOURCE) || _XOPEN_SOURCE < 700
+    #define _XOPEN_SOURCE 700
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "hooverio.h"
+#include "hooverstats.h"
+
+struct stage_stats {
+    uint64_t count;
+    uint64_t nsec;
+    uint64_t buckets[HOOVER_STATS_BUCKETS];
+};
+
+/* every thread of the process updates the same totals */
+static int stats_enabled = 0;
+static struct stage_stats stages[HOOVER_NUM_STAGES];
+static uint64_t counters[HOOVER_NUM_COUNTERS];
+
+static const char *stage_names[HOOVER_NUM_STAGES] = {
+    "read", "hash", "compress", "hash_compressed", "create_hdo",
+    "manifest", "send", "publish", "confirm"
+};
+
+static const char *counter_names[HOOVER_NUM_COUNTERS] = {
+    "hdos", "bytes_in", "bytes_out", "stored_hdos", "stored_blocks",
+    "messages", "message_bytes", "retries", "failed"
+};
+
+/*******************************************************************************
+ * Private functions
+ ******************************************************************************/
+
+static uint64_t now_nsec( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ *  Upper bound of a histogram bucket, in seconds; the last one has none
+ */
+static double bucket_bound( int i ) {
+    return (double)(1ULL << i) / 1e6;
+}
+
+/**
+ *  Write a node or task id with anything that would need escaping in a JSON
+ *  string or a Prometheus label value replaced by an underscore
+ */
+static void write_id( FILE *fp, const char *id ) {
+    for ( ; *id; id++ )
+        fputc( (*id == '"' || *id == '\\' || (unsigned char)*id < 0x20) ? '_' : *id, fp );
+}
+
+/**
+ *  Compressed size as a fraction of the original size, or 0 before any data
+ *  has been seen
+ */
+static double compression_ratio( const uint64_t *count ) {
+    if ( count[HOOVER_COUNT_BYTES_IN] == 0 )
+        return 0.0;
+    return (double)count[HOOVER_COUNT_BYTES_OUT] / count[HOOVER_COUNT_BYTES_IN];
+}
+
+static void write_json( FILE *fp, const char *node_id, const char *task_id,
+                        const struct stage_stats *stage, const uint64_t *count ) {
+    int i, j;
+
+    fprintf( fp, "{\n  \"node_id\": \"" );
+    write_id( fp, node_id );
+    fprintf( fp, "\",\n  \"task_id\": \"" );
+    write_id( fp, task_id );
+    fprintf( fp, "\",\n  \"time\": %ld,\n", (long)time(NULL) );
+
+    for ( i = 0; i < HOOVER_NUM_COUNTERS; i++ )
+        fprintf( fp, "  \"%s\": %llu,\n", counter_names[i], (unsigned long long)count[i] );
+    fprintf( fp, "  \"compression_ratio\": %.6f,\n", compression_ratio(count) );
+
+    /* bucket counts are not cumulative; bucket_bounds gives the upper bound
+     * of every bucket but the last */
+    fprintf( fp, "  \"bucket_bounds\": [" );
+    for ( j = 0; j < HOOVER_STATS_BUCKETS - 1; j++ )
+        fprintf( fp, "%s%.9g", j ? ", " : "", bucket_bound(j) );
+    fprintf( fp, "],\n  \"stages\": {\n" );
+
+    for ( i = 0; i < HOOVER_NUM_STAGES; i++ ) {
+        fprintf( fp, "    \"%s\": {\"count\": %llu, \"seconds\": %.9f, \"buckets\": [",
+            stage_names[i], (unsigned long long)stage[i].count, stage[i].nsec / 1e9 );
+        for ( j = 0; j < HOOVER_STATS_BUCKETS; j++ )
+            fprintf( fp, "%s%llu", j ? ", " : "", (unsigned long long)stage[i].buckets[j] );
+        fprintf( fp, "]}%s\n", i < HOOVER_NUM_STAGES - 1 ? "," : "" );
+    }
+    fprintf( fp, "  }\n}\n" );
+}
+
+static void write_labels( FILE *fp, const char *node_id, const char *task_id ) {
+    fprintf( fp, "node_id=\"" );
+    write_id( fp, node_id );
+    fprintf( fp, "\",task_id=\"" );
+    write_id( fp, task_id );
+    fprintf( fp, "\"" );
+}
+
+static void write_prometheus( FILE *fp, const char *node_id, const char *task_id,
+                              const struct stage_stats *stage, const uint64_t *count ) {
+    uint64_t cumulative;
+    int i, j;
+
+    for ( i = 0; i < HOOVER_NUM_COUNTERS; i++ ) {
+        fprintf( fp, "# TYPE hoover_%s_total counter\nhoover_%s_total{", counter_names[i], counter_names[i] );
+        write_labels( fp, node_id, task_id );
+        fprintf( fp, "} %llu\n", (unsigned long long)count[i] );
+    }
+
+    fprintf( fp, "# TYPE hoover_compression_ratio gauge\nhoover_compression_ratio{" );
+    write_labels( fp, node_id, task_id );
+    fprintf( fp, "} %.6f\n", compression_ratio(count) );
+
+    fprintf( fp, "# HELP hoover_stage_seconds Time spent in each stage of the producer\n" );
+    fprintf( fp, "# TYPE hoover_stage_seconds histogram\n" );
+    for ( i = 0; i < HOOVER_NUM_STAGES; i++ ) {
+        cumulative = 0;
+        for ( j = 0; j < HOOVER_STATS_BUCKETS; j++ ) {
+            cumulative += stage[i].buckets[j];
+            fprintf( fp, "hoover_stage_seconds_bucket{" );
+            write_labels( fp, node_id, task_id );
+            if ( j < HOOVER_STATS_BUCKETS - 1 )
+                fprintf( fp, ",stage=\"%s\",le=\"%.9g\"} %llu\n", stage_names[i], bucket_bound(j), (unsigned long long)cumulative );
+            else
+                fprintf( fp, ",stage=\"%s\",le=\"+Inf\"} %llu\n", stage_names[i], (unsigned long long)cumulative );
+        }
+        fprintf( fp, "hoover_stage_seconds_sum{" );
+        write_labels( fp, node_id, task_id );
+        fprintf( fp, ",stage=\"%s\"} %.9f\n", stage_names[i], stage[i].nsec / 1e9 );
+        fprintf( fp, "hoover_stage_seconds_count{" );
+        write_labels( fp, node_id, task_id );
+        fprintf( fp, ",stage=\"%s\"} %llu\n", stage_names[i], (unsigned long long)stage[i].count );
+    }
+}
+
+/*******************************************************************************
+ * Public functions
+ ******************************************************************************/
+
+/**
+ *  Start recording.  There is no way to stop again; a process either wants
+ *  statistics or it does not.
+ */
+void hoover_stats_enable( void ) {
+    __atomic_store_n( &stats_enabled, 1, __ATOMIC_RELAXED );
+}
+
+/**
+ *  Note the time at which a stage starts.  Returns 0 if statistics are off, in
+ *  which case hoover_stats_stop() does nothing.
+ */
+uint64_t hoover_stats_start( void ) {
+    if ( !__atomic_load_n(&stats_enabled, __ATOMIC_RELAXED) )
+        return 0;
+    return now_nsec();
+}
+
+/**
+ *  Charge the time since start to a stage
+ */
+void hoover_stats_stop( enum hoover_stage stage, uint64_t start ) {
+    uint64_t nsec, usec;
+    int bucket = 0;
+
+    if ( start == 0 )
+        return;
+
+    nsec = now_nsec() - start;
+    usec = (nsec + 999) / 1000;
+    while ( bucket < HOOVER_STATS_BUCKETS - 1 && usec > (1ULL << bucket) )
+        bucket++;
+
+    __atomic_fetch_add( &(stages[stage].count), 1, __ATOMIC_RELAXED );
+    __atomic_fetch_add( &(stages[stage].nsec), nsec, __ATOMIC_RELAXED );
+    __atomic_fetch_add( &(stages[stage].buckets[bucket]), 1, __ATOMIC_RELAXED );
+}
+
+void hoover_stats_count( enum hoover_counter counter, uint64_t value ) {
+    if ( !__atomic_load_n(&stats_enabled, __ATOMIC_RELAXED) )
+        return;
+    __atomic_fetch_add( &(counters[counter]), value, __ATOMIC_RELAXED );
+}
+
+/**
+ *  Write everything recorded so far to path, replacing whatever was there.  A
+ *  path ending in .prom gets the Prometheus text format, anything else gets
+ *  JSON.  The file is written under a temporary name and renamed into place so
+ *  that a collector never reads half of it.
+ *
+ *  Returns 0 on success.
+ */
+int hoover_stats_write( const char *path ) {
+    struct stage_stats stage[HOOVER_NUM_STAGES];
+    uint64_t count[HOOVER_NUM_COUNTERS];
+    char node_id[HOST_NAME_MAX + 1] = "",
+         task_id[TASK_ID_LEN + 1] = "",
+         tmp_path[PATH_MAX];
+    size_t len = strlen(path);
+    FILE *fp;
+    int i, j;
+
+    /* take a copy so the file is consistent with itself, more or less, even if
+     * other threads keep counting */
+    for ( i = 0; i < HOOVER_NUM_STAGES; i++ ) {
+        stage[i].count = __atomic_load_n( &(stages[i].count), __ATOMIC_RELAXED );
+        stage[i].nsec = __atomic_load_n( &(stages[i].nsec), __ATOMIC_RELAXED );
+        for ( j = 0; j < HOOVER_STATS_BUCKETS; j++ )
+            stage[i].buckets[j] = __atomic_load_n( &(stages[i].buckets[j]), __ATOMIC_RELAXED );
+    }
+    for ( i = 0; i < HOOVER_NUM_COUNTERS; i++ )
+        count[i] = __atomic_load_n( &(counters[i]), __ATOMIC_RELAXED );
+
+    get_hoover_node_id( node_id, HOST_NAME_MAX );
+    get_hoover_task_id( task_id, TASK_ID_LEN );
+
+    if ( snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path) ) {
+        fprintf( stderr, "hoover_stats_write: path too long: %s\n", path );
+        return -1;
+    }
+    if ( !(fp = fopen(tmp_path, "w")) ) {
+        fprintf( stderr, "hoover_stats_write: could not open %s\n", tmp_path );
+        return -1;
+    }
+
+    if ( len > 5 && strcmp(path + len - 5, ".prom") == 0 )
+        write_prometheus( fp, node_id, task_id, stage, count );
+    else
+        write_json( fp, node_id, task_id, stage, count );
+
+    if ( fclose(fp) != 0 || rename(tmp_path, path) != 0 ) {
+        fprintf( stderr, "hoover_stats_write: could not write %s\n", path );
+        remove( tmp_path );
+        return -1;
+    }
+    return 0;
+}
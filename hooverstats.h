@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Where a producer's time goes.  Stages nest (create_hdo contains read, hash
+ * and compress; send contains publish) and may overlap, since the parallel
+ * codec hashes one batch while its blocks are being compressed.
+ */
+enum hoover_stage {
+    HOOVER_STAGE_READ = 0,          /* reading input that is not mapped */
+    HOOVER_STAGE_HASH,              /* hashing the original data */
+    HOOVER_STAGE_COMPRESS,          /* compressing it */
+    HOOVER_STAGE_HASH_COMPRESSED,   /* hashing the compressed payload */
+    HOOVER_STAGE_CREATE_HDO,        /* all of hoover_create_hdo() and friends */
+    HOOVER_STAGE_MANIFEST,          /* building a manifest */
+    HOOVER_STAGE_SEND,              /* all of hoover_send_message() */
+    HOOVER_STAGE_PUBLISH,           /* handing one message to the broker */
+    HOOVER_STAGE_CONFIRM,           /* waiting for the broker to confirm messages */
+    HOOVER_NUM_STAGES
+};
+
+enum hoover_counter {
+    HOOVER_COUNT_HDOS = 0,          /* HDOs whose payload has been produced */
+    HOOVER_COUNT_BYTES_IN,          /* original bytes in those HDOs */
+    HOOVER_COUNT_BYTES_OUT,         /* payload bytes in those HDOs */
+    HOOVER_COUNT_STORED_HDOS,       /* HDOs stored as is because they would not shrink */
+    HOOVER_COUNT_STORED_BLOCKS,     /* blocks stored as is within compressed HDOs */
+    HOOVER_COUNT_MESSAGES,          /* messages handed to the tube */
+    HOOVER_COUNT_MESSAGE_BYTES,     /* payload bytes in those messages */
+    HOOVER_COUNT_RETRIES,           /* messages published again */
+    HOOVER_COUNT_FAILED,            /* messages given up on */
+    HOOVER_NUM_COUNTERS
+};
+
+/*
+ * Latency histograms have one bucket per power of two microseconds, from 1 us
+ * to 2^(HOOVER_STATS_BUCKETS - 2) us (about 33 seconds); the last bucket
+ * catches everything slower.
+ */
+#define HOOVER_STATS_BUCKETS 27
+
+/*
+ * Nothing is recorded until hoover_stats_enable() is called, so the hooks cost
+ * one branch each in a process that does not want statistics.
+ */
+void hoover_stats_enable( void );
+uint64_t hoover_stats_start( void );
+void hoover_stats_stop( enum hoover_stage stage, uint64_t start );
+void hoover_stats_count( enum hoover_counter counter, uint64_t value );
+int hoover_stats_write( const char *path );
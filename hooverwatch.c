@@ -0,0 +1,513 @@
+/*******************************************************************************
+ *  hooverwatch.c
+ *
+ *  Find the files to send by walking a directory tree, and keep finding them
+ *  as they are written by watching the tree with inotify
+ ******************************************************************************/
+#if !defined(_XOPEN_SOURCE) || _XOPEN_SOURCE < 700
+    #define _XOPEN_SOURCE 700
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+    #include <poll.h>
+    #include <sys/inotify.h>
+#endif
+
+#include "hooverwatch.h"
+#include "hooverio.h"
+
+#ifdef __linux__
+    #define HOOVER_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR)
+#endif
+
+/* what walk_dir() does with the tree */
+#define WALK_WATCH  1  /* add a watch on every directory */
+#define WALK_REPORT 2  /* report every file right away */
+#define WALK_SETTLE 4  /* report new or changed files once they settle */
+
+#ifdef __APPLE__
+    #define st_mtim st_mtimespec
+#endif
+
+/*******************************************************************************
+ * Private functions
+ ******************************************************************************/
+
+/**
+ *  Join a directory and a name into a newly allocated path
+ */
+static char *join_path( const char *dir, const char *name ) {
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(len);
+    if ( path )
+        snprintf( path, len, "%s/%s", dir, name );
+    return path;
+}
+
+/**
+ *  Remember which directory a watch descriptor belongs to
+ */
+static int track_dir( struct hoover_watch *watch, int wd, const char *dir ) {
+    if ( wd >= watch->max_dirs ) {
+        int i, max_dirs = watch->max_dirs ? watch->max_dirs : 64;
+        char **dirs;
+        while ( wd >= max_dirs )
+            max_dirs *= 2;
+        if ( !(dirs = realloc(watch->dirs, max_dirs * sizeof(*dirs))) )
+            return -1;
+        for ( i = watch->max_dirs; i < max_dirs; i++ )
+            dirs[i] = NULL;
+        watch->dirs = dirs;
+        watch->max_dirs = max_dirs;
+    }
+    free( watch->dirs[wd] );
+    if ( !(watch->dirs[wd] = strdup(dir)) )
+        return -1;
+    return 0;
+}
+
+/**
+ *  Milliseconds from a to b
+ */
+static long elapsed_ms( const struct timespec *a, const struct timespec *b ) {
+    return (b->tv_sec - a->tv_sec) * 1000L + (b->tv_nsec - a->tv_nsec) / 1000000L;
+}
+
+/**
+ *  Find the slot that holds (or would hold) the file at path
+ */
+static size_t find_file( struct hoover_watch *watch, const char *path, uint64_t path_hash ) {
+    size_t mask = watch->num_slots - 1,
+           i = (size_t)path_hash & mask;
+    while ( watch->files[i] != NULL
+    &&      (watch->files[i]->path_hash != path_hash || strcmp(watch->files[i]->path, path) != 0) )
+        i = (i + 1) & mask;
+    return i;
+}
+
+/**
+ *  Double the number of slots and rehash every file
+ */
+static int grow_files( struct hoover_watch *watch ) {
+    size_t i, old_num_slots = watch->num_slots,
+           num_slots = old_num_slots ? 2 * old_num_slots : 1024;
+    struct hoover_watch_file **old_files = watch->files;
+
+    if ( !(watch->files = calloc(num_slots, sizeof(*(watch->files)))) ) {
+        watch->files = old_files;
+        return -1;
+    }
+    watch->num_slots = num_slots;
+    for ( i = 0; i < old_num_slots; i++ ) {
+        if ( old_files[i] )
+            watch->files[find_file(watch, old_files[i]->path, old_files[i]->path_hash)] = old_files[i];
+    }
+    free(old_files);
+    return 0;
+}
+
+/**
+ *  Look up the file at path, adding it (unreported) if it is not known yet.
+ *  *is_new is set if it was added.
+ */
+static struct hoover_watch_file *remember_file( struct hoover_watch *watch, const char *path, int *is_new ) {
+    struct hoover_watch_file *file;
+    uint64_t path_hash = hoover_hash_path(path);
+    size_t slot;
+
+    if ( 2 * (watch->num_files + 1) > watch->num_slots && grow_files(watch) != 0 )
+        return NULL;
+    slot = find_file( watch, path, path_hash );
+    *is_new = watch->files[slot] == NULL;
+    if ( !*is_new )
+        return watch->files[slot];
+
+    if ( !(file = calloc(1, sizeof(*file))) )
+        return NULL;
+    if ( !(file->path = strdup(path)) ) {
+        free(file);
+        return NULL;
+    }
+    file->path_hash = path_hash;
+    watch->files[slot] = file;
+    watch->num_files++;
+    return file;
+}
+
+/**
+ *  Take a file off the list of files waiting to settle
+ */
+static void unlist_unsettled( struct hoover_watch *watch, struct hoover_watch_file *file ) {
+    struct hoover_watch_file **p;
+    for ( p = &(watch->unsettled); *p; p = &((*p)->next_unsettled) ) {
+        if ( *p == file ) {
+            *p = file->next_unsettled;
+            break;
+        }
+    }
+    file->next_unsettled = NULL;
+    return;
+}
+
+/**
+ *  Forget the file in a slot, shifting back the files after it that belong
+ *  in an earlier slot
+ */
+static void forget_slot( struct hoover_watch *watch, size_t i ) {
+    struct hoover_watch_file *file = watch->files[i];
+    size_t j, home, mask = watch->num_slots - 1;
+
+    if ( !file->reported )
+        unlist_unsettled( watch, file );
+    free( file->path );
+    free( file );
+    watch->num_files--;
+
+    for ( j = (i + 1) & mask; watch->files[j] != NULL; j = (j + 1) & mask ) {
+        home = (size_t)watch->files[j]->path_hash & mask;
+        /* the file at j can move to i unless its home lies in (i, j] */
+        if ( (i < j) ? (home <= i || home > j) : (home <= i && home > j) ) {
+            watch->files[i] = watch->files[j];
+            i = j;
+        }
+    }
+    watch->files[i] = NULL;
+    return;
+}
+
+/**
+ *  Forget the file at path, e.g., because it was removed
+ */
+static void forget_file( struct hoover_watch *watch, const char *path ) {
+    size_t slot;
+    if ( watch->num_slots == 0 )
+        return;
+    slot = find_file( watch, path, hoover_hash_path(path) );
+    if ( watch->files[slot] )
+        forget_slot( watch, slot );
+    return;
+}
+
+/**
+ *  Does a file still look the way it was remembered?
+ */
+static int same_stat( const struct hoover_watch_file *file, const struct stat *st ) {
+    return file->dev == st->st_dev && file->ino == st->st_ino && file->size == st->st_size
+        && file->mtime.tv_sec == st->st_mtim.tv_sec && file->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void set_stat( struct hoover_watch_file *file, const struct stat *st ) {
+    file->dev = st->st_dev;
+    file->ino = st->st_ino;
+    file->size = st->st_size;
+    file->mtime.tv_sec = st->st_mtim.tv_sec;
+    file->mtime.tv_nsec = st->st_mtim.tv_nsec;
+    return;
+}
+
+/**
+ *  Remember that a file was reported as it is now
+ */
+static void mark_reported( struct hoover_watch *watch, const char *path, const struct stat *st ) {
+    int is_new;
+    struct hoover_watch_file *file = remember_file( watch, path, &is_new );
+    if ( !file )
+        return;
+    if ( !is_new && !file->reported )
+        unlist_unsettled( watch, file );
+    set_stat( file, st );
+    file->reported = 1;
+    file->scan = watch->scan;
+    return;
+}
+
+/**
+ *  A walk found a file.  Unless it was already reported as it is now, it has
+ *  to settle before it is reported.  A file is on the unsettled list exactly
+ *  as long as it is not reported.
+ */
+static void note_walked_file( struct hoover_watch *watch, const char *path, const struct stat *st ) {
+    int is_new;
+    struct hoover_watch_file *file = remember_file( watch, path, &is_new );
+
+    if ( !file )
+        return;
+    file->scan = watch->scan;
+    if ( !is_new && same_stat(file, st) )
+        return;
+
+    set_stat( file, st );
+    clock_gettime( CLOCK_MONOTONIC, &(file->changed) );
+    if ( file->reported || is_new ) {
+        file->reported = 0;
+        file->next_unsettled = watch->unsettled;
+        watch->unsettled = file;
+    }
+    return;
+}
+
+/**
+ *  Report each walked file that has not changed for HOOVER_WATCH_SETTLE_MS.
+ *  Returns the number of files reported.
+ */
+static int report_settled( struct hoover_watch *watch, hoover_found_fn found, void *arg ) {
+    struct hoover_watch_file **p = &(watch->unsettled), *file;
+    struct timespec now;
+    struct stat st;
+    int num_found = 0;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    while ( (file = *p) != NULL ) {
+        if ( elapsed_ms(&(file->changed), &now) < HOOVER_WATCH_SETTLE_MS ) {
+            p = &(file->next_unsettled);
+            continue;
+        }
+        if ( lstat(file->path, &st) != 0 || !S_ISREG(st.st_mode) ) {
+            forget_file( watch, file->path );
+            continue;
+        }
+        if ( !same_stat(file, &st) ) {
+            set_stat( file, &st );
+            file->changed = now;
+            p = &(file->next_unsettled);
+            continue;
+        }
+        *p = file->next_unsettled;
+        file->next_unsettled = NULL;
+        file->reported = 1;
+        found( file->path, arg );
+        num_found++;
+    }
+    return num_found;
+}
+
+/**
+ *  Forget every file that the latest full scan did not find
+ */
+static void forget_unscanned( struct hoover_watch *watch ) {
+    size_t i = 0;
+    while ( i < watch->num_slots ) {
+        /* forget_slot() may shift another file into slot i */
+        if ( watch->files[i] && watch->files[i]->scan != watch->scan )
+            forget_slot( watch, i );
+        else
+            i++;
+    }
+    return;
+}
+
+/**
+ *  Walk a tree and do what flags say (see WALK_WATCH and friends) with every
+ *  directory and regular file in it.  Files reported right away are also
+ *  remembered if there is a watch.  Directories that cannot be read are
+ *  skipped.  Returns nonzero if found asked to stop.
+ */
+static int walk_dir( struct hoover_watch *watch, const char *dir, int flags, hoover_found_fn found, void *arg ) {
+    DIR *dp;
+    struct dirent *entry;
+    struct stat st;
+    int ret = 0;
+
+#ifdef __linux__
+    if ( flags & WALK_WATCH ) {
+        int wd = inotify_add_watch(watch->fd, dir, HOOVER_WATCH_MASK);
+        if ( wd < 0 || track_dir(watch, wd, dir) != 0 )
+            fprintf( stderr, "walk_dir: could not watch %s\n", dir );
+    }
+#endif
+
+    if ( !(dp = opendir(dir)) ) {
+        fprintf( stderr, "walk_dir: could not open %s\n", dir );
+        return 0;
+    }
+    while ( ret == 0 && (entry = readdir(dp)) != NULL ) {
+        char *path;
+        if ( strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 )
+            continue;
+        if ( !(path = join_path(dir, entry->d_name)) )
+            break;
+        if ( lstat(path, &st) == 0 ) {
+            if ( S_ISDIR(st.st_mode) )
+                ret = walk_dir( watch, path, flags, found, arg );
+            else if ( S_ISREG(st.st_mode) && (flags & WALK_REPORT) ) {
+                if ( watch )
+                    mark_reported( watch, path, &st );
+                ret = found( path, arg );
+            }
+            else if ( S_ISREG(st.st_mode) && (flags & WALK_SETTLE) )
+                note_walked_file( watch, path, &st );
+        }
+        free(path);
+    }
+    closedir(dp);
+    return ret;
+}
+
+/*******************************************************************************
+ * Global functions
+ ******************************************************************************/
+
+/**
+ *  Report every regular file under dir.  Symbolic links are not followed.
+ *  Returns -1 if dir cannot be read.
+ */
+int hoover_scan_dir( const char *dir, hoover_found_fn found, void *arg ) {
+    struct stat st;
+    if ( stat(dir, &st) != 0 || !S_ISDIR(st.st_mode) ) {
+        fprintf( stderr, "hoover_scan_dir: %s is not a directory\n", dir );
+        return -1;
+    }
+    walk_dir( NULL, dir, WALK_REPORT, found, arg );
+    return 0;
+}
+
+/**
+ *  Start watching every directory under dir.  Files that are already there
+ *  are not reported; use hoover_watch_scan() afterwards to pick them up.
+ */
+struct hoover_watch *create_hoover_watch( const char *dir ) {
+#ifdef __linux__
+    struct hoover_watch *watch;
+    struct stat st;
+
+    if ( stat(dir, &st) != 0 || !S_ISDIR(st.st_mode) ) {
+        fprintf( stderr, "create_hoover_watch: %s is not a directory\n", dir );
+        return NULL;
+    }
+    if ( !(watch = calloc(1, sizeof(*watch))) )
+        return NULL;
+    if ( !(watch->root = strdup(dir))
+    ||   !(watch->buf = malloc(HOOVER_WATCH_BUF_SIZE))
+    ||   (watch->fd = inotify_init()) < 0 ) {
+        fprintf( stderr, "create_hoover_watch: could not set up inotify\n" );
+        free( watch->buf );
+        free( watch->root );
+        free( watch );
+        return NULL;
+    }
+
+    walk_dir( watch, dir, WALK_WATCH, NULL, NULL );
+    return watch;
+#else
+    fprintf( stderr, "create_hoover_watch: watching %s needs inotify, which is Linux-only\n", dir );
+    return NULL;
+#endif
+}
+
+/**
+ *  Stop watching and release everything
+ */
+void free_hoover_watch( struct hoover_watch *watch ) {
+    size_t j;
+    int i;
+    if ( watch == NULL ) {
+        fprintf( stderr, "free_hoover_watch: received NULL pointer\n" );
+        return;
+    }
+    close( watch->fd );
+    for ( i = 0; i < watch->max_dirs; i++ )
+        free( watch->dirs[i] );
+    for ( j = 0; j < watch->num_slots; j++ ) {
+        if ( watch->files[j] ) {
+            free( watch->files[j]->path );
+            free( watch->files[j] );
+        }
+    }
+    free( watch->files );
+    free( watch->dirs );
+    free( watch->buf );
+    free( watch->root );
+    free( watch );
+    return;
+}
+
+/**
+ *  Report every regular file under the watched tree, like hoover_scan_dir(),
+ *  and remember them so that a later rescan does not report them again
+ */
+int hoover_watch_scan( struct hoover_watch *watch, hoover_found_fn found, void *arg ) {
+    watch->scan++;
+    walk_dir( watch, watch->root, WALK_REPORT, found, arg );
+    return 0;
+}
+
+/**
+ *  Wait up to timeout_ms milliseconds for files to be finished, and report
+ *  each one, along with files found by earlier rescans that have settled.
+ *  Returns the number of files reported, or -1 on error.
+ */
+int hoover_watch_wait( struct hoover_watch *watch, int timeout_ms, hoover_found_fn found, void *arg ) {
+#ifdef __linux__
+    struct pollfd pfd;
+    ssize_t len;
+    char *p;
+    int ready, num_found;
+
+    num_found = report_settled( watch, found, arg );
+
+    pfd.fd = watch->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if ( (ready = poll(&pfd, 1, timeout_ms)) < 0 )
+        return errno == EINTR ? num_found : -1;
+    if ( ready == 0 )
+        return num_found;
+
+    if ( (len = read(watch->fd, watch->buf, HOOVER_WATCH_BUF_SIZE)) < 0 )
+        return errno == EINTR || errno == EAGAIN ? num_found : -1;
+
+    for ( p = watch->buf; p < watch->buf + len; ) {
+        struct inotify_event *event = (struct inotify_event *)p;
+        p += sizeof(*event) + event->len;
+
+        /* the queue overflowed, so files may have been missed */
+        if ( event->mask & IN_Q_OVERFLOW ) {
+            fprintf( stderr, "hoover_watch_wait: lost events; rescanning %s\n", watch->root );
+            watch->scan++;
+            walk_dir( watch, watch->root, WALK_WATCH | WALK_SETTLE, NULL, NULL );
+            forget_unscanned( watch );
+            continue;
+        }
+        if ( event->wd < 0 || event->wd >= watch->max_dirs || !watch->dirs[event->wd] )
+            continue;
+        if ( event->mask & IN_IGNORED ) {
+            free( watch->dirs[event->wd] );
+            watch->dirs[event->wd] = NULL;
+            continue;
+        }
+        if ( event->len == 0 )
+            continue;
+
+        char *path = join_path(watch->dirs[event->wd], event->name);
+        if ( !path )
+            return -1;
+        if ( event->mask & IN_ISDIR ) {
+            /* files may have landed in it before the watch was added */
+            if ( event->mask & (IN_CREATE | IN_MOVED_TO) )
+                walk_dir( watch, path, WALK_WATCH | WALK_SETTLE, NULL, NULL );
+        }
+        else if ( event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO) ) {
+            struct stat st;
+            if ( lstat(path, &st) == 0 )
+                mark_reported( watch, path, &st );
+            found( path, arg );
+            num_found++;
+        }
+        else if ( event->mask & (IN_DELETE | IN_MOVED_FROM) ) {
+            forget_file( watch, path );
+        }
+        free(path);
+    }
+    return num_found;
+#else
+    (void)watch; (void)timeout_ms; (void)found; (void)arg;
+    return -1;
+#endif
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* bytes of inotify events read at once */
+#ifndef HOOVER_WATCH_BUF_SIZE
+    #define HOOVER_WATCH_BUF_SIZE (64 * 1024)
+#endif
+
+/* milliseconds that a file found by a rescan must go unchanged before it is
+ * reported, so that files still being written are left alone */
+#ifndef HOOVER_WATCH_SETTLE_MS
+    #define HOOVER_WATCH_SETTLE_MS 2000
+#endif
+
+/* called with the path of each file found; nonzero stops the search */
+typedef int (*hoover_found_fn)( const char *path, void *arg );
+
+/*
+ * hoover_watch_file is a file under a watched tree that was reported, or that
+ *   a rescan found and that will be reported once it stops changing
+ */
+struct hoover_watch_file {
+    char *path;
+    uint64_t path_hash;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    int reported;                          /* 0 while it is waiting to settle */
+    unsigned scan;                         /* last full scan that found it */
+    struct timespec changed;               /* when it was last seen to change */
+    struct hoover_watch_file *next_unsettled;
+};
+
+/*
+ * hoover_watch follows a directory tree with inotify and reports each file
+ *   once the process that wrote it closes it, or once it is moved into the
+ *   tree.  Directories created under the tree are followed as well.
+ *
+ *   Files found by walking the tree, either a new directory or the whole tree
+ *   after the kernel dropped events, may still be open for writing and may
+ *   have been reported already.  The watch remembers what it reported, as of
+ *   the stat data it had then, and only reports a walked file that is new or
+ *   changed since, and has then gone HOOVER_WATCH_SETTLE_MS without changing.
+ *
+ *   Watching is only supported on Linux.
+ */
+struct hoover_watch {
+    int fd;                   /* inotify instance */
+    char *root;
+    char **dirs;              /* path watched by each watch descriptor, or NULL */
+    int max_dirs;
+    char *buf;
+    struct hoover_watch_file **files; /* open-addressing table keyed by path */
+    size_t num_files;
+    size_t num_slots;         /* always a power of two */
+    struct hoover_watch_file *unsettled; /* files waiting to be reported */
+    unsigned scan;            /* number of full scans so far */
+};
+
+int hoover_scan_dir( const char *dir, hoover_found_fn found, void *arg );
+
+struct hoover_watch *create_hoover_watch( const char *dir );
+void free_hoover_watch( struct hoover_watch *watch );
+int hoover_watch_scan( struct hoover_watch *watch, hoover_found_fn found, void *arg );
+int hoover_watch_wait( struct hoover_watch *watch, int timeout_ms, hoover_found_fn found, void *arg );
@@ -0,0 +1,1406 @@
+/*
+ * A loopback stand-in for a RabbitMQ broker, so that producers and consumers
+ * can be tested on one machine.  It speaks enough AMQP 0-9-1 for what Hoover
+ * does: login, channels, exchange and queue declares, bindings, publishes with
+ * publisher confirms, and consumers with prefetch, acks, and requeues.
+ * Messages are only held in memory, and nothing survives a restart.
+ *
+ * Faults can be injected to see how clients cope:
+ *
+ *   -l ms           hold each publisher confirm this long before sending it
+ *   -r bytes        let each connection read and write this many bytes a second
+ *   -n count        nack every count-th message published instead of taking it
+ *   -d count        drop the connection on every count-th message published,
+ *                   without confirming it
+ *   -x count        exit on the count-th message published, as if the broker
+ *                   had died
+ *
+ * Publishes are counted across all connections.  Several brokers can run on
+ * one host by listening on different loopback addresses (127.0.0.1, 127.0.0.2,
+ * ...) with the same port, which is how a tube's servers list expects them.
+ *
+ * Usage: loopback-broker [-a address] [-p port] [-u user:password] [-l ms]
+ *                        [-r bytes_per_sec] [-n count] [-d count] [-x count] [-v]
+ *
+ * Counts of what happened are printed when the broker exits on SIGINT or
+ * SIGTERM, or because of -x.
+ */
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifndef LOOPBACK_MAX_CONNECTIONS
+    #define LOOPBACK_MAX_CONNECTIONS 64
+#endif
+
+/* channels each connection may open, numbered from 1 */
+#ifndef LOOPBACK_MAX_CHANNELS
+    #define LOOPBACK_MAX_CHANNELS 16
+#endif
+
+#ifndef LOOPBACK_MAX_QUEUES
+    #define LOOPBACK_MAX_QUEUES 64
+#endif
+
+#ifndef LOOPBACK_MAX_EXCHANGES
+    #define LOOPBACK_MAX_EXCHANGES 64
+#endif
+
+#ifndef LOOPBACK_MAX_BINDINGS
+    #define LOOPBACK_MAX_BINDINGS 256
+#endif
+
+/* largest frame offered to clients in connection.tune */
+#ifndef LOOPBACK_FRAME_MAX
+    #define LOOPBACK_FRAME_MAX 131072
+#endif
+
+/* deliveries to a connection stop while it has this many bytes unsent */
+#ifndef LOOPBACK_OUTPUT_HIGH_WATER
+    #define LOOPBACK_OUTPUT_HIGH_WATER (4 * 1024 * 1024)
+#endif
+
+#define AMQP_PROTOCOL_HEADER "AMQP\0\0\x09\x01"
+#define AMQP_PROTOCOL_HEADER_LEN 8
+
+#define FRAME_METHOD 1
+#define FRAME_HEADER 2
+#define FRAME_BODY 3
+#define FRAME_HEARTBEAT 8
+#define FRAME_END 0xce
+#define FRAME_OVERHEAD 8
+
+/* class and method ids, as (class << 16 | method) */
+#define METHOD(class, method) (((uint32_t)(class) << 16) | (method))
+#define CONNECTION_START       METHOD(10, 10)
+#define CONNECTION_START_OK    METHOD(10, 11)
+#define CONNECTION_TUNE        METHOD(10, 30)
+#define CONNECTION_TUNE_OK     METHOD(10, 31)
+#define CONNECTION_OPEN        METHOD(10, 40)
+#define CONNECTION_OPEN_OK     METHOD(10, 41)
+#define CONNECTION_CLOSE       METHOD(10, 50)
+#define CONNECTION_CLOSE_OK    METHOD(10, 51)
+#define CHANNEL_OPEN           METHOD(20, 10)
+#define CHANNEL_OPEN_OK        METHOD(20, 11)
+#define CHANNEL_CLOSE          METHOD(20, 40)
+#define CHANNEL_CLOSE_OK       METHOD(20, 41)
+#define EXCHANGE_DECLARE       METHOD(40, 10)
+#define EXCHANGE_DECLARE_OK    METHOD(40, 11)
+#define QUEUE_DECLARE          METHOD(50, 10)
+#define QUEUE_DECLARE_OK       METHOD(50, 11)
+#define QUEUE_BIND             METHOD(50, 20)
+#define QUEUE_BIND_OK          METHOD(50, 21)
+#define BASIC_QOS              METHOD(60, 10)
+#define BASIC_QOS_OK           METHOD(60, 11)
+#define BASIC_CONSUME          METHOD(60, 20)
+#define BASIC_CONSUME_OK       METHOD(60, 21)
+#define BASIC_CANCEL           METHOD(60, 30)
+#define BASIC_CANCEL_OK        METHOD(60, 31)
+#define BASIC_PUBLISH          METHOD(60, 40)
+#define BASIC_DELIVER          METHOD(60, 60)
+#define BASIC_ACK              METHOD(60, 80)
+#define BASIC_REJECT           METHOD(60, 90)
+#define BASIC_NACK             METHOD(60, 120)
+#define CONFIRM_SELECT         METHOD(85, 10)
+#define CONFIRM_SELECT_OK      METHOD(85, 11)
+
+/* reply codes */
+#define REPLY_ACCESS_REFUSED 403
+#define REPLY_NOT_FOUND 404
+#define REPLY_PRECONDITION_FAILED 406
+#define REPLY_FRAME_ERROR 501
+#define REPLY_CHANNEL_ERROR 504
+#define REPLY_NOT_IMPLEMENTED 540
+
+#define NAME_LEN 256
+
+/* one message, in a queue, being published, or delivered but not acked */
+struct message {
+    struct message *next;
+    char exchange[NAME_LEN];
+    char routing_key[NAME_LEN];
+    unsigned char *props;      /* content header after the body size */
+    size_t props_len;
+    unsigned char *body;
+    size_t body_len;
+    size_t received;           /* body bytes that have arrived so far */
+    int queue;                 /* queue it was delivered from */
+    uint64_t delivery_tag;
+    int redelivered;
+};
+
+struct queue {
+    char name[NAME_LEN];
+    struct message *head, *tail;
+    size_t count;
+};
+
+struct exchange {
+    char name[NAME_LEN];
+    char type[NAME_LEN];
+};
+
+struct binding {
+    int queue;
+    char exchange[NAME_LEN];
+    char key[NAME_LEN];
+};
+
+struct buffer {
+    unsigned char *data;
+    size_t start;              /* bytes already consumed or sent */
+    size_t len;                /* bytes in data, including consumed ones */
+    size_t capacity;
+};
+
+struct channel {
+    int open;
+    int confirm;               /* confirm.select was issued */
+    uint64_t publish_seq;      /* delivery tag of the last publish confirmed */
+    uint64_t deliver_seq;      /* delivery tag of the last delivery */
+    int consumer_queue;        /* queue consumed from, or -1 */
+    char consumer_tag[NAME_LEN];
+    int prefetch;              /* unacked deliveries allowed; 0 = no limit */
+    int unacked;
+    struct message *unacked_head, *unacked_tail;
+    struct message *incoming;  /* publish waiting for its header or body */
+    int want_header;
+};
+
+/* a confirm that is held back by -l */
+struct confirm {
+    int channel;
+    uint64_t tag;
+    int nack;
+    int64_t due_ms;
+};
+
+enum conn_state {
+    CONN_PROTOCOL = 0,         /* waiting for the protocol header */
+    CONN_START,                /* sent connection.start */
+    CONN_TUNE,                 /* sent connection.tune */
+    CONN_OPEN,                 /* waiting for connection.open */
+    CONN_RUNNING,
+    CONN_CLOSING               /* close once the output is sent */
+};
+
+struct conn {
+    int fd;                    /* -1 if the slot is free */
+    enum conn_state state;
+    struct buffer in, out;
+    size_t frame_max;
+    struct channel channels[LOOPBACK_MAX_CHANNELS + 1];
+    struct confirm *confirms;
+    int num_confirms, max_confirms;
+    double read_budget, write_budget;
+    char peer[64];
+};
+
+/* reads a method's arguments; err is set once it runs off the end */
+struct reader {
+    const unsigned char *p;
+    size_t len, pos;
+    int err;
+};
+
+/*
+ * Global state
+ */
+static struct conn conns[LOOPBACK_MAX_CONNECTIONS];
+static struct queue queues[LOOPBACK_MAX_QUEUES];
+static int num_queues;
+static struct exchange exchanges[LOOPBACK_MAX_EXCHANGES];
+static int num_exchanges;
+static struct binding bindings[LOOPBACK_MAX_BINDINGS];
+static int num_bindings;
+static unsigned long names_made;
+
+static const char *auth_user, *auth_password;
+static int64_t confirm_latency_ms;
+static double rate_limit;             /* bytes per second per connection; 0 = none */
+static unsigned long nack_every, drop_every, exit_after;
+static int verbose;
+static volatile sig_atomic_t stop;
+
+static struct {
+    unsigned long connections, published, confirmed, nacked, dropped,
+                  routed, unroutable, delivered, acked, requeued;
+} stats;
+
+/*******************************************************************************
+ * Buffers and frames
+ ******************************************************************************/
+static int64_t now_ms( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ *  Move the unconsumed bytes to the front.  Frames refer to their place in the
+ *  output buffer while they are built, so this is only done between frames.
+ */
+static void buffer_compact( struct buffer *buf ) {
+    if ( buf->start == 0 )
+        return;
+    memmove( buf->data, buf->data + buf->start, buf->len - buf->start );
+    buf->len -= buf->start;
+    buf->start = 0;
+}
+
+static int buffer_reserve( struct buffer *buf, size_t more ) {
+    unsigned char *data;
+    size_t capacity;
+
+    if ( buf->len + more <= buf->capacity )
+        return 0;
+    capacity = buf->capacity ? buf->capacity : 64 * 1024;
+    while ( capacity < buf->len + more )
+        capacity *= 2;
+    if ( !(data = realloc(buf->data, capacity)) ) {
+        fprintf( stderr, "loopback-broker: out of memory\n" );
+        return -1;
+    }
+    buf->data = data;
+    buf->capacity = capacity;
+    return 0;
+}
+
+static void put_bytes( struct buffer *buf, const void *p, size_t len ) {
+    if ( buffer_reserve(buf, len) != 0 )
+        exit( 1 );
+    memcpy( buf->data + buf->len, p, len );
+    buf->len += len;
+}
+
+static void put_uint( struct buffer *buf, uint64_t value, int width ) {
+    unsigned char b[8];
+    int i;
+    for ( i = width - 1; i >= 0; i-- ) {
+        b[i] = value & 0xff;
+        value >>= 8;
+    }
+    put_bytes( buf, b, width );
+}
+
+static void put_shortstr( struct buffer *buf, const char *s ) {
+    size_t len = strlen(s);
+    if ( len > 255 )
+        len = 255;
+    put_uint( buf, len, 1 );
+    put_bytes( buf, s, len );
+}
+
+static void put_longstr( struct buffer *buf, const char *s ) {
+    put_uint( buf, strlen(s), 4 );
+    put_bytes( buf, s, strlen(s) );
+}
+
+/**
+ *  Start a frame; returns where its size goes so that end_frame() can fill it
+ */
+static size_t begin_frame( struct buffer *buf, int type, int channel ) {
+    size_t at;
+    put_uint( buf, type, 1 );
+    put_uint( buf, channel, 2 );
+    at = buf->len;
+    put_uint( buf, 0, 4 );
+    return at;
+}
+
+static void end_frame( struct buffer *buf, size_t at ) {
+    uint32_t size = buf->len - at - 4;
+    buf->data[at] = size >> 24;
+    buf->data[at + 1] = size >> 16;
+    buf->data[at + 2] = size >> 8;
+    buf->data[at + 3] = size;
+    put_uint( buf, FRAME_END, 1 );
+}
+
+static size_t begin_method( struct conn *c, int channel, uint32_t method ) {
+    size_t at = begin_frame( &(c->out), FRAME_METHOD, channel );
+    put_uint( &(c->out), method, 4 );
+    return at;
+}
+
+/**
+ *  Send a method that takes no arguments
+ */
+static void send_method( struct conn *c, int channel, uint32_t method ) {
+    end_frame( &(c->out), begin_method(c, channel, method) );
+}
+
+static uint64_t get_uint( struct reader *r, int width ) {
+    uint64_t value = 0;
+    int i;
+    if ( r->pos + width > r->len ) {
+        r->err = 1;
+        return 0;
+    }
+    for ( i = 0; i < width; i++ )
+        value = (value << 8) | r->p[r->pos++];
+    return value;
+}
+
+static void get_shortstr( struct reader *r, char *dest ) {
+    size_t len = get_uint( r, 1 );
+    if ( r->err || r->pos + len > r->len ) {
+        r->err = 1;
+        dest[0] = '\0';
+        return;
+    }
+    memcpy( dest, r->p + r->pos, len );
+    dest[len] = '\0';
+    r->pos += len;
+}
+
+/**
+ *  Skip a long string or a field table; returns where it starts
+ */
+static const unsigned char *get_longstr( struct reader *r, size_t *len ) {
+    const unsigned char *p;
+    *len = get_uint( r, 4 );
+    if ( r->err || r->pos + *len > r->len ) {
+        r->err = 1;
+        *len = 0;
+        return NULL;
+    }
+    p = r->p + r->pos;
+    r->pos += *len;
+    return p;
+}
+
+/*******************************************************************************
+ * Queues and routing
+ ******************************************************************************/
+static void free_message( struct message *m ) {
+    free( m->props );
+    free( m->body );
+    free( m );
+}
+
+static int find_queue( const char *name ) {
+    int i;
+    for ( i = 0; i < num_queues; i++ )
+        if ( strcmp(queues[i].name, name) == 0 )
+            return i;
+    return -1;
+}
+
+static struct exchange *find_exchange( const char *name ) {
+    int i;
+    for ( i = 0; i < num_exchanges; i++ )
+        if ( strcmp(exchanges[i].name, name) == 0 )
+            return &exchanges[i];
+    return NULL;
+}
+
+static void push_message( int q, struct message *m ) {
+    m->next = NULL;
+    m->queue = q;
+    if ( queues[q].tail )
+        queues[q].tail->next = m;
+    else
+        queues[q].head = m;
+    queues[q].tail = m;
+    queues[q].count++;
+}
+
+/**
+ *  Put a message back at the front of the queue it came from
+ */
+static void requeue_message( struct message *m ) {
+    struct queue *q = &queues[m->queue];
+    m->redelivered = 1;
+    m->next = q->head;
+    q->head = m;
+    if ( !q->tail )
+        q->tail = m;
+    q->count++;
+    stats.requeued++;
+}
+
+/**
+ *  Hand a copy of a published message to every queue it is routed to.  The
+ *  default exchange routes by queue name, fanout exchanges to every bound
+ *  queue, and the rest to queues bound with the routing key (or "#").
+ */
+static void route_message( struct message *m ) {
+    struct exchange *ex = find_exchange( m->exchange );
+    int fanout = ex && strcmp(ex->type, "fanout") == 0,
+        targets[LOOPBACK_MAX_QUEUES],
+        num_targets = 0, i, j;
+
+    if ( m->exchange[0] == '\0' ) {
+        if ( (i = find_queue(m->routing_key)) >= 0 )
+            targets[num_targets++] = i;
+    }
+    else {
+        for ( i = 0; i < num_bindings; i++ ) {
+            struct binding *b = &bindings[i];
+            if ( strcmp(b->exchange, m->exchange) != 0 )
+                continue;
+            if ( !fanout && strcmp(b->key, m->routing_key) != 0 && strcmp(b->key, "#") != 0 )
+                continue;
+            for ( j = 0; j < num_targets && targets[j] != b->queue; j++ )
+                ;
+            if ( j == num_targets )
+                targets[num_targets++] = b->queue;
+        }
+    }
+
+    if ( num_targets == 0 ) {
+        stats.unroutable++;
+        free_message( m );
+        return;
+    }
+    for ( i = 1; i < num_targets; i++ ) {
+        struct message *copy = calloc( 1, sizeof(*copy) );
+        if ( !copy ) {
+            fprintf( stderr, "loopback-broker: out of memory\n" );
+            exit( 1 );
+        }
+        *copy = *m;
+        copy->props = malloc( m->props_len ? m->props_len : 1 );
+        copy->body = malloc( m->body_len ? m->body_len : 1 );
+        if ( !copy->props || !copy->body ) {
+            fprintf( stderr, "loopback-broker: out of memory\n" );
+            exit( 1 );
+        }
+        memcpy( copy->props, m->props, m->props_len );
+        memcpy( copy->body, m->body, m->body_len );
+        push_message( targets[i], copy );
+    }
+    push_message( targets[0], m );
+    stats.routed++;
+}
+
+/*******************************************************************************
+ * Connections
+ ******************************************************************************/
+static void print_stats( void ) {
+    fprintf( stderr, "loopback-broker: %lu connections, %lu published, %lu confirmed, "
+        "%lu nacked, %lu dropped, %lu routed, %lu unroutable, %lu delivered, "
+        "%lu acked, %lu requeued\n",
+        stats.connections, stats.published, stats.confirmed, stats.nacked,
+        stats.dropped, stats.routed, stats.unroutable, stats.delivered,
+        stats.acked, stats.requeued );
+}
+
+/**
+ *  Give back everything a channel had been delivered but not acked, in the
+ *  order it was delivered, and forget its consumer
+ */
+static void reset_channel( struct channel *ch ) {
+    struct message *m, *next, *reversed = NULL;
+
+    for ( m = ch->unacked_head; m; m = next ) {
+        next = m->next;
+        m->next = reversed;
+        reversed = m;
+    }
+    for ( m = reversed; m; m = next ) {
+        next = m->next;
+        requeue_message( m );
+    }
+    if ( ch->incoming )
+        free_message( ch->incoming );
+    memset( ch, 0, sizeof(*ch) );
+    ch->consumer_queue = -1;
+}
+
+static void close_conn( struct conn *c ) {
+    int i;
+    if ( verbose )
+        fprintf( stderr, "loopback-broker: closing connection from %s\n", c->peer );
+    for ( i = 0; i <= LOOPBACK_MAX_CHANNELS; i++ )
+        reset_channel( &(c->channels[i]) );
+    close( c->fd );
+    free( c->in.data );
+    free( c->out.data );
+    free( c->confirms );
+    memset( c, 0, sizeof(*c) );
+    c->fd = -1;
+}
+
+/**
+ *  Report a connection-level error and close once the client has been told
+ */
+static void connection_error( struct conn *c, int code, const char *text, uint32_t method ) {
+    size_t at = begin_method( c, 0, CONNECTION_CLOSE );
+    put_uint( &(c->out), code, 2 );
+    put_shortstr( &(c->out), text );
+    put_uint( &(c->out), method >> 16, 2 );
+    put_uint( &(c->out), method & 0xffff, 2 );
+    end_frame( &(c->out), at );
+    c->state = CONN_CLOSING;
+    if ( verbose )
+        fprintf( stderr, "loopback-broker: %s: %s\n", c->peer, text );
+}
+
+/**
+ *  Close a channel because of something the client did on it
+ */
+static void channel_error( struct conn *c, int channel, int code, const char *text, uint32_t method ) {
+    size_t at = begin_method( c, channel, CHANNEL_CLOSE );
+    put_uint( &(c->out), code, 2 );
+    put_shortstr( &(c->out), text );
+    put_uint( &(c->out), method >> 16, 2 );
+    put_uint( &(c->out), method & 0xffff, 2 );
+    end_frame( &(c->out), at );
+    reset_channel( &(c->channels[channel]) );
+    if ( verbose )
+        fprintf( stderr, "loopback-broker: %s channel %d: %s\n", c->peer, channel, text );
+}
+
+static void send_confirm( struct conn *c, int channel, uint64_t tag, int nack ) {
+    size_t at = begin_method( c, channel, nack ? BASIC_NACK : BASIC_ACK );
+    put_uint( &(c->out), tag, 8 );
+    put_uint( &(c->out), 0, 1 );    /* multiple = 0, requeue = 0 */
+    end_frame( &(c->out), at );
+    if ( nack )
+        stats.nacked++;
+    else
+        stats.confirmed++;
+}
+
+/**
+ *  Send every held-back confirm that is due.  Confirms go out in the order
+ *  their messages came in.
+ */
+static void send_due_confirms( struct conn *c, int64_t now ) {
+    int i, sent = 0;
+    for ( i = 0; i < c->num_confirms && c->confirms[i].due_ms <= now; i++, sent++ ) {
+        struct confirm *cf = &(c->confirms[i]);
+        if ( c->channels[cf->channel].open )
+            send_confirm( c, cf->channel, cf->tag, cf->nack );
+    }
+    if ( sent > 0 ) {
+        memmove( c->confirms, c->confirms + sent, sizeof(*c->confirms) * (c->num_confirms - sent) );
+        c->num_confirms -= sent;
+    }
+}
+
+/**
+ *  A message has arrived in full.  Take it, nack it, or fail, as configured.
+ *  Returns -1 if the connection was dropped.
+ */
+static int finish_publish( struct conn *c, int channel ) {
+    struct channel *ch = &(c->channels[channel]);
+    struct message *m = ch->incoming;
+    int nack;
+
+    ch->incoming = NULL;
+    stats.published++;
+
+    if ( exit_after && stats.published >= exit_after ) {
+        fprintf( stderr, "loopback-broker: exiting after %lu messages\n", stats.published );
+        print_stats();
+        exit( 0 );
+    }
+    if ( drop_every && stats.published % drop_every == 0 ) {
+        free_message( m );
+        stats.dropped++;
+        if ( verbose )
+            fprintf( stderr, "loopback-broker: dropping connection from %s\n", c->peer );
+        close_conn( c );
+        return -1;
+    }
+
+    nack = nack_every && stats.published % nack_every == 0;
+    if ( nack )
+        free_message( m );
+    else
+        route_message( m );
+
+    if ( ch->confirm ) {
+        uint64_t tag = ++ch->publish_seq;
+        if ( confirm_latency_ms <= 0 ) {
+            send_confirm( c, channel, tag, nack );
+        }
+        else {
+            if ( c->num_confirms == c->max_confirms ) {
+                int max = c->max_confirms ? 2 * c->max_confirms : 64;
+                struct confirm *grown = realloc( c->confirms, sizeof(*grown) * max );
+                if ( !grown ) {
+                    fprintf( stderr, "loopback-broker: out of memory\n" );
+                    exit( 1 );
+                }
+                c->confirms = grown;
+                c->max_confirms = max;
+            }
+            c->confirms[c->num_confirms].channel = channel;
+            c->confirms[c->num_confirms].tag = tag;
+            c->confirms[c->num_confirms].nack = nack;
+            c->confirms[c->num_confirms].due_ms = now_ms() + confirm_latency_ms;
+            c->num_confirms++;
+        }
+    }
+    return 0;
+}
+
+/**
+ *  Settle deliveries that a consumer acked or rejected.  Returns 0, or -1 if
+ *  no such delivery is outstanding.
+ */
+static int settle( struct channel *ch, uint64_t tag, int multiple, int ack, int requeue ) {
+    struct message *m = ch->unacked_head, *prev = NULL, *next;
+    int found = 0;
+
+    while ( m ) {
+        next = m->next;
+        if ( m->delivery_tag == tag || (multiple && m->delivery_tag < tag) ) {
+            if ( prev )
+                prev->next = next;
+            else
+                ch->unacked_head = next;
+            if ( ch->unacked_tail == m )
+                ch->unacked_tail = prev;
+            ch->unacked--;
+            found = 1;
+            if ( ack ) {
+                stats.acked++;
+                free_message( m );
+            }
+            else if ( requeue ) {
+                requeue_message( m );
+            }
+            else {
+                free_message( m );
+            }
+        }
+        else {
+            prev = m;
+        }
+        m = next;
+    }
+    return found ? 0 : -1;
+}
+
+/**
+ *  Act on one method frame.  Returns -1 if the connection was closed.
+ */
+static int handle_method( struct conn *c, int channel, const unsigned char *payload, size_t len ) {
+    struct reader r = { payload, len, 0, 0 };
+    struct channel *ch;
+    uint32_t method = get_uint( &r, 4 );
+    char name[NAME_LEN], other[NAME_LEN], key[NAME_LEN];
+    const unsigned char *s;
+    size_t slen;
+    int bits, q;
+    size_t at;
+
+    if ( r.err ) {
+        connection_error( c, REPLY_FRAME_ERROR, "FRAME_ERROR - short method frame", 0 );
+        return 0;
+    }
+    if ( channel > LOOPBACK_MAX_CHANNELS ) {
+        connection_error( c, REPLY_CHANNEL_ERROR, "CHANNEL_ERROR - channel number too high", method );
+        return 0;
+    }
+    ch = &(c->channels[channel]);
+
+    /* only the handshake is allowed before the connection is open */
+    if ( c->state < CONN_RUNNING && method >> 16 != 10 ) {
+        connection_error( c, REPLY_CHANNEL_ERROR, "CHANNEL_ERROR - connection is not open", method );
+        return 0;
+    }
+    if ( method >> 16 != 10 && !ch->open && method != CHANNEL_OPEN && method != CHANNEL_CLOSE_OK ) {
+        connection_error( c, REPLY_CHANNEL_ERROR, "CHANNEL_ERROR - channel is not open", method );
+        return 0;
+    }
+
+    switch ( method ) {
+    case CONNECTION_START_OK:
+        get_longstr( &r, &slen );             /* client properties */
+        get_shortstr( &r, name );             /* mechanism */
+        s = get_longstr( &r, &slen );         /* response */
+        if ( r.err || strcmp(name, "PLAIN") != 0 ) {
+            connection_error( c, REPLY_ACCESS_REFUSED, "ACCESS_REFUSED - only PLAIN login is supported", method );
+            return 0;
+        }
+        if ( auth_user ) {
+            /* PLAIN responses are "\0user\0password" */
+            size_t ulen = strlen(auth_user), plen = strlen(auth_password);
+            if ( slen != ulen + plen + 2 || s[0] != '\0'
+            ||   memcmp(s + 1, auth_user, ulen) != 0 || s[ulen + 1] != '\0'
+            ||   memcmp(s + ulen + 2, auth_password, plen) != 0 ) {
+                connection_error( c, REPLY_ACCESS_REFUSED, "ACCESS_REFUSED - Login was refused", method );
+                return 0;
+            }
+        }
+        at = begin_method( c, 0, CONNECTION_TUNE );
+        put_uint( &(c->out), LOOPBACK_MAX_CHANNELS, 2 );
+        put_uint( &(c->out), LOOPBACK_FRAME_MAX, 4 );
+        put_uint( &(c->out), 0, 2 );          /* no heartbeats */
+        end_frame( &(c->out), at );
+        c->state = CONN_TUNE;
+        break;
+
+    case CONNECTION_TUNE_OK:
+        get_uint( &r, 2 );
+        slen = get_uint( &r, 4 );
+        if ( slen >= 4096 && slen < c->frame_max )
+            c->frame_max = slen;
+        c->state = CONN_OPEN;
+        break;
+
+    case CONNECTION_OPEN:
+        at = begin_method( c, 0, CONNECTION_OPEN_OK );
+        put_shortstr( &(c->out), "" );
+        end_frame( &(c->out), at );
+        c->state = CONN_RUNNING;
+        break;
+
+    case CONNECTION_CLOSE:
+        send_method( c, 0, CONNECTION_CLOSE_OK );
+        c->state = CONN_CLOSING;
+        break;
+
+    case CONNECTION_CLOSE_OK:
+        close_conn( c );
+        return -1;
+
+    case CHANNEL_OPEN:
+        if ( channel == 0 || ch->open ) {
+            connection_error( c, REPLY_CHANNEL_ERROR, "CHANNEL_ERROR - channel cannot be opened", method );
+            return 0;
+        }
+        reset_channel( ch );
+        ch->open = 1;
+        at = begin_method( c, channel, CHANNEL_OPEN_OK );
+        put_longstr( &(c->out), "" );
+        end_frame( &(c->out), at );
+        break;
+
+    case CHANNEL_CLOSE:
+        reset_channel( ch );
+        send_method( c, channel, CHANNEL_CLOSE_OK );
+        break;
+
+    case CHANNEL_CLOSE_OK:
+        reset_channel( ch );
+        break;
+
+    case EXCHANGE_DECLARE:
+        get_uint( &r, 2 );
+        get_shortstr( &r, name );
+        get_shortstr( &r, other );
+        bits = get_uint( &r, 1 );
+        if ( r.err ) {
+            connection_error( c, REPLY_FRAME_ERROR, "FRAME_ERROR - malformed exchange.declare", method );
+            return 0;
+        }
+        if ( !find_exchange(name) ) {
+            if ( num_exchanges == LOOPBACK_MAX_EXCHANGES ) {
+                channel_error( c, channel, REPLY_NOT_IMPLEMENTED, "NOT_IMPLEMENTED - too many exchanges", method );
+                break;
+            }
+            strcpy( exchanges[num_exchanges].name, name );
+            strcpy( exchanges[num_exchanges].type, other );
+            num_exchanges++;
+        }
+        if ( !(bits & 0x10) )                 /* no-wait */
+            send_method( c, channel, EXCHANGE_DECLARE_OK );
+        break;
+
+    case QUEUE_DECLARE:
+        get_uint( &r, 2 );
+        get_shortstr( &r, name );
+        bits = get_uint( &r, 1 );
+        if ( r.err ) {
+            connection_error( c, REPLY_FRAME_ERROR, "FRAME_ERROR - malformed queue.declare", method );
+            return 0;
+        }
+        if ( name[0] == '\0' )
+            snprintf( name, NAME_LEN, "amq.gen-%lu", ++names_made );
+        if ( (q = find_queue(name)) < 0 ) {
+            if ( num_queues == LOOPBACK_MAX_QUEUES ) {
+                channel_error( c, channel, REPLY_NOT_IMPLEMENTED, "NOT_IMPLEMENTED - too many queues", method );
+                break;
+            }
+            q = num_queues++;
+            strcpy( queues[q].name, name );
+        }
+        if ( !(bits & 0x10) ) {
+            int consumers = 0, i, j;
+            for ( i = 0; i < LOOPBACK_MAX_CONNECTIONS; i++ )
+                for ( j = 1; conns[i].fd >= 0 && j <= LOOPBACK_MAX_CHANNELS; j++ )
+                    consumers += conns[i].channels[j].open && conns[i].channels[j].consumer_queue == q;
+            at = begin_method( c, channel, QUEUE_DECLARE_OK );
+            put_shortstr( &(c->out), name );
+            put_uint( &(c->out), queues[q].count, 4 );
+            put_uint( &(c->out), consumers, 4 );
+            end_frame( &(c->out), at );
+        }
+        break;
+
+    case QUEUE_BIND:
+        get_uint( &r, 2 );
+        get_shortstr( &r, name );
+        get_shortstr( &r, other );
+        get_shortstr( &r, key );
+        bits = get_uint( &r, 1 );
+        if ( r.err ) {
+            connection_error( c, REPLY_FRAME_ERROR, "FRAME_ERROR - malformed queue.bind", method );
+            return 0;
+        }
+        if ( (q = find_queue(name)) < 0 ) {
+            channel_error( c, channel, REPLY_NOT_FOUND, "NOT_FOUND - no such queue", method );
+            break;
+        }
+        if ( !find_exchange(other) ) {
+            channel_error( c, channel, REPLY_NOT_FOUND, "NOT_FOUND - no such exchange", method );
+            break;
+        }
+        if ( num_bindings == LOOPBACK_MAX_BINDINGS ) {
+            channel_error( c, channel, REPLY_NOT_IMPLEMENTED, "NOT_IMPLEMENTED - too many bindings", method );
+            break;
+        }
+        bindings[num_bindings].queue = q;
+        strcpy( bindings[num_bindings].exchange, other );
+        strcpy( bindings[num_bindings].key, key );
+        num_bindings++;
+        if ( !(bits & 0x01) )
+            send_method( c, channel, QUEUE_BIND_OK );
+        break;
+
+    case BASIC_QOS:
+        get_uint( &r, 4 );
+        ch->prefetch = get_uint( &r, 2 );
+        send_method( c, channel, BASIC_QOS_OK );
+        break;
+
+    case BASIC_CONSUME:
+        get_uint( &r, 2 );
+        get_shortstr( &r, name );
+        get_shortstr( &r, key );
+        bits = get_uint( &r, 1 );
+        if ( r.err ) {
+            connection_error( c, REPLY_FRAME_ERROR, "FRAME_ERROR - malformed basic.consume", method );
+            return 0;
+        }
+        if ( (q = find_queue(name)) < 0 ) {
+            channel_error( c, channel, REPLY_NOT_FOUND, "NOT_FOUND - no such queue", method );
+            break;
+        }
+        if ( ch->consumer_queue >= 0 || (bits & 0x02) ) {
+            channel_error( c, channel, REPLY_NOT_IMPLEMENTED,
+                "NOT_IMPLEMENTED - one consumer per channel, with acks", method );
+            break;
+        }
+        if ( key[0] == '\0' )
+            snprintf( key, NAME_LEN, "amq.ctag-%lu", ++names_made );
+        ch->consumer_queue = q;
+        strcpy( ch->consumer_tag, key );
+        if ( !(bits & 0x08) ) {
+            at = begin_method( c, channel, BASIC_CONSUME_OK );
+            put_shortstr( &(c->out), key );
+            end_frame( &(c->out), at );
+        }
+        break;
+
+    case BASIC_CANCEL:
+        get_shortstr( &r, name );
+        bits = get_uint( &r, 1 );
+        ch->consumer_queue = -1;
+        if ( !(bits & 0x01) ) {
+            at = begin_method( c, channel, BASIC_CANCEL_OK );
+            put_shortstr( &(c->out), name );
+            end_frame( &(c->out), at );
+        }
+        break;
+
+    case BASIC_PUBLISH:
+        get_uint( &r, 2 );
+        get_shortstr( &r, name );
+        get_shortstr( &r, key );
+        if ( r.err || ch->incoming ) {
+            connection_error( c, REPLY_FRAME_ERROR, "FRAME_ERROR - unexpected basic.publish", method );
+            return 0;
+        }
+        if ( !(ch->incoming = calloc(1, sizeof(struct message))) ) {
+            fprintf( stderr, "loopback-broker: out of memory\n" );
+            exit( 1 );
+        }
+        strcpy( ch->incoming->exchange, name );
+        strcpy( ch->incoming->routing_key, key );
+        ch->want_header = 1;
+        break;
+
+    case BASIC_ACK:
+    case BASIC_NACK:
+    case BASIC_REJECT: {
+        uint64_t tag = get_uint( &r, 8 );
+        bits = get_uint( &r, 1 );
+        if ( r.err ) {
+            connection_error( c, REPLY_FRAME_ERROR, "FRAME_ERROR - malformed acknowledgement", method );
+            return 0;
+        }
+        if ( method == BASIC_ACK )
+            q = settle( ch, tag, bits & 0x01, 1, 0 );
+        else if ( method == BASIC_NACK )
+            q = settle( ch, tag, bits & 0x01, 0, bits & 0x02 );
+        else
+            q = settle( ch, tag, 0, 0, bits & 0x01 );
+        if ( q != 0 )
+            channel_error( c, channel, REPLY_PRECONDITION_FAILED, "PRECONDITION_FAILED - unknown delivery tag", method );
+        break;
+    }
+
+    case CONFIRM_SELECT:
+        bits = get_uint( &r, 1 );
+        ch->confirm = 1;
+        if ( !(bits & 0x01) )
+            send_method( c, channel, CONFIRM_SELECT_OK );
+        break;
+
+    default:
+        connection_error( c, REPLY_NOT_IMPLEMENTED, "NOT_IMPLEMENTED - method not supported", method );
+        return 0;
+    }
+    return 0;
+}
+
+/**
+ *  Act on one frame.  Returns -1 if the connection was closed.
+ */
+static int handle_frame( struct conn *c, int type, int channel, const unsigned char *payload, size_t len ) {
+    struct channel *ch = &(c->channels[channel <= LOOPBACK_MAX_CHANNELS ? channel : 0]);
+    struct message *m = ch->incoming;
+
+    if ( type == FRAME_HEARTBEAT )
+        return 0;
+    if ( type == FRAME_METHOD ) {
+        if ( m ) {
+            connection_error( c, REPLY_FRAME_ERROR, "FRAME_ERROR - method inside a message", 0 );
+            return 0;
+        }
+        return handle_method( c, channel, payload, len );
+    }
+
+    if ( type == FRAME_HEADER && m && ch->want_header ) {
+        struct reader r = { payload, len, 0, 0 };
+        get_uint( &r, 4 );                    /* class and weight */
+        m->body_len = get_uint( &r, 8 );
+        if ( r.err ) {
+            connection_error( c, REPLY_FRAME_ERROR, "FRAME_ERROR - short content header", 0 );
+            return 0;
+        }
+        m->props_len = len - r.pos;
+        m->props = malloc( m->props_len ? m->props_len : 1 );
+        m->body = malloc( m->body_len ? m->body_len : 1 );
+        if ( !m->props || !m->body ) {
+            connection_error( c, REPLY_FRAME_ERROR, "FRAME_ERROR - message too large", 0 );
+            return 0;
+        }
+        memcpy( m->props, payload + r.pos, m->props_len );
+        ch->want_header = 0;
+        if ( m->body_len == 0 )
+            return finish_publish( c, channel );
+        return 0;
+    }
+
+    if ( type == FRAME_BODY && m && !ch->want_header ) {
+        if ( m->received + len > m->body_len ) {
+            connection_error( c, REPLY_FRAME_ERROR, "FRAME_ERROR - body longer than its header says", 0 );
+            return 0;
+        }
+        memcpy( m->body + m->received, payload, len );
+        m->received += len;
+        if ( m->received == m->body_len )
+            return finish_publish( c, channel );
+        return 0;
+    }
+
+    connection_error( c, REPLY_FRAME_ERROR, "FRAME_ERROR - unexpected frame", 0 );
+    return 0;
+}
+
+/**
+ *  Act on every complete frame that has been read.  Returns -1 if the
+ *  connection was closed.
+ */
+static int process_input( struct conn *c ) {
+    struct buffer *in = &(c->in);
+
+    if ( c->state == CONN_PROTOCOL ) {
+        size_t at;
+        if ( in->len - in->start < AMQP_PROTOCOL_HEADER_LEN )
+            return 0;
+        if ( memcmp(in->data + in->start, AMQP_PROTOCOL_HEADER, AMQP_PROTOCOL_HEADER_LEN) != 0 ) {
+            /* tell the client which protocol is spoken here, then hang up */
+            put_bytes( &(c->out), AMQP_PROTOCOL_HEADER, AMQP_PROTOCOL_HEADER_LEN );
+            c->state = CONN_CLOSING;
+            return 0;
+        }
+        in->start += AMQP_PROTOCOL_HEADER_LEN;
+
+        at = begin_method( c, 0, CONNECTION_START );
+        put_uint( &(c->out), 0, 1 );          /* version 0-9 */
+        put_uint( &(c->out), 9, 1 );
+        put_uint( &(c->out), 0, 4 );          /* no server properties */
+        put_longstr( &(c->out), "PLAIN" );
+        put_longstr( &(c->out), "en_US" );
+        end_frame( &(c->out), at );
+        c->state = CONN_START;
+    }
+
+    while ( c->state != CONN_CLOSING && in->len - in->start >= 7 ) {
+        const unsigned char *p = in->data + in->start;
+        size_t size = ((size_t)p[3] << 24) | ((size_t)p[4] << 16) | ((size_t)p[5] << 8) | p[6];
+        if ( size + FRAME_OVERHEAD > c->frame_max ) {
+            connection_error( c, REPLY_FRAME_ERROR, "FRAME_ERROR - frame too large", 0 );
+            return 0;
+        }
+        if ( in->len - in->start < size + FRAME_OVERHEAD )
+            break;
+        if ( p[7 + size] != FRAME_END ) {
+            connection_error( c, REPLY_FRAME_ERROR, "FRAME_ERROR - bad frame end", 0 );
+            return 0;
+        }
+        in->start += size + FRAME_OVERHEAD;
+        if ( handle_frame(c, p[0], (p[1] << 8) | p[2], p + 7, size) != 0 )
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ *  Send one message to a consumer as a basic.deliver and its content
+ */
+static void deliver( struct conn *c, int channel, struct message *m ) {
+    struct channel *ch = &(c->channels[channel]);
+    size_t at, sent, max_body = c->frame_max - FRAME_OVERHEAD;
+
+    m->delivery_tag = ++ch->deliver_seq;
+    at = begin_method( c, channel, BASIC_DELIVER );
+    put_shortstr( &(c->out), ch->consumer_tag );
+    put_uint( &(c->out), m->delivery_tag, 8 );
+    put_uint( &(c->out), m->redelivered, 1 );
+    put_shortstr( &(c->out), m->exchange );
+    put_shortstr( &(c->out), m->routing_key );
+    end_frame( &(c->out), at );
+
+    at = begin_frame( &(c->out), FRAME_HEADER, channel );
+    put_uint( &(c->out), 60, 2 );             /* basic class */
+    put_uint( &(c->out), 0, 2 );              /* weight */
+    put_uint( &(c->out), m->body_len, 8 );
+    put_bytes( &(c->out), m->props, m->props_len );
+    end_frame( &(c->out), at );
+
+    for ( sent = 0; sent < m->body_len; sent += max_body ) {
+        size_t len = m->body_len - sent < max_body ? m->body_len - sent : max_body;
+        at = begin_frame( &(c->out), FRAME_BODY, channel );
+        put_bytes( &(c->out), m->body + sent, len );
+        end_frame( &(c->out), at );
+    }
+
+    m->next = NULL;
+    if ( ch->unacked_tail )
+        ch->unacked_tail->next = m;
+    else
+        ch->unacked_head = m;
+    ch->unacked_tail = m;
+    ch->unacked++;
+    stats.delivered++;
+}
+
+/**
+ *  Hand queued messages to consumers that have room for them, taking turns
+ */
+static void dispatch( void ) {
+    static int next_conn;
+    int progress = 1, q, i, j;
+
+    while ( progress ) {
+        progress = 0;
+        for ( i = 0; i < LOOPBACK_MAX_CONNECTIONS; i++ ) {
+            struct conn *c = &conns[(next_conn + i) % LOOPBACK_MAX_CONNECTIONS];
+            if ( c->fd < 0 || c->state != CONN_RUNNING
+            ||   c->out.len - c->out.start >= LOOPBACK_OUTPUT_HIGH_WATER )
+                continue;
+            for ( j = 1; j <= LOOPBACK_MAX_CHANNELS; j++ ) {
+                struct channel *ch = &(c->channels[j]);
+                struct message *m;
+                if ( !ch->open || (q = ch->consumer_queue) < 0 || !queues[q].head
+                ||   (ch->prefetch > 0 && ch->unacked >= ch->prefetch) )
+                    continue;
+                m = queues[q].head;
+                queues[q].head = m->next;
+                if ( !queues[q].head )
+                    queues[q].tail = NULL;
+                queues[q].count--;
+                deliver( c, j, m );
+                progress = 1;
+            }
+        }
+        next_conn = (next_conn + 1) % LOOPBACK_MAX_CONNECTIONS;
+    }
+}
+
+static void accept_conn( int listener ) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    struct conn *c = NULL;
+    int fd, i;
+
+    if ( (fd = accept(listener, (struct sockaddr *)&addr, &addr_len)) < 0 )
+        return;
+    for ( i = 0; i < LOOPBACK_MAX_CONNECTIONS && !c; i++ )
+        if ( conns[i].fd < 0 )
+            c = &conns[i];
+    if ( !c ) {
+        fprintf( stderr, "loopback-broker: too many connections; refusing one\n" );
+        close( fd );
+        return;
+    }
+    fcntl( fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK );
+    memset( c, 0, sizeof(*c) );
+    c->fd = fd;
+    c->state = CONN_PROTOCOL;
+    c->frame_max = LOOPBACK_FRAME_MAX;
+    for ( i = 0; i <= LOOPBACK_MAX_CHANNELS; i++ )
+        c->channels[i].consumer_queue = -1;
+    snprintf( c->peer, sizeof(c->peer), "%s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port) );
+    stats.connections++;
+    if ( verbose )
+        fprintf( stderr, "loopback-broker: connection from %s\n", c->peer );
+}
+
+/**
+ *  Read what the connection's budget allows.  Returns -1 if it was closed.
+ */
+static int read_conn( struct conn *c ) {
+    size_t want = 64 * 1024;
+    ssize_t n;
+
+    if ( rate_limit > 0 && want > c->read_budget )
+        want = c->read_budget;
+    if ( want == 0 )
+        return 0;
+    buffer_compact( &(c->in) );
+    if ( buffer_reserve(&(c->in), want) != 0 )
+        return 0;
+    n = read( c->fd, c->in.data + c->in.len, want );
+    if ( n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR) ) {
+        close_conn( c );
+        return -1;
+    }
+    if ( n > 0 ) {
+        c->in.len += n;
+        c->read_budget -= n;
+    }
+    return process_input( c );
+}
+
+/**
+ *  Write what the connection's budget allows.  Returns -1 if it was closed.
+ */
+static int write_conn( struct conn *c ) {
+    size_t want = c->out.len - c->out.start;
+    ssize_t n;
+
+    if ( rate_limit > 0 && want > c->write_budget )
+        want = c->write_budget;
+    if ( want == 0 )
+        return 0;
+    n = write( c->fd, c->out.data + c->out.start, want );
+    if ( n < 0 && errno != EAGAIN && errno != EINTR ) {
+        close_conn( c );
+        return -1;
+    }
+    if ( n > 0 ) {
+        c->out.start += n;
+        c->write_budget -= n;
+        if ( c->out.start == c->out.len )
+            c->out.start = c->out.len = 0;
+        else if ( c->out.start > c->out.capacity / 2 )
+            buffer_compact( &(c->out) );
+    }
+    if ( c->state == CONN_CLOSING && c->out.start == c->out.len ) {
+        close_conn( c );
+        return -1;
+    }
+    return 0;
+}
+
+static void handle_signal( int sig ) {
+    stop = 1;
+}
+
+static int64_t parse_count( const char *str ) {
+    char *end;
+    double value = strtod( str, &end );
+    switch ( *end ) {
+        case 'g': case 'G': value *= 1024; /* fall through */
+        case 'm': case 'M': value *= 1024; /* fall through */
+        case 'k': case 'K': value *= 1024;
+    }
+    return (int64_t)value;
+}
+
+int main( int argc, char **argv ) {
+    struct pollfd fds[LOOPBACK_MAX_CONNECTIONS + 1];
+    struct conn *polled[LOOPBACK_MAX_CONNECTIONS + 1];
+    struct sockaddr_in addr;
+    struct sigaction sa;
+    const char *address = "127.0.0.1";
+    char *password;
+    int64_t last_refill;
+    int port = 5672, listener, one = 1, c, i;
+
+    while ( (c = getopt(argc, argv, "a:p:u:l:r:n:d:x:v")) != -1 ) {
+        switch (c) {
+        case 'a': address = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'u':
+            if ( !(password = strchr(optarg, ':')) ) {
+                fprintf( stderr, "-u takes user:password\n" );
+                return 1;
+            }
+            *password = '\0';
+            auth_user = optarg;
+            auth_password = password + 1;
+            break;
+        case 'l': confirm_latency_ms = atol(optarg); break;
+        case 'r': rate_limit = parse_count(optarg); break;
+        case 'n': nack_every = strtoul(optarg, NULL, 10); break;
+        case 'd': drop_every = strtoul(optarg, NULL, 10); break;
+        case 'x': exit_after = strtoul(optarg, NULL, 10); break;
+        case 'v': verbose = 1; break;
+        default:
+            fprintf( stderr, "Syntax: %s [-a address] [-p port] [-u user:password] [-l ms] [-r bytes_per_sec] [-n count] [-d count] [-x count] [-v]\n", argv[0] );
+            return 1;
+        }
+    }
+
+    memset( &addr, 0, sizeof(addr) );
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if ( inet_pton(AF_INET, address, &addr.sin_addr) != 1 ) {
+        fprintf( stderr, "loopback-broker: bad address %s\n", address );
+        return 1;
+    }
+    if ( (listener = socket(AF_INET, SOCK_STREAM, 0)) < 0
+    ||   setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0
+    ||   bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0
+    ||   listen(listener, 64) != 0 ) {
+        fprintf( stderr, "loopback-broker: cannot listen on %s:%d: %s\n", address, port, strerror(errno) );
+        return 1;
+    }
+    if ( port == 0 ) {
+        socklen_t len = sizeof(addr);
+        getsockname( listener, (struct sockaddr *)&addr, &len );
+        port = ntohs(addr.sin_port);
+    }
+    printf( "listening on %s:%d\n", address, port );
+    fflush( stdout );
+
+    memset( &sa, 0, sizeof(sa) );
+    sa.sa_handler = handle_signal;
+    sigaction( SIGINT, &sa, NULL );
+    sigaction( SIGTERM, &sa, NULL );
+    signal( SIGPIPE, SIG_IGN );
+
+    for ( i = 0; i < LOOPBACK_MAX_CONNECTIONS; i++ )
+        conns[i].fd = -1;
+    last_refill = now_ms();
+
+    while ( !stop ) {
+        int64_t now = now_ms(), next_due = -1;
+        int nfds = 0, timeout = 1000, throttled = 0;
+
+        /* each connection may move rate_limit bytes a second each way, and
+         * save up at most a tenth of a second of that */
+        if ( rate_limit > 0 ) {
+            double refill = rate_limit * (now - last_refill) / 1000.0,
+                   burst = rate_limit / 10 > 4096 ? rate_limit / 10 : 4096;
+            for ( i = 0; i < LOOPBACK_MAX_CONNECTIONS; i++ ) {
+                conns[i].read_budget += refill;
+                if ( conns[i].read_budget > burst )
+                    conns[i].read_budget = burst;
+                conns[i].write_budget += refill;
+                if ( conns[i].write_budget > burst )
+                    conns[i].write_budget = burst;
+            }
+        }
+        last_refill = now;
+
+        for ( i = 0; i < LOOPBACK_MAX_CONNECTIONS; i++ ) {
+            if ( conns[i].fd >= 0 && conns[i].num_confirms > 0 ) {
+                send_due_confirms( &conns[i], now );
+                if ( conns[i].num_confirms > 0
+                &&   (next_due < 0 || conns[i].confirms[0].due_ms < next_due) )
+                    next_due = conns[i].confirms[0].due_ms;
+            }
+        }
+        dispatch();
+
+        fds[nfds].fd = listener;
+        fds[nfds].events = POLLIN;
+        polled[nfds++] = NULL;
+        for ( i = 0; i < LOOPBACK_MAX_CONNECTIONS; i++ ) {
+            struct conn *conn = &conns[i];
+            short events = 0;
+            if ( conn->fd < 0 )
+                continue;
+            if ( conn->state != CONN_CLOSING ) {
+                if ( rate_limit <= 0 || conn->read_budget >= 1 )
+                    events |= POLLIN;
+                else
+                    throttled = 1;
+            }
+            if ( conn->out.len > conn->out.start ) {
+                if ( rate_limit <= 0 || conn->write_budget >= 1 )
+                    events |= POLLOUT;
+                else
+                    throttled = 1;
+            }
+            fds[nfds].fd = conn->fd;
+            fds[nfds].events = events;
+            polled[nfds++] = conn;
+        }
+
+        if ( next_due >= 0 )
+            timeout = next_due > now ? (int)(next_due - now) : 0;
+        if ( throttled && timeout > 10 )
+            timeout = 10;
+        if ( poll(fds, nfds, timeout) < 0 ) {
+            if ( errno == EINTR )
+                continue;
+            fprintf( stderr, "loopback-broker: poll failed: %s\n", strerror(errno) );
+            break;
+        }
+
+        if ( fds[0].revents & POLLIN )
+            accept_conn( listener );
+        for ( i = 1; i < nfds; i++ ) {
+            struct conn *conn = polled[i];
+            if ( fds[i].revents & (POLLIN | POLLHUP | POLLERR) ) {
+                if ( read_conn(conn) != 0 )
+                    continue;
+            }
+            if ( conn->fd >= 0 && conn->out.len > conn->out.start )
+                write_conn( conn );
+        }
+    }
+
+    print_stats();
+    return 0;
+}
@@ -0,0 +1,59 @@
+#!/usr/bin/env python
+#
+#  Convert a Hoover manifest to the JSON manifest format, or look up one of
+#  its files.  Accepts binary and JSON manifests, compressed or not.
+#
+
+from __future__ import print_function
+
+import sys
+import json
+import hoover
+import argparse
+
+def load_manifest( filename ):
+    """Read a manifest file and undo its compression, which is inferred from
+    its suffix"""
+    compression = ''
+    for suffix in ( 'gz', 'zst', 'lz4' ):
+        if filename.endswith('.' + suffix):
+            compression = suffix
+    dec = hoover.decompressor(compression)
+    with open(filename, 'rb') as fp:
+        return dec.decompress(fp.read()) + dec.flush()
+
+def main( argv=None ):
+    parser = argparse.ArgumentParser()
+    parser.add_argument('manifest', help='manifest file to read')
+    parser.add_argument('-s', '--sha', help='only print the file whose sha1sum or hash_orig is SHA')
+    parser.add_argument('-n', '--name', help='only print the file transmitted as NAME')
+    parser.add_argument('-o', '--output', help='write the JSON here instead of stdout')
+    args = parser.parse_args(argv)
+
+    data = load_manifest(args.manifest)
+    if args.sha or args.name:
+        if data.startswith(hoover.MANIFEST_MAGIC):
+            ### binary manifests are searched through their indices
+            manifest = hoover.BinaryManifest(data)
+            entry = manifest.find_by_hash(args.sha) if args.sha else manifest.find_by_name(args.name)
+        elif args.sha:
+            entry = next((x for x in hoover.read_manifest(data)
+                          if args.sha in (x.get('sha1sum'), x.get('hash_orig'))), None)
+        else:
+            entry = next((x for x in hoover.read_manifest(data) if x.get('filename') == args.name), None)
+        if entry is None:
+            print("no such file in %s" % args.manifest, file=sys.stderr)
+            return 1
+        output = json.dumps(entry, indent=4)
+    else:
+        output = hoover.manifest_to_json(data)
+
+    if args.output:
+        with open(args.output, 'w') as fp:
+            fp.write(output + '\n')
+    else:
+        print(output)
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
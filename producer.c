@@ -10,9 +10,114 @@
 #include <stdint.h>
 #include <unistd.h> /* gethostname */
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include "hooverio.h"
+#ifdef HOOVER_TUBE_FILE
+#include "hooverfile.h"
+#elif defined(HOOVER_TUBE_MEM)
+#include "hoovermem.h"
+#else
 #include "hooverrmq.h"
+#endif
+#include "hooverqueue.h"
+#include "hooverbundle.h"
+#include "hoovermanifest.h"
+#include "hooverindex.h"
+#include "hooverspool.h"
+#include "hooverwatch.h"
+#include "hooveringest.h"
+#include "hooverstats.h"
+
+#ifndef HOOVER_MAX_THREADS
+    #define HOOVER_MAX_THREADS 256
+#endif
+
+/* number of HDOs that may wait for the sender per worker thread */
+#ifndef HOOVER_QUEUE_DEPTH_PER_THREAD
+    #define HOOVER_QUEUE_DEPTH_PER_THREAD 2
+#endif
+
+/* files at least this big are compressed by a worker chunk by chunk while
+ * the sender sends them, instead of all at once into memory; at most
+ * HOOVER_STREAM_DEPTH chunks of each wait for the sender */
+#ifndef HOOVER_STREAM_MIN_SIZE
+    #define HOOVER_STREAM_MIN_SIZE (16 * 1024 * 1024)
+#endif
+#ifndef HOOVER_STREAM_DEPTH
+    #define HOOVER_STREAM_DEPTH 16
+#endif
+
+/* files up to this size are read into memory whole when a batch of files is
+ * opened through io_uring; bigger ones are mapped or streamed as usual */
+#ifndef HOOVER_INGEST_MAX_READ
+    #define HOOVER_INGEST_MAX_READ (1024 * 1024)
+#endif
+
+/* in watch mode, seconds without a new file before partial bundles are sent
+ * and the tube is flushed */
+#ifndef HOOVER_WATCH_IDLE_TIME
+    #define HOOVER_WATCH_IDLE_TIME 5
+#endif
+
+/* in watch mode, milliseconds between checks for a signal to stop */
+#ifndef HOOVER_WATCH_POLL_MS
+    #define HOOVER_WATCH_POLL_MS 500
+#endif
+
+/*
+ * producer_work is shared by all worker threads.  Workers claim input files by
+ *   incrementing next_file, turn them into HDOs, and push them on to the
+ *   queue.  The last worker to finish closes the queue so the sender knows
+ *   that no more HDOs are coming.
+ *
+ *   In watch mode, files keep being added to the list as they are written,
+ *   and workers wait for more until watching stops.
+ */
+struct producer_work {
+    char **filenames;
+    uint32_t num_files;
+    uint32_t max_files;
+    uint32_t next_file;
+    int workers_left;
+    int watching;                  /* more files may still be added */
+    struct hoover_watch *watch;
+    pthread_mutex_t lock;
+    pthread_cond_t more_files;
+    struct hoover_queue *queue;
+    struct hoover_index *index;    /* files delivered by earlier runs, or NULL */
+    const char *hash_algo;         /* hash that new HDOs will carry */
+    int num_threads;
+    int batched;                   /* open and read files in batches if possible */
+};
+
+/* an HDO that is ready to be sent, along with its header */
+struct producer_item {
+    char *filename;
+    struct hoover_data_obj *hdo;   /* NULL if the file was already delivered */
+    struct hoover_header *header;
+    char *index_key;               /* absolute path for the index, or NULL */
+    struct stat st;                /* the file as it was opened */
+};
+
+/*
+ * producer_output is where the sender puts HDOs: straight into the tube, or
+ *   into a spool first and from there into the tube.  With a spool, the tube
+ *   may be NULL if no broker could be reached; HDOs then stay in the spool
+ *   until a later run or producer -D delivers them.
+ */
+struct producer_output {
+    struct hoover_tube *tube;
+    struct hoover_spool *spool;    /* NULL to send without spooling */
+    const char *spool_dir;
+    int failed;                    /* HDOs that could not be spooled */
+};
 
 uint32_t delete_files( char **filenames, uint32_t num_files ) {
     uint32_t errors = 0;
@@ -41,34 +146,628 @@ uint16_t endswith(const char *str, const char *suffix) {
 /* does str start with prefix? */
 #define startswith(str, prefix) (strncmp((str), (prefix), strlen((prefix))) == 0)
 
-/* not thread safe */
+/* returns a string constant, so it is safe to call from worker threads */
 char *infer_hdo_type( char *filename ) {
-    static char type[HDO_TYPE_FIELD_LEN];
     if ( !filename ) {
-        type[0] = '\0';
-        return type;
+        return "";
     }
     else if (endswith(filename, ".darshan.gz")
          ||  endswith(filename, ".darshan")) {
-        strncpy(type, "darshan", HDO_TYPE_FIELD_LEN);
+        return "darshan";
     }
     else if (startswith(filename, "manifest_") 
-         && (endswith(filename, ".json") || endswith(filename, ".gz")) ) {
-        strncpy(type, "manifest", HDO_TYPE_FIELD_LEN);
+         && (endswith(filename, ".json") || endswith(filename, ".hvm") || endswith(filename, ".gz")) ) {
+        return "manifest";
+    }
+    return "";
+}
+
+/*
+ * Send every spooled HDO that has not been sent yet.  The spool is
+ * checkpointed each time HOOVER_SPOOL_CHECKPOINT_INTERVAL messages have been
+ * confirmed, and once more at the end if final is set.  Returns nonzero if any
+ * message was not confirmed; it stays in the spool.
+ */
+int drain_spool( struct hoover_tube *tube, struct hoover_spool *spool, int final ) {
+    struct hoover_data_obj *hdo;
+    struct hoover_header *header;
+    int ret;
+
+    while ( (ret = hoover_spool_next(spool, &hdo, &header)) > 0 ) {
+        /* losses are counted when the tube is flushed */
+        hoover_send_message( tube, hdo, header );
+        if ( spool->num_unconfirmed >= HOOVER_SPOOL_CHECKPOINT_INTERVAL ) {
+            if ( hoover_flush_tube(tube) != 0 || hoover_spool_checkpoint(spool) != 0 )
+                return -1;
+        }
+    }
+    if ( ret < 0 )
+        return -1;
+    if ( final && (hoover_flush_tube(tube) != 0 || hoover_spool_checkpoint(spool) != 0) )
+        return -1;
+    return 0;
+}
+
+/*
+ * Stop sending after the tube lost messages; everything from here on only
+ * goes into the spool
+ */
+void abandon_tube( struct producer_output *out ) {
+    fprintf( stderr, "messages were lost; spooling the rest to %s\n", out->spool_dir );
+    free_hoover_tube( out->tube );
+    out->tube = NULL;
+    return;
+}
+
+/*
+ * Send an HDO, or append it to the spool and send it from there.  A streaming
+ * HDO is drained either way, and its header is up to date afterwards.
+ */
+int deliver( struct producer_output *out, struct hoover_data_obj *hdo, struct hoover_header *header ) {
+    if ( !out->spool )
+        return hoover_send_message( out->tube, hdo, header );
+
+    if ( hoover_spool_append(out->spool, hdo, header) != 0 ) {
+        out->failed++;
+        return -1;
+    }
+    if ( out->tube && drain_spool(out->tube, out->spool, 0) != 0 )
+        abandon_tube( out );
+    return 0;
+}
+
+/*
+ * Wait until every message is either confirmed by the broker or safe in the
+ * spool.  Returns the number of messages that were lost.
+ */
+int flush_output( struct producer_output *out ) {
+    int failed;
+
+    if ( !out->spool )
+        return hoover_flush_tube( out->tube );
+
+    if ( out->tube && drain_spool(out->tube, out->spool, 1) != 0 )
+        abandon_tube( out );
+    failed = out->failed;
+    if ( hoover_spool_sync(out->spool) != 0 )
+        failed++;
+    out->failed = 0;
+    return failed;
+}
+
+/*
+ * Deliver everything in a spool, retrying every HOOVER_SPOOL_RETRY_INTERVAL
+ * seconds while no broker can be reached.  The spool is only held open while
+ * it is being drained, so producers can keep adding to it.
+ */
+int drain_spool_dir( struct hoover_tube_config *config, const char *spool_dir ) {
+    struct hoover_spool *spool;
+    struct hoover_tube *tube;
+    size_t pending;
+    int ret;
+
+    while ( 1 ) {
+        if ( !(spool = open_hoover_spool(spool_dir)) )
+            return 1;
+        if ( (pending = hoover_spool_pending(spool)) == 0 ) {
+            printf( "spool %s is empty\n", spool_dir );
+            close_hoover_spool( spool );
+            return 0;
+        }
+
+        ret = -1;
+        if ( (tube = create_hoover_tube(config)) != NULL ) {
+            printf( "Draining %zu messages from %s\n", pending, spool_dir );
+            ret = drain_spool( tube, spool, 1 );
+            free_hoover_tube( tube );
+        }
+        else {
+            fprintf( stderr, "could not establish tube; %zu messages remain in %s\n", pending, spool_dir );
+        }
+        close_hoover_spool( spool );
+
+        /* check again for anything spooled in the meantime */
+        if ( ret != 0 )
+            sleep( HOOVER_SPOOL_RETRY_INTERVAL );
+    }
+}
+
+/*
+ * Send everything collected in a bundle as one message and empty the bundle.
+ * The members' headers stay with the caller, so they still make it into the
+ * manifest one by one.
+ */
+int send_bundle( struct producer_output *out, struct hoover_bundle *bundle ) {
+    static unsigned long num_bundles = 0;
+    struct hoover_data_obj *hdo;
+    struct hoover_header *header;
+    char hostname[HOST_NAME_MAX], filename[PATH_MAX];
+    int count = bundle->count, ret;
+
+    if ( count == 0 )
+        return 0;
+    if ( !(hdo = hoover_bundle_to_hdo(bundle)) ) {
+        fprintf( stderr, "could not build bundle of %d files\n", count );
+        return -1;
+    }
+
+    gethostname( hostname, HOST_NAME_MAX );
+    snprintf( filename, PATH_MAX, "bundle_%s_%d_%lu.hvb", hostname, (int)getpid(), ++num_bundles );
+    if ( !(header = build_hoover_header(filename, hdo, "bundle")) ) {
+        fprintf( stderr, "got NULL header for bundle %s\n", filename );
+        free_hdo( hdo );
+        return -1;
+    }
+
+    printf( "Sending %s (%d files)\n", filename, count );
+    ret = deliver( out, hdo, header );
+    if ( ret != 0 )
+        fprintf( stderr, "failed to send %s\n", filename );
+
+    free_hoover_header( header );
+    free_hdo( hdo );
+    return ret;
+}
+
+/*
+ * Build the header of a file that an earlier run already delivered from what
+ * the index remembers about it, so that it can be listed in the manifest
+ * without being read again
+ */
+struct hoover_header *build_indexed_header( char *filename, struct hoover_index_record *record ) {
+    struct hoover_data_obj hdo;
+    uint32_t i;
+
+    memset( &hdo, 0, sizeof(hdo) );
+    hdo.size = record->size;
+    hdo.size_orig = record->size_orig;
+    strncpy( hdo.hash_algo, record->hash_algo, HASH_ALGO_FIELD_LEN - 1 );
+    strncpy( hdo.compression, record->compression, COMPRESS_FIELD_LEN - 1 );
+    for ( i = 0; i < record->digest_len; i++ )
+        snprintf( hdo.hash_orig + 2 * i, 3, "%02x", record->digest[i] );
+
+    return build_hoover_header( filename, &hdo, infer_hdo_type(filename) );
+}
+
+/*
+ * Add a file to the list of files to send and wake up a worker for it
+ */
+int add_work_file( struct producer_work *work, const char *filename ) {
+    int ret = 0;
+
+    pthread_mutex_lock( &(work->lock) );
+    if ( work->num_files == work->max_files ) {
+        uint32_t max_files = work->max_files ? 2 * work->max_files : 1024;
+        char **filenames = realloc(work->filenames, max_files * sizeof(*filenames));
+        if ( filenames ) {
+            work->filenames = filenames;
+            work->max_files = max_files;
+        }
+    }
+    if ( work->num_files < work->max_files && (work->filenames[work->num_files] = strdup(filename)) ) {
+        work->num_files++;
+        pthread_cond_signal( &(work->more_files) );
+    }
+    else {
+        fprintf( stderr, "couldn't add %s to the list of files\n", filename );
+        ret = -1;
+    }
+    pthread_mutex_unlock( &(work->lock) );
+    return ret;
+}
+
+/*
+ * Called for each file found in a directory; only files whose type can be
+ * inferred are sent
+ */
+int found_file( const char *path, void *arg ) {
+    if ( infer_hdo_type((char *)path)[0] == '\0' )
+        return 0;
+    add_work_file( (struct producer_work *)arg, path );
+    return 0;
+}
+
+/*
+ * Signals that tell a producer in watch mode to send what it has and exit
+ */
+void get_stop_signals( sigset_t *signals ) {
+    sigemptyset( signals );
+    sigaddset( signals, SIGINT );
+    sigaddset( signals, SIGTERM );
+    sigaddset( signals, SIGHUP );
+    return;
+}
+
+/*
+ * Watcher thread: add files to the work list as soon as they are written, until
+ * the producer is told to stop
+ */
+void *producer_watcher( void *arg ) {
+    struct producer_work *work = arg;
+    struct timespec no_wait = { 0, 0 };
+    sigset_t signals;
+
+    get_stop_signals( &signals );
+    while ( sigtimedwait(&signals, NULL, &no_wait) < 0 ) {
+        if ( hoover_watch_wait(work->watch, HOOVER_WATCH_POLL_MS, found_file, work) < 0 ) {
+            fprintf( stderr, "could not watch for new files\n" );
+            break;
+        }
+    }
+
+    /* let the workers run out of files */
+    pthread_mutex_lock( &(work->lock) );
+    work->watching = 0;
+    pthread_cond_broadcast( &(work->more_files) );
+    pthread_mutex_unlock( &(work->lock) );
+    return NULL;
+}
+
+/*
+ * Turn one input file into an HDO and hand it to the sender.  The file comes
+ * either open as fd, or already read in as data (which is freed here).  A big
+ * file is handed over before it is compressed, and compressed here while the
+ * sender sends it.  Returns -1 if the sender is gone and the worker should
+ * stop.
+ */
+int produce_file( struct producer_work *work, char *filename, int fd, struct stat *st, void *data, size_t len ) {
+    struct hoover_data_obj *hdo = NULL,
+                           *src;
+    struct hoover_hdo_relay *relay = NULL;
+    struct hoover_header *header;
+    char *index_key = NULL;
+    int streaming = 0, ret = 0;
+
+    /* Files that an earlier run delivered and that have not changed since
+     * are neither read nor sent again; they only go into the manifest */
+    struct hoover_index_record record;
+    if ( work->index )
+        index_key = realpath( filename, NULL );
+    if ( index_key && hoover_index_lookup(work->index, index_key, st, work->hash_algo, &record) ) {
+        if ( fd >= 0 ) close(fd);
+        free(data);
+        free(index_key);
+        index_key = NULL;
+        header = build_indexed_header( filename, &record );
+    }
+    else {
+        /* Load file in as an HDO.  Big files are only opened here, and
+         * their chunks go to the sender through a relay as they are
+         * compressed, so that memory use stays bounded.  Regular files are
+         * mapped rather than read, so their data is never copied out of the
+         * page cache */
+        if ( data ) {
+            hdo = hoover_create_hdo_from_buffer(data, len, HOOVER_BLOCK_AUTO);
+            free(data);
+        }
+        else {
+            streaming = st->st_size >= HOOVER_STREAM_MIN_SIZE;
+            if ( streaming ) {
+                if ( (src = hoover_open_hdo_fd(fd, HOOVER_BLOCK_AUTO))
+                &&   !(hdo = hoover_open_hdo_relay(src, HOOVER_STREAM_DEPTH, &relay)) )
+                    free_hdo(src);
+            }
+            else {
+                hdo = hoover_create_hdo_fd(fd, HOOVER_BLOCK_AUTO);
+                close(fd);
+            }
+        }
+        if ( !hdo ) {
+            fprintf( stderr, "got NULL HDO from %s\n", filename );
+            if ( streaming ) close(fd);
+            free(index_key);
+            return 0;
+        }
+
+        /* Build header for HDO */
+        header = build_hoover_header( filename, hdo, infer_hdo_type(filename) );
+    }
+    struct producer_item *item = NULL;
+    if ( !header ) {
+        fprintf( stderr, "got NULL header from %s\n", filename );
+        if ( hdo ) free_hdo( hdo );
+        free(index_key);
+    }
+    else if ( !(item = malloc(sizeof(*item))) ) {
+        fprintf( stderr, "couldn't allocate work item for %s\n", filename );
+        free_hoover_header( header );
+        if ( hdo ) free_hdo( hdo );
+        free(index_key);
     }
     else {
-        type[0] = '\0';
+        item->filename = filename;
+        item->hdo = hdo;
+        item->header = header;
+        item->index_key = index_key;
+        item->st = *st;
+
+        /* blocks while the sender is behind */
+        if ( hoover_queue_push(work->queue, item) != 0 ) {
+            free_hoover_header( header );
+            if ( hdo ) free_hdo( hdo );
+            free( index_key );
+            free( item );
+            ret = -1;
+        }
+    }
+
+    /* the relay stops early if its HDO was freed above, or by the sender
+     * after a failure; either way the sender reports it */
+    if ( relay )
+        hoover_pump_hdo_relay( relay );
+    if ( streaming )
+        close(fd);
+    return ret;
+}
+
+/*
+ * Worker thread: read, hash, and compress input files into HDOs and hand them
+ * off to the sender through the work queue.  Files are claimed in batches so
+ * that a whole batch of small files can be opened and read with a few
+ * io_uring calls; without io_uring, each file is opened on its own.
+ */
+void *producer_worker( void *arg ) {
+    struct producer_work *work = arg;
+    struct hoover_ingest *ingest = work->batched ? create_hoover_ingest() : NULL;
+    struct hoover_ingest_file files[HOOVER_INGEST_BATCH];
+
+    while ( 1 ) {
+        int num_claimed, i, ingested;
+
+        /* leave enough files for the other workers to stay busy */
+        pthread_mutex_lock( &(work->lock) );
+        while ( work->next_file >= work->num_files && work->watching )
+            pthread_cond_wait( &(work->more_files), &(work->lock) );
+        num_claimed = (work->num_files - work->next_file) / work->num_threads;
+        if ( num_claimed > HOOVER_INGEST_BATCH || (num_claimed > 1 && !ingest) )
+            num_claimed = ingest ? HOOVER_INGEST_BATCH : 1;
+        if ( num_claimed < 1 && work->next_file < work->num_files )
+            num_claimed = 1;
+        for ( i = 0; i < num_claimed; i++ )
+            files[i].filename = work->filenames[work->next_file++];
+        pthread_mutex_unlock( &(work->lock) );
+        if ( num_claimed == 0 )
+            break;
+
+        ingested = ingest && hoover_ingest_files(ingest, files, num_claimed, HOOVER_INGEST_MAX_READ) == 0;
+        for ( i = 0; i < num_claimed; i++ ) {
+            char *filename = (char *)files[i].filename;
+            if ( !ingested ) {
+                files[i].data = NULL;
+                files[i].len = 0;
+                if ( (files[i].fd = open(filename, O_RDONLY)) < 0 ) {
+                    fprintf( stderr, "could not open file %s\n", filename );
+                    continue;
+                }
+                if ( fstat(files[i].fd, &(files[i].st)) != 0 ) {
+                    fprintf( stderr, "could not stat file %s\n", filename );
+                    close( files[i].fd );
+                    continue;
+                }
+            }
+            else if ( files[i].fd < 0 && !files[i].data ) {
+                fprintf( stderr, "could not open file %s\n", filename );
+                continue;
+            }
+
+            if ( produce_file(work, filename, files[i].fd, &(files[i].st), files[i].data, files[i].len) != 0 ) {
+                /* nobody is left to send the rest of the batch */
+                for ( i++; ingested && i < num_claimed; i++ ) {
+                    if ( files[i].fd >= 0 ) close( files[i].fd );
+                    free( files[i].data );
+                }
+                num_claimed = -1;
+                break;
+            }
+        }
+        if ( num_claimed < 0 )
+            break;
+    }
+    if ( ingest )
+        free_hoover_ingest( ingest );
+
+    /* last one out tells the sender that no more HDOs are coming */
+    pthread_mutex_lock( &(work->lock) );
+    if ( --(work->workers_left) == 0 )
+        hoover_queue_close( work->queue );
+    pthread_mutex_unlock( &(work->lock) );
+
+    return NULL;
+}
+
+/*
+ * Move a header into the arena that the manifest is built from.  A header
+ * that cannot be kept only goes missing from the manifest.
+ */
+void keep_header( struct hoover_header_arena *headers, struct hoover_header *header ) {
+    if ( hoover_header_arena_add(headers, header) != 0 )
+        fprintf( stderr, "couldn't keep header of %s for the manifest\n", header->filename );
+    free_hoover_header( header );
+    return;
+}
+
+/*
+ * producer_stats is shared with the thread that rewrites the statistics file
+ *   every interval seconds until the producer is done
+ */
+struct producer_stats {
+    const char *path;
+    int interval;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+};
+
+/*
+ * Statistics thread: keep the statistics file current while a long-running
+ * (e.g., watching) producer works.  The final version is written at exit.
+ */
+void *producer_stats_writer( void *arg ) {
+    struct producer_stats *stats = arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock( &(stats->lock) );
+    while ( !stats->done ) {
+        clock_gettime( CLOCK_REALTIME, &deadline );
+        deadline.tv_sec += stats->interval;
+        while ( !stats->done && pthread_cond_timedwait(&(stats->finished), &(stats->lock), &deadline) != ETIMEDOUT )
+            ;
+        if ( !stats->done )
+            hoover_stats_write( stats->path );
     }
-   
-    return type;
+    pthread_mutex_unlock( &(stats->lock) );
+    return NULL;
+}
+
+/* default to one worker per online core */
+int default_num_threads( void ) {
+    long ncpus = sysconf( _SC_NPROCESSORS_ONLN );
+    if ( ncpus < 1 )
+        return 1;
+    else if ( ncpus > HOOVER_MAX_THREADS )
+        return HOOVER_MAX_THREADS;
+    return (int)ncpus;
 }
 
 int main(int argc, char **argv) {
     struct hoover_tube_config *config;
     struct hoover_tube *tube;
+    int num_threads = default_num_threads();
+    char *codec_spec = NULL,
+         *hash_name = NULL;
+    int hash_compressed = -1;
+    int adaptive = -1;
+    long block_size = -1;
+    char *block_size_cache = NULL;
+    long bundle_size = -1;
+    int bundle_count = 0;
+    struct hoover_bundle *bundle = NULL;
+    char *index_file = NULL;
+    struct hoover_index *index = NULL;
+    char *spool_dir = NULL;
+    int drain_only = 0;
+    int batched = 1;
+    int binary_manifest = -1;
+    struct producer_stats stats;
+    int stats_interval = -1;
+    pthread_t stats_writer;
+    struct producer_output out;
+    char **scan_dirs = calloc(argc, sizeof(*scan_dirs)),
+         *watch_dir = NULL;
+    int num_scan_dirs = 0;
+    struct option long_options[] = {
+        { "dir",   required_argument, NULL, 'd' },
+        { "watch", required_argument, NULL, 'w' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
 
-    if ( argc < 2 ) {
-        fprintf( stderr, "Syntax: %s <file name> [file name [file name [...]]]\n", argv[0] );
+    memset( &stats, 0, sizeof(stats) );
+    if ( !scan_dirs ) {
+        fprintf( stderr, "couldn't allocate memory for directories\n" );
+        return 1;
+    }
+
+    while ( (c = getopt_long(argc, argv, "t:p:c:H:OAB:C:b:i:s:DUd:w:m:S:T:", long_options, NULL)) != -1 ) {
+        switch (c) {
+        case 't':
+            num_threads = atoi(optarg);
+            if ( num_threads < 1 || num_threads > HOOVER_MAX_THREADS ) {
+                fprintf( stderr, "number of threads must be between 1 and %d\n", HOOVER_MAX_THREADS );
+                return 1;
+            }
+            break;
+        case 'p':
+            /* threads used to compress each individual file */
+            if ( atoi(optarg) < 1 || atoi(optarg) > HOOVER_MAX_THREADS ) {
+                fprintf( stderr, "number of compression threads must be between 1 and %d\n", HOOVER_MAX_THREADS );
+                return 1;
+            }
+            hoover_set_compress_threads( atoi(optarg) );
+            break;
+        case 'c':
+            /* codec[:level]; overrides the tube config */
+            codec_spec = optarg;
+            break;
+        case 'H':
+            /* integrity hash; overrides the tube config */
+            hash_name = optarg;
+            break;
+        case 'O':
+            /* only hash the original data, not the compressed payload */
+            hash_compressed = 0;
+            break;
+        case 'A':
+            /* compress everything, even data that would not shrink */
+            adaptive = 0;
+            break;
+        case 'B':
+            /* bytes read at a time, or 0 to pick for each file; overrides the
+             * tube config */
+            block_size = strtol(optarg, NULL, 10);
+            break;
+        case 'C':
+            /* calibrate block sizes and keep them here; overrides the tube
+             * config */
+            block_size_cache = optarg;
+            break;
+        case 'b':
+            /* bundle_size[:bundle_count]; overrides the tube config */
+            bundle_size = strtol(optarg, NULL, 10);
+            if ( strchr(optarg, ':') )
+                bundle_count = atoi(strchr(optarg, ':') + 1);
+            break;
+        case 'i':
+            /* index of files already delivered; overrides the tube config */
+            index_file = optarg;
+            break;
+        case 's':
+            /* spool directory; overrides the tube config */
+            spool_dir = optarg;
+            break;
+        case 'D':
+            /* only deliver what is already in the spool */
+            drain_only = 1;
+            break;
+        case 'U':
+            /* open and read every file on its own, without io_uring */
+            batched = 0;
+            break;
+        case 'd':
+            /* send the logs found anywhere under a directory */
+            scan_dirs[num_scan_dirs++] = optarg;
+            break;
+        case 'w':
+            /* keep sending logs as they are written under a directory */
+            watch_dir = optarg;
+            break;
+        case 'm':
+            /* manifest format; overrides the tube config */
+            if ( strcmp(optarg, "binary") == 0 )
+                binary_manifest = 1;
+            else if ( strcmp(optarg, "json") == 0 )
+                binary_manifest = 0;
+            else {
+                fprintf( stderr, "manifest format must be json or binary\n" );
+                return 1;
+            }
+            break;
+        case 'S':
+            /* where to write statistics; overrides the tube config */
+            stats.path = optarg;
+            break;
+        case 'T':
+            /* seconds between statistics updates; overrides the tube config */
+            stats_interval = atoi(optarg);
+            break;
+        default:
+            fprintf( stderr, "Syntax: %s [-t num_threads] [-p compress_threads] [-c codec[:level]] [-H hash] [-O] [-A] [-B block_size] [-C cache_file] [-b bundle_size[:count]] [-i index_file] [-s spool_dir] [-U] [-m json|binary] [-S stats_file] [-T stats_interval] [--dir dir] [--watch dir] [file name [file name [...]]]\n       %s [-s spool_dir] -D\n", argv[0], argv[0] );
+            return 1;
+        }
+    }
+
+    if ( optind >= argc && !drain_only && !num_scan_dirs && !watch_dir ) {
+        fprintf( stderr, "Syntax: %s [-t num_threads] [-p compress_threads] [-c codec[:level]] [-H hash] [-O] [-A] [-B block_size] [-C cache_file] [-b bundle_size[:count]] [-i index_file] [-s spool_dir] [-U] [-m json|binary] [-S stats_file] [-T stats_interval] [--dir dir] [--watch dir] [file name [file name [...]]]\n       %s [-s spool_dir] -D\n", argv[0], argv[0] );
         return 1;
     }
 
@@ -81,69 +780,320 @@ int main(int argc, char **argv) {
         save_tube_config( config, stdout );
     }
 
-    /* Set up the tube (AMQP connection, socket, exchange, and channel) */
-    if ( (tube = create_hoover_tube(config)) == NULL ) {
-        fprintf( stderr, "could not establish tube\n" );
+    /* Everything that is sent goes through the spool if there is one */
+    if ( !spool_dir )
+        spool_dir = config->spool_dir;
+    if ( drain_only ) {
+        if ( !spool_dir ) {
+            fprintf( stderr, "-D needs a spool directory\n" );
+            return 1;
+        }
+        return drain_spool_dir( config, spool_dir );
+    }
+
+    /* In watch mode, the watcher thread takes the signals that stop the
+     * producer, so that the files found so far are still sent.  They are
+     * blocked before any other thread starts, since every thread that does not
+     * block them could be the one a signal is delivered to */
+    if ( watch_dir ) {
+        sigset_t signals;
+        get_stop_signals( &signals );
+        pthread_sigmask( SIG_BLOCK, &signals, NULL );
+    }
+
+    /* Pick the compression codec before any HDOs are created */
+    if ( !codec_spec )
+        codec_spec = config->compression;
+    if ( codec_spec && hoover_set_codec(codec_spec) != 0 )
+        return 1;
+    if ( !hash_name )
+        hash_name = config->hash;
+    if ( hash_name && hoover_set_hash(hash_name) != 0 )
+        return 1;
+    hoover_set_hash_compressed( hash_compressed < 0 ? config->hash_compressed : hash_compressed );
+    hoover_set_adaptive( adaptive < 0 ? config->adaptive_compression : adaptive );
+    if ( block_size < 0 )
+        block_size = config->block_size;
+    if ( hoover_set_block_size(block_size) != 0 )
+        return 1;
+
+    /* Small files are packed into bundles if a bundle size is given */
+    if ( bundle_size < 0 ) {
+        bundle_size = config->bundle_size;
+        bundle_count = config->bundle_count;
+    }
+    if ( bundle_size > 0 && !(bundle = create_hoover_bundle(bundle_size, bundle_count)) ) {
+        fprintf( stderr, "couldn't allocate bundle\n" );
+        return 1;
+    }
+
+    /* Files that were delivered by an earlier run are skipped if an index of
+     * them is kept */
+    if ( !index_file )
+        index_file = config->index_file;
+    if ( index_file && !(index = open_hoover_index(index_file)) ) {
+        fprintf( stderr, "could not open index %s\n", index_file );
+        return 1;
+    }
+
+    /* Collect the files named on the command line and found in directories.
+     * The watch is set up before its directory is scanned, so that no file
+     * written in between is missed */
+    struct producer_work work;
+    memset( &work, 0, sizeof(work) );
+    pthread_mutex_init( &(work.lock), NULL );
+    pthread_cond_init( &(work.more_files), NULL );
+    for ( int i = optind; i < argc; i++ )
+        add_work_file( &work, argv[i] );
+    for ( int i = 0; i < num_scan_dirs; i++ ) {
+        if ( hoover_scan_dir(scan_dirs[i], found_file, &work) != 0 )
+            return 1;
+    }
+    if ( watch_dir ) {
+        if ( !(work.watch = create_hoover_watch(watch_dir)) )
+            return 1;
+        work.watching = 1;
+        hoover_watch_scan( work.watch, found_file, &work );
+    }
+    free( scan_dirs );
+    if ( work.num_files == 0 && !work.watching ) {
+        printf( "no files to send\n" );
+        return 0;
+    }
+
+    /* Unless the block size is fixed, block sizes measured by earlier runs are
+     * reused, and any filesystem the files are on that has not been measured
+     * yet is measured now.  This happens before statistics are enabled so that
+     * it does not count */
+    if ( !block_size_cache )
+        block_size_cache = config->block_size_cache;
+    if ( block_size_cache && block_size == HOOVER_BLOCK_AUTO ) {
+        if ( hoover_load_block_sizes(block_size_cache) != 0 )
+            fprintf( stderr, "could not read block sizes from %s\n", block_size_cache );
+        if ( hoover_calibrate_block_sizes(work.filenames, work.num_files) > 0 )
+            hoover_save_block_sizes( block_size_cache );
+    }
+
+    /* Statistics are only kept if they are going somewhere.  A producer that
+     * runs for a while also rewrites them on a timer */
+    if ( !stats.path )
+        stats.path = config->stats_file;
+    stats.interval = stats_interval < 0 ? config->stats_interval : stats_interval;
+    if ( stats.path ) {
+        hoover_stats_enable();
+        pthread_mutex_init( &(stats.lock), NULL );
+        pthread_cond_init( &(stats.finished), NULL );
+        if ( stats.interval > 0 && pthread_create(&stats_writer, NULL, producer_stats_writer, &stats) != 0 ) {
+            fprintf( stderr, "couldn't create statistics thread\n" );
+            return 1;
+        }
+    }
+
+
+    memset( &out, 0, sizeof(out) );
+    out.spool_dir = spool_dir;
+    if ( spool_dir && !(out.spool = open_hoover_spool(spool_dir)) ) {
+        fprintf( stderr, "could not open spool %s\n", spool_dir );
         return 1;
     }
 
-    /* Load files in as hoover data objects (HDOs) */
-    char **filenames = &argv[1];
-    uint32_t num_files = argc - 1;
-    uint32_t num_headers = 0;
-    struct hoover_header **headers = malloc(sizeof(struct hoover_header) * num_files);
-    memset(headers, 0, sizeof(struct hoover_header) * num_files);
+    /* Set up the tube (AMQP connection, socket, exchange, and channel).  With
+     * a spool, HDOs can wait there until the brokers are back */
+    if ( (tube = create_hoover_tube(config)) == NULL ) {
+        if ( !out.spool ) {
+            fprintf( stderr, "could not establish tube\n" );
+            return 1;
+        }
+        fprintf( stderr, "could not establish tube; spooling to %s\n", spool_dir );
+    }
+    out.tube = tube;
+
+    /* Load files in as hoover data objects (HDOs).  The headers are kept for
+     * the manifest in a compact arena, and index records of the files sent by
+     * this run are only added to the index once the broker has confirmed
+     * every one of them */
+    uint32_t num_records = 0,
+             max_records = 0;
+    struct hoover_header_arena *headers = create_hoover_header_arena();
+    struct hoover_index_record *records = NULL;
     if ( !headers ) {
         fprintf( stderr, "couldn't allocate memory for headers\n" );
         return 1;
     }
-    for ( uint32_t i = 0; i < num_files; i++ ) {
-        FILE *fp;
-        if ( !(fp = fopen(filenames[i], "r")) ) {
-            fprintf( stderr, "could not open file %s\n", filenames[i] );
-            continue;
+
+    /* Never spin up more workers than there are files to process */
+    if ( !work.watching && (uint32_t)num_threads > work.num_files )
+        num_threads = work.num_files;
+
+    work.workers_left = num_threads;
+    work.index = index;
+    work.hash_algo = hoover_get_hash();
+    work.num_threads = num_threads;
+    work.batched = batched;
+    if ( !(work.queue = create_hoover_queue(num_threads * HOOVER_QUEUE_DEPTH_PER_THREAD)) ) {
+        fprintf( stderr, "couldn't allocate work queue\n" );
+        return 1;
+    }
+
+    /* the stop signals were blocked at startup and are only waited for here */
+    pthread_t watcher;
+    if ( work.watching ) {
+        if ( pthread_create(&watcher, NULL, producer_watcher, &work) != 0 ) {
+            fprintf( stderr, "couldn't create watcher thread\n" );
+            return 1;
         }
+        printf( "Watching %s; send SIGINT or SIGTERM to finish\n", watch_dir );
+    }
 
-        /* Load file in as an HDO */
-        struct hoover_data_obj *hdo = hoover_create_hdo(fp, HOOVER_BLK_SIZE);
-        fclose(fp);
-        if ( !hdo ) {
-            fprintf( stderr, "got NULL HDO from %s\n", filenames[i] );
+    pthread_t *workers = malloc(sizeof(*workers) * num_threads);
+    if ( !workers ) {
+        fprintf( stderr, "couldn't allocate memory for worker threads\n" );
+        return 1;
+    }
+    for ( int i = 0; i < num_threads; i++ ) {
+        if ( pthread_create(&workers[i], NULL, producer_worker, &work) != 0 ) {
+            fprintf( stderr, "couldn't create worker thread %d\n", i );
+            return 1;
+        }
+    }
+
+    /* This thread is the sender and the only user of the tube.  HDOs arrive in
+     * whatever order the workers finish them; the manifest does not care. */
+    struct producer_item *item;
+    int lost = 0;
+    while ( 1 ) {
+        int idle = 0;
+        if ( work.watch )
+            item = hoover_queue_pop_timed( work.queue, HOOVER_WATCH_IDLE_TIME, &idle );
+        else
+            item = hoover_queue_pop( work.queue );
+
+        /* nothing new for a while, so don't make finished files wait */
+        if ( idle ) {
+            if ( bundle )
+                send_bundle( &out, bundle );
+            lost += flush_output( &out );
             continue;
         }
+        if ( !item )
+            break;
 
-        /* Build header for HDO */
-        struct hoover_header *header = build_hoover_header( filenames[i], hdo, infer_hdo_type(filenames[i]) );
-        if ( !header ) {
-            fprintf( stderr, "got NULL header from %s\n", filenames[i] );
-            free_hdo( hdo );
+        /* the number of files is not known ahead of time when watching */
+        if ( index && num_records == max_records ) {
+            max_records = max_records ? 2 * max_records : 1024;
+            if ( !(records = realloc(records, max_records * sizeof(*records))) ) {
+                fprintf( stderr, "couldn't allocate memory for index records\n" );
+                return 1;
+            }
+        }
+
+        /* Small HDOs ride along in a bundle; everything else is sent as a
+         * message of its own */
+        int bundled = 0;
+        if ( !item->hdo ) {
+            printf("Skipping %s (already delivered)\n", item->filename);
+            keep_header( headers, item->header );
+            free(item);
             continue;
         }
+        if ( hoover_bundle_accepts(bundle, item->hdo) ) {
+            if ( !hoover_bundle_fits(bundle, item->hdo) )
+                send_bundle( &out, bundle );
+            bundled = hoover_bundle_add( bundle, item->hdo, item->header ) == 0;
+        }
+        if ( bundled ) {
+            printf("Bundling %s\n", item->filename);
+            if ( hoover_bundle_full(bundle) )
+                send_bundle( &out, bundle );
+        }
+        else {
+            printf("Sending %s\n", item->filename);
+            if ( deliver( &out, item->hdo, item->header ) != 0 )
+                fprintf( stderr, "failed to send %s\n", item->filename );
+        }
 
-        /* Send the message */
-        printf("Sending %s\n", filenames[i]);
-        hoover_send_message( tube, hdo, header );
+        /* Streaming headers are only complete once the HDO has been sent */
+        if ( item->index_key ) {
+            if ( hoover_index_make_record(item->index_key, &(item->st), item->header, &records[num_records]) == 0 )
+                num_records++;
+            free(item->index_key);
+        }
 
         /* Release the HDO, but retain the header to build the manifest */
-        free_hdo(hdo);
-        headers[num_headers++] = header;
+        free_hdo(item->hdo);
+        keep_header( headers, item->header );
+        free(item);
+    }
+
+    /* send whatever is left in the last bundle */
+    if ( bundle ) {
+        send_bundle( &out, bundle );
+        free_hoover_bundle( bundle );
     }
 
+    for ( int i = 0; i < num_threads; i++ )
+        pthread_join( workers[i], NULL );
+    free(workers);
+    if ( work.watch ) {
+        pthread_join( watcher, NULL );
+        free_hoover_watch( work.watch );
+    }
+    free_hoover_queue(work.queue);
+
+    /* Messages are pipelined, so they are only known to be safe once the
+     * broker has confirmed all of them (or they are in the spool) */
+    int failed = lost + flush_output( &out );
+    if ( failed )
+        fprintf( stderr, "%d messages could not be delivered\n", failed );
+
+    /* Only remember files once they are known to be delivered.  A message
+     * that was lost cannot be traced back to its file, so nothing from this
+     * run is remembered if any was.  Neither is it while the spool still
+     * holds messages, since journaled is not the same as confirmed */
+    int confirmed = !failed && !(out.spool && hoover_spool_pending(out.spool) > 0);
+    if ( index && confirmed ) {
+        for ( uint32_t i = 0; i < num_records; i++ )
+            hoover_index_add( index, &records[i] );
+        if ( hoover_index_sync(index) != 0 )
+            fprintf( stderr, "could not update index %s\n", index_file );
+    }
+    free(records);
+
     /* 
      * destroy files after they have been transferred
      *
-    delete_files(filenames, num_files);
+    if ( !failed )
+        delete_files(work.filenames, work.num_files);
     */
 
     /* build the manifest */
-    char *manifest = build_manifest(headers, num_files);
-
-    /* turn manifest into HDO */
-    struct hoover_data_obj *manifest_hdo = manifest_to_hdo(manifest, strlen(manifest));
+    if ( binary_manifest < 0 )
+        binary_manifest = config->binary_manifest;
+    struct hoover_data_obj *manifest_hdo = NULL;
+    if ( binary_manifest ) {
+        /* the binary manifest's indices need every header before the first
+         * byte can be written, so it is built in full and then compressed */
+        size_t manifest_len;
+        char *manifest = (char *)build_binary_manifest(headers, &manifest_len);
+        if ( !manifest ) {
+            fprintf(stderr, "unable to allocate memory for manifest\n" );
+            return 1;
+        }
+        manifest_hdo = manifest_to_hdo(manifest, manifest_len);
+        free(manifest);
+    }
+    else {
+        /* the JSON manifest is compressed as it is generated */
+        manifest_hdo = hoover_create_manifest_hdo(headers);
+    }
+    if ( !manifest_hdo ) {
+        fprintf(stderr, "unable to compress manifest\n" );
+        return 1;
+    }
 
     /* create manifest header - first figure out what it should be called */
-    char *manifest_fn_template = "manifest_%s_%s.json";
-    size_t manifest_fn_len = sizeof(char)*(strlen(manifest_fn_template) + HOST_NAME_MAX + SHA_DIGEST_LENGTH_HEX + 1);
+    char *manifest_fn_template = binary_manifest ? "manifest_%s_%s.hvm" : "manifest_%s_%s.json";
+    size_t manifest_fn_len = sizeof(char)*(strlen(manifest_fn_template) + HOST_NAME_MAX + HASH_DIGEST_LENGTH_HEX + 1);
     char *manifest_fn = malloc(manifest_fn_len);
     if (!manifest_fn ) {
         fprintf(stderr, "unable to allocate memory for manifest file name\n" );
@@ -153,26 +1103,57 @@ int main(int argc, char **argv) {
     else {
         char hostname[HOST_NAME_MAX];
         gethostname(hostname, HOST_NAME_MAX);
-        snprintf(manifest_fn, manifest_fn_len, manifest_fn_template, manifest_hdo->hash, hostname);
+        snprintf(manifest_fn, manifest_fn_len, manifest_fn_template, manifest_hdo->hash_orig, hostname);
     }
 
     /* then build the manifest HDO's header */
     struct hoover_header *manifest_header = build_hoover_header(manifest_fn, manifest_hdo, "manifest");
 
     /* send the manifest HDO as the final piece */
-    hoover_send_message( tube, manifest_hdo, manifest_header );
+    deliver( &out, manifest_hdo, manifest_header );
+    if ( flush_output( &out ) ) {
+        fprintf( stderr, "manifest %s could not be delivered\n", manifest_fn );
+        failed++;
+    }
+
+    /* the statistics are complete once the manifest is out */
+    if ( stats.path ) {
+        if ( stats.interval > 0 ) {
+            pthread_mutex_lock( &(stats.lock) );
+            stats.done = 1;
+            pthread_cond_signal( &(stats.finished) );
+            pthread_mutex_unlock( &(stats.lock) );
+            pthread_join( stats_writer, NULL );
+        }
+        if ( hoover_stats_write(stats.path) != 0 )
+            fprintf( stderr, "could not write statistics to %s\n", stats.path );
+        pthread_cond_destroy( &(stats.finished) );
+        pthread_mutex_destroy( &(stats.lock) );
+    }
 
     /* tear down everything */
     free(manifest_fn);
     free_hoover_header(manifest_header);
     free_hdo(manifest_hdo);
-    for (uint32_t i = 0; i < num_files; i++)
-        free_hoover_header(headers[i]);
-    free(headers);
+    free_hoover_header_arena(headers);
+    for (uint32_t i = 0; i < work.num_files; i++)
+        free(work.filenames[i]);
+    free(work.filenames);
+    pthread_cond_destroy( &(work.more_files) );
+    pthread_mutex_destroy( &(work.lock) );
 
     /* tear down communication structures */
-    free_hoover_tube(tube);
+    if ( out.tube )
+        free_hoover_tube(out.tube);
+    if ( out.spool ) {
+        if ( hoover_spool_pending(out.spool) > 0 )
+            fprintf( stderr, "%zu messages remain in %s; run %s -D to deliver them\n",
+                     hoover_spool_pending(out.spool), spool_dir, argv[0] );
+        close_hoover_spool(out.spool);
+    }
+    if ( index )
+        close_hoover_index(index);
     free_tube_config(config);
 
-    return 0;
+    return failed ? 1 : 0;
 }
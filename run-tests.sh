@@ -1,11 +1,30 @@
 #!/bin/bash
 
-for bs in 0 1 2 1024 1025 $((128*1024-1)) $((128*1024)) $((128*1024+1)) 1m 1234567 20m
+# write $2 bytes of the named kind of input to file $3.  Random data will not
+# shrink, so adaptive mode stores it; text and zeros exercise real compression
+make_input() {
+    case "$1" in
+        random) head -c "$2" /dev/urandom > "$3" ;;
+        text)   yes "hoover test input $RANDOM" | head -c "$2" > "$3" ;;
+        zeros)  head -c "$2" /dev/zero > "$3" ;;
+    esac
+}
+
+for input in random text zeros
+do
+for opts in "-p 1" "-p 4" "-s -p 1" "-s -p 4" "-c gzip:1 -p 4" "-H sha256 -s -p 4" "-m -p 1" "-m -s -p 4" "-A -m -p 4"
 do
-    echo "====== Trying block size of $bs ======"
-    dd if=/dev/random of=$bs bs=$bs count=1 2>/dev/null
+for bs in 0 1 2 1024 1025 $((128*1024-1)) $((128*1024)) $((128*1024+1)) $((1024*1024)) 1234567 $((20*1024*1024))
+do
+    echo "====== Trying $input input of $bs bytes with options $opts ======"
+    make_input $input $bs $bs
 
-    ./test-hdo $bs $bs.hz.gz 2>&1 | grep hash > tmp.txt
+    ./test-hdo $opts $bs $bs.hz.gz 2>&1 | grep -E "hash|Compression" > tmp.txt
+    if [[ "$opts" == *sha256* ]]; then
+        shasum="shasum -a 256"
+    else
+        shasum="shasum"
+    fi
 
     if [ ! -s "$bs.hz.gz" ]; then
         echo "test-hdo broke and returned a zero-sized file" >&2
@@ -15,10 +34,18 @@ do
 
     result_comp=$(awk '/^Saved hash:/ { print $3 }' tmp.txt)
     result_uncomp=$(awk '/^Original hash:/ { print $3 }' tmp.txt)
-    actual_comp=$(shasum $bs.hz.gz | awk '{print $1}')
-    actual_uncomp=$(gunzip -c $bs.hz.gz | shasum | awk '{print $1}')
+    actual_comp=$($shasum $bs.hz.gz | awk '{print $1}')
+    # random data that would not shrink is stored as is
+    if [ -n "$(awk '/^Compression:/ { print $2 }' tmp.txt)" ]; then
+        actual_uncomp=$(gunzip -c $bs.hz.gz | $shasum | awk '{print $1}')
+    else
+        actual_uncomp=$($shasum < $bs.hz.gz | awk '{print $1}')
+    fi
 
-    original_uncomp=$(shasum $bs | awk '{print $1}')
+    original_uncomp=$($shasum $bs | awk '{print $1}')
+    if [ "$input" != "random" -a $bs -ge 1024 ] && [ $(stat -c %s $bs.hz.gz) -ge $bs ]; then
+        echo "$input input of $bs bytes was NOT compressed" >&2
+    fi
     rm $bs $bs.hz.gz tmp.txt
 
     if [ "$result_comp" == "$actual_comp" ]; then
@@ -32,7 +59,7 @@ do
         echo "SHA1 for uncompressed stream is calculated correctly ($result_uncomp)"
     else
         echo "SHA1 for uncompressed stream does NOT match calculated value" >&2
-        echo "$result_comp != $actual_comp" >&2
+        echo "$result_uncomp != $actual_uncomp" >&2
     fi
 
     if [ "$actual_uncomp" == "$original_uncomp" ]; then
@@ -42,3 +69,16 @@ do
         echo "$actual_uncomp != $original_uncomp" >&2
     fi
 done
+done
+done
+
+echo "====== Trying an index with a torn last record ======"
+./test-index test-index.idx
+
+echo "====== Trying a spool with a torn last entry ======"
+./test-spool test-spool.d
+
+# enough headers that the manifest is streamed in several batches
+echo "====== Trying a manifest streamed into its HDO ======"
+./test-manifest $(yes Makefile | head -n 1000) > /dev/null
+rm -f manifest.json.gz
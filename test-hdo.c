@@ -1,9 +1,13 @@
 /*
  * Test block encoding components of HDO generation
  */
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600 /* for getopt in unistd.h */
+#endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
 #include "hooverio.h"
@@ -16,9 +20,45 @@ int main( int argc, char **argv )
     FILE *fp_in, *fp_out;
     struct stat st;
     struct hoover_data_obj *hdo;
+    int c, streaming = 0, use_fd = 0;
+
+    while ( (c = getopt(argc, argv, "p:c:H:OAsm")) != -1 ) {
+        switch (c) {
+        case 'p':
+            hoover_set_compress_threads( atoi(optarg) );
+            break;
+        case 'c':
+            if ( hoover_set_codec( optarg ) != 0 )
+                return 1;
+            break;
+        case 'H':
+            if ( hoover_set_hash( optarg ) != 0 )
+                return 1;
+            break;
+        case 'O':
+            hoover_set_hash_compressed( 0 );
+            break;
+        case 'A':
+            /* compress everything, even data that would not shrink */
+            hoover_set_adaptive( 0 );
+            break;
+        case 's':
+            streaming = 1;
+            break;
+        case 'm':
+            /* read through a file descriptor, which maps regular files */
+            use_fd = 1;
+            break;
+        default:
+            fprintf( stderr, "Syntax: %s [-p compress_threads] [-c codec[:level]] [-H hash] [-O] [-A] [-s] [-m] <input file> [output file]\n", argv[0] );
+            return 1;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
 
     if ( argc < 2 ) {
-        fprintf( stderr, "Syntax: %s <input file> [output file]\n", argv[0] );
+        fprintf( stderr, "Syntax: %s [-p compress_threads] [-c codec[:level]] [-H hash] [-O] [-A] [-s] [-m] <input file> [output file]\n", argv[0] );
         return 1;
     }
     else if ( argc < 3 )
@@ -32,7 +72,31 @@ int main( int argc, char **argv )
         return ENOENT;
     }
 
-    hdo = hoover_create_hdo( fp_in, HOOVER_BLK_SIZE );
+    /* a streaming HDO is written out (or drained) before its hashes are known */
+    if ( streaming && (hdo = use_fd ? hoover_open_hdo_fd( fileno(fp_in), HOOVER_BLK_SIZE )
+                                    : hoover_open_hdo( fp_in, HOOVER_BLK_SIZE )) != NULL ) {
+        if ( fp_out ) {
+            hoover_write_hdo( fp_out, hdo, HOOVER_BLK_SIZE );
+        }
+        else {
+            const void *chunk;
+            size_t len;
+            while ( hoover_read_hdo_chunk( hdo, &chunk, &len ) > 0 );
+        }
+        printf( "Loaded:        %ld bytes\n", hdo->size_orig );
+        printf( "Original hash: %s\n",        hdo->hash_orig );
+        printf( "Saving:        %ld bytes\n", hdo->size );
+        printf( "Saved hash:    %s\n",        hdo->hash );
+        printf( "Compression:   %s\n",        hdo->compression );
+        free_hdo( hdo );
+        fclose(fp_in);
+        if (fp_out) fclose(fp_out);
+        return 0;
+    }
+    else if ( !streaming ) {
+        hdo = use_fd ? hoover_create_hdo_fd( fileno(fp_in), HOOVER_BLK_SIZE )
+                     : hoover_create_hdo( fp_in, HOOVER_BLK_SIZE );
+    }
 
     fclose(fp_in);
 
@@ -41,6 +105,7 @@ int main( int argc, char **argv )
         printf( "Original hash: %s\n",        hdo->hash_orig );
         printf( "Saving:        %ld bytes\n", hdo->size );
         printf( "Saved hash:    %s\n",        hdo->hash );
+        printf( "Compression:   %s\n",        hdo->compression );
         if (fp_out) hoover_write_hdo( fp_out, hdo, HOOVER_BLK_SIZE );
         free_hdo( hdo );
     }
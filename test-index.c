@@ -0,0 +1,111 @@
+/*
+ * Test that an index whose last record was torn by a crash during an append
+ * keeps every complete record and forgets only the torn one
+ */
+#if !defined(_XOPEN_SOURCE) || _XOPEN_SOURCE < 700
+    #define _XOPEN_SOURCE 700
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "hooverindex.h"
+
+#define NUM_RECORDS 10
+
+/* index header: magic + uint32_t record size */
+#define INDEX_HEADER_LEN 8
+
+int main(int argc, char **argv) {
+    struct hoover_index *index;
+    struct hoover_index_record record;
+    struct hoover_header header;
+    struct stat st[NUM_RECORDS], st_file;
+    char paths[NUM_RECORDS][32];
+    char *index_path;
+    int fd, i, found, failed = 0;
+    off_t full_len;
+
+    if ( argc < 2 ) {
+        fprintf( stderr, "Syntax: %s <index file>\n", argv[0] );
+        return 1;
+    }
+    index_path = argv[1];
+    unlink( index_path );
+
+    memset( &header, 0, sizeof(header) );
+    strcpy( header.hash_algo, "sha1" );
+    strcpy( header.compression, "gz" );
+
+    /* fill the index with records for made-up files */
+    if ( !(index = open_hoover_index(index_path)) )
+        return 1;
+    for ( i = 0; i < NUM_RECORDS; i++ ) {
+        snprintf( paths[i], sizeof(paths[i]), "/no/such/file.%d", i );
+        memset( &st[i], 0, sizeof(st[i]) );
+        st[i].st_ino = 1000 + i;
+        st[i].st_size = 100 * i;
+        st[i].st_mtime = 1500000000 + i;
+        header.size = 10 * i;
+        snprintf( header.hash_orig, sizeof(header.hash_orig), "%040x", i + 1 );
+        if ( hoover_index_make_record(paths[i], &st[i], &header, &record) != 0
+        ||   hoover_index_add(index, &record) != 0 ) {
+            fprintf( stderr, "could not add record %d\n", i );
+            return 1;
+        }
+    }
+    if ( hoover_index_sync(index) != 0 ) {
+        fprintf( stderr, "could not sync index\n" );
+        return 1;
+    }
+    close_hoover_index( index );
+
+    /* cut the last record in half, as a crash in the middle of an append would */
+    full_len = INDEX_HEADER_LEN + NUM_RECORDS * sizeof(struct hoover_index_record);
+    if ( stat(index_path, &st_file) != 0 || st_file.st_size != full_len ) {
+        fprintf( stderr, "index does NOT have the expected size\n" );
+        return 1;
+    }
+    if ( (fd = open(index_path, O_WRONLY)) < 0
+    ||   ftruncate(fd, full_len - sizeof(struct hoover_index_record) / 2) != 0 ) {
+        fprintf( stderr, "could not tear index\n" );
+        return 1;
+    }
+    close( fd );
+
+    /* every complete record survives; the torn one is forgotten and cut off */
+    if ( !(index = open_hoover_index(index_path)) ) {
+        fprintf( stderr, "torn index could NOT be opened\n" );
+        return 1;
+    }
+    for ( i = 0; i < NUM_RECORDS; i++ ) {
+        found = hoover_index_lookup( index, paths[i], &st[i], "sha1", &record );
+        if ( found && i == NUM_RECORDS - 1 ) {
+            fprintf( stderr, "torn record %d was NOT forgotten\n", i );
+            failed = 1;
+        }
+        else if ( !found && i < NUM_RECORDS - 1 ) {
+            fprintf( stderr, "record %d was NOT found after tearing the index\n", i );
+            failed = 1;
+        }
+        else if ( found && (record.digest_len != 20 || record.digest[19] != i + 1 || record.size != (uint64_t)(10 * i)) ) {
+            fprintf( stderr, "record %d does NOT match what was added\n", i );
+            failed = 1;
+        }
+    }
+    close_hoover_index( index );
+
+    if ( stat(index_path, &st_file) != 0
+    ||   st_file.st_size != full_len - (off_t)sizeof(struct hoover_index_record) ) {
+        fprintf( stderr, "torn record was NOT cut off the index\n" );
+        failed = 1;
+    }
+    unlink( index_path );
+
+    if ( !failed )
+        printf( "index recovered %d of %d records after a torn append\n", NUM_RECORDS - 1, NUM_RECORDS );
+    return failed;
+}
@@ -0,0 +1,134 @@
+#!/bin/bash
+#
+#  Send a scratch set of files from a producer to a consumer on this machine
+#  and check that every one of them arrives intact.  Half of the files are
+#  random bytes and half are cut from hooverio.c.  Prints one row per tube
+#  with the files and megabytes per second from the producer's start to the
+#  last file being written.
+#
+#  Usage: ./test-loopback.sh [-b] [-f "broker options"] [num_files [max_file_size]]
+#
+#  By default the files go through the in-memory ring, from producer-mem to
+#  consumer-mem.  With -b they also go through two loopback-broker processes,
+#  on 127.0.0.1 and 127.0.0.2, from producer to consumer; both of those open a
+#  connection to each broker.  The first broker gets the fault options given
+#  with -f (default "-d 25 -n 10 -l 5"), so the producer has to republish
+#  messages and move them to the other broker.  Nothing is sent to a real
+#  broker.
+#
+
+brokers=0
+faults="-d 25 -n 10 -l 5"
+while [ "${1:0:1}" == "-" ]; do
+    case "$1" in
+        -b) brokers=1; shift ;;
+        -f) faults="$2"; shift 2 ;;
+        *) echo "Usage: $0 [-b] [-f \"broker options\"] [num_files [max_file_size]]" >&2; exit 1 ;;
+    esac
+done
+
+NUM_FILES=${1:-1000}
+MAX_SIZE=${2:-262144}
+PORT=${PORT:-5673}
+
+scratch=$(mktemp -d)
+export HOOVER_RING=/dev/shm/hoover-test.$$.ring
+pids=""
+trap 'kill $pids 2>/dev/null; rm -rf "$scratch" "$HOOVER_RING"' EXIT
+mkdir "$scratch/in"
+
+for i in $(seq 1 $NUM_FILES)
+do
+    size=$((RANDOM * 8 % MAX_SIZE + 1))
+    if [ $((i % 2)) -eq 0 ]; then
+        head -c $size /dev/urandom > "$scratch/in/file$i.darshan"
+    else
+        yes "$(cat hooverio.c)" | head -c $size > "$scratch/in/file$i.darshan"
+    fi
+done
+total_bytes=$(cat "$scratch"/in/* | wc -c)
+
+#
+#  run_tube name producer consumer: start the consumer, run the producer, and
+#  wait up to a minute for every file and the manifest to be written
+#
+failed=0
+run_tube() {
+    local name=$1 producer=$2 consumer=$3 out="$scratch/out-$1" start end cpid got bad f
+    for prog in "$producer" "$consumer"; do
+        if [ ! -x "$prog" ]; then
+            echo "$prog not found; build it with make $(basename $prog)" >&2
+            failed=1
+            return
+        fi
+    done
+    mkdir -p "$out"
+
+    "$consumer" -t 4 -o "$out" > "$scratch/$name-consumer.log" 2>&1 &
+    cpid=$!
+    pids="$pids $cpid"
+    sleep 1
+
+    start=$(date +%s%N)
+    if ! "$producer" -t 4 --dir "$scratch/in" > "$scratch/$name-producer.log" 2>&1; then
+        echo "$name: producer failed; see below" >&2
+        tail -5 "$scratch/$name-producer.log" >&2
+        failed=1
+    fi
+    for i in $(seq 1 600); do
+        got=$(ls "$out/darshanlogs" 2>/dev/null | wc -l)
+        [ "$got" -ge $NUM_FILES ] && ls "$out"/manifests/* >/dev/null 2>&1 && break
+        sleep 0.1
+    done
+    end=$(date +%s%N)
+    kill $cpid 2>/dev/null
+    wait $cpid 2>/dev/null
+
+    bad=0
+    for f in "$scratch"/in/*; do
+        # random files do not shrink, so they arrive as they are
+        got="$out/darshanlogs/$(basename $f)"
+        if [ -f "$got.gz" ]; then
+            gunzip -c "$got.gz" 2>/dev/null | cmp -s - "$f" || bad=$((bad + 1))
+        else
+            cmp -s "$got" "$f" || bad=$((bad + 1))
+        fi
+    done
+    [ $bad -eq 0 ] || failed=1
+
+    awk -v tube=$name -v files=$NUM_FILES -v bytes=$total_bytes -v bad=$bad -v ns=$((end - start)) 'BEGIN {
+        secs = ns / 1e9
+        printf("%-8s %8d %8d %10.3f %10.1f %10.1f\n", tube, files, bad, secs,
+               (secs > 0 ? files / secs : 0), (secs > 0 ? bytes / secs / 1e6 : 0))
+    }'
+}
+
+printf "%-8s %8s %8s %10s %10s %10s\n" tube files bad seconds files/s MB/s
+run_tube ring "$(pwd)/producer-mem" "$(pwd)/consumer-mem"
+
+if [ $brokers -eq 1 ]; then
+    cat > "$scratch/hoover.conf" <<EOF
+servers       = 127.0.0.1, 127.0.0.2
+port          = $PORT
+vhost         = /
+username      = guest
+password      = guest
+exchange      = darshanlogs
+exchange_type = direct
+queue         = hoover-test
+routing_key   = logs
+connections   = 2
+EOF
+    export HOOVER_CONFIG="$scratch/hoover.conf"
+    ./loopback-broker -a 127.0.0.1 -p $PORT $faults 2> "$scratch/broker1.log" > /dev/null &
+    pids="$pids $!"
+    ./loopback-broker -a 127.0.0.2 -p $PORT 2> "$scratch/broker2.log" > /dev/null &
+    pids="$pids $!"
+    run_tube broker "$(pwd)/producer" "$(pwd)/consumer"
+    kill $pids 2>/dev/null
+    wait 2>/dev/null
+    echo "127.0.0.1 $(tail -1 "$scratch/broker1.log")"
+    echo "127.0.0.2 $(tail -1 "$scratch/broker2.log")"
+fi
+
+exit $failed
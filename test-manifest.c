@@ -16,10 +16,10 @@ int main(int argc, char **argv) {
 
     struct hoover_tube_config *config;
     struct hoover_header *header;
-    struct hoover_data_obj *hdo;
+    struct hoover_data_obj *hdo, *streamed;
     struct hoover_tube *tube;
 
-    struct hoover_header **headers;
+    struct hoover_header_arena *headers;
     int num_files;
     int i;
 
@@ -31,7 +31,7 @@ int main(int argc, char **argv) {
         return 1;
     }
     num_files = argc - 1;
-    headers = malloc(sizeof(*headers) * num_files);
+    headers = create_hoover_header_arena();
     for ( i = 0; i < num_files; i++ ) {
         if ( !(fp = fopen( argv[i+1], "r" )) ) {
             fprintf( stderr, "could not open file %s\n", argv[i+1] );
@@ -41,27 +41,37 @@ int main(int argc, char **argv) {
         hdo = hoover_create_hdo( fp, HOOVER_BLK_SIZE );
 
         /* Build header */
-        headers[i] = build_hoover_header( argv[i+1], hdo, "" );
-        if ( !headers[i] ) {
+        header = build_hoover_header( argv[i+1], hdo, "" );
+        if ( !header || hoover_header_arena_add(headers, header) != 0 ) {
             fprintf( stderr, "got null header\n" );
             return 1;
         }
+        free_hoover_header(header);
 
         free_hdo(hdo);
         fclose(fp);
     }
 
-    manifest = build_manifest( headers, num_files );
+    manifest = build_manifest( headers );
     printf( "%s\n", manifest );
 
-    /* Tear down everything */
-    for ( i = 0; i < num_files; i++ )
-        free(headers[i]);
-    free(headers);
-
     /* Now convert manifest into an HDO */
     FILE *fp_out = fopen( "manifest.json.gz", "w" );
     hdo = manifest_to_hdo( manifest, strlen(manifest) );
+
+    /* streaming the manifest into its HDO must give the same manifest */
+    streamed = hoover_create_manifest_hdo( headers );
+    if ( hdo && (!streamed || streamed->size_orig != hdo->size_orig
+                 || strcmp(streamed->hash_orig, hdo->hash_orig) != 0) ) {
+        fprintf( stderr, "streamed manifest does NOT match the built one\n" );
+        return 1;
+    }
+    if ( streamed )
+        free_hdo( streamed );
+
+    /* Tear down everything */
+    free_hoover_header_arena(headers);
+
     if ( hdo != NULL ) {
         printf( "Loaded:        %ld bytes\n", hdo->size_orig );
         printf( "Original hash: %s\n",        hdo->hash_orig );
@@ -0,0 +1,152 @@
+/*
+ * Test that a spool whose last journal entry was torn by a crash during an
+ * append hands out every complete entry, and keeps working afterwards
+ */
+#if !defined(_XOPEN_SOURCE) || _XOPEN_SOURCE < 700
+    #define _XOPEN_SOURCE 700
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "hooverspool.h"
+
+#define NUM_ENTRIES 10
+
+/*
+ * Append one made-up message whose payload and file name are derived from n
+ */
+static int append_entry( struct hoover_spool *spool, int n ) {
+    struct hoover_data_obj hdo;
+    struct hoover_header header;
+    char payload[64];
+
+    memset( &hdo, 0, sizeof(hdo) );
+    memset( &header, 0, sizeof(header) );
+    snprintf( payload, sizeof(payload), "payload of entry %d", n );
+    hdo.data = payload;
+    hdo.size = strlen(payload);
+    snprintf( header.filename, sizeof(header.filename), "entry.%d", n );
+    strcpy( header.compression, "none" );
+    strcpy( header.hash_algo, "sha1" );
+    header.size = hdo.size;
+    return hoover_spool_append( spool, &hdo, &header );
+}
+
+/*
+ * Open the spool and check that it hands out entries first to last, in order
+ */
+static int check_entries( const char *dir, int first, int last ) {
+    struct hoover_spool *spool;
+    struct hoover_data_obj *hdo;
+    struct hoover_header *header;
+    char expect[64];
+    int n, failed = 0;
+
+    if ( !(spool = open_hoover_spool(dir)) ) {
+        fprintf( stderr, "spool could NOT be opened\n" );
+        return 1;
+    }
+    if ( hoover_spool_pending(spool) != (size_t)(last - first + 1) ) {
+        fprintf( stderr, "spool does NOT hold %d entries but %zu\n", last - first + 1, hoover_spool_pending(spool) );
+        failed = 1;
+    }
+    for ( n = first; n <= last && !failed; n++ ) {
+        if ( hoover_spool_next(spool, &hdo, &header) != 1 ) {
+            fprintf( stderr, "entry %d was NOT handed out\n", n );
+            failed = 1;
+            break;
+        }
+        snprintf( expect, sizeof(expect), "payload of entry %d", n );
+        if ( hdo->size != strlen(expect) || memcmp(hdo->data, expect, hdo->size) != 0 ) {
+            fprintf( stderr, "payload of entry %d does NOT match what was spooled\n", n );
+            failed = 1;
+        }
+        snprintf( expect, sizeof(expect), "entry.%d", n );
+        if ( strcmp(header->filename, expect) != 0 ) {
+            fprintf( stderr, "header of entry %d does NOT match what was spooled\n", n );
+            failed = 1;
+        }
+    }
+    if ( !failed && hoover_spool_next(spool, &hdo, &header) != 0 ) {
+        fprintf( stderr, "spool did NOT end after entry %d\n", last );
+        failed = 1;
+    }
+    close_hoover_spool( spool );
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    struct hoover_spool *spool;
+    struct stat st_before, st_after;
+    char path[PATH_MAX];
+    int fd, i, failed = 0;
+
+    if ( argc < 2 ) {
+        fprintf( stderr, "Syntax: %s <spool directory>\n", argv[0] );
+        return 1;
+    }
+
+    /* start from an empty spool */
+    snprintf( path, sizeof(path), "%s/checkpoint", argv[1] );
+    unlink( path );
+    snprintf( path, sizeof(path), "%s/journal", argv[1] );
+    unlink( path );
+
+    if ( !(spool = open_hoover_spool(argv[1])) )
+        return 1;
+    for ( i = 0; i < NUM_ENTRIES - 1; i++ ) {
+        if ( append_entry(spool, i) != 0 ) {
+            fprintf( stderr, "could not spool entry %d\n", i );
+            return 1;
+        }
+    }
+    if ( hoover_spool_sync(spool) != 0 || stat(path, &st_before) != 0 ) {
+        fprintf( stderr, "could not sync spool\n" );
+        return 1;
+    }
+    if ( append_entry(spool, NUM_ENTRIES - 1) != 0 ) {
+        fprintf( stderr, "could not spool entry %d\n", NUM_ENTRIES - 1 );
+        return 1;
+    }
+    close_hoover_spool( spool );
+
+    /* cut the last entry short, as a crash in the middle of an append would */
+    if ( stat(path, &st_after) != 0 || st_after.st_size <= st_before.st_size ) {
+        fprintf( stderr, "last entry was NOT appended\n" );
+        return 1;
+    }
+    if ( (fd = open(path, O_WRONLY)) < 0
+    ||   ftruncate(fd, st_after.st_size - 3) != 0 ) {
+        fprintf( stderr, "could not tear journal\n" );
+        return 1;
+    }
+    close( fd );
+
+    /* every complete entry survives; the torn one is forgotten and cut off */
+    failed |= check_entries( argv[1], 0, NUM_ENTRIES - 2 );
+    if ( stat(path, &st_after) != 0 || st_after.st_size != st_before.st_size ) {
+        fprintf( stderr, "torn entry was NOT cut off the journal\n" );
+        failed = 1;
+    }
+
+    /* the journal takes new entries where the torn one was */
+    if ( !(spool = open_hoover_spool(argv[1])) || append_entry(spool, NUM_ENTRIES - 1) != 0 ) {
+        fprintf( stderr, "could NOT spool after recovering\n" );
+        return 1;
+    }
+    close_hoover_spool( spool );
+    failed |= check_entries( argv[1], 0, NUM_ENTRIES - 1 );
+
+    unlink( path );
+    snprintf( path, sizeof(path), "%s/checkpoint", argv[1] );
+    unlink( path );
+    rmdir( argv[1] );
+
+    if ( !failed )
+        printf( "spool recovered %d of %d entries after a torn append\n", NUM_ENTRIES - 1, NUM_ENTRIES );
+    return failed;
+}